@@ -0,0 +1,65 @@
+#define _POSIX_C_SOURCE 200809L
+#include "bench.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_sleep_until(double when) {
+    double left = when - bench_now();
+    if (left <= 0) return;
+
+    struct timespec ts;
+    ts.tv_sec = (time_t)left;
+    ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double bench_percentile(double *values, int count, double p) {
+    if (count <= 0) return 0;
+
+    qsort(values, count, sizeof(double), compare_double);
+    int index = (int)(p * (count - 1) + 0.5);
+    return values[index];
+}
+
+long bench_peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) return -1;
+    return usage.ru_maxrss;
+}
+
+static long parse_scaled(const char *text, long unit) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 0) return -1;
+
+    switch (*end) {
+        case '\0': return value;
+        case 'k': case 'K': value *= unit; break;
+        case 'm': case 'M': value *= unit * unit; break;
+        case 'g': case 'G': value *= unit * unit * unit; break;
+        default: return -1;
+    }
+    return end[1] == '\0' ? value : -1;
+}
+
+long bench_parse_size(const char *text) {
+    return parse_scaled(text, 1024L);
+}
+
+long bench_parse_count(const char *text) {
+    return parse_scaled(text, 1000L);
+}
@@ -0,0 +1,25 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+
+/* Helpers shared by the benchmark programs */
+
+/* Monotonic clock in seconds */
+double bench_now(void);
+void bench_sleep_until(double when);
+
+/* Value at fraction p (0..1) of a sample; sorts values in place */
+double bench_percentile(double *values, int count, double p);
+
+/* Peak resident set size of this process in KB */
+long bench_peak_rss_kb(void);
+
+/* Parse a size such as "64k" or "10M" (powers of 1024). Returns -1 if the
+ * text is not a size. */
+long bench_parse_size(const char *text);
+
+/* Parse a count such as "10k" or "1M" (powers of 1000) */
+long bench_parse_count(const char *text);
+
+#endif /* BENCH_H */
@@ -0,0 +1,516 @@
+/* Synthetic mail for the benchmarks. A message is a pure function of its
+ * mailbox and sequence number, so any number of them can be produced
+ * without storing anything. */
+#define _POSIX_C_SOURCE 200809L
+#include "corpus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define HEADER_SIZE 16384
+#define TEXT_SIZE 65536
+#define BODY_SIZE (1 << 20)
+
+static void buf_add(CorpusBuffer *buf, const char *text, size_t len) {
+    if (buf->len + len >= buf->capacity) {
+        len = buf->capacity - buf->len - 1;
+    }
+    memcpy(buf->data + buf->len, text, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+static void buf_str(CorpusBuffer *buf, const char *text) {
+    buf_add(buf, text, strlen(text));
+}
+
+static void buf_printf(CorpusBuffer *buf, const char *format, ...) {
+    va_list args;
+    size_t room = buf->capacity - buf->len;
+
+    va_start(args, format);
+    int len = vsnprintf(buf->data + buf->len, room, format, args);
+    va_end(args);
+    if (len < 0) return;
+    buf->len += (size_t)len < room ? (size_t)len : room - 1;
+}
+
+typedef struct {
+    const char *name;
+    const char *address;
+} Person;
+
+static const Person people[] = {
+    { "Alice Johnson", "alice.johnson@example.com" },
+    { "Иван Петров", "ivan.petrov@example.ru" },
+    { "山田 太郎", "taro.yamada@example.jp" },
+    { "José García", "jose.garcia@example.es" },
+    { "Bob Smith", "bob@example.org" },
+    { "Ольга Смирнова", "olga@example.ru" },
+    { "Müller, Jürgen", "j.mueller@example.de" },
+    { "GitLab", "noreply@gitlab.example.com" },
+    { "Zoë 🚀 Launch Team", "launch@startup.example.io" },
+    { "Chen Wei", "chen.wei@example.cn" },
+    { "Дмитрий Соколов-Кузнецов", "d.sokolov@example.ru" },
+    { "Priya Natarajan", "priya@example.in" },
+};
+#define PEOPLE_COUNT (int)(sizeof(people) / sizeof(people[0]))
+
+static const char *const words_en[] = {
+    "the", "meeting", "report", "quarterly", "budget", "please", "review", "attached",
+    "draft", "schedule", "deployment", "server", "latency", "release", "notes",
+    "customer", "feedback", "invoice", "thanks", "update", "tomorrow", "agenda",
+    "project", "deadline", "benchmark", "results", "network", "mailbox", "question",
+    "proposal", "and", "for", "with", "about", "we", "should", "discuss", "before",
+    "migration", "rollback", "incident", "summary", "plan", "next", "week",
+};
+static const char *const words_ru[] = {
+    "встреча", "отчёт", "бюджет", "пожалуйста", "посмотрите", "вложение", "черновик",
+    "расписание", "сервер", "задержка", "выпуск", "клиент", "отзыв", "счёт", "спасибо",
+    "обновление", "завтра", "проект", "срок", "результаты", "и", "по", "для", "с",
+    "нужно", "обсудить", "перед", "миграция", "итоги", "план", "неделя",
+};
+#define WORDS_EN (int)(sizeof(words_en) / sizeof(words_en[0]))
+#define WORDS_RU (int)(sizeof(words_ru) / sizeof(words_ru[0]))
+
+unsigned int corpus_hash(unsigned int a, unsigned int b) {
+    unsigned int h = a * 0x9e3779b1u ^ (b + 0x7f4a7c15u) * 0x85ebca77u;
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h;
+}
+
+enum { MSG_PLAIN, MSG_ALTERNATIVE, MSG_ATTACHMENT };
+
+typedef struct {
+    int mailbox;
+    unsigned int seq;
+    unsigned int hash;
+    int kind;
+    int russian;
+    int thread_pos;                 /* 0 for the first message of a thread */
+    unsigned int thread_start;
+    const Person *from;
+    time_t date;
+} Shape;
+
+#define THREAD_BLOCK 6
+
+static void shape_of(int mailbox, unsigned int seq, Shape *shape) {
+    shape->mailbox = mailbox;
+    shape->seq = seq;
+    shape->hash = corpus_hash(seq, (unsigned int)mailbox + 1);
+
+    /* Threads of up to THREAD_BLOCK messages in consecutive blocks */
+    unsigned int block = (seq - 1) / THREAD_BLOCK;
+    unsigned int pos = (seq - 1) % THREAD_BLOCK;
+    unsigned int length = 1 + corpus_hash(block, 77) % THREAD_BLOCK;
+    shape->thread_pos = pos < length ? (int)pos : 0;
+    shape->thread_start = pos < length ? block * THREAD_BLOCK + 1 : seq;
+
+    int kind = shape->hash % 10;
+    shape->kind = kind < 4 ? MSG_PLAIN : kind < 8 ? MSG_ALTERNATIVE : MSG_ATTACHMENT;
+    shape->russian = corpus_hash(shape->thread_start, 3) % 3 == 0;
+    shape->from = &people[(shape->hash >> 8) % PEOPLE_COUNT];
+    shape->date = 1704067200 + (time_t)seq * 2237 + mailbox * 1000;
+}
+
+static void message_id(const Shape *shape, unsigned int seq, CorpusBuffer *buf) {
+    buf_printf(buf, "<%u.%d.%08x@%s>", seq, shape->mailbox,
+               corpus_hash(seq, (unsigned int)shape->mailbox + 1), CORPUS_DOMAIN);
+}
+
+static void format_date(time_t when, char *out, size_t size) {
+    struct tm tm;
+    gmtime_r(&when, &tm);
+    strftime(out, size, "%a, %d %b %Y %H:%M:%S +0000", &tm);
+}
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void base64_add(CorpusBuffer *buf, const unsigned char *in, size_t len) {
+    char out[4];
+    for (size_t i = 0; i < len; i += 3) {
+        unsigned int v = in[i] << 16;
+        if (i + 1 < len) v |= in[i + 1] << 8;
+        if (i + 2 < len) v |= in[i + 2];
+        out[0] = base64_chars[(v >> 18) & 63];
+        out[1] = base64_chars[(v >> 12) & 63];
+        out[2] = i + 1 < len ? base64_chars[(v >> 6) & 63] : '=';
+        out[3] = i + 2 < len ? base64_chars[v & 63] : '=';
+        buf_add(buf, out, 4);
+    }
+}
+
+static int is_ascii(const char *text) {
+    for (; *text; text++) {
+        if ((unsigned char)*text >= 0x80) return 0;
+    }
+    return 1;
+}
+
+/* Length of the longest prefix of at most max bytes ending on a UTF-8
+ * character boundary */
+static size_t utf8_prefix(const char *text, size_t max) {
+    size_t len = strlen(text);
+    if (len <= max) return len;
+    while (max > 0 && ((unsigned char)text[max] & 0xC0) == 0x80) max--;
+    return max;
+}
+
+/* A header value as RFC 2047 encoded words, B or Q, folded between words */
+static void encoded_words(CorpusBuffer *buf, const char *text, int q) {
+    int first = 1;
+
+    while (*text) {
+        size_t n = utf8_prefix(text, q ? 20 : 39);
+        if (!first) buf_str(buf, "\r\n ");
+        first = 0;
+
+        buf_str(buf, q ? "=?UTF-8?Q?" : "=?UTF-8?B?");
+        if (q) {
+            for (size_t i = 0; i < n; i++) {
+                unsigned char c = (unsigned char)text[i];
+                char hex[4];
+                if (c == ' ') {
+                    buf_add(buf, "_", 1);
+                } else if (isalnum(c)) {
+                    buf_add(buf, (const char *)&c, 1);
+                } else {
+                    snprintf(hex, sizeof(hex), "=%02X", c);
+                    buf_add(buf, hex, 3);
+                }
+            }
+        } else {
+            base64_add(buf, (const unsigned char *)text, n);
+        }
+        buf_str(buf, "?=");
+        text += n;
+    }
+}
+
+/* "Name <address>", encoded or quoted as the name needs */
+static void address_header(CorpusBuffer *buf, const Person *person, unsigned int hash) {
+    if (!is_ascii(person->name)) {
+        encoded_words(buf, person->name, hash & 1);
+    } else if (strchr(person->name, ',')) {
+        buf_printf(buf, "\"%s\"", person->name);
+    } else {
+        buf_str(buf, person->name);
+    }
+    buf_printf(buf, " <%s>", person->address);
+}
+
+static void words(CorpusBuffer *buf, unsigned int hash, int count, int russian) {
+    for (int i = 0; i < count; i++) {
+        unsigned int h = corpus_hash(hash, (unsigned int)i);
+        if (i > 0) buf_add(buf, " ", 1);
+        buf_str(buf, russian ? words_ru[h % WORDS_RU] : words_en[h % WORDS_EN]);
+    }
+}
+
+static void subject_text(const Shape *shape, CorpusBuffer *buf) {
+    unsigned int h = corpus_hash(shape->thread_start, (unsigned int)shape->mailbox + 11);
+
+    if (shape->thread_pos > 0) buf_str(buf, "Re: ");
+    else if (h % 17 == 0) buf_str(buf, "Fwd: ");
+    if (h % 4 == 0) buf_printf(buf, "[PROJ-%u] ", h % 9000 + 1000);
+    words(buf, h, 3 + h % 10, shape->russian);
+}
+
+/* Full header block, ending with the empty line */
+static void generate_header(const Shape *shape, CorpusBuffer *buf, const char *boundary) {
+    char date[64];
+    char subject_data[512];
+    CorpusBuffer subject = { subject_data, 0, sizeof(subject_data) };
+    unsigned int h = shape->hash;
+
+    format_date(shape->date, date, sizeof(date));
+    subject_data[0] = '\0';
+    subject_text(shape, &subject);
+
+    buf_printf(buf, "Return-Path: <%s>\r\n", shape->from->address);
+    buf_printf(buf, "Received: from mx%u.example.net (mx%u.example.net [192.0.2.%u])\r\n"
+                    "\tby mail.%s (Postfix) with ESMTPS id %08X\r\n"
+                    "\tfor <me@%s>; %s\r\n",
+               h % 7, h % 7, h % 250 + 1, CORPUS_DOMAIN, h, CORPUS_DOMAIN, date);
+
+    buf_str(buf, "From: ");
+    address_header(buf, shape->from, h);
+    buf_printf(buf, "\r\nTo: Me <me@%s>\r\n", CORPUS_DOMAIN);
+    if (h % 5 == 0) {
+        buf_str(buf, "Cc: ");
+        address_header(buf, &people[(h >> 12) % PEOPLE_COUNT], h >> 1);
+        buf_str(buf, ",\r\n ");
+        address_header(buf, &people[(h >> 16) % PEOPLE_COUNT], h >> 2);
+        buf_str(buf, "\r\n");
+    }
+
+    buf_str(buf, "Subject: ");
+    if (!is_ascii(subject.data)) {
+        encoded_words(buf, subject.data, (h >> 3) & 1);
+    } else {
+        buf_str(buf, subject.data);
+    }
+    buf_printf(buf, "\r\nDate: %s\r\nMessage-ID: ", date);
+    message_id(shape, shape->seq, buf);
+    buf_str(buf, "\r\n");
+
+    if (shape->thread_pos > 0) {
+        buf_str(buf, "In-Reply-To: ");
+        message_id(shape, shape->seq - 1, buf);
+        buf_str(buf, "\r\nReferences:");
+        for (unsigned int seq = shape->thread_start; seq < shape->seq; seq++) {
+            buf_str(buf, seq == shape->thread_start ? " " : "\r\n ");
+            message_id(shape, seq, buf);
+        }
+        buf_str(buf, "\r\n");
+    }
+
+    buf_str(buf, "MIME-Version: 1.0\r\n");
+    switch (shape->kind) {
+        case MSG_PLAIN:
+            buf_printf(buf, "Content-Type: text/plain; charset=UTF-8; format=flowed\r\n"
+                            "Content-Transfer-Encoding: %s\r\n",
+                       shape->russian ? "quoted-printable" : "7bit");
+            break;
+        case MSG_ALTERNATIVE:
+            buf_printf(buf, "Content-Type: multipart/alternative;\r\n boundary=\"%s\"\r\n", boundary);
+            break;
+        default:
+            buf_printf(buf, "Content-Type: multipart/mixed;\r\n boundary=\"%s\"\r\n", boundary);
+            break;
+    }
+    buf_str(buf, h % 3 ? "X-Mailer: Bench Mailer 2.1\r\n" : "User-Agent: Mozilla Thunderbird\r\n");
+    buf_str(buf, "\r\n");
+}
+
+/* Text wrapped at 72 columns */
+static void paragraph(CorpusBuffer *buf, unsigned int hash, int russian, const char *prefix) {
+    int count = 20 + hash % 70;
+    int column = 0;
+
+    buf_str(buf, prefix);
+    for (int i = 0; i < count; i++) {
+        unsigned int h = corpus_hash(hash, (unsigned int)i + 1000);
+        const char *word = russian ? words_ru[h % WORDS_RU] : words_en[h % WORDS_EN];
+        int width = (int)strlen(word);
+
+        if (column > 0 && column + width > 72) {
+            buf_str(buf, "\r\n");
+            buf_str(buf, prefix);
+            column = 0;
+        } else if (column > 0) {
+            buf_add(buf, " ", 1);
+            column++;
+        }
+        buf_str(buf, word);
+        column += width;
+        if (h % 11 == 0) {
+            buf_add(buf, ".", 1);
+            column++;
+        }
+    }
+    buf_str(buf, ".\r\n\r\n");
+}
+
+static void body_text(const Shape *shape, CorpusBuffer *buf) {
+    unsigned int h = corpus_hash(shape->hash, 5);
+    int paragraphs = 1 + h % 8;
+
+    buf_str(buf, shape->russian ? "Привет,\r\n\r\n" : "Hi,\r\n\r\n");
+    for (int i = 0; i < paragraphs; i++) {
+        paragraph(buf, corpus_hash(h, (unsigned int)i), shape->russian, "");
+    }
+    if (shape->thread_pos > 0) {
+        char date[64];
+        format_date(shape->date - 2237, date, sizeof(date));
+        buf_printf(buf, "On %s, %s wrote:\r\n", date, shape->from->name);
+        paragraph(buf, corpus_hash(h, 99), shape->russian, "> ");
+    }
+    buf_printf(buf, "-- \r\n%s\r\n", shape->from->name);
+}
+
+/* Quoted-printable with soft breaks at 76 columns */
+static void quoted_printable(CorpusBuffer *buf, const char *text, size_t len) {
+    int column = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)text[i];
+        char encoded[4];
+        int width;
+
+        if (c == '\r' && i + 1 < len && text[i + 1] == '\n') {
+            buf_str(buf, "\r\n");
+            column = 0;
+            i++;
+            continue;
+        }
+        if ((c >= 33 && c <= 126 && c != '=') || (c == ' ' && i + 1 < len && text[i + 1] != '\r')) {
+            encoded[0] = (char)c;
+            width = 1;
+        } else {
+            snprintf(encoded, sizeof(encoded), "=%02X", c);
+            width = 3;
+        }
+        if (column + width > 75) {
+            buf_str(buf, "=\r\n");
+            column = 0;
+        }
+        buf_add(buf, encoded, width);
+        column += width;
+    }
+}
+
+static void html_of(const char *text, CorpusBuffer *html) {
+    buf_str(html, "<html><head><meta charset=\"utf-8\"></head><body><div dir=\"ltr\">");
+    for (const char *p = text; *p; p++) {
+        if (*p == '\r') continue;
+        if (*p == '\n') buf_str(html, "<br>\r\n");
+        else if (*p == '<') buf_str(html, "&lt;");
+        else if (*p == '>') buf_str(html, "&gt;");
+        else buf_add(html, p, 1);
+    }
+    buf_str(html, "</div></body></html>\r\n");
+}
+
+static void attachment(const Shape *shape, CorpusBuffer *buf, const char *boundary) {
+    unsigned int h = corpus_hash(shape->hash, 9);
+    size_t size = 8192 + h % (256 * 1024);
+    unsigned int state = h | 1;
+
+    if (shape->russian) {
+        buf_printf(buf, "--%s\r\nContent-Type: application/pdf\r\n"
+                        "Content-Disposition: attachment;\r\n"
+                        " filename*=UTF-8''%%D0%%BE%%D1%%82%%D1%%87%%D1%%91%%D1%%82-%u.pdf\r\n",
+                   boundary, h % 1000);
+    } else {
+        buf_printf(buf, "--%s\r\nContent-Type: application/pdf; name=\"report-%u.pdf\"\r\n"
+                        "Content-Disposition: attachment; filename=\"report-%u.pdf\"\r\n",
+                   boundary, h % 1000, h % 1000);
+    }
+    buf_str(buf, "Content-Transfer-Encoding: base64\r\n\r\n");
+
+    unsigned char line[57];
+    while (size > 0) {
+        size_t n = size < sizeof(line) ? size : sizeof(line);
+        for (size_t i = 0; i < n; i++) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            line[i] = (unsigned char)state;
+        }
+        base64_add(buf, line, n);
+        buf_str(buf, "\r\n");
+        size -= n;
+    }
+}
+
+static void boundary_of(const Shape *shape, char *out, size_t size) {
+    snprintf(out, size, "=_bench_%08x", corpus_hash(shape->hash, 13));
+}
+
+static void generate_message(CorpusMessage *gen, const Shape *shape, int with_body) {
+    gen->date = shape->date;
+    char boundary[32];
+
+    boundary_of(shape, boundary, sizeof(boundary));
+    gen->header.len = 0;
+    generate_header(shape, &gen->header, boundary);
+    if (!with_body) return;
+
+    gen->body.len = 0;
+    gen->text.len = 0;
+    body_text(shape, &gen->text);
+
+    if (shape->kind == MSG_PLAIN) {
+        if (shape->russian) quoted_printable(&gen->body, gen->text.data, gen->text.len);
+        else buf_add(&gen->body, gen->text.data, gen->text.len);
+        return;
+    }
+
+    buf_printf(&gen->body, "This is a multi-part message in MIME format.\r\n\r\n--%s\r\n"
+                           "Content-Type: text/plain; charset=UTF-8\r\n"
+                           "Content-Transfer-Encoding: quoted-printable\r\n\r\n",
+               boundary);
+    quoted_printable(&gen->body, gen->text.data, gen->text.len);
+
+    if (shape->kind == MSG_ALTERNATIVE) {
+        gen->html.len = 0;
+        html_of(gen->text.data, &gen->html);
+        buf_printf(&gen->body, "\r\n--%s\r\nContent-Type: text/html; charset=UTF-8\r\n"
+                               "Content-Transfer-Encoding: quoted-printable\r\n\r\n",
+                   boundary);
+        quoted_printable(&gen->body, gen->html.data, gen->html.len);
+    } else {
+        buf_str(&gen->body, "\r\n");
+        attachment(shape, &gen->body, boundary);
+    }
+    buf_printf(&gen->body, "\r\n--%s--\r\n", boundary);
+}
+
+int corpus_init(CorpusMessage *gen) {
+    CorpusBuffer *bufs[4] = { &gen->header, &gen->body, &gen->text, &gen->html };
+    size_t sizes[4] = { HEADER_SIZE, BODY_SIZE, TEXT_SIZE, TEXT_SIZE * 2 };
+
+    for (int i = 0; i < 4; i++) {
+        bufs[i]->data = malloc(sizes[i]);
+        bufs[i]->len = 0;
+        bufs[i]->capacity = sizes[i];
+        if (!bufs[i]->data) return -1;
+    }
+    return 0;
+}
+
+void corpus_free(CorpusMessage *gen) {
+    free(gen->header.data);
+    free(gen->body.data);
+    free(gen->text.data);
+    free(gen->html.data);
+}
+
+void corpus_generate(CorpusMessage *message, int mailbox, unsigned int seq, int with_body) {
+    Shape shape;
+
+    shape_of(mailbox, seq, &shape);
+    generate_message(message, &shape, with_body);
+}
+
+/* Copy the header lines whose names appear in the field list */
+void corpus_header_fields(const CorpusMessage *message, const char *section, CorpusBuffer *out) {
+    const char *list = strchr(section, '(');
+    const char *p = message->header.data;
+    const char *end = message->header.data + message->header.len;
+
+    out->len = 0;
+    while (p < end && !(p[0] == '\r' && p[1] == '\n')) {
+        const char *line_end = p;
+        do {
+            line_end = strstr(line_end, "\r\n");
+            if (!line_end) line_end = end;
+            else line_end += 2;
+        } while (line_end < end && (*line_end == ' ' || *line_end == '\t'));
+
+        const char *colon = memchr(p, ':', line_end - p);
+        int wanted = 0;
+        if (colon && list) {
+            size_t name_len = colon - p;
+            for (const char *f = list + 1; *f && *f != ')';) {
+                while (*f == ' ') f++;
+                size_t n = strcspn(f, " )");
+                if (n == name_len && strncasecmp(f, p, n) == 0) wanted = 1;
+                f += n;
+            }
+        }
+        if (wanted) buf_add(out, p, line_end - p);
+        p = line_end;
+    }
+    buf_str(out, "\r\n");
+}
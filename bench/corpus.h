@@ -0,0 +1,41 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <stddef.h>
+#include <time.h>
+
+#define CORPUS_DOMAIN "bench.cterm"
+
+typedef struct {
+    char *data;             /* NUL-terminated */
+    size_t len;
+    size_t capacity;
+} CorpusBuffer;
+
+/* One generated message. Messages have the shape of real mail: encoded-word
+ * names and subjects in several scripts, folded headers, reply chains with
+ * References, plain, multipart/alternative and multipart/mixed bodies with
+ * quoted-printable text and base64 attachments. */
+typedef struct {
+    CorpusBuffer header;    /* Full header block, ending with the empty line */
+    CorpusBuffer body;      /* Everything after the header */
+    CorpusBuffer text;      /* Scratch space */
+    CorpusBuffer html;
+    time_t date;
+} CorpusMessage;
+
+int corpus_init(CorpusMessage *message);
+void corpus_free(CorpusMessage *message);
+
+/* Message seq (from 1) of a mailbox; the same arguments give the same
+ * message. Without with_body only the header is made. */
+void corpus_generate(CorpusMessage *message, int mailbox, unsigned int seq, int with_body);
+
+/* The header lines named in an IMAP section such as
+ * "HEADER.FIELDS (FROM SUBJECT)", ending with the empty line */
+void corpus_header_fields(const CorpusMessage *message, const char *section, CorpusBuffer *out);
+
+/* Deterministic mixing of two numbers */
+unsigned int corpus_hash(unsigned int a, unsigned int b);
+
+#endif /* CORPUS_H */
@@ -0,0 +1,288 @@
+/* End-to-end load benchmark: runs cterm's session code, headless, against
+ * the mock server for a range of mailbox sizes.
+ *
+ * For each size a fresh server is started and the driver measures:
+ *   first screen  connect, login, select INBOX and fetch its index, as
+ *                 cterm does before drawing
+ *   full sync     first screen plus the folder list, every folder's index
+ *                 and the background STATUS refresh
+ *   open          fetching the body of random messages (percentiles)
+ *   send          messages per second and throughput over one SMTP session */
+#define _POSIX_C_SOURCE 200809L
+#include "bench.h"
+#include "imap.h"
+#include "smtp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_SIZES 16
+
+typedef struct {
+    const char *server;
+    int sizes[MAX_SIZES];
+    int size_count;
+    int latency_ms;
+    long bandwidth;
+    int opens;
+    int sends;
+    long send_size;
+    int minimal;
+} BenchOptions;
+
+typedef struct {
+    pid_t pid;
+    int imap_port;
+    int smtp_port;
+} Server;
+
+static int server_start(const BenchOptions *options, int messages, Server *server) {
+    char messages_arg[32], latency_arg[32], bandwidth_arg[32];
+    int fds[2];
+
+    snprintf(messages_arg, sizeof(messages_arg), "%d", messages);
+    snprintf(latency_arg, sizeof(latency_arg), "%d", options->latency_ms);
+    snprintf(bandwidth_arg, sizeof(bandwidth_arg), "%ld", options->bandwidth);
+
+    if (pipe(fds) < 0) return -1;
+    server->pid = fork();
+    if (server->pid < 0) return -1;
+
+    if (server->pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execl(options->server, options->server, "-n", messages_arg, "-l", latency_arg,
+              "-b", bandwidth_arg, options->minimal ? "-m" : (char *)NULL, (char *)NULL);
+        perror(options->server);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    FILE *out = fdopen(fds[0], "r");
+    int ok = out && fscanf(out, "imap %d smtp %d", &server->imap_port, &server->smtp_port) == 2;
+    if (out) fclose(out);
+    if (!ok) {
+        fprintf(stderr, "Mock server did not start\n");
+        kill(server->pid, SIGTERM);
+        waitpid(server->pid, NULL, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static void server_stop(Server *server) {
+    kill(server->pid, SIGTERM);
+    waitpid(server->pid, NULL, 0);
+}
+
+typedef struct {
+    int messages;
+    double first_screen;
+    double full_sync;
+    double open_p50, open_p90, open_p99, open_max;
+    double send_rate;
+    double send_mbps;
+    long rss_kb;
+} Result;
+
+static int run_imap(const BenchOptions *options, const Server *server, Result *result) {
+    ImapSession session;
+    double start = bench_now();
+
+    if (imap_connect(&session, "127.0.0.1", server->imap_port, 0) < 0 ||
+        imap_login(&session, "bench", "bench", NULL) < 0 ||
+        imap_select_mailbox(&session, "INBOX") < 0 ||
+        imap_fetch_emails(&session) < 0) {
+        fprintf(stderr, "IMAP session failed\n");
+        imap_disconnect(&session);
+        return -1;
+    }
+    result->first_screen = bench_now() - start;
+
+    /* Full sync: every folder's index and fresh counts */
+    int inbox = -1;
+    if (imap_list_folders(&session) < 0) {
+        imap_disconnect(&session);
+        return -1;
+    }
+    for (int i = 0; i < session.folder_count; i++) {
+        if (strcmp(session.folders[i].name, "INBOX") == 0) inbox = i;
+    }
+    for (int i = 0; i < session.folder_count; i++) {
+        if (i != inbox && imap_switch_folder(&session, i) < 0) {
+            fprintf(stderr, "Loading folder %s failed\n", session.folders[i].name);
+        }
+    }
+    if (inbox >= 0) imap_switch_folder(&session, inbox);
+    if (imap_status_refresh_begin(&session) > 0) {
+        while (imap_status_refresh_poll(&session) > 0) {
+            net_poll_readable(&session.conn, 100);
+        }
+    }
+    result->full_sync = bench_now() - start;
+
+    /* Open random messages of the open folder */
+    char *body = malloc(MAX_BODY_LEN);
+    double *times = malloc(sizeof(double) * (options->opens > 0 ? options->opens : 1));
+    int opened = 0;
+    unsigned int seed = 12345;
+
+    for (int i = 0; i < options->opens && body && times && session.email_count > 0; i++) {
+        seed = seed * 1103515245u + 12345u;
+        unsigned int uid = session.emails[(seed >> 8) % session.email_count].uid;
+
+        double t = bench_now();
+        if (imap_fetch_email_body(&session, uid, body, MAX_BODY_LEN) < 0) break;
+        times[opened++] = bench_now() - t;
+    }
+    if (opened > 0) {
+        result->open_p50 = bench_percentile(times, opened, 0.50);
+        result->open_p90 = bench_percentile(times, opened, 0.90);
+        result->open_p99 = bench_percentile(times, opened, 0.99);
+        result->open_max = bench_percentile(times, opened, 1.0);
+    }
+    free(times);
+    free(body);
+
+    result->rss_kb = bench_peak_rss_kb();
+    imap_disconnect(&session);
+    return 0;
+}
+
+static int run_smtp(const BenchOptions *options, const Server *server, Result *result) {
+    SmtpSession session;
+    char *body = malloc(options->send_size + 1);
+    int sent = 0;
+
+    if (!body) return -1;
+
+    /* Text lines of 72 characters, some starting with a dot */
+    for (long i = 0; i < options->send_size; i++) {
+        long column = i % 74;
+        body[i] = column == 72 ? '\r' : column == 73 ? '\n' : column == 0 && i % 740 == 0 ? '.' : 'a' + i % 26;
+    }
+    body[options->send_size] = '\0';
+
+    double start = bench_now();
+    if (smtp_connect(&session, "127.0.0.1", server->smtp_port, 0) < 0 ||
+        smtp_authenticate(&session, "bench", "bench", NULL) < 0) {
+        fprintf(stderr, "SMTP session failed\n");
+        free(body);
+        return -1;
+    }
+    for (int i = 0; i < options->sends; i++) {
+        if (smtp_send_email(&session, "bench@bench.cterm", "me@bench.cterm", "Benchmark", body) < 0) {
+            fprintf(stderr, "Sending message %d failed\n", i + 1);
+            break;
+        }
+        sent++;
+    }
+    double elapsed = bench_now() - start;
+    smtp_disconnect(&session);
+    free(body);
+
+    if (elapsed > 0) {
+        result->send_rate = sent / elapsed;
+        result->send_mbps = sent * (double)options->send_size / elapsed / (1024.0 * 1024.0);
+    }
+    return 0;
+}
+
+static int parse_sizes(const char *text, BenchOptions *options) {
+    options->size_count = 0;
+    while (*text && options->size_count < MAX_SIZES) {
+        char item[32];
+        size_t len = strcspn(text, ",");
+        if (len >= sizeof(item)) return -1;
+        memcpy(item, text, len);
+        item[len] = '\0';
+
+        long value = bench_parse_count(item);
+        if (value < 1) return -1;
+        options->sizes[options->size_count++] = (int)value;
+        text += len;
+        if (*text == ',') text++;
+    }
+    return options->size_count > 0 ? 0 : -1;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s -S server [-n sizes] [-l latency_ms] [-b bandwidth] [-o opens]\n"
+           "          [-s sends] [-z send_size] [-m]\n", program);
+    printf("  -S  Path to cterm_mock_server\n");
+    printf("  -n  INBOX sizes, comma-separated, k and M suffixes (default 1k,10k,100k)\n");
+    printf("  -l  Server reply latency, ms; -b bandwidth in bytes/s (k, M suffixes)\n");
+    printf("  -o  Messages to open (default 200)\n");
+    printf("  -s  Messages to send (default 100), -z their body size (default 20k)\n");
+    printf("  -m  Server without extensions\n");
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options = { NULL, { 1000, 10000, 100000 }, 3, 0, 0, 200, 100, 20 * 1024, 0 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "S:n:l:b:o:s:z:mh")) != -1) {
+        switch (opt) {
+            case 'S': options.server = optarg; break;
+            case 'n':
+                if (parse_sizes(optarg, &options) < 0) {
+                    fprintf(stderr, "Bad size list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l': options.latency_ms = atoi(optarg); break;
+            case 'b': options.bandwidth = bench_parse_size(optarg); break;
+            case 'o': options.opens = atoi(optarg); break;
+            case 's': options.sends = atoi(optarg); break;
+            case 'z': options.send_size = bench_parse_size(optarg); break;
+            case 'm': options.minimal = 1; break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!options.server || options.bandwidth < 0 || options.send_size < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    net_init_ssl();
+
+    printf("latency %d ms, bandwidth %s%ld B/s, %s server\n\n", options.latency_ms,
+           options.bandwidth ? "" : "unlimited ", options.bandwidth,
+           options.minimal ? "minimal" : "full-featured");
+    printf("%9s %12s %11s %26s %10s %8s %10s\n", "messages", "first(s)", "sync(s)",
+           "open p50/p90/p99/max(ms)", "send/s", "MB/s", "peakRSS(MB)");
+
+    int failed = 0;
+    for (int i = 0; i < options.size_count; i++) {
+        Server server;
+        Result result;
+
+        memset(&result, 0, sizeof(result));
+        result.messages = options.sizes[i];
+        if (server_start(&options, result.messages, &server) < 0) return 1;
+
+        if (run_imap(&options, &server, &result) < 0 || run_smtp(&options, &server, &result) < 0) {
+            failed = 1;
+        }
+        server_stop(&server);
+
+        printf("%9d %12.3f %11.3f %7.2f/%5.2f/%5.2f/%6.2f %10.1f %8.2f %10.1f\n",
+               result.messages, result.first_screen, result.full_sync,
+               result.open_p50 * 1e3, result.open_p90 * 1e3, result.open_p99 * 1e3,
+               result.open_max * 1e3, result.send_rate, result.send_mbps, result.rss_kb / 1024.0);
+        fflush(stdout);
+    }
+
+    net_cleanup_ssl();
+    return failed;
+}
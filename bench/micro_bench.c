@@ -0,0 +1,418 @@
+/* Microbenchmarks for the parsing and encoding hot paths.
+ *
+ * The decoders under test are private to src/imap.c; a library built
+ * with CTERM_BENCH_INTERNALS exports them and src/imap_internal.h
+ * declares them. Inputs come from the benchmark corpus, the messages the
+ * mock server serves, plus a few hand-written headers with the encodings
+ * real mail still carries.
+ *
+ * Each benchmark runs over its whole input set repeatedly for at least
+ * the configured time; the median of five such trials is reported as
+ * ns/op and MB/s of input. Results can be saved and later compared
+ * against, flagging benchmarks that got slower than the threshold. */
+#define _POSIX_C_SOURCE 200809L
+#define CTERM_BENCH_INTERNALS
+#include "../src/imap_internal.h"
+#include "bench.h"
+#include "corpus.h"
+#include "mime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define CORPUS_MESSAGES 512
+#define TRIALS 5
+#define MAX_BASELINE 64
+#define BENCH_BODY_LEN 4096      /* Bodies as the client once capped them, so results compare */
+#define FETCH_FIELDS "HEADER.FIELDS (FROM SUBJECT DATE MESSAGE-ID IN-REPLY-TO REFERENCES)"
+
+typedef struct {
+    char *data;
+    size_t len;
+} Input;
+
+typedef struct {
+    Input *items;
+    int count;
+} InputSet;
+
+static InputSet headers;        /* Header blocks as FETCH returns them */
+static InputSet header_values;  /* Unfolded Subject and From values */
+static InputSet base64_words;   /* Payloads of B encoded words */
+static InputSet base64_blocks;  /* Attachment base64, 76-column lines */
+static InputSet binary_blocks;  /* Raw data to encode */
+static InputSet bodies;         /* Body text as shown, before sanitizing */
+static InputSet responses;      /* UID FETCH BODY[TEXT] responses */
+
+static volatile size_t sink;    /* Keeps results alive */
+
+/* Encodings found in real mail that the generator does not produce */
+static const char *const extra_values[] = {
+    "=?ISO-8859-1?Q?Andr=E9_Pirard?= <pirard@example.be>",
+    "=?windows-1251?B?z/Do4uXyLCDs6PA=?=",
+    "Re: =?UTF-8?B?0J/RgNC40LLQtdGC?= =?UTF-8?B?LCDQvNC40YA=?= and plain text",
+    "=?utf-8?q?caf=C3=A9_=E2=98=95?= <cafe@example.fr>",
+    "=?UTF-8?B?broken base64 !!!?=",
+    "Plain ASCII subject that is rather long and has no encoding at all, as most still do",
+    "=?UTF-8?Q?=F0=9F=9A=80_Launch_day?=",
+};
+
+static void input_add(InputSet *set, const char *data, size_t len) {
+    Input *items = realloc(set->items, (set->count + 1) * sizeof(Input));
+    if (!items) return;
+    set->items = items;
+
+    Input *item = &set->items[set->count];
+    item->data = malloc(len + 1);
+    if (!item->data) return;
+    memcpy(item->data, data, len);
+    item->data[len] = '\0';
+    item->len = len;
+    set->count++;
+}
+
+/* A header value with continuation lines joined, as parse_email_header
+ * hands it to decode_mime_header */
+static void add_header_value(const CorpusBuffer *header, const char *name) {
+    char value[BUFFER_SIZE];
+    size_t name_len = strlen(name);
+    const char *p = header->data;
+
+    while (p && *p) {
+        if (strncasecmp(p, name, name_len) == 0 && p[name_len] == ':') {
+            const char *start = p + name_len + 1;
+            size_t len = 0;
+            while (*start == ' ') start++;
+
+            for (const char *q = start; *q && len + 1 < sizeof(value); q++) {
+                if (q[0] == '\r' && q[1] == '\n') {
+                    if (q[2] != ' ' && q[2] != '\t') break;
+                    q++;
+                    continue;
+                }
+                value[len++] = *q;
+            }
+            input_add(&header_values, value, len);
+            return;
+        }
+        p = strstr(p, "\r\n");
+        if (p) p += 2;
+    }
+}
+
+/* Base64 payload of every B encoded word in a header */
+static void add_base64_words(const CorpusBuffer *header) {
+    const char *p = header->data;
+    while ((p = strstr(p, "?B?")) != NULL) {
+        p += 3;
+        const char *end = strstr(p, "?=");
+        if (!end) break;
+        input_add(&base64_words, p, end - p);
+        p = end;
+    }
+}
+
+/* The base64 part of an attachment, if the body has one */
+static void add_base64_block(const CorpusBuffer *body) {
+    const char *start = strstr(body->data, "Content-Transfer-Encoding: base64\r\n\r\n");
+    if (!start) return;
+    start += 37;
+
+    const char *end = strstr(start, "\r\n--");
+    size_t len = end ? (size_t)(end - start) : strlen(start);
+    if (len > 16384) len = 16384 - 16384 % 78;
+    input_add(&base64_blocks, start, len);
+
+    char raw[16384];
+    int raw_len = base64_decode(start, (int)len, raw, sizeof(raw));
+    input_add(&binary_blocks, raw, raw_len);
+}
+
+/* What imap_send_command collects for a body: the FETCH line, the body
+ * up to the response buffer size, and the tagged reply */
+static void add_response(unsigned int uid, const CorpusBuffer *body) {
+    static char response[BUFFER_SIZE * 2];
+    int len = snprintf(response, sizeof(response), "* %u FETCH (UID %u BODY[TEXT] {%zu}\r\n",
+                       uid, uid, body->len);
+    size_t room = sizeof(response) - 64 - len;
+    size_t n = body->len < room ? body->len : room;
+
+    memcpy(response + len, body->data, n);
+    len += (int)n;
+    len += snprintf(response + len, sizeof(response) - len, ")\r\nA%u OK FETCH completed\r\n", uid);
+    input_add(&responses, response, len);
+}
+
+static int build_inputs(void) {
+    CorpusMessage message;
+    CorpusBuffer fields;
+    char fields_data[16384];
+
+    if (corpus_init(&message) < 0) return -1;
+    fields.data = fields_data;
+    fields.capacity = sizeof(fields_data);
+
+    for (unsigned int seq = 1; seq <= CORPUS_MESSAGES; seq++) {
+        corpus_generate(&message, 0, seq, 1);
+
+        fields.len = 0;
+        corpus_header_fields(&message, FETCH_FIELDS, &fields);
+        input_add(&headers, fields.data, fields.len);
+
+        add_header_value(&message.header, "Subject");
+        add_header_value(&message.header, "From");
+        add_base64_words(&message.header);
+        add_base64_block(&message.body);
+        add_response(seq, &message.body);
+
+        size_t len = message.body.len < BENCH_BODY_LEN - 1 ? message.body.len : BENCH_BODY_LEN - 1;
+        input_add(&bodies, message.body.data, len);
+    }
+    for (size_t i = 0; i < sizeof(extra_values) / sizeof(extra_values[0]); i++) {
+        input_add(&header_values, extra_values[i], strlen(extra_values[i]));
+    }
+
+    corpus_free(&message);
+    return 0;
+}
+
+/* ---- Benchmarks: each runs once over its inputs, returns bytes read ---- */
+
+static size_t run_base64_decode_word(void) {
+    char out[512];
+    size_t bytes = 0;
+    for (int i = 0; i < base64_words.count; i++) {
+        sink += base64_decode(base64_words.items[i].data, (int)base64_words.items[i].len, out, sizeof(out));
+        bytes += base64_words.items[i].len;
+    }
+    return bytes;
+}
+
+static size_t run_base64_decode_block(void) {
+    static char out[16384];
+    size_t bytes = 0;
+    for (int i = 0; i < base64_blocks.count; i++) {
+        sink += base64_decode(base64_blocks.items[i].data, (int)base64_blocks.items[i].len, out, sizeof(out));
+        bytes += base64_blocks.items[i].len;
+    }
+    return bytes;
+}
+
+static size_t run_base64_encode_word(void) {
+    char out[128];
+    size_t bytes = 0;
+    for (int i = 0; i < header_values.count; i++) {
+        size_t len = header_values.items[i].len < 57 ? header_values.items[i].len : 57;
+        sink += mime_base64_encode((const unsigned char *)header_values.items[i].data, len, out);
+        bytes += len;
+    }
+    return bytes;
+}
+
+static size_t run_base64_encode_block(void) {
+    static char out[32768];
+    size_t bytes = 0;
+    for (int i = 0; i < binary_blocks.count; i++) {
+        sink += mime_base64_encode_lines((const unsigned char *)binary_blocks.items[i].data,
+                                         binary_blocks.items[i].len, out);
+        bytes += binary_blocks.items[i].len;
+    }
+    return bytes;
+}
+
+static size_t run_decode_mime_header(void) {
+    char out[MAX_SUBJECT_LEN];
+    size_t bytes = 0;
+    for (int i = 0; i < header_values.count; i++) {
+        decode_mime_header(header_values.items[i].data, out, sizeof(out));
+        sink += (unsigned char)out[0];
+        bytes += header_values.items[i].len;
+    }
+    return bytes;
+}
+
+/* Includes copying the input, since sanitize_text works in place */
+static size_t run_sanitize_text(void) {
+    static char text[BENCH_BODY_LEN];
+    size_t bytes = 0;
+    for (int i = 0; i < bodies.count; i++) {
+        memcpy(text, bodies.items[i].data, bodies.items[i].len + 1);
+        sanitize_text(text);
+        sink += (unsigned char)text[0];
+        bytes += bodies.items[i].len;
+    }
+    return bytes;
+}
+
+static size_t run_parse_email_header(void) {
+    static Email email;
+    static ThreadHeaders refs;
+    size_t bytes = 0;
+    for (int i = 0; i < headers.count; i++) {
+        parse_email_header(headers.items[i].data, &email, &refs);
+        sink += (unsigned char)email.subject[0];
+        bytes += headers.items[i].len;
+    }
+    return bytes;
+}
+
+static size_t run_extract_body(void) {
+    static char body[BENCH_BODY_LEN];
+    size_t bytes = 0;
+    for (int i = 0; i < responses.count; i++) {
+        sink += extract_body(responses.items[i].data, body, sizeof(body));
+        bytes += responses.items[i].len;
+    }
+    return bytes;
+}
+
+typedef struct {
+    const char *name;
+    size_t (*run)(void);
+    const InputSet *inputs;
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    { "base64_decode/word", run_base64_decode_word, &base64_words },
+    { "base64_decode/block", run_base64_decode_block, &base64_blocks },
+    { "base64_encode/word", run_base64_encode_word, &header_values },
+    { "base64_encode/block", run_base64_encode_block, &binary_blocks },
+    { "decode_mime_header", run_decode_mime_header, &header_values },
+    { "sanitize_text", run_sanitize_text, &bodies },
+    { "parse_email_header", run_parse_email_header, &headers },
+    { "extract_body", run_extract_body, &responses },
+};
+#define BENCHMARK_COUNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+typedef struct {
+    char name[64];
+    double ns_per_op;
+} BaselineEntry;
+
+/* Median of TRIALS timings, each at least min_time long */
+static void measure(const Benchmark *benchmark, double min_time, double *ns_per_op, double *mb_per_s) {
+    double ns[TRIALS], rate[TRIALS];
+
+    benchmark->run();   /* Warm up caches */
+    for (int t = 0; t < TRIALS; t++) {
+        long passes = 0;
+        size_t bytes = 0;
+        double start = bench_now(), elapsed;
+        do {
+            bytes += benchmark->run();
+            passes++;
+            elapsed = bench_now() - start;
+        } while (elapsed < min_time);
+
+        ns[t] = elapsed * 1e9 / ((double)passes * benchmark->inputs->count);
+        rate[t] = bytes / elapsed / (1024.0 * 1024.0);
+    }
+    *ns_per_op = bench_percentile(ns, TRIALS, 0.5);
+    *mb_per_s = bench_percentile(rate, TRIALS, 0.5);
+}
+
+static int load_baseline(const char *path, BaselineEntry *entries) {
+    FILE *file = fopen(path, "r");
+    char line[256];
+    int count = 0;
+
+    if (!file) {
+        fprintf(stderr, "Cannot open baseline %s\n", path);
+        return -1;
+    }
+    while (count < MAX_BASELINE && fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %lf", entries[count].name, &entries[count].ns_per_op) == 2) count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-t seconds] [-f filter] [-b baseline] [-w results] [-r percent]\n", program);
+    printf("  -t  Minimum time per trial (default 0.2 s)\n");
+    printf("  -f  Run only benchmarks whose name contains this text\n");
+    printf("  -b  Compare with results saved earlier; exit 1 on regressions\n");
+    printf("  -w  Save results for later comparison\n");
+    printf("  -r  Slowdown that counts as a regression (default 10%%)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL, *baseline_path = NULL, *save_path = NULL;
+    double min_time = 0.2, threshold = 10;
+    BaselineEntry baseline[MAX_BASELINE];
+    int baseline_count = 0;
+    int regressions = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:f:b:w:r:h")) != -1) {
+        switch (opt) {
+            case 't': min_time = atof(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            case 'w': save_path = optarg; break;
+            case 'r': threshold = atof(optarg); break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (baseline_path && (baseline_count = load_baseline(baseline_path, baseline)) < 0) return 2;
+    if (build_inputs() < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+
+    FILE *save = NULL;
+    if (save_path) {
+        save = fopen(save_path, "w");
+        if (!save) {
+            fprintf(stderr, "Cannot write %s\n", save_path);
+            return 2;
+        }
+        fprintf(save, "# cterm_bench results: name ns/op MB/s\n");
+    }
+
+    printf("%-22s %6s %10s %10s", "benchmark", "inputs", "ns/op", "MB/s");
+    if (baseline_count > 0) printf(" %10s %8s", "baseline", "change");
+    printf("\n");
+
+    for (int i = 0; i < BENCHMARK_COUNT; i++) {
+        const Benchmark *benchmark = &benchmarks[i];
+        double ns_per_op, mb_per_s;
+
+        if (filter && !strstr(benchmark->name, filter)) continue;
+        if (benchmark->inputs->count == 0) continue;
+
+        measure(benchmark, min_time, &ns_per_op, &mb_per_s);
+        printf("%-22s %6d %10.1f %10.1f", benchmark->name, benchmark->inputs->count, ns_per_op, mb_per_s);
+        if (save) fprintf(save, "%s %.2f %.2f\n", benchmark->name, ns_per_op, mb_per_s);
+
+        for (int b = 0; b < baseline_count; b++) {
+            if (strcmp(baseline[b].name, benchmark->name) != 0) continue;
+
+            double change = (ns_per_op / baseline[b].ns_per_op - 1) * 100;
+            printf(" %10.1f %+7.1f%%", baseline[b].ns_per_op, change);
+            if (change > threshold) {
+                printf("  REGRESSION");
+                regressions++;
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (save) fclose(save);
+    if (regressions > 0) {
+        printf("\n%d benchmark%s slower than the baseline by more than %.0f%%\n",
+               regressions, regressions == 1 ? "" : "s", threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,1245 @@
+/* Scripted IMAP and SMTP stand-in for benchmarks.
+ *
+ * Mailboxes are synthetic: every message is generated on demand from its
+ * mailbox and sequence number, so a million-message INBOX costs a bit per
+ * message for the flags and nothing else. Messages have realistic shape:
+ * encoded-word names and subjects in several scripts, folded headers,
+ * reply chains with References, plain, multipart/alternative and
+ * multipart/mixed bodies with quoted-printable text and base64
+ * attachments.
+ *
+ * Each connection goes through an emulated link: a reply leaves no
+ * earlier than the request's arrival plus the configured latency, and
+ * both directions are limited to the configured bandwidth. Pipelined
+ * requests arriving together therefore cost one round trip, as on a real
+ * network.
+ *
+ * On start the server prints "imap <port> smtp <port>" on stdout. */
+#define _POSIX_C_SOURCE 200809L
+#include "bench.h"
+#include "corpus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define IN_SIZE (1 << 20)           /* Longest request line, literals included */
+#define OUT_SIZE 65536              /* Replies are written in pieces of this size */
+#define MAX_MARKS 64
+#define HOSTNAME CORPUS_DOMAIN
+
+#define FLAG_SEEN 1
+#define FLAG_DELETED 2
+
+typedef struct {
+    int messages;
+    int latency_ms;
+    long bandwidth;                 /* Bytes per second each way, 0 = unlimited */
+    int minimal;                    /* Advertise no extensions */
+    long digest;                    /* Text size of INBOX message 1, 0 = as generated */
+} ServerOptions;
+
+typedef struct {
+    const char *name;               /* Modified UTF-7, as on the wire */
+    int messages;
+    unsigned char *flags;
+} Mailbox;
+
+static ServerOptions options = { 1000, 0, 0, 0, 0 };
+static char *digest_text;           /* The text of a -d digest */
+static pthread_mutex_t flags_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Mailbox mailboxes[] = {
+    { "INBOX", 0, NULL },
+    { "Sent", 0, NULL },
+    { "Drafts", 0, NULL },
+    { "&BBAEQARFBDgEMg-", 0, NULL },   /* "Архив" */
+    { "Trash", 0, NULL },
+};
+#define MAILBOX_COUNT (int)(sizeof(mailboxes) / sizeof(mailboxes[0]))
+
+/* ---- Emulated link ---- */
+
+typedef struct {
+    int fd;
+    int closed;
+
+    char *in;
+    size_t in_start;
+    size_t in_end;
+    struct {
+        size_t end;
+        double when;
+    } marks[MAX_MARKS];             /* When the bytes up to end arrived */
+    int mark_count;
+    double in_free;                 /* Inbound link is busy until then */
+
+    char out[OUT_SIZE];
+    size_t out_len;
+    double out_free;
+    double ready;                   /* Replies may not leave before then */
+
+    char *line;                     /* Current request, a copy */
+    size_t line_len;
+} Link;
+
+static double seconds_for(size_t bytes) {
+    return options.bandwidth > 0 ? (double)bytes / options.bandwidth : 0;
+}
+
+static void link_drop_marks(Link *link) {
+    int keep = 0;
+    while (keep < link->mark_count && link->marks[keep].end <= link->in_start) keep++;
+    if (keep > 0) {
+        memmove(link->marks, link->marks + keep, (link->mark_count - keep) * sizeof(link->marks[0]));
+        link->mark_count -= keep;
+    }
+}
+
+/* Read what the client sent, waiting up to timeout_ms (-1 = forever).
+ * Returns 1 if data came, 0 if not, -1 when the connection is gone. */
+static int link_pump(Link *link, int timeout_ms) {
+    if (link->closed) return -1;
+
+    if (link->in_start > 0 && link->in_end == IN_SIZE) {
+        size_t shift = link->in_start;
+        memmove(link->in, link->in + shift, link->in_end - shift);
+        link->in_end -= shift;
+        link->in_start = 0;
+        for (int i = 0; i < link->mark_count; i++) link->marks[i].end -= shift;
+    }
+    if (link->in_end == IN_SIZE) return 0;
+
+    struct pollfd pfd = { link->fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready <= 0) return ready;
+
+    ssize_t n = recv(link->fd, link->in + link->in_end, IN_SIZE - link->in_end, 0);
+    if (n <= 0) {
+        link->closed = 1;
+        return -1;
+    }
+
+    /* The bytes are considered arrived once the emulated link carried them */
+    double start = bench_now();
+    if (link->in_free > start) start = link->in_free;
+    link->in_free = start + seconds_for((size_t)n);
+    link->in_end += n;
+
+    if (link->mark_count == MAX_MARKS) {
+        memmove(link->marks, link->marks + 1, (MAX_MARKS - 1) * sizeof(link->marks[0]));
+        link->mark_count--;
+    }
+    link->marks[link->mark_count].end = link->in_end;
+    link->marks[link->mark_count].when = link->in_free;
+    link->mark_count++;
+    return 1;
+}
+
+/* Note that the request ending at offset end has arrived: replies to it
+ * leave one latency later */
+static void link_arrived(Link *link, size_t end) {
+    double when = link->in_free;
+    for (int i = 0; i < link->mark_count; i++) {
+        if (link->marks[i].end >= end) {
+            when = link->marks[i].when;
+            break;
+        }
+    }
+    link->ready = when + options.latency_ms / 1000.0;
+}
+
+/* Wait until the given time, taking in requests as they arrive */
+static void link_wait(Link *link, double when) {
+    for (;;) {
+        double left = when - bench_now();
+        if (left <= 0) return;
+        if (link->closed || link->in_end == IN_SIZE) {
+            bench_sleep_until(when);
+            return;
+        }
+        link_pump(link, (int)(left * 1000) + 1);
+    }
+}
+
+static int link_flush(Link *link) {
+    if (link->out_len == 0 || link->closed) {
+        link->out_len = 0;
+        return link->closed ? -1 : 0;
+    }
+
+    double start = link->ready;
+    if (link->out_free > start) start = link->out_free;
+    double now = bench_now();
+    if (now > start) start = now;
+    link->out_free = start + seconds_for(link->out_len);
+    link_wait(link, link->out_free);
+
+    size_t sent = 0;
+    while (sent < link->out_len) {
+        ssize_t n = send(link->fd, link->out + sent, link->out_len - sent, 0);
+        if (n <= 0) {
+            link->closed = 1;
+            break;
+        }
+        sent += n;
+    }
+    link->out_len = 0;
+    return link->closed ? -1 : 0;
+}
+
+static int link_write(Link *link, const char *data, size_t len) {
+    while (len > 0) {
+        size_t room = OUT_SIZE - link->out_len;
+        size_t n = len < room ? len : room;
+        memcpy(link->out + link->out_len, data, n);
+        link->out_len += n;
+        data += n;
+        len -= n;
+        if (link->out_len == OUT_SIZE && link_flush(link) < 0) return -1;
+    }
+    return 0;
+}
+
+static int link_printf(Link *link, const char *format, ...) {
+    char buffer[4096];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (len < 0) return -1;
+    if (len >= (int)sizeof(buffer)) len = sizeof(buffer) - 1;
+    return link_write(link, buffer, len);
+}
+
+/* Next CRLF-terminated line into link->line, without the line break */
+static int link_read_line(Link *link) {
+    for (;;) {
+        char *start = link->in + link->in_start;
+        char *newline = memchr(start, '\n', link->in_end - link->in_start);
+        if (newline) {
+            size_t len = newline - start;
+            size_t end = link->in_start + len + 1;
+            if (len > 0 && start[len - 1] == '\r') len--;
+
+            memcpy(link->line, start, len);
+            link->line[len] = '\0';
+            link->line_len = len;
+            link_arrived(link, end);
+            link->in_start = end;
+            link_drop_marks(link);
+            return 0;
+        }
+        if (link->in_start == 0 && link->in_end == IN_SIZE) return -1;
+        if (link_pump(link, -1) < 0) return -1;
+    }
+}
+
+/* Read exactly len bytes; they are appended to dst unless it is NULL */
+static int link_read_bytes(Link *link, char *dst, size_t len) {
+    while (len > 0) {
+        size_t have = link->in_end - link->in_start;
+        if (have == 0) {
+            if (link_pump(link, -1) < 0) return -1;
+            continue;
+        }
+        size_t n = have < len ? have : len;
+        if (dst) {
+            memcpy(dst, link->in + link->in_start, n);
+            dst += n;
+        }
+        link->in_start += n;
+        len -= n;
+        link_arrived(link, link->in_start);
+        link_drop_marks(link);
+    }
+    return 0;
+}
+
+static Link *link_open(int fd) {
+    Link *link = calloc(1, sizeof(Link));
+    if (!link) return NULL;
+
+    link->in = malloc(IN_SIZE);
+    link->line = malloc(IN_SIZE + 1);
+    if (!link->in || !link->line) {
+        free(link->in);
+        free(link->line);
+        free(link);
+        return NULL;
+    }
+    link->fd = fd;
+    link->in_free = bench_now();
+    /* The greeting waits one latency, like the answer to the handshake */
+    link->ready = link->in_free + options.latency_ms / 1000.0;
+    return link;
+}
+
+static void link_close(Link *link) {
+    close(link->fd);
+    free(link->in);
+    free(link->line);
+    free(link);
+}
+
+/* ---- IMAP ---- */
+
+typedef struct {
+    unsigned int first;
+    unsigned int last;
+} Range;
+
+typedef struct {
+    Link *link;
+    CorpusMessage gen;
+    int selected;
+    char tag[64];
+} ImapState;
+
+/* Parse a sequence set such as "1:4,7,9:*". Returns the number of
+ * ranges, each clamped to 1..max, or -1. */
+static int parse_set(const char *text, unsigned int max, Range **ranges) {
+    int count = 0, capacity = 8;
+    *ranges = malloc(capacity * sizeof(Range));
+    if (!*ranges) return -1;
+
+    while (*text && *text != ' ' && *text != ')') {
+        unsigned int a, b;
+        char *end;
+
+        if (*text == '*') { a = max; end = (char *)text + 1; }
+        else a = strtoul(text, &end, 10);
+        if (end == text) break;
+        b = a;
+        if (*end == ':') {
+            text = end + 1;
+            if (*text == '*') { b = max; end = (char *)text + 1; }
+            else b = strtoul(text, &end, 10);
+        }
+        if (a > b) { unsigned int t = a; a = b; b = t; }
+        if (a < 1) a = 1;
+        if (b > max) b = max;
+
+        if (a <= b) {
+            if (count == capacity) {
+                capacity *= 2;
+                Range *grown = realloc(*ranges, capacity * sizeof(Range));
+                if (!grown) return -1;
+                *ranges = grown;
+            }
+            (*ranges)[count].first = a;
+            (*ranges)[count].last = b;
+            count++;
+        }
+        text = end;
+        if (*text == ',') text++;
+    }
+    return count;
+}
+
+/* Next space-separated token; quoted strings are unquoted, parentheses
+ * and brackets are kept together */
+static const char *next_token(const char *p, char *out, size_t size) {
+    size_t len = 0;
+    int depth = 0;
+
+    while (*p == ' ') p++;
+    if (*p == '"') {
+        for (p++; *p && *p != '"'; p++) {
+            if (*p == '\\' && p[1]) p++;
+            if (len + 1 < size) out[len++] = *p;
+        }
+        if (*p == '"') p++;
+    } else {
+        for (; *p && (depth > 0 || *p != ' '); p++) {
+            if (*p == '(' || *p == '[') depth++;
+            if ((*p == ')' || *p == ']') && depth > 0) depth--;
+            if (len + 1 < size) out[len++] = *p;
+        }
+    }
+    out[len] = '\0';
+    return p;
+}
+
+static int find_mailbox(const char *name) {
+    for (int i = 0; i < MAILBOX_COUNT; i++) {
+        if (strcasecmp(name, mailboxes[i].name) == 0) return i;
+    }
+    return -1;
+}
+
+static unsigned char get_flags(int mailbox, unsigned int seq) {
+    pthread_mutex_lock(&flags_lock);
+    unsigned char flags = mailboxes[mailbox].flags[seq - 1];
+    pthread_mutex_unlock(&flags_lock);
+    return flags;
+}
+
+static int unseen_count(int mailbox) {
+    int unseen = 0;
+    pthread_mutex_lock(&flags_lock);
+    for (int i = 0; i < mailboxes[mailbox].messages; i++) {
+        if (!(mailboxes[mailbox].flags[i] & FLAG_SEEN)) unseen++;
+    }
+    pthread_mutex_unlock(&flags_lock);
+    return unseen;
+}
+
+static const char *capabilities(void) {
+    return options.minimal ? "IMAP4rev1 AUTH=PLAIN"
+                           : "IMAP4rev1 LITERAL+ SASL-IR AUTH=PLAIN ESEARCH LIST-STATUS UIDPLUS IDLE PREVIEW";
+}
+
+/* Read a command, with any literals folded in as quoted strings */
+static int imap_read_command(ImapState *state, char *command, size_t size) {
+    Link *link = state->link;
+    size_t len = 0;
+
+    for (;;) {
+        if (link_read_line(link) < 0) return -1;
+        if (len + link->line_len + 1 >= size) return -1;
+        memcpy(command + len, link->line, link->line_len + 1);
+        len += link->line_len;
+
+        /* A literal: "{n}" or "{n+}" at the end of the line */
+        char *brace = strrchr(command, '{');
+        char *end;
+        if (!brace || len == 0 || command[len - 1] != '}') return 0;
+        long n = strtol(brace + 1, &end, 10);
+        if (end == brace + 1 || (*end != '}' && !(end[0] == '+' && end[1] == '}'))) return 0;
+        if (n < 0 || (size_t)n * 2 + (brace - command) + 3 >= size) return -1;
+
+        if (*end == '}') {
+            link_printf(link, "+ Ready for literal data\r\n");
+            if (link_flush(link) < 0) return -1;
+        }
+
+        char *literal = malloc(n + 1);
+        if (!literal || link_read_bytes(link, literal, n) < 0) {
+            free(literal);
+            return -1;
+        }
+        len = brace - command;
+        command[len++] = '"';
+        for (long i = 0; i < n; i++) {
+            if (literal[i] == '"' || literal[i] == '\\') command[len++] = '\\';
+            command[len++] = literal[i];
+        }
+        command[len++] = '"';
+        command[len] = '\0';
+        free(literal);
+    }
+}
+
+enum { ITEM_UID, ITEM_FLAGS, ITEM_SIZE, ITEM_INTERNALDATE, ITEM_BODY, ITEM_PREVIEW };
+enum { SECTION_ALL, SECTION_HEADER, SECTION_TEXT, SECTION_FIELDS };
+
+typedef struct {
+    int type;
+    int section;
+    int peek;
+    char fields[512];               /* Section text, e.g. "HEADER.FIELDS (FROM DATE)" */
+    long partial_start;             /* -1 when the whole section is wanted */
+    long partial_count;
+} FetchItem;
+
+#define MAX_FETCH_ITEMS 16
+
+static int parse_fetch_items(const char *text, FetchItem *items, int uid) {
+    char token[1024];
+    int count = 0;
+
+    while (*text == ' ') text++;
+    int list = *text == '(';
+    if (list) text++;
+
+    if (uid) {
+        items[count].type = ITEM_UID;
+        count++;
+    }
+
+    while (*text && *text != ')' && count < MAX_FETCH_ITEMS) {
+        text = next_token(text, token, sizeof(token));
+        size_t len = strlen(token);
+        if (list && len > 0 && token[len - 1] == ')' && !strchr(token, '(')) {
+            token[--len] = '\0';
+        }
+        if (len == 0) break;
+
+        FetchItem *item = &items[count];
+        memset(item, 0, sizeof(*item));
+        item->partial_start = -1;
+
+        if (strcasecmp(token, "UID") == 0) {
+            if (uid) continue;
+            item->type = ITEM_UID;
+        } else if (strcasecmp(token, "FLAGS") == 0) {
+            item->type = ITEM_FLAGS;
+        } else if (strcasecmp(token, "RFC822.SIZE") == 0) {
+            item->type = ITEM_SIZE;
+        } else if (strcasecmp(token, "INTERNALDATE") == 0) {
+            item->type = ITEM_INTERNALDATE;
+        } else if (strcasecmp(token, "PREVIEW") == 0 && !options.minimal) {
+            item->type = ITEM_PREVIEW;
+        } else if (strncasecmp(token, "BODY[", 5) == 0 || strncasecmp(token, "BODY.PEEK[", 10) == 0) {
+            item->type = ITEM_BODY;
+            item->peek = token[4] == '.';
+            char *section = strchr(token, '[') + 1;
+            char *close = strrchr(token, ']');
+            if (!close) continue;
+            *close = '\0';
+            snprintf(item->fields, sizeof(item->fields), "%s", section);
+
+            if (section[0] == '\0') item->section = SECTION_ALL;
+            else if (strcasecmp(section, "TEXT") == 0) item->section = SECTION_TEXT;
+            else if (strcasecmp(section, "HEADER") == 0) item->section = SECTION_HEADER;
+            else if (strncasecmp(section, "HEADER.FIELDS ", 14) == 0) item->section = SECTION_FIELDS;
+            else continue;
+
+            if (close[1] == '<') {
+                item->partial_start = strtol(close + 2, &section, 10);
+                item->partial_count = *section == '.' ? strtol(section + 1, NULL, 10) : -1;
+            }
+        } else {
+            continue;   /* ENVELOPE, BODYSTRUCTURE: not generated */
+        }
+        count++;
+    }
+    return count;
+}
+
+static void flags_text(unsigned char flags, char *out, size_t size) {
+    snprintf(out, size, "(%s%s%s)", flags & FLAG_SEEN ? "\\Seen" : "",
+             (flags & FLAG_SEEN) && (flags & FLAG_DELETED) ? " " : "",
+             flags & FLAG_DELETED ? "\\Deleted" : "");
+}
+
+/* PREVIEW (RFC 8970) of a generated message: the start of its plain
+ * text with white space collapsed, at most PREVIEW_LEN bytes */
+#define PREVIEW_LEN 200
+
+static size_t preview_of(const CorpusMessage *gen, char *out) {
+    size_t len = 0;
+    int space = 0;
+
+    for (size_t i = 0; i < gen->text.len && len < PREVIEW_LEN; i++) {
+        char c = gen->text.data[i];
+        if (c == '\r' || c == '\n' || c == ' ') {
+            space = len > 0;
+            continue;
+        }
+        if (space && len + 1 < PREVIEW_LEN) out[len++] = ' ';
+        space = 0;
+        out[len++] = c;
+    }
+    /* Never end inside a UTF-8 sequence */
+    if (len == PREVIEW_LEN) {
+        while (len > 0 && ((unsigned char)out[len - 1] & 0xC0) == 0x80) len--;
+        if (len > 0 && ((unsigned char)out[len - 1] & 0x80)) len--;
+    }
+    return len;
+}
+
+static void imap_fetch_one(ImapState *state, unsigned int seq, const FetchItem *items, int count) {
+    Link *link = state->link;
+    CorpusMessage *gen = &state->gen;
+    char preview[PREVIEW_LEN];
+    size_t preview_len = 0;
+    int generated = 0;
+    int with_body = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (items[i].type == ITEM_SIZE || items[i].type == ITEM_PREVIEW ||
+            (items[i].type == ITEM_BODY && items[i].section != SECTION_HEADER &&
+             items[i].section != SECTION_FIELDS)) {
+            with_body = 1;
+        }
+        if (items[i].type == ITEM_BODY && !items[i].peek) {
+            pthread_mutex_lock(&flags_lock);
+            mailboxes[state->selected].flags[seq - 1] |= FLAG_SEEN;
+            pthread_mutex_unlock(&flags_lock);
+        }
+    }
+
+    link_printf(link, "* %u FETCH (", seq);
+    for (int i = 0; i < count; i++) {
+        const FetchItem *item = &items[i];
+        char text[64];
+
+        if (i > 0) link_write(link, " ", 1);
+
+        if (item->type == ITEM_UID) {
+            link_printf(link, "UID %u", seq);
+            continue;
+        }
+        if (item->type == ITEM_FLAGS) {
+            flags_text(get_flags(state->selected, seq), text, sizeof(text));
+            link_printf(link, "FLAGS %s", text);
+            continue;
+        }
+
+        if (!generated) {
+            corpus_generate(gen, state->selected, seq, with_body);
+            generated = 1;
+            /* Before HEADER.FIELDS takes over the text buffer */
+            if (with_body) preview_len = preview_of(gen, preview);
+        }
+
+        if (item->type == ITEM_PREVIEW) {
+            /* Quoted strings are 7-bit; other text goes as a literal */
+            size_t n = 0;
+            while (n < preview_len && !(preview[n] & 0x80) && preview[n] != '"' && preview[n] != '\\') n++;
+            if (n == preview_len) {
+                link_printf(link, "PREVIEW \"%.*s\"", (int)preview_len, preview);
+            } else {
+                link_printf(link, "PREVIEW {%zu}\r\n", preview_len);
+                link_write(link, preview, preview_len);
+            }
+            continue;
+        }
+
+        /* A digest stands in for the generated text */
+        const char *body = gen->body.data;
+        size_t body_len = gen->body.len;
+        if (digest_text && state->selected == 0 && seq == 1) {
+            body = digest_text;
+            body_len = (size_t)options.digest;
+        }
+
+        if (item->type == ITEM_SIZE) {
+            link_printf(link, "RFC822.SIZE %zu", gen->header.len + body_len);
+            continue;
+        }
+        if (item->type == ITEM_INTERNALDATE) {
+            struct tm tm;
+            gmtime_r(&gen->date, &tm);
+            strftime(text, sizeof(text), "%d-%b-%Y %H:%M:%S +0000", &tm);
+            link_printf(link, "INTERNALDATE \"%s\"", text);
+            continue;
+        }
+
+        const char *data;
+        size_t len;
+        const char *second = NULL;
+        size_t second_len = 0;
+
+        switch (item->section) {
+            case SECTION_HEADER:
+                data = gen->header.data;
+                len = gen->header.len;
+                break;
+            case SECTION_TEXT:
+                data = body;
+                len = body_len;
+                break;
+            case SECTION_FIELDS:
+                corpus_header_fields(gen, item->fields, &gen->text);
+                data = gen->text.data;
+                len = gen->text.len;
+                break;
+            default:
+                data = gen->header.data;
+                len = gen->header.len;
+                second = body;
+                second_len = body_len;
+                break;
+        }
+
+        if (item->partial_start >= 0) {
+            size_t start = (size_t)item->partial_start;
+            size_t total = len + second_len;
+            size_t want = item->partial_count >= 0 ? (size_t)item->partial_count : total;
+            if (start > total) start = total;
+            if (want > total - start) want = total - start;
+
+            link_printf(link, "BODY[%s]<%zu> {%zu}\r\n", item->fields, start, want);
+            if (start < len) {
+                size_t n = want < len - start ? want : len - start;
+                link_write(link, data + start, n);
+                want -= n;
+                start = len;
+            }
+            if (want > 0 && second) link_write(link, second + (start - len), want);
+        } else {
+            link_printf(link, "BODY[%s] {%zu}\r\n", item->fields, len + second_len);
+            link_write(link, data, len);
+            if (second) link_write(link, second, second_len);
+        }
+    }
+    link_write(link, ")\r\n", 3);
+}
+
+static void imap_fetch(ImapState *state, const char *args, int uid) {
+    Link *link = state->link;
+    FetchItem items[MAX_FETCH_ITEMS];
+    Range *ranges;
+    unsigned int max = (unsigned int)mailboxes[state->selected].messages;
+
+    while (*args == ' ') args++;
+    int count = parse_set(args, max, &ranges);
+    const char *rest = strchr(args, ' ');
+    int item_count = rest ? parse_fetch_items(rest, items, uid) : 0;
+
+    for (int r = 0; r < count; r++) {
+        for (unsigned int seq = ranges[r].first; seq <= ranges[r].last && !link->closed; seq++) {
+            imap_fetch_one(state, seq, items, item_count);
+        }
+    }
+    free(ranges);
+    link_printf(link, "%s OK FETCH completed\r\n", state->tag);
+}
+
+static void imap_store(ImapState *state, const char *args, int uid) {
+    Link *link = state->link;
+    char token[128];
+    Range *ranges;
+    unsigned int max = (unsigned int)mailboxes[state->selected].messages;
+
+    args = next_token(args, token, sizeof(token));
+    int count = parse_set(token, max, &ranges);
+    args = next_token(args, token, sizeof(token));
+
+    int mode = token[0] == '+' ? 1 : token[0] == '-' ? -1 : 0;
+    int silent = strstr(token, ".SILENT") != NULL || strstr(token, ".silent") != NULL;
+    unsigned char bits = 0;
+    if (strstr(args, "\\Seen") || strstr(args, "\\SEEN")) bits |= FLAG_SEEN;
+    if (strstr(args, "\\Deleted") || strstr(args, "\\DELETED")) bits |= FLAG_DELETED;
+
+    for (int r = 0; r < count; r++) {
+        for (unsigned int seq = ranges[r].first; seq <= ranges[r].last; seq++) {
+            pthread_mutex_lock(&flags_lock);
+            unsigned char *flags = &mailboxes[state->selected].flags[seq - 1];
+            if (mode > 0) *flags |= bits;
+            else if (mode < 0) *flags &= ~bits;
+            else *flags = bits;
+            unsigned char now = *flags;
+            pthread_mutex_unlock(&flags_lock);
+
+            if (!silent) {
+                char text[32];
+                flags_text(now, text, sizeof(text));
+                if (uid) link_printf(link, "* %u FETCH (UID %u FLAGS %s)\r\n", seq, seq, text);
+                else link_printf(link, "* %u FETCH (FLAGS %s)\r\n", seq, text);
+            }
+        }
+    }
+    free(ranges);
+    link_printf(link, "%s OK STORE completed\r\n", state->tag);
+}
+
+static int in_ranges(const Range *ranges, int count, unsigned int seq) {
+    for (int i = 0; i < count; i++) {
+        if (seq >= ranges[i].first && seq <= ranges[i].last) return 1;
+    }
+    return 0;
+}
+
+static int contains_text(const char *haystack, const char *needle) {
+    size_t n = strlen(needle);
+    for (; *haystack; haystack++) {
+        if (strncasecmp(haystack, needle, n) == 0) return 1;
+    }
+    return 0;
+}
+
+enum { CRIT_SEEN, CRIT_UNSEEN, CRIT_DELETED, CRIT_UNDELETED, CRIT_SET, CRIT_HEADER_TEXT, CRIT_BODY_TEXT };
+
+#define MAX_CRITERIA 16
+
+typedef struct {
+    int type;
+    Range *ranges;
+    int range_count;
+    char text[512];
+} Criterion;
+
+/* SEARCH with the criteria cterm and most clients use; anything else is
+ * taken to match. Text is matched against the raw message. */
+static void imap_search(ImapState *state, const char *args, int uid) {
+    Link *link = state->link;
+    Criterion criteria[MAX_CRITERIA];
+    int criteria_count = 0;
+    char token[8192];               /* A UID set fills most of a command line */
+    char returns[256] = "";
+    int esearch = 0;
+    unsigned int max = (unsigned int)mailboxes[state->selected].messages;
+
+    for (;;) {
+        const char *next = next_token(args, token, sizeof(token));
+        if (!token[0]) break;
+        args = next;
+
+        if (strcasecmp(token, "RETURN") == 0) {
+            args = next_token(args, returns, sizeof(returns));
+            esearch = 1;
+        } else if (strcasecmp(token, "CHARSET") == 0) {
+            args = next_token(args, token, sizeof(token));
+        } else if (criteria_count < MAX_CRITERIA) {
+            Criterion *c = &criteria[criteria_count];
+            c->ranges = NULL;
+            if (strcasecmp(token, "SEEN") == 0) c->type = CRIT_SEEN;
+            else if (strcasecmp(token, "UNSEEN") == 0) c->type = CRIT_UNSEEN;
+            else if (strcasecmp(token, "DELETED") == 0) c->type = CRIT_DELETED;
+            else if (strcasecmp(token, "UNDELETED") == 0) c->type = CRIT_UNDELETED;
+            else if (strcasecmp(token, "UID") == 0 || isdigit((unsigned char)token[0]) || token[0] == '*') {
+                if (strcasecmp(token, "UID") == 0) args = next_token(args, token, sizeof(token));
+                c->type = CRIT_SET;
+                c->range_count = parse_set(token, max, &c->ranges);
+            } else if (strcasecmp(token, "SUBJECT") == 0 || strcasecmp(token, "FROM") == 0 ||
+                       strcasecmp(token, "TEXT") == 0 || strcasecmp(token, "BODY") == 0) {
+                c->type = toupper((unsigned char)token[0]) == 'S' || toupper((unsigned char)token[0]) == 'F'
+                              ? CRIT_HEADER_TEXT : CRIT_BODY_TEXT;
+                args = next_token(args, c->text, sizeof(c->text));
+            } else {
+                continue;   /* ALL and the rest */
+            }
+            criteria_count++;
+        }
+    }
+
+    int found = 0, capacity = 1024;
+    unsigned int *matches = malloc(capacity * sizeof(unsigned int));
+
+    for (unsigned int seq = 1; seq <= max && matches; seq++) {
+        unsigned char flags = get_flags(state->selected, seq);
+        int match = 1;
+        int generated = 0;
+
+        for (int i = 0; i < criteria_count && match; i++) {
+            Criterion *c = &criteria[i];
+            switch (c->type) {
+                case CRIT_SEEN: match = (flags & FLAG_SEEN) != 0; break;
+                case CRIT_UNSEEN: match = !(flags & FLAG_SEEN); break;
+                case CRIT_DELETED: match = (flags & FLAG_DELETED) != 0; break;
+                case CRIT_UNDELETED: match = !(flags & FLAG_DELETED); break;
+                case CRIT_SET: match = in_ranges(c->ranges, c->range_count, seq); break;
+                default:
+                    if (generated < 1 + (c->type == CRIT_BODY_TEXT)) {
+                        corpus_generate(&state->gen, state->selected, seq, c->type == CRIT_BODY_TEXT);
+                        generated = 1 + (c->type == CRIT_BODY_TEXT);
+                    }
+                    match = contains_text(state->gen.header.data, c->text) ||
+                            (c->type == CRIT_BODY_TEXT && contains_text(state->gen.body.data, c->text));
+                    break;
+            }
+        }
+        if (!match) continue;
+
+        if (found == capacity) {
+            capacity *= 2;
+            unsigned int *grown = realloc(matches, capacity * sizeof(unsigned int));
+            if (!grown) break;
+            matches = grown;
+        }
+        matches[found++] = seq;
+    }
+
+    if (esearch) {
+        int all = strstr(returns, "ALL") != NULL || strcmp(returns, "()") == 0;
+        link_printf(link, "* ESEARCH (TAG \"%s\")%s", state->tag, uid ? " UID" : "");
+        if (strstr(returns, "MIN") && found > 0) link_printf(link, " MIN %u", matches[0]);
+        if (strstr(returns, "MAX") && found > 0) link_printf(link, " MAX %u", matches[found - 1]);
+        if (strstr(returns, "COUNT")) link_printf(link, " COUNT %d", found);
+        if (all && found > 0) {
+            link_write(link, " ALL ", 5);
+            for (int i = 0; i < found;) {
+                int j = i;
+                while (j + 1 < found && matches[j + 1] == matches[j] + 1) j++;
+                if (i > 0) link_write(link, ",", 1);
+                if (j > i) link_printf(link, "%u:%u", matches[i], matches[j]);
+                else link_printf(link, "%u", matches[i]);
+                i = j + 1;
+            }
+        }
+        link_write(link, "\r\n", 2);
+    } else {
+        link_write(link, "* SEARCH", 8);
+        for (int i = 0; i < found; i++) link_printf(link, " %u", matches[i]);
+        link_write(link, "\r\n", 2);
+    }
+
+    free(matches);
+    for (int i = 0; i < criteria_count; i++) free(criteria[i].ranges);
+    link_printf(link, "%s OK SEARCH completed\r\n", state->tag);
+}
+
+static void imap_status_line(Link *link, int mailbox, const char *items) {
+    int first = 1;
+
+    link_printf(link, "* STATUS \"%s\" (", mailboxes[mailbox].name);
+    if (strstr(items, "MESSAGES")) {
+        link_printf(link, "MESSAGES %d", mailboxes[mailbox].messages);
+        first = 0;
+    }
+    if (strstr(items, "UNSEEN")) {
+        link_printf(link, "%sUNSEEN %d", first ? "" : " ", unseen_count(mailbox));
+        first = 0;
+    }
+    if (strstr(items, "UIDNEXT")) {
+        link_printf(link, "%sUIDNEXT %d", first ? "" : " ", mailboxes[mailbox].messages + 1);
+        first = 0;
+    }
+    if (strstr(items, "UIDVALIDITY")) {
+        link_printf(link, "%sUIDVALIDITY %d", first ? "" : " ", 1000 + mailbox);
+    }
+    link_write(link, ")\r\n", 3);
+}
+
+static void imap_session(Link *link) {
+    ImapState state;
+    char *command = malloc(IN_SIZE * 2 + 1);
+    char word[64];
+
+    memset(&state, 0, sizeof(state));
+    state.link = link;
+    state.selected = -1;
+    if (!command || corpus_init(&state.gen) < 0) {
+        free(command);
+        corpus_free(&state.gen);
+        return;
+    }
+
+    link_printf(link, "* OK [CAPABILITY %s] %s mock IMAP ready\r\n", capabilities(), HOSTNAME);
+    link_flush(link);
+
+    while (!link->closed && imap_read_command(&state, command, IN_SIZE * 2 + 1) == 0) {
+        const char *args = next_token(command, state.tag, sizeof(state.tag));
+        args = next_token(args, word, sizeof(word));
+        int uid = strcasecmp(word, "UID") == 0;
+        if (uid) args = next_token(args, word, sizeof(word));
+
+        int need_mailbox = strcasecmp(word, "FETCH") == 0 || strcasecmp(word, "STORE") == 0 ||
+                           strcasecmp(word, "SEARCH") == 0 || strcasecmp(word, "EXPUNGE") == 0;
+        if (need_mailbox && state.selected < 0) {
+            link_printf(link, "%s BAD No mailbox selected\r\n", state.tag);
+        } else if (strcasecmp(word, "CAPABILITY") == 0) {
+            link_printf(link, "* CAPABILITY %s\r\n%s OK CAPABILITY completed\r\n", capabilities(), state.tag);
+        } else if (strcasecmp(word, "LOGIN") == 0) {
+            link_printf(link, "%s OK [CAPABILITY %s] Logged in\r\n", state.tag, capabilities());
+        } else if (strcasecmp(word, "AUTHENTICATE") == 0) {
+            char mechanism[64], initial[64];
+            args = next_token(args, mechanism, sizeof(mechanism));
+            next_token(args, initial, sizeof(initial));
+            if (!initial[0]) {
+                link_printf(link, "+ \r\n");
+                link_flush(link);
+                if (link_read_line(link) < 0) break;
+            }
+            link_printf(link, "%s OK [CAPABILITY %s] Authenticated\r\n", state.tag, capabilities());
+        } else if (strcasecmp(word, "SELECT") == 0 || strcasecmp(word, "EXAMINE") == 0) {
+            char name[512];
+            next_token(args, name, sizeof(name));
+            int mailbox = find_mailbox(name);
+            state.selected = mailbox;
+            if (mailbox < 0) {
+                link_printf(link, "%s NO Mailbox does not exist\r\n", state.tag);
+            } else {
+                link_printf(link, "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
+                                  "* %d EXISTS\r\n* 0 RECENT\r\n"
+                                  "* OK [UIDVALIDITY %d] UIDs valid\r\n"
+                                  "* OK [UIDNEXT %d] Predicted next UID\r\n"
+                                  "%s OK [%s] %s completed\r\n",
+                            mailboxes[mailbox].messages, 1000 + mailbox,
+                            mailboxes[mailbox].messages + 1, state.tag,
+                            toupper((unsigned char)word[0]) == 'S' ? "READ-WRITE" : "READ-ONLY", word);
+            }
+        } else if (strcasecmp(word, "LIST") == 0 || strcasecmp(word, "LSUB") == 0) {
+            int with_status = strstr(args, "STATUS") != NULL;
+            for (int i = 0; i < MAILBOX_COUNT; i++) {
+                link_printf(link, "* %s (\\HasNoChildren) \"/\" \"%s\"\r\n", word, mailboxes[i].name);
+                if (with_status) imap_status_line(link, i, args);
+            }
+            link_printf(link, "%s OK %s completed\r\n", state.tag, word);
+        } else if (strcasecmp(word, "STATUS") == 0) {
+            char name[512];
+            args = next_token(args, name, sizeof(name));
+            int mailbox = find_mailbox(name);
+            if (mailbox < 0) {
+                link_printf(link, "%s NO Mailbox does not exist\r\n", state.tag);
+            } else {
+                imap_status_line(link, mailbox, args);
+                link_printf(link, "%s OK STATUS completed\r\n", state.tag);
+            }
+        } else if (strcasecmp(word, "FETCH") == 0) {
+            imap_fetch(&state, args, uid);
+        } else if (strcasecmp(word, "STORE") == 0) {
+            imap_store(&state, args, uid);
+        } else if (strcasecmp(word, "SEARCH") == 0) {
+            imap_search(&state, args, uid);
+        } else if (strcasecmp(word, "EXPUNGE") == 0) {
+            /* Mailboxes keep their size so runs stay comparable */
+            pthread_mutex_lock(&flags_lock);
+            for (int i = 0; i < mailboxes[state.selected].messages; i++) {
+                mailboxes[state.selected].flags[i] &= ~FLAG_DELETED;
+            }
+            pthread_mutex_unlock(&flags_lock);
+            link_printf(link, "%s OK EXPUNGE completed\r\n", state.tag);
+        } else if (strcasecmp(word, "CLOSE") == 0 || strcasecmp(word, "UNSELECT") == 0) {
+            state.selected = -1;
+            link_printf(link, "%s OK %s completed\r\n", state.tag, word);
+        } else if (strcasecmp(word, "IDLE") == 0) {
+            link_printf(link, "+ idling\r\n");
+            link_flush(link);
+            if (link_read_line(link) < 0) break;
+            link_printf(link, "%s OK IDLE terminated\r\n", state.tag);
+        } else if (strcasecmp(word, "NOOP") == 0 || strcasecmp(word, "CHECK") == 0 ||
+                   strcasecmp(word, "ENABLE") == 0 || strcasecmp(word, "ID") == 0) {
+            link_printf(link, "%s OK %s completed\r\n", state.tag, word);
+        } else if (strcasecmp(word, "LOGOUT") == 0) {
+            link_printf(link, "* BYE Logging out\r\n%s OK LOGOUT completed\r\n", state.tag);
+            link_flush(link);
+            break;
+        } else {
+            link_printf(link, "%s BAD Command not supported\r\n", state.tag);
+        }
+        link_flush(link);
+    }
+
+    free(command);
+    corpus_free(&state.gen);
+}
+
+/* ---- SMTP ---- */
+
+static void smtp_session(Link *link) {
+    unsigned long queued = 0;
+
+    link_printf(link, "220 %s ESMTP mock\r\n", HOSTNAME);
+    link_flush(link);
+
+    while (!link->closed && link_read_line(link) == 0) {
+        char *line = link->line;
+
+        if (strncasecmp(line, "EHLO", 4) == 0) {
+            if (options.minimal) {
+                link_printf(link, "250-%s\r\n250 AUTH PLAIN LOGIN\r\n", HOSTNAME);
+            } else {
+                link_printf(link, "250-%s\r\n250-PIPELINING\r\n250-SIZE 52428800\r\n"
+                                  "250-8BITMIME\r\n250-CHUNKING\r\n250-ENHANCEDSTATUSCODES\r\n"
+                                  "250 AUTH PLAIN LOGIN\r\n", HOSTNAME);
+            }
+        } else if (strncasecmp(line, "HELO", 4) == 0) {
+            link_printf(link, "250 %s\r\n", HOSTNAME);
+        } else if (strncasecmp(line, "AUTH LOGIN", 10) == 0) {
+            link_printf(link, "334 VXNlcm5hbWU6\r\n");
+            link_flush(link);
+            if (link_read_line(link) < 0) break;
+            link_printf(link, "334 UGFzc3dvcmQ6\r\n");
+            link_flush(link);
+            if (link_read_line(link) < 0) break;
+            link_printf(link, "235 2.7.0 Authentication successful\r\n");
+        } else if (strncasecmp(line, "AUTH ", 5) == 0) {
+            if (!strchr(line + 5, ' ')) {
+                link_printf(link, "334 \r\n");
+                link_flush(link);
+                if (link_read_line(link) < 0) break;
+            }
+            link_printf(link, "235 2.7.0 Authentication successful\r\n");
+        } else if (strncasecmp(line, "MAIL", 4) == 0 || strncasecmp(line, "RCPT", 4) == 0 ||
+                   strncasecmp(line, "RSET", 4) == 0 || strncasecmp(line, "NOOP", 4) == 0) {
+            link_printf(link, "250 2.0.0 Ok\r\n");
+        } else if (strncasecmp(line, "DATA", 4) == 0) {
+            link_printf(link, "354 End data with <CR><LF>.<CR><LF>\r\n");
+            link_flush(link);
+            do {
+                if (link_read_line(link) < 0) break;
+            } while (strcmp(link->line, ".") != 0);
+            link_printf(link, "250 2.0.0 Ok: queued as %lu\r\n", ++queued);
+        } else if (strncasecmp(line, "BDAT ", 5) == 0) {
+            unsigned long size = strtoul(line + 5, NULL, 10);
+            int last = strstr(line, "LAST") != NULL || strstr(line, "last") != NULL;
+            if (link_read_bytes(link, NULL, size) < 0) break;
+            if (last) link_printf(link, "250 2.0.0 Ok: queued as %lu\r\n", ++queued);
+            else link_printf(link, "250 2.0.0 %lu octets received\r\n", size);
+        } else if (strncasecmp(line, "QUIT", 4) == 0) {
+            link_printf(link, "221 2.0.0 Bye\r\n");
+            link_flush(link);
+            break;
+        } else {
+            link_printf(link, "502 5.5.2 Command not recognized\r\n");
+        }
+        link_flush(link);
+    }
+}
+
+/* ---- Server ---- */
+
+typedef struct {
+    Link *link;
+    int smtp;
+} Client;
+
+static void *client_thread(void *arg) {
+    Client *client = arg;
+
+    if (client->smtp) smtp_session(client->link);
+    else imap_session(client->link);
+
+    link_close(client->link);
+    free(client);
+    return NULL;
+}
+
+static int listen_on(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int bound_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0) return -1;
+    return ntohs(addr.sin_port);
+}
+
+static void setup_mailboxes(void) {
+    int n = options.messages;
+    int sizes[MAILBOX_COUNT] = { n, n / 10 > 10 ? n / 10 : 10, 5, n / 5 > 1 ? n / 5 : 1, n / 50 + 1 };
+
+    for (int m = 0; m < MAILBOX_COUNT; m++) {
+        mailboxes[m].messages = sizes[m];
+        mailboxes[m].flags = calloc(sizes[m] > 0 ? sizes[m] : 1, 1);
+        if (!mailboxes[m].flags) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+
+        /* Mostly read, with the newest tenth largely unread */
+        for (int i = 0; i < sizes[m]; i++) {
+            unsigned int h = corpus_hash((unsigned int)i + 1, (unsigned int)m + 101);
+            int recent = i >= sizes[m] - sizes[m] / 10;
+            if (!(recent ? h % 3 == 0 : h % 25 == 0)) mailboxes[m].flags[i] = FLAG_SEEN;
+        }
+    }
+}
+
+/* A mailing-list digest of numbered lines, so a client scrolled deep into
+ * it shows where it is */
+static int setup_digest(void) {
+    long len = 0, line = 0;
+
+    digest_text = malloc(options.digest + 1);
+    if (!digest_text) return -1;
+    while (len < options.digest) {
+        char text[128];
+        int n = snprintf(text, sizeof(text), "%08ld  [cterm-dev] digest line %ld: "
+                         "patch review notes for the weekly release\r\n", line + 1, line + 1);
+        if (n > options.digest - len) n = (int)(options.digest - len);
+        memcpy(digest_text + len, text, n);
+        len += n;
+        line++;
+    }
+    digest_text[len] = '\0';
+    return 0;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-n messages] [-l latency_ms] [-b bandwidth] [-d size] [-i imap_port] [-s smtp_port] [-m]\n",
+           program);
+    printf("  -n  Messages in INBOX, k and M suffixes (default 1000); other folders scale with it\n");
+    printf("  -l  One-way delay added to every reply, milliseconds\n");
+    printf("  -b  Bandwidth each way in bytes/s, suffixes k and M (default unlimited)\n");
+    printf("  -d  Make the text of INBOX message 1 a digest of this size, suffixes k and M\n");
+    printf("  -i  IMAP port, -s SMTP port (default: any free port)\n");
+    printf("  -m  Minimal server: no IMAP or SMTP extensions\n");
+}
+
+int main(int argc, char *argv[]) {
+    int imap_port = 0, smtp_port = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:b:d:i:s:mh")) != -1) {
+        switch (opt) {
+            case 'n': options.messages = (int)bench_parse_count(optarg); break;
+            case 'l': options.latency_ms = atoi(optarg); break;
+            case 'b': options.bandwidth = bench_parse_size(optarg); break;
+            case 'd': options.digest = bench_parse_size(optarg); break;
+            case 'i': imap_port = atoi(optarg); break;
+            case 's': smtp_port = atoi(optarg); break;
+            case 'm': options.minimal = 1; break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (options.messages < 1 || options.bandwidth < 0 || options.digest < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setup_mailboxes();
+    if (options.digest > 0 && setup_digest() < 0) {
+        fprintf(stderr, "Cannot make a %ld byte digest\n", options.digest);
+        return 1;
+    }
+
+    int listeners[2] = { listen_on(imap_port), listen_on(smtp_port) };
+    if (listeners[0] < 0 || listeners[1] < 0) return 1;
+
+    printf("imap %d smtp %d\n", bound_port(listeners[0]), bound_port(listeners[1]));
+    fflush(stdout);
+
+    for (;;) {
+        struct pollfd pfd[2] = { { listeners[0], POLLIN, 0 }, { listeners[1], POLLIN, 0 } };
+        if (poll(pfd, 2, -1) < 0) continue;
+
+        for (int i = 0; i < 2; i++) {
+            if (!(pfd[i].revents & POLLIN)) continue;
+
+            int fd = accept(listeners[i], NULL, NULL);
+            if (fd < 0) continue;
+
+            /* Replies go out in whole pieces already */
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            Client *client = malloc(sizeof(Client));
+            Link *link = link_open(fd);
+            pthread_t thread;
+            if (!client || !link) {
+                free(client);
+                if (link) link_close(link);
+                else close(fd);
+                continue;
+            }
+            client->link = link;
+            client->smtp = i == 1;
+            if (pthread_create(&thread, NULL, client_thread, client) != 0) {
+                link_close(link);
+                free(client);
+                continue;
+            }
+            pthread_detach(thread);
+        }
+    }
+}
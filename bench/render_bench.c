@@ -0,0 +1,451 @@
+/* Headless render benchmark: drives the real ncurses views through scripted
+ * keystrokes and measures what each frame costs.
+ *
+ * The terminal is a newterm screen writing into a temporary file, so every
+ * byte cterm would send to a terminal can be counted and nothing needs a
+ * tty. The IMAP worker is replaced by a synthetic message index and an
+ * in-process stand-in that answers body and snippet fetches at once, so only the UI
+ * is measured: the frame time is handling the key plus ui_frame (apply
+ * results, draw, doupdate), excluding the stand-in's own work.
+ *
+ * For each mailbox size the scripts are:
+ *   scroll   j through the list, then k back up
+ *   open     Enter and Esc on messages spread over the list
+ *   page     Space and b through a long body, then End and Home
+ *   filter   type a filter pattern letter by letter, Backspace, Esc
+ *   preview  P, then j and k through the list with the preview pane
+ *   compose  type a message body, with Enter every line */
+#define _POSIX_C_SOURCE 200809L
+#include "bench.h"
+#include "corpus.h"
+#include "ui.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_SIZES 16
+#define MAX_FRAMES 65536
+
+typedef struct {
+    int sizes[MAX_SIZES];
+    int size_count;
+    int columns;
+    int lines;
+    const char *term;
+    int keys;               /* Keys per script */
+    long body_size;         /* Bytes of the message opened for paging */
+} BenchOptions;
+
+typedef struct {
+    UIContext ui;
+    ImapWorker worker;      /* Queues only, no thread */
+    Outbox outbox;          /* Never started */
+    Config config;
+    SCREEN *screen;
+    FILE *out;              /* What the terminal receives */
+    int saved_stdout;
+    char *body;
+    size_t body_len;
+    double frames[MAX_FRAMES];
+    long bytes;
+    int frame_count;
+} Bench;
+
+static const char *const names[] = {
+    "Anna Petrova <anna@" CORPUS_DOMAIN ">",
+    "Дмитрий Иванов <dima@" CORPUS_DOMAIN ">",
+    "山田 太郎 <taro@" CORPUS_DOMAIN ">",
+    "José Álvarez <jose@" CORPUS_DOMAIN ">",
+    "release-bot 🚀 <ci@" CORPUS_DOMAIN ">",
+    "Ola Nordmann <ola@" CORPUS_DOMAIN ">",
+    "김민준 <minjun@" CORPUS_DOMAIN ">",
+    "The cterm mailing list <cterm-dev@" CORPUS_DOMAIN ">",
+};
+
+static const char *const words[] = {
+    "build", "release", "notes", "meeting", "отчет", "квартал", "会議", "資料",
+    "invoice", "draft", "review", "patch", "ошибка", "🚀", "weekly", "digest",
+    "résumé", "schedule", "대한", "update", "server", "latency", "fix", "plan",
+};
+
+#define COUNT(array) ((int)(sizeof(array) / sizeof((array)[0])))
+
+/* A snapshot as the worker would hand it over, one message per UID */
+static WorkerIndex *mailbox_make(int count) {
+    WorkerIndex *index = calloc(1, sizeof(WorkerIndex));
+    if (!index) return NULL;
+    index->shared = worker_emails_new(count);
+    if (!index->shared) {
+        free(index);
+        return NULL;
+    }
+    index->emails = index->shared->emails;
+    index->email_count = count;
+    index->thread_count = -1;
+    index->current_folder = -1;
+    index->counts.server_messages = -1;
+    snprintf(index->folder_name, sizeof(index->folder_name), "INBOX");
+
+    for (int i = 0; i < count; i++) {
+        Email *email = &index->shared->emails[i];
+        unsigned int seq = (unsigned int)i + 1;
+        unsigned int hash = corpus_hash(seq, 0);
+        int len = 0;
+
+        email->uid = seq;
+        email->seen = hash % 5 != 0;
+        snprintf(email->from, sizeof(email->from), "%s", names[hash % COUNT(names)]);
+        snprintf(email->date, sizeof(email->date), "Mon, %02u Oct 2026 %02u:%02u:00 +0000",
+                 1 + hash % 28, hash / 28 % 24, hash / 672 % 60);
+        snprintf(email->message_id, sizeof(email->message_id), "<%u@%s>", seq, CORPUS_DOMAIN);
+
+        if (hash & 8) len = snprintf(email->subject, sizeof(email->subject), "Re: ");
+        for (int w = 0, n = 3 + hash % 6; w < n && len < (int)sizeof(email->subject) - 32; w++) {
+            len += snprintf(email->subject + len, sizeof(email->subject) - len, "%s%s",
+                            w ? " " : "", words[corpus_hash(seq, w + 1) % COUNT(words)]);
+        }
+    }
+    return index;
+}
+
+/* Paragraphs of mixed scripts with the odd long line, like a digest */
+static char *body_make(long size, size_t *len) {
+    char *body = malloc(size + 1);
+    long pos = 0;
+    unsigned int n = 0;
+
+    if (!body) return NULL;
+    while (pos < size) {
+        const char *word = words[corpus_hash(n, 7) % COUNT(words)];
+        size_t word_len = strlen(word);
+        if (pos + (long)word_len + 2 > size) break;
+
+        memcpy(body + pos, word, word_len);
+        pos += word_len;
+        n++;
+        body[pos++] = n % 13 == 0 ? '\n' : ' ';
+        if (n % 97 == 0) body[pos++] = '\n';
+    }
+    body[pos] = '\0';
+    *len = pos;
+    return body;
+}
+
+/* Snippets for the messages asked about, made from the word list */
+static WorkerResult *snippets_make(const WorkerCommand *command) {
+    WorkerResult *result = calloc(1, sizeof(WorkerResult));
+    if (!result) return NULL;
+
+    result->type = WORKER_RESULT_SNIPPETS;
+    result->folder = command->folder;
+    layout_init(&result->layout);
+    result->snippets = calloc(command->uid_count, sizeof(WorkerSnippet));
+    if (!result->snippets) return result;
+
+    for (int i = 0; i < command->uid_count; i++) {
+        WorkerSnippet *snippet = &result->snippets[result->snippet_count++];
+        int len = 0;
+
+        snippet->uid = command->uids[i];
+        for (int w = 0; len < (int)sizeof(snippet->text) - 32; w++) {
+            len += snprintf(snippet->text + len, sizeof(snippet->text) - len, "%s%s",
+                            w ? " " : "", words[corpus_hash(snippet->uid, w + 100) % COUNT(words)]);
+        }
+    }
+    return result;
+}
+
+/* What the worker would do with the UI's commands, done at once */
+static void worker_serve(Bench *bench) {
+    WorkerCommand *command;
+
+    while ((command = queue_pop(&bench->worker.commands)) != NULL) {
+        if (command->type == WORKER_SNIPPETS) {
+            WorkerResult *result = snippets_make(command);
+            if (result && queue_push(&bench->worker.results, result) < 0) worker_result_free(result);
+        }
+        if (command->type == WORKER_OPEN) {
+            WorkerResult *result = calloc(1, sizeof(WorkerResult));
+            if (result) {
+                result->type = WORKER_RESULT_BODY;
+                result->folder = command->folder;
+                result->uid = command->uid;
+                layout_init(&result->layout);
+                result->body = malloc(bench->body_len + 1);
+                if (result->body) {
+                    memcpy(result->body, bench->body, bench->body_len + 1);
+                    layout_wrap(&result->layout, result->body, bench->body_len, command->width);
+                } else {
+                    result->status = -1;
+                }
+                if (queue_push(&bench->worker.results, result) < 0) worker_result_free(result);
+            }
+        }
+        free(command);
+    }
+}
+
+/* Bytes sent to the terminal since the last call */
+static long terminal_bytes(Bench *bench) {
+    struct stat st;
+
+    fflush(stdout);
+    fflush(bench->out);
+    if (fstat(fileno(bench->out), &st) < 0) return 0;
+    rewind(bench->out);
+    if (ftruncate(fileno(bench->out), 0) < 0) return 0;
+    return (long)st.st_size;
+}
+
+/* One key and the frame that shows it */
+static void bench_key(Bench *bench, int ch) {
+    double start = bench_now();
+    if (bench->ui.current_view == VIEW_COMPOSE) {
+        ui_compose_input(&bench->ui, (wint_t)ch, ch >= KEY_MIN);
+    } else {
+        ui_handle_input(&bench->ui, ch);
+    }
+    double handled = bench_now();
+
+    worker_serve(bench);
+
+    double framed = bench_now();
+    ui_frame(&bench->ui);
+    double elapsed = (handled - start) + (bench_now() - framed);
+
+    if (bench->frame_count < MAX_FRAMES) bench->frames[bench->frame_count++] = elapsed;
+    bench->bytes += terminal_bytes(bench);
+}
+
+static void script_scroll(Bench *bench, int keys) {
+    for (int i = 0; i < keys; i++) bench_key(bench, i < keys / 2 ? 'j' : 'k');
+}
+
+static void script_open(Bench *bench, int keys) {
+    int count = bench->ui.index->email_count;
+
+    for (int i = 0; i < keys / 2; i++) {
+        /* Jump without a frame, so only opening and closing are timed */
+        bench->ui.selected_index = (int)(corpus_hash(i, 11) % count);
+        bench_key(bench, '\n');
+        bench_key(bench, 27);
+    }
+}
+
+static void script_page(Bench *bench, int keys) {
+    bench_key(bench, '\n');
+    for (int i = 0; i < keys - 4; i++) bench_key(bench, i < (keys - 4) / 2 ? ' ' : 'b');
+    bench_key(bench, 'G');
+    bench_key(bench, 'g');
+    bench_key(bench, 27);
+}
+
+static void script_filter(Bench *bench, int keys) {
+    static const char pattern[] = "release notes";
+
+    for (int done = 0; done < keys;) {
+        bench_key(bench, 'F');
+        for (int i = 0; pattern[i] && done < keys; i++, done++) bench_key(bench, pattern[i]);
+        bench_key(bench, KEY_BACKSPACE);
+        bench_key(bench, 27);
+        done += 3;
+    }
+}
+
+static void script_preview(Bench *bench, int keys) {
+    bench_key(bench, 'P');
+    for (int i = 0; i < keys - 1; i++) bench_key(bench, i < (keys - 1) / 2 ? 'j' : 'k');
+}
+
+static void script_compose(Bench *bench, int keys) {
+    static const char text[] = "The quick brown fox jumps over the lazy dog again";
+
+    bench_key(bench, 'C');
+    for (int i = 0; i < 3; i++) bench_key(bench, '\t');
+    for (int i = 0; i < keys; i++) {
+        int ch = text[i % (sizeof(text) - 1)];
+        bench_key(bench, i % 60 == 59 ? '\n' : ch);
+    }
+    bench_key(bench, 27);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(Bench *bench, int keys);
+} scripts[] = {
+    { "scroll", script_scroll },
+    { "open", script_open },
+    { "page", script_page },
+    { "filter", script_filter },
+    { "preview", script_preview },
+    { "compose", script_compose },
+};
+
+static int bench_open(Bench *bench, const BenchOptions *options, int messages) {
+    WorkerResult *result;
+    char size[16];
+
+    memset(bench, 0, sizeof(Bench));
+    bench->worker.wake[0] = bench->worker.wake[1] = -1;
+    bench->worker.notify[0] = bench->worker.notify[1] = -1;
+    bench->outbox.notify[0] = bench->outbox.notify[1] = -1;
+    if (queue_init(&bench->worker.commands, WORKER_QUEUE_LEN) < 0 ||
+        queue_init(&bench->worker.results, WORKER_QUEUE_LEN) < 0) {
+        return -1;
+    }
+
+    bench->body = body_make(options->body_size, &bench->body_len);
+    result = calloc(1, sizeof(WorkerResult));
+    if (!bench->body || !result) return -1;
+    result->type = WORKER_RESULT_INDEX;
+    result->folder = -1;
+    layout_init(&result->layout);
+    result->index = mailbox_make(messages);
+    if (!result->index) {
+        worker_result_free(result);
+        return -1;
+    }
+    queue_push(&bench->worker.results, result);
+
+    /* The screen size comes from the environment when output is a file */
+    snprintf(size, sizeof(size), "%d", options->lines);
+    setenv("LINES", size, 1);
+    snprintf(size, sizeof(size), "%d", options->columns);
+    setenv("COLUMNS", size, 1);
+
+    bench->out = tmpfile();
+    FILE *in = fopen("/dev/null", "r");
+    if (!bench->out || !in) return -1;
+    bench->screen = newterm(options->term, bench->out, in);
+    if (!bench->screen) {
+        fprintf(stderr, "Unknown terminal type: %s\n", options->term);
+        return -1;
+    }
+
+    /* putp writes to stdout, which is the terminal in cterm */
+    fflush(stdout);
+    bench->saved_stdout = dup(STDOUT_FILENO);
+    dup2(fileno(bench->out), STDOUT_FILENO);
+
+    if (ui_init(&bench->ui, &bench->worker, &bench->outbox, &bench->config) < 0) return -1;
+    ui_frame(&bench->ui);
+    terminal_bytes(bench);
+    return 0;
+}
+
+static void bench_close(Bench *bench) {
+    WorkerResult *result;
+    WorkerCommand *command;
+
+    ui_cleanup(&bench->ui);
+    delscreen(bench->screen);
+    fflush(stdout);
+    dup2(bench->saved_stdout, STDOUT_FILENO);
+    close(bench->saved_stdout);
+    while ((result = queue_pop(&bench->worker.results)) != NULL) worker_result_free(result);
+    while ((command = queue_pop(&bench->worker.commands)) != NULL) free(command);
+    queue_free(&bench->worker.commands);
+    queue_free(&bench->worker.results);
+    fclose(bench->out);
+    free(bench->body);
+}
+
+static int parse_sizes(const char *text, BenchOptions *options) {
+    options->size_count = 0;
+    while (*text && options->size_count < MAX_SIZES) {
+        char item[32];
+        size_t len = strcspn(text, ",");
+        if (len >= sizeof(item)) return -1;
+        memcpy(item, text, len);
+        item[len] = '\0';
+
+        long value = bench_parse_count(item);
+        if (value < 1) return -1;
+        options->sizes[options->size_count++] = (int)value;
+        text += len;
+        if (*text == ',') text++;
+    }
+    return options->size_count > 0 ? 0 : -1;
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-n sizes] [-g columns x lines] [-t term] [-k keys] [-z body_size]\n", program);
+    printf("  -n  Mailbox sizes, comma-separated, k and M suffixes (default 10k,100k)\n");
+    printf("  -g  Terminal size (default 120x40)\n");
+    printf("  -t  Terminal type (default xterm-256color)\n");
+    printf("  -k  Keys per script (default 500)\n");
+    printf("  -z  Size of the message paged through (default 256k)\n");
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options = { { 10000, 100000 }, 2, 120, 40, "xterm-256color", 500, 256 * 1024 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:g:t:k:z:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                if (parse_sizes(optarg, &options) < 0) {
+                    fprintf(stderr, "Bad size list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'g':
+                if (sscanf(optarg, "%dx%d", &options.columns, &options.lines) != 2 ||
+                    options.columns < 40 || options.lines < 12) {
+                    fprintf(stderr, "Bad terminal size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't': options.term = optarg; break;
+            case 'k': options.keys = atoi(optarg); break;
+            case 'z': options.body_size = bench_parse_size(optarg); break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (options.keys < 8 || options.keys > MAX_FRAMES / 2 || options.body_size < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* UTF-8 subjects are drawn as cterm draws them */
+    setlocale(LC_ALL, "");
+
+    printf("%dx%d %s, %d keys per script, %ld byte body\n\n", options.columns, options.lines,
+           options.term, options.keys, options.body_size);
+    printf("%9s %-8s %7s %9s %9s %9s %9s %12s\n", "messages", "script", "frames",
+           "p50(us)", "p90(us)", "p99(us)", "max(us)", "bytes/frame");
+
+    for (int i = 0; i < options.size_count; i++) {
+        for (int s = 0; s < COUNT(scripts); s++) {
+            /* A fresh screen per script, so each starts from the list */
+            static Bench bench;
+            if (bench_open(&bench, &options, options.sizes[i]) < 0) {
+                fprintf(stderr, "Cannot set up %d messages\n", options.sizes[i]);
+                return 1;
+            }
+            scripts[s].run(&bench, options.keys);
+
+            int frames = bench.frame_count;
+            double p50 = bench_percentile(bench.frames, frames, 0.50);
+            double p90 = bench_percentile(bench.frames, frames, 0.90);
+            double p99 = bench_percentile(bench.frames, frames, 0.99);
+            double max = bench_percentile(bench.frames, frames, 1.0);
+            long bytes = bench.bytes;
+            bench_close(&bench);
+
+            printf("%9d %-8s %7d %9.1f %9.1f %9.1f %9.1f %12.1f\n", options.sizes[i],
+                   scripts[s].name, frames, p50 * 1e6, p90 * 1e6, p99 * 1e6, max * 1e6,
+                   frames ? (double)bytes / frames : 0.0);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
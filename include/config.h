@@ -1,7 +1,10 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <stddef.h>
+
 #define MAX_STRING_LEN 256
+#define MAX_TOKEN_LEN 4096
 
 typedef struct {
     /* IMAP settings */
@@ -10,6 +13,7 @@ typedef struct {
     int imap_use_ssl;
     char imap_username[MAX_STRING_LEN];
     char imap_password[MAX_STRING_LEN];
+    char imap_oauth_token[MAX_TOKEN_LEN];
 
     /* SMTP settings */
     char smtp_server[MAX_STRING_LEN];
@@ -18,15 +22,24 @@ typedef struct {
     int smtp_use_starttls;
     char smtp_username[MAX_STRING_LEN];
     char smtp_password[MAX_STRING_LEN];
+    char smtp_oauth_token[MAX_TOKEN_LEN];
+
+    /* Prints a fresh OAuth access token; run for every login */
+    char oauth_token_command[MAX_STRING_LEN];
 
     /* User info */
     char email_address[MAX_STRING_LEN];
     char display_name[MAX_STRING_LEN];
+
+    /* Local storage */
+    char cache_dir[MAX_STRING_LEN];
 } Config;
 
 /* Function prototypes */
 int config_load(const char *filename, Config *config);
 void config_free(Config *config);
 void config_print(const Config *config);
+int config_cache_path(const Config *config, const char *name, char *path, size_t path_size);
+int config_oauth_token(const Config *config, int smtp, char *token, size_t size);
 
 #endif /* CONFIG_H */
@@ -0,0 +1,64 @@
+#ifndef CTERM_H
+#define CTERM_H
+
+/* libcterm: the mail engine without the terminal UI. Configuration,
+ * connections, the IMAP session with its message index, search and
+ * threading, and the outbound queue. The cterm binary is one front end on
+ * top of it; benchmarks and batch tools use the same calls in-process.
+ *
+ * The engine only owns the lifetime of these parts. Once connected, the
+ * module APIs (imap.h, outbox.h, ...) are used directly on its members,
+ * until the IMAP worker is started: from then on the session belongs to
+ * the worker thread and is reached through worker.h. */
+
+#include "config.h"
+#include "network.h"
+#include "imap.h"
+#include "smtp.h"
+#include "outbox.h"
+#include "worker.h"
+#include "mime.h"
+#include "search.h"
+#include "thread.h"
+#include "filter.h"
+
+typedef struct {
+    Config config;
+    ImapSession imap;
+    Outbox outbox;
+    ImapWorker worker;
+    int config_loaded;
+    int connected;
+    int outbox_started;
+    int worker_started;
+} CtermEngine;
+
+/* Process-wide setup of the TLS library; once per process, before any
+ * engine connects */
+int cterm_init(void);
+void cterm_cleanup(void);
+
+/* Load the configuration; nothing is connected yet */
+int cterm_open(CtermEngine *engine, const char *config_file);
+
+/* Connect and log in to the IMAP server. Search indices are kept in the
+ * account's cache directory. */
+int cterm_connect(CtermEngine *engine);
+
+/* Open a mailbox and fetch its message index. Returns the message count
+ * or -1. */
+int cterm_select(CtermEngine *engine, const char *mailbox);
+
+/* Open the outbound spool and start its worker; messages left from an
+ * earlier run are sent */
+int cterm_start_outbox(CtermEngine *engine);
+
+/* Hand the IMAP session to a worker thread; the first snapshot of the
+ * open mailbox is waiting in its result queue */
+int cterm_start_worker(CtermEngine *engine);
+
+/* Stop the workers, log out and forget the configuration. Safe on a
+ * partially opened engine. */
+void cterm_close(CtermEngine *engine);
+
+#endif /* CTERM_H */
@@ -0,0 +1,69 @@
+#ifndef EDITOR_H
+#define EDITOR_H
+
+#include <stddef.h>
+
+#define EDITOR_TAB_WIDTH 8
+
+/* Editable text in a gap buffer: the text before the cursor sits at the
+ * start of one array, the text after it at the end, and the gap between
+ * them is where typing goes. Typing and deleting cost the same in a
+ * megabyte as in a line, and moving the cursor moves only the bytes it
+ * passes. The cursor is always on a character boundary, so no UTF-8
+ * sequence is ever split by the gap.
+ *
+ * Text is shown in rows of at most width columns, broken at newlines and
+ * wherever a row is full. Row work starts from the row being looked at,
+ * never from the start of the text, so drawing a screen costs the same
+ * anywhere in a long message. */
+typedef struct {
+    char *data;
+    size_t size;            /* Bytes allocated */
+    size_t gap;             /* Start of the gap: the cursor */
+    size_t gap_end;
+    size_t top;             /* Text offset of the first row shown */
+    int width;              /* Row width top was found for */
+    int goal;               /* Column up/down keep to, -1 for none */
+} Editor;
+
+/* Returns -1 if out of memory */
+int editor_init(Editor *editor);
+void editor_free(Editor *editor);
+
+/* Drop all text */
+void editor_clear(Editor *editor);
+
+size_t editor_length(const Editor *editor);
+size_t editor_cursor(const Editor *editor);
+
+/* Insert at the cursor and move past it. Returns -1 if out of memory. */
+int editor_insert(Editor *editor, const char *text, size_t len);
+
+/* Delete the character before / under the cursor */
+void editor_backspace(Editor *editor);
+void editor_delete(Editor *editor);
+
+/* Cursor movement by character, by row of width columns, or to the start
+ * or end of its row. Up and down return -1 on the first / last row. */
+void editor_left(Editor *editor);
+void editor_right(Editor *editor);
+int editor_up(Editor *editor, int width);
+int editor_down(Editor *editor, int width);
+void editor_home(Editor *editor, int width);
+void editor_end(Editor *editor, int width);
+
+/* Scroll so the cursor is on one of height rows; y and x get where it is
+ * on them */
+void editor_view(Editor *editor, int width, int height, int *y, int *x);
+
+/* Copy the row starting at start as it is shown: tabs expanded, control
+ * characters as spaces. next gets where the row after it starts.
+ * Returns 0 if this is the last row. */
+int editor_row(const Editor *editor, size_t start, int width,
+               char *output, size_t output_size, size_t *next);
+
+/* The whole text, NUL-terminated. The cursor moves to the end. Returns
+ * NULL if out of memory. */
+const char *editor_text(Editor *editor);
+
+#endif /* EDITOR_H */
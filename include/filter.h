@@ -0,0 +1,50 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "imap.h"
+#include <stddef.h>
+
+#define FILTER_MAX_PATTERN 63
+
+/* Search-as-you-type filter over the message list. Every message gets a
+ * case-folded "from subject" key once; each typed byte narrows the result
+ * of the previous one, and backspace just returns to an earlier level. */
+typedef struct {
+    /* Folded keys, indexed by email index */
+    char *keys;
+    size_t keys_len;
+    size_t keys_capacity;
+    size_t *key_offsets;
+    unsigned short *key_lengths;
+    int key_count;
+    int key_capacity;
+
+    /* Raw pattern as typed and its folded form */
+    char pattern[FILTER_MAX_PATTERN + 1];
+    int pattern_len;
+
+    /* levels[n] holds the matching email indices for the first n pattern
+     * bytes; levels[0] is the unfiltered base list */
+    int *levels[FILTER_MAX_PATTERN + 1];
+    int level_counts[FILTER_MAX_PATTERN + 1];
+} ListFilter;
+
+void filter_init(ListFilter *filter);
+void filter_free(ListFilter *filter);
+
+/* Emails were refetched: forget keys (the pattern is kept) */
+void filter_invalidate(ListFilter *filter);
+
+/* Start over on a new base list of email indices, reapplying the pattern */
+int filter_begin(ListFilter *filter, const Email *emails, int email_count,
+                 const int *rows, int row_count);
+
+/* Append one byte of the pattern / remove the last character */
+int filter_push(ListFilter *filter, char c);
+void filter_pop(ListFilter *filter);
+
+/* Current result */
+int filter_count(const ListFilter *filter);
+const int *filter_rows(const ListFilter *filter);
+
+#endif /* FILTER_H */
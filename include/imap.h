@@ -2,48 +2,163 @@
 #define IMAP_H
 
 #include "network.h"
+#include "thread.h"
+#include "search.h"
 #include <time.h>
 
 #define MAX_SUBJECT_LEN 256
 #define MAX_FROM_LEN 128
-#define MAX_BODY_LEN 4096
+#define MAX_BODY_LEN (4 * 1024 * 1024)   /* Body text kept by one fetch */
+#define IMAP_BODY_FIRST_CHUNK (64 * 1024)   /* Bytes of a text fetched when it is opened */
+#define IMAP_BODY_CHUNK (512 * 1024)        /* Bytes fetched at a time after that */
+#define MAX_CAPABILITY_LEN 1024
+#define MAX_MAILBOX_LEN 256
+#define MAX_SNIPPET_LEN 256      /* Start of the text shown in the list and preview */
 
 typedef struct {
     unsigned int uid;
     char subject[MAX_SUBJECT_LEN];
     char from[MAX_FROM_LEN];
     char date[64];
+    char message_id[MAX_MSGID_LEN];
     int seen;
     int deleted;
-    char body[MAX_BODY_LEN];
+    char snippet[MAX_SNIPPET_LEN];  /* One line, empty if the text has none */
+    int previewed;                  /* snippet is known: 1, not yet: 0 */
 } Email;
 
+/* A mailbox from LIST. The message index of a folder that is not open is
+ * parked here so switching back to it needs no refetch. */
+typedef struct {
+    char name[MAX_MAILBOX_LEN];          /* As the server knows it (modified UTF-7) */
+    char display_name[MAX_MAILBOX_LEN];  /* Decoded for display */
+    int noselect;
+    int messages;                        /* -1 if unknown */
+    int unseen;
+
+    int loaded;
+    unsigned int uidvalidity;
+    Email *emails;
+    int email_count;
+    int email_capacity;
+    ThreadIndex threads;
+    SearchIndex search;
+} ImapFolder;
+
+/* Result of UID SEARCH RETURN (COUNT MIN MAX ALL), RFC 4731 */
+typedef struct {
+    int count;
+    unsigned int min;      /* 0 if nothing matched */
+    unsigned int max;
+    char *all;             /* Matching UIDs as a set such as "3:7,12", malloc'd */
+} ImapSearchSummary;
+
+#define IMAP_BODY_RESPONSE_LEN (MAX_BODY_LEN + 1024)   /* Body plus FETCH line */
+
+/* A UID FETCH BODY[TEXT], or a range of it, whose reply is read as it
+ * arrives */
+typedef struct {
+    int tag;                /* Tag of the command in flight, 0 if none */
+    unsigned int uid;
+    size_t offset;          /* Range asked for; length 0 for the whole text */
+    size_t length;
+    int cancelled;          /* Read the reply but drop it */
+    int result;             /* 1 arrived, -1 failed, 0 nothing to report */
+    long literal;           /* Literal bytes still to read, -1 once read */
+    size_t body_start;      /* Where the literal starts in response */
+    long body_len;          /* Its size, -1 if none came */
+    char *response;         /* Grows with the reply, up to IMAP_BODY_RESPONSE_LEN */
+    size_t len;
+    size_t capacity;
+    unsigned long long sent_at;   /* For the trace */
+} ImapBodyFetch;
+
 typedef struct {
     Connection conn;
     int logged_in;
     int tag_counter;
+    char capabilities[MAX_CAPABILITY_LEN];
+    char cache_dir[512];            /* Where search indices are kept, may be empty */
+
+    /* Folders from LIST; current_folder is the one whose index is below */
+    ImapFolder *folders;
+    int folder_count;
+    int current_folder;
+    int pending_status;             /* Background STATUS replies still due */
+    int check_tag;                  /* Tag of the background ESEARCH, 0 if none */
+    int server_messages;            /* Open mailbox per that check, -1 unknown */
+    unsigned int server_max_uid;
+    ImapBodyFetch body_fetch;
+
+    /* Message index of the open mailbox */
+    char mailbox[MAX_MAILBOX_LEN];
+    char selected[MAX_MAILBOX_LEN]; /* Mailbox the server has selected */
+    unsigned int uidvalidity;
     Email *emails;
     int email_count;
     int email_capacity;
+    ThreadIndex threads;
+    SearchIndex search;
 } ImapSession;
 
 /* Session management */
 int imap_connect(ImapSession *session, const char *host, int port, int use_ssl);
-int imap_login(ImapSession *session, const char *username, const char *password);
+int imap_login(ImapSession *session, const char *username, const char *password,
+               const char *token);
 void imap_disconnect(ImapSession *session);
+int imap_fetch_capabilities(ImapSession *session);
+int imap_has_capability(const ImapSession *session, const char *name);
 
 /* Mailbox operations */
+void imap_set_cache_dir(ImapSession *session, const char *dir);
 int imap_select_mailbox(ImapSession *session, const char *mailbox);
 int imap_fetch_emails(ImapSession *session);
-int imap_fetch_email_body(ImapSession *session, unsigned int uid, Email *email);
+int imap_refresh_emails(ImapSession *session);
+int imap_fetch_email_body(ImapSession *session, unsigned int uid, char *body, size_t size);
+
+/* Open a message without waiting. begin sends the fetch of length bytes
+ * of its text from offset, or of all of it if length is 0; poll reads
+ * what has arrived without blocking and returns 0 while more is due, 1
+ * once the decoded text is in body, -1 on failure. A fetch from offset 0
+ * makes the message seen; later ranges are peeked. After cancel the
+ * reply is read and dropped when it comes. Other commands wait for a
+ * fetch in flight.
+ *
+ * A range that came back full is cut after its last line break, and next
+ * gets the offset the rest starts at; it is 0 once the text is complete.
+ * So each range ends a line and no UTF-8 sequence is split between two. */
+int imap_body_fetch_begin(ImapSession *session, unsigned int uid, size_t offset, size_t length);
+int imap_body_fetch_poll(ImapSession *session, char *body, size_t size, size_t *next);
+void imap_body_fetch_cancel(ImapSession *session);
+int imap_search_text(ImapSession *session, const char *text, unsigned int **uids);
+
+/* Snippets of the open mailbox's messages by UID: the server's PREVIEW
+ * (RFC 8970) when it has one, otherwise made from the start of each text.
+ * The messages count as previewed even if they have no text. */
+int imap_fetch_snippets(ImapSession *session, const unsigned int *uids, int count);
+
+/* Counts without downloading messages: STATUS works on any mailbox,
+ * imap_esearch runs search criteria on the open one */
+int imap_status(ImapSession *session, const char *mailbox, int *messages, int *unseen);
+int imap_esearch(ImapSession *session, const char *criteria, ImapSearchSummary *summary);
+void imap_search_summary_free(ImapSearchSummary *summary);
+
+/* Folders. Switching parks the open folder's index in memory; message
+ * counts of the other folders are refreshed in the background. */
+int imap_list_folders(ImapSession *session);
+int imap_switch_folder(ImapSession *session, int folder);
+int imap_status_refresh_begin(ImapSession *session);
+int imap_status_refresh_poll(ImapSession *session);
+const char *imap_current_folder_name(const ImapSession *session);
 
 /* Email operations */
 int imap_mark_seen(ImapSession *session, unsigned int uid);
 int imap_mark_unseen(ImapSession *session, unsigned int uid);
 int imap_delete_email(ImapSession *session, unsigned int uid);
-int imap_expunge(ImapSession *session);
+int imap_expunge(ImapSession *session);   /* Also drops the messages from the list */
 
 /* Utility functions */
+int imap_find_email(const ImapSession *session, unsigned int uid);
 void imap_free_emails(ImapSession *session);
 
 #endif /* IMAP_H */
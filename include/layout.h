@@ -0,0 +1,46 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stddef.h>
+
+#define LAYOUT_TAB_WIDTH 8
+
+/* Text word-wrapped for a given width, kept as the byte offset where each
+ * display line starts. Wrapping walks the text once; after that any line
+ * is found by its number, so scrolling through a body of megabytes costs
+ * no more than through a short one. Widths are in terminal columns. */
+typedef struct {
+    const char *text;       /* Not owned; must outlive the layout */
+    size_t len;
+    int width;              /* Columns it was wrapped for, 0 if not yet */
+    size_t *lines;          /* Start offset of each display line */
+    int count;
+    int capacity;
+} TextLayout;
+
+void layout_init(TextLayout *layout);
+void layout_free(TextLayout *layout);
+
+/* Wrap text into lines of at most width columns, breaking after spaces
+ * where possible. Newlines always end a line, so blank lines are kept.
+ * Returns the number of lines, -1 if out of memory. */
+int layout_wrap(TextLayout *layout, const char *text, size_t len, int width);
+
+/* Extend the layout to text, which is the text it was made for (perhaps
+ * moved) followed by more: tail is that more wrapped alone for the same
+ * width. The layout's text should end with a line break, as a range of a
+ * body does, so the lines come out as if all were wrapped at once.
+ * Returns the number of lines, -1 if out of memory. */
+int layout_append(TextLayout *layout, const char *text, size_t len, const TextLayout *tail);
+
+/* Is the layout made for this text and width? */
+int layout_valid(const TextLayout *layout, const char *text, int width);
+
+/* Line holding the byte at offset, e.g. to keep the position on rewrap */
+int layout_find(const TextLayout *layout, size_t offset);
+
+/* Copy line n as it is shown: tabs expanded, control characters as
+ * spaces, no line break. Returns bytes written. */
+size_t layout_line(const TextLayout *layout, int line, char *output, size_t output_size);
+
+#endif /* LAYOUT_H */
@@ -0,0 +1,32 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include "smtp.h"
+#include <stddef.h>
+#include <stdio.h>
+
+#define MIME_MAX_ATTACHMENTS 16
+#define MIME_BOUNDARY_LEN 64
+#define MIME_LINE_BYTES 57      /* Input bytes per 76-character base64 line */
+
+/* Base64 without line breaks. out needs room for 4 * ((len + 2) / 3) + 1
+ * bytes; it is NUL-terminated. Returns the encoded length. */
+size_t mime_base64_encode(const unsigned char *in, size_t len, char *out);
+
+/* Base64 in 76-character CRLF-terminated lines, for a message body. len
+ * should be a multiple of MIME_LINE_BYTES except for the last piece of a
+ * stream. Returns the encoded length. */
+size_t mime_base64_encode_lines(const unsigned char *in, size_t len, char *out);
+
+/* Check that a file can be attached */
+int mime_attachment_ok(const char *path);
+
+/* Headers that turn a message into multipart/mixed, and the opening of
+ * the text part that follows them */
+int mime_write_multipart_headers(FILE *file, const char *boundary);
+
+/* Stream a file as a base64 part, and close the multipart body */
+int mime_write_attachment(SmtpData *data, const char *boundary, const char *path);
+int mime_write_end(SmtpData *data, const char *boundary);
+
+#endif /* MIME_H */
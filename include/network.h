@@ -4,11 +4,19 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#define NET_BUFFER_SIZE 16384
+
 typedef struct {
     int sockfd;
     SSL *ssl;
     SSL_CTX *ssl_ctx;
     int use_ssl;
+
+    /* Received but not yet consumed: lines are cut out of this buffer
+     * instead of reading the socket a byte at a time */
+    char in[NET_BUFFER_SIZE];
+    int in_start;
+    int in_end;
 } Connection;
 
 /* Connection management */
@@ -19,6 +27,13 @@ void net_disconnect(Connection *conn);
 int net_send(Connection *conn, const char *data, int len);
 int net_recv(Connection *conn, char *buffer, int buffer_size);
 int net_recv_line(Connection *conn, char *buffer, int buffer_size);
+int net_poll_readable(Connection *conn, int timeout_ms);
+
+/* Like net_recv_line, but returns 0 at once when no whole line has
+ * arrived yet (what did arrive stays buffered), -1 if the connection
+ * was closed */
+int net_recv_line_nowait(Connection *conn, char *buffer, int buffer_size);
+int net_set_timeout(Connection *conn, int seconds);
 
 /* SSL/TLS utilities */
 int net_init_ssl(void);
@@ -0,0 +1,75 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include "smtp.h"
+#include "config.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#define OUTBOX_RETRY_MIN 30       /* First retry delay, seconds */
+#define OUTBOX_RETRY_MAX 900      /* Longest retry delay, seconds */
+#define OUTBOX_MAX_ATTEMPTS 8     /* A message is set aside after this many */
+#define OUTBOX_KEEPALIVE 120      /* NOOP an idle session this often, seconds */
+#define OUTBOX_WARM_SECONDS 600   /* How long a warm-up keeps the session open */
+
+/* Outbound queue. Composed messages are written to a spool directory and
+ * the call returns at once; a worker thread sends them over the SMTP
+ * session, oldest first, retrying with exponential backoff. Messages stay
+ * on disk until the server accepted them, so they survive a restart.
+ *
+ * The worker owns the SMTP session: it connects when there is something
+ * to send or the UI asks for a warm-up, notices connections the server
+ * dropped, keeps a wanted session alive with NOOPs and closes it when it
+ * is no longer wanted. */
+typedef struct {
+    const Config *config;
+    SmtpSession smtp;
+    char spool_dir[512];
+    time_t last_used;       /* Last exchange with the server (worker only) */
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int started;
+    int stop;
+    int notify[2];          /* Pipe poked when the status changes, -1 if none */
+
+    /* Shared with the UI, protected by lock */
+    int queued;             /* Messages waiting in the spool */
+    int failed;             /* Messages set aside after OUTBOX_MAX_ATTEMPTS */
+    int sending;            /* Worker is talking to the server */
+    int offline;            /* Last connection attempt failed */
+    int connect_failures;
+    int sent;               /* Messages sent since start */
+    int attempts;           /* Failed attempts on the oldest message */
+    time_t next_attempt;    /* Retry time after a failure, 0 if none */
+    time_t last_sent;
+    time_t warm_until;      /* Keep the session open until then */
+    unsigned int seq;
+} Outbox;
+
+/* Scan the spool and start the worker */
+int outbox_init(Outbox *outbox, const Config *config, const char *spool_dir);
+
+/* Stop the worker after the message in progress; the spool is kept */
+void outbox_shutdown(Outbox *outbox);
+
+/* Spool a message for sending. Returns once it is safely on disk.
+ * Attached files are read when the message is sent. */
+int outbox_enqueue(Outbox *outbox, const char *from, const char *to,
+                   const char *subject, const char *body,
+                   const char *const *attachments, int attachment_count);
+
+/* A message is about to be written: connect now so sending does not wait
+ * for TCP, TLS and authentication */
+void outbox_warm_up(Outbox *outbox);
+
+/* One-line state for the status bar, empty when there is nothing to say */
+void outbox_status(Outbox *outbox, char *buffer, size_t size);
+
+/* Descriptor that becomes readable when outbox_status would say something
+ * else, for an event loop to watch; outbox_status clears it. -1 if none. */
+int outbox_event_fd(const Outbox *outbox);
+
+#endif /* OUTBOX_H */
@@ -0,0 +1,33 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#define QUEUE_CACHE_LINE 64
+
+/* Bounded queue of pointers between exactly two threads: one pushes, the
+ * other pops, and neither takes a lock. Each index is written by one side
+ * only and published with a release store, so an item is fully written
+ * before the other side can see it. The indices sit on separate cache
+ * lines so the two threads do not contend for one. */
+typedef struct {
+    void **slots;
+    unsigned int mask;          /* Capacity - 1, capacity a power of two */
+    char pad0[QUEUE_CACHE_LINE];
+    unsigned int head;          /* Next slot to pop (consumer) */
+    char pad1[QUEUE_CACHE_LINE];
+    unsigned int tail;          /* Next slot to push (producer) */
+    char pad2[QUEUE_CACHE_LINE];
+} SpscQueue;
+
+/* capacity is rounded up to a power of two */
+int queue_init(SpscQueue *queue, unsigned int capacity);
+
+/* Items still queued are not freed */
+void queue_free(SpscQueue *queue);
+
+/* Producer side. Returns -1 if the queue is full. */
+int queue_push(SpscQueue *queue, void *item);
+
+/* Consumer side. Returns NULL if the queue is empty. */
+void *queue_pop(SpscQueue *queue);
+
+#endif /* QUEUE_H */
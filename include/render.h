@@ -0,0 +1,65 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <ncurses.h>
+#include <stdint.h>
+
+#define RENDER_UNKNOWN 0                            /* Row content not known */
+#define RENDER_HASH_SEED 14695981039346656037ULL    /* FNV-1a offset basis */
+
+/* What a window currently shows, one hash per row, so drawing code can
+ * skip rows that would come out the same. A region is repainted in full
+ * when it is new, its window changed size, another view drew into the
+ * window, or it was invalidated. */
+typedef struct {
+    uint64_t *rows;
+    int height;
+    int width;
+    int owner;              /* Who painted it last, -1 if nobody */
+    int valid;
+    int top;                /* Scroll position that is shown */
+} RenderRegion;
+
+void render_init(RenderRegion *region);
+void render_free(RenderRegion *region);
+
+/* Forget what is on screen: the next paint is a full one */
+void render_invalidate(RenderRegion *region);
+
+/* Start painting win for owner. Returns 1 when everything must be drawn,
+ * with every row unknown; the caller then clears the window. */
+int render_begin(RenderRegion *region, WINDOW *win, int owner);
+
+/* Hash of what a row shows, built from its text and attributes */
+uint64_t render_hash(uint64_t hash, const char *text);
+uint64_t render_hash_int(uint64_t hash, long value);
+
+/* Record that row y should show hash. Returns 1 if it shows something
+ * else now and must be drawn. */
+int render_row_changed(RenderRegion *region, int y, uint64_t hash);
+
+/* Move rows top..bottom of win by delta (positive: content moves up) with
+ * the terminal's scroll region; rows that come into view become unknown */
+void render_scroll(RenderRegion *region, WINDOW *win, int top, int bottom, int delta);
+
+/* Rows formatted once and reused while what they were made from is the
+ * same. The key packs everything the text depends on (never 0). */
+typedef struct {
+    char **text;            /* malloc'd, NULL if not formatted */
+    uint64_t *keys;
+    int capacity;
+} RenderRowCache;
+
+void render_cache_init(RenderRowCache *cache);
+void render_cache_free(RenderRowCache *cache);
+
+/* Drop every row, e.g. when the items behind the indices changed */
+void render_cache_clear(RenderRowCache *cache);
+
+/* Row index if it was formatted with key, else NULL */
+const char *render_cache_get(RenderRowCache *cache, int index, uint64_t key);
+
+/* Keep a copy of text as row index. Returns the copy, NULL if out of memory. */
+const char *render_cache_put(RenderRowCache *cache, int index, uint64_t key, const char *text);
+
+#endif /* RENDER_H */
@@ -0,0 +1,29 @@
+#ifndef SASL_H
+#define SASL_H
+
+#include <stddef.h>
+
+#define SASL_MAX_RESPONSE 8192  /* Base64 initial response, token included */
+
+typedef enum {
+    SASL_NONE,
+    SASL_PLAIN,         /* RFC 4616 */
+    SASL_LOGIN,         /* SMTP "AUTH LOGIN", three round trips */
+    SASL_XOAUTH2,       /* Google/Microsoft bearer token */
+    SASL_OAUTHBEARER    /* RFC 7628 */
+} SaslMechanism;
+
+/* Pick a mechanism from the server's list, e.g. the capability line
+ * "IMAP4rev1 AUTH=PLAIN AUTH=XOAUTH2" with prefix "AUTH=", or the EHLO
+ * parameters "PLAIN LOGIN" with prefix "". With a token only token
+ * mechanisms qualify; otherwise PLAIN is preferred over LOGIN. */
+SaslMechanism sasl_choose(const char *offered, const char *prefix, int use_token);
+
+const char *sasl_mechanism_name(SaslMechanism mechanism);
+
+/* Base64 initial client response carrying the password or token, so the
+ * exchange completes in one round trip. Returns its length or -1. */
+int sasl_initial_response(SaslMechanism mechanism, const char *username,
+                          const char *secret, char *out, size_t size);
+
+#endif /* SASL_H */
@@ -0,0 +1,67 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+/* Which part of a message a document holds */
+#define SEARCH_DOC_HEADER 1
+#define SEARCH_DOC_BODY   2
+
+typedef struct {
+    size_t text_offset;        /* Offset of the term in the string pool */
+    unsigned int hash;
+    int df;                    /* Number of documents containing the term */
+    int last_doc;
+    unsigned char *postings;   /* varint(doc delta), tf byte, ... */
+    size_t postings_len;
+    size_t postings_capacity;
+} SearchTerm;
+
+typedef struct {
+    unsigned int uid;
+    double score;
+} SearchResult;
+
+typedef struct {
+    /* Term dictionary */
+    SearchTerm *terms;
+    int term_count;
+    int term_capacity;
+    int *term_buckets;
+    int term_bucket_count;
+    char *pool;
+    size_t pool_len;
+    size_t pool_capacity;
+
+    /* Documents, numbered in the order they were added */
+    unsigned int *doc_uids;
+    unsigned char *doc_kinds;
+    int doc_count;
+    int doc_capacity;
+
+    /* UID -> SEARCH_DOC_* bits already indexed */
+    unsigned int *uid_keys;
+    unsigned char *uid_flags;
+    int uid_bucket_count;
+    int uid_count;
+
+    unsigned int uidvalidity;
+    int dirty;
+} SearchIndex;
+
+void search_init(SearchIndex *index);
+void search_free(SearchIndex *index);
+
+/* Persistence. A file written for another UIDVALIDITY is ignored. */
+int search_load(SearchIndex *index, const char *path, unsigned int uidvalidity);
+int search_save(SearchIndex *index, const char *path);
+
+/* Index one part of a message. Parts that are already indexed are skipped. */
+int search_add(SearchIndex *index, unsigned int uid, int kind, const char *text);
+int search_has(const SearchIndex *index, unsigned int uid, int kind);
+
+/* Messages containing every word of query, best match first.
+ * Returns result count and a malloc'd array in *results. */
+int search_query(const SearchIndex *index, const char *query, SearchResult **results);
+
+#endif /* SEARCH_H */
@@ -2,17 +2,63 @@
 #define SMTP_H
 
 #include "network.h"
+#include <stddef.h>
+
+#define MAX_EXTENSIONS_LEN 1024
+#define MAX_RECIPIENTS 32
+#define MAX_ADDRESS_LEN 256
+#define SMTP_CHUNK_SIZE 65536   /* Content is sent in writes of this size */
+#define SMTP_CHUNK_HEADROOM 32  /* Room for "BDAT <size> LAST" before a chunk */
+#define SMTP_BDAT_WINDOW 8      /* Pipelined BDAT chunks left unanswered at most */
+#define SMTP_TIMEOUT 120        /* Seconds to wait for the server */
+#define SMTP_REJECTED (-2)      /* The server refused the message for good (5xx) */
 
 typedef struct {
     Connection conn;
     int connected;
+    char extensions[MAX_EXTENSIONS_LEN]; /* EHLO lines, one extension per line */
 } SmtpSession;
 
 /* Session management */
 int smtp_connect(SmtpSession *session, const char *host, int port, int use_ssl);
 int smtp_starttls(SmtpSession *session);
 int smtp_auth_login(SmtpSession *session, const char *username, const char *password);
+int smtp_authenticate(SmtpSession *session, const char *username, const char *password,
+                      const char *token);
 void smtp_disconnect(SmtpSession *session);
+int smtp_has_extension(const SmtpSession *session, const char *name);
+
+/* Session health */
+int smtp_noop(SmtpSession *session);
+int smtp_idle_ok(SmtpSession *session);
+
+/* Message content writer. Memory use is one chunk, whatever the
+ * message size. Content goes out with BDAT (RFC 3030) when the server has
+ * CHUNKING, otherwise as dot-stuffed DATA. */
+typedef struct {
+    SmtpSession *session;
+    char *buffer;       /* Headroom followed by one chunk */
+    size_t len;
+    int bdat;
+    int pipelining;
+    int pending;        /* BDAT replies not read yet */
+    int at_line_start;
+    int last_cr;        /* Last byte was a CR not yet known to start CRLF */
+    int failed;
+    int rejected;       /* A 5xx reply came for the content */
+} SmtpData;
+
+/* smtp_data_begin and smtp_data_end return SMTP_REJECTED rather than -1
+ * when the failure is permanent: trying the message again cannot help */
+int smtp_data_begin(SmtpSession *session, const char *from, const char *to, SmtpData *data);
+int smtp_data_write(SmtpData *data, const char *text, size_t len);
+int smtp_data_write_fd(SmtpData *data, int fd);
+int smtp_data_end(SmtpData *data);
+
+/* Give up on a message part way through. The server discards what it got:
+ * a BDAT transaction is reset, while DATA content cannot be taken back
+ * and the connection is closed instead. */
+void smtp_data_abort(SmtpData *data);
 
 /* Email sending */
 int smtp_send_email(SmtpSession *session,
@@ -0,0 +1,37 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#define STATS_SUB_BUCKETS 8                         /* Per power of two */
+#define STATS_BUCKETS (STATS_SUB_BUCKETS * 40)      /* Up to about 2^41 us */
+
+/* Latency histogram in microseconds. Buckets are log-spaced, eight to
+ * each power of two, so a percentile read from it is within 12.5% of the
+ * exact value while a sample costs a few instructions and the histogram
+ * a fixed few kilobytes, however long the program runs. */
+typedef struct {
+    unsigned long counts[STATS_BUCKETS];
+    unsigned long count;
+    unsigned long long total;
+    unsigned long long max;
+} StatsHistogram;
+
+void stats_init(StatsHistogram *histogram);
+void stats_add(StatsHistogram *histogram, unsigned long long us);
+
+/* Value that p percent of the samples do not exceed (rounded up to its
+ * bucket), 0 if there are none */
+unsigned long long stats_percentile(const StatsHistogram *histogram, double p);
+
+/* Monotonic clock in microseconds */
+unsigned long long stats_now(void);
+
+/* "1.25ms" or "340us" */
+void stats_format(unsigned long long us, char *buffer, size_t size);
+
+/* One line of a report: name, count, p50, p90, p99, max, mean. With a
+ * NULL histogram, the header line. */
+void stats_write(FILE *file, const char *name, const StatsHistogram *histogram);
+
+#endif /* STATS_H */
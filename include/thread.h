@@ -0,0 +1,67 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stddef.h>
+
+#define MAX_MSGID_LEN 256
+
+/* One node of the JWZ threading tree. A container may be empty (no message)
+ * when it only stands for a Message-ID seen in someone's References. */
+typedef struct {
+    size_t id_offset;     /* Offset of the Message-ID in the string pool */
+    unsigned int hash;
+    int email;            /* Index into the email array, -1 if empty */
+    int parent;
+    int first_child;
+    int last_child;
+    int next;             /* Next sibling */
+} ThreadContainer;
+
+typedef struct {
+    ThreadContainer *containers;
+    int count;
+    int capacity;
+
+    /* Open-addressing hash table: Message-ID -> container index */
+    int *buckets;
+    int bucket_count;
+    int used_buckets;
+
+    /* Email index -> container index */
+    int *by_email;
+    int by_email_capacity;
+
+    /* Pool of NUL-terminated Message-ID strings */
+    char *pool;
+    size_t pool_len;
+    size_t pool_capacity;
+
+    /* Cached depth-first ordering, rebuilt lazily */
+    int *order;           /* Email indices in display order */
+    int *depth;           /* Nesting level of each entry in order[] */
+    int order_count;
+    int dirty;
+} ThreadIndex;
+
+void thread_init(ThreadIndex *index);
+void thread_free(ThreadIndex *index);
+void thread_reset(ThreadIndex *index);
+
+/* Add one message. references may be NULL or a whitespace separated list of
+ * <id> tokens, in_reply_to may be NULL. Existing threads are updated in place. */
+int thread_add(ThreadIndex *index, int email,
+               const char *message_id, const char *in_reply_to,
+               const char *references);
+
+/* Link child_email under parent_email (-1 makes it a root), as returned by
+ * server-side THREAD. Local links of child_email are replaced. */
+int thread_link(ThreadIndex *index, int parent_email, int child_email);
+
+/* Take a message out. Its container stays, empty, while replies hang
+ * under it; later email indices shift down by one, as in the array. */
+int thread_remove(ThreadIndex *index, int email);
+
+/* Build (or reuse) the flattened conversation order. Returns entry count. */
+int thread_flatten(ThreadIndex *index);
+
+#endif /* THREAD_H */
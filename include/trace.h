@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Hot-path tracing. Spans around network I/O, protocol commands, parsing
+ * and drawing are recorded into a ring buffer per thread and written as a
+ * Chrome trace (JSON) that chrome://tracing and Perfetto open.
+ *
+ * Trace points are compiled out unless CTERM_TRACE is defined: the macros
+ * then expand to nothing and their arguments are never evaluated.
+ *
+ *     TRACE_BEGIN(span);
+ *     ...
+ *     TRACE_END(span, "imap", "fetch", "%d messages", count);
+ *
+ * The detail is formatted only while a trace is being recorded; pass NULL
+ * for none. */
+
+#define TRACE_RING_EVENTS 65536   /* Per thread; the oldest are overwritten */
+#define TRACE_DETAIL_LEN 48
+
+/* Start recording; the trace is written to path by trace_stop. Once per
+ * process. Returns -1 if tracing was not compiled in. */
+int trace_start(const char *path);
+
+/* Stop recording and write the file. Threads that recorded events must
+ * have stopped or be idle. */
+int trace_stop(void);
+
+#ifdef CTERM_TRACE
+
+/* Microseconds on the trace clock, 0 while not recording */
+unsigned long long trace_now(void);
+
+void trace_record(const char *category, const char *name, unsigned long long start,
+                  const char *format, ...);
+
+/* Record a protocol command with only its name as detail ("UID FETCH"),
+ * skipping the tag and never the arguments, which may be credentials */
+void trace_record_command(const char *category, unsigned long long start, const char *command);
+
+/* Name the calling thread in the trace */
+void trace_thread_name(const char *name);
+
+#define TRACE_BEGIN(span) unsigned long long span = trace_now()
+#define TRACE_END(span, category, name, ...) trace_record(category, name, span, __VA_ARGS__)
+#define TRACE_END_COMMAND(span, category, command) trace_record_command(category, span, command)
+#define TRACE_THREAD(name) trace_thread_name(name)
+
+#else
+
+#define TRACE_BEGIN(span) do { } while (0)
+#define TRACE_END(span, category, name, ...) do { } while (0)
+#define TRACE_END_COMMAND(span, category, command) do { } while (0)
+#define TRACE_THREAD(name) do { } while (0)
+
+#endif /* CTERM_TRACE */
+
+#endif /* TRACE_H */
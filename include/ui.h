@@ -1,10 +1,18 @@
 #ifndef UI_H
 #define UI_H
 
+/* Wide-character input (wget_wch) for the compose editor */
+#ifndef NCURSES_WIDECHAR
+#define NCURSES_WIDECHAR 1
+#endif
 #include <ncurses.h>
-#include "imap.h"
-#include "smtp.h"
+#include "worker.h"
+#include "outbox.h"
 #include "config.h"
+#include "filter.h"
+#include "render.h"
+#include "editor.h"
+#include "stats.h"
 
 typedef enum {
     VIEW_EMAIL_LIST,
@@ -12,32 +20,104 @@ typedef enum {
     VIEW_COMPOSE
 } ViewMode;
 
+/* Fields of the compose form, in Tab order */
+typedef enum {
+    COMPOSE_TO,
+    COMPOSE_SUBJECT,
+    COMPOSE_ATTACH,
+    COMPOSE_BODY,
+    COMPOSE_FIELDS
+} ComposeField;
+
+/* A snapshot's message as the UI knows it now: flags changed since the
+ * snapshot was taken and snippets that came later */
+typedef struct {
+    int seen;
+    int previewed;          /* As in Email, or -1 while asked for */
+    char *snippet;          /* NULL: the one in the snapshot */
+} UIEmailState;
+
 typedef struct {
     WINDOW *main_win;
     WINDOW *status_win;
+    WINDOW *folder_win;
+    WINDOW *preview_win;    /* Below the list when the preview is shown */
     ViewMode current_view;
     int selected_index;
     int scroll_offset;
-    ImapSession *imap_session;
-    SmtpSession *smtp_session;
+    int threaded;           /* Conversation view instead of flat list */
+    char search_query[128]; /* Active search, empty if none */
+    unsigned int *search_uids;  /* Search hits, best first */
+    int search_count;
+    int *search_rows;       /* search_uids mapped to email indices */
+    int search_row_count;
+    ListFilter filter;      /* Search-as-you-type filter */
+    int filtering;          /* Keys currently go to the filter */
+    int show_folders;       /* Folder pane visible */
+    int folder_focus;       /* Keys currently go to the folder pane */
+    int folder_selected;    /* Cursor in the folder pane */
+    int show_preview;       /* Snippets in the list and the preview pane */
+    int preview_height;     /* Rows the pane takes now, 0 if hidden */
+    TextLayout preview_layout;  /* Snippet of the selected message, wrapped */
+    RenderRegion main_region;   /* What the windows show, to redraw only changes */
+    RenderRegion status_region;
+    RenderRegion folder_region;
+    RenderRegion preview_region;
+    RenderRowCache list_rows;   /* Formatted list lines by email index */
+    unsigned int loading_uid;   /* Message being opened, 0 if none */
+    int status_ticking;     /* Status bar shows a countdown */
+    char notice[WORKER_MESSAGE_LEN];    /* Status bar text until the next key */
+    ImapWorker *worker;     /* Owns the IMAP session */
+    WorkerIndex *index;     /* Latest snapshot of the open folder */
+    UIEmailState *email_state;  /* One per message of index */
+    int unseen;             /* Unseen messages in it */
+    char *body;             /* Text of the message last opened, as far as loaded */
+    size_t body_len;
+    size_t body_next;       /* Where the rest of it starts, 0 if all is in */
+    int body_more;          /* The rest is being fetched */
+    unsigned int body_uid;
+    TextLayout body_layout; /* body wrapped for the content view */
+    int body_top;           /* First body line shown */
+    Editor compose[COMPOSE_FIELDS]; /* Message being written */
+    int compose_field;      /* Field keys go to */
+    int pasting;            /* Inside a bracketed paste */
+    StatsHistogram key_latency; /* Key read to screen updated */
+    StatsHistogram draw_time[VIEW_COMPOSE + 1]; /* Per view */
+    unsigned long long key_time;    /* When keys not yet shown came, 0 if none */
+    int show_stats;         /* Latency overlay in the status bar */
+    Outbox *outbox;
     Config *config;
     int running;
 } UIContext;
 
 /* UI initialization and cleanup */
-int ui_init(UIContext *ctx, ImapSession *imap, SmtpSession *smtp, Config *cfg);
+int ui_init(UIContext *ctx, ImapWorker *worker, Outbox *outbox, Config *cfg);
 void ui_cleanup(UIContext *ctx);
 
 /* Main UI loop */
 void ui_run(UIContext *ctx);
 
-/* View rendering */
+/* One frame: apply what the worker sent, draw the current view and send
+ * the changes to the terminal in one doupdate. ui_run calls it after each
+ * batch of keys. */
+void ui_frame(UIContext *ctx);
+
+/* Write the latency histograms as a table (--stats). Returns -1 if the
+ * file could not be written. */
+int ui_write_stats(UIContext *ctx, const char *path);
+
+/* View rendering. Only rows that changed are drawn, and windows are staged
+ * with wnoutrefresh for ui_run to send in one doupdate; ui_draw_status puts
+ * its message on screen at once. */
 void ui_draw_email_list(UIContext *ctx);
 void ui_draw_email_content(UIContext *ctx);
+void ui_draw_preview(UIContext *ctx);
 void ui_draw_compose(UIContext *ctx);
 void ui_draw_status(UIContext *ctx, const char *message);
 
-/* Input handling */
+/* Input handling. Compose takes whole characters: ch is a code point, or
+ * a KEY_ code if key is set (as wget_wch returns them). */
 void ui_handle_input(UIContext *ctx, int ch);
+void ui_compose_input(UIContext *ctx, wint_t ch, int key);
 
 #endif /* UI_H */
@@ -0,0 +1,27 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+/* Case-fold UTF-8 text for matching: ASCII and Cyrillic letters are
+ * lowercased, everything else is copied. Returns bytes written. */
+size_t utf8_fold(const char *input, char *output, size_t output_size);
+
+/* Terminal columns taken by UTF-8 text: wide (CJK, emoji) characters take
+ * two, combining marks none, control characters one */
+int utf8_width(const char *text);
+
+/* Bytes in the character at text, with its width in columns; -1 for
+ * control characters and bytes that are not valid UTF-8 */
+size_t utf8_next(const char *text, int *columns);
+
+/* Write code point code as UTF-8 (U+FFFD if it is not one); output needs
+ * room for 4 bytes. Returns bytes written. */
+size_t utf8_encode(unsigned int code, char *output);
+
+/* Copy text cut to at most columns terminal columns, never splitting a
+ * character; with pad, spaces fill it up to exactly columns. Control
+ * characters become spaces. Returns bytes written. */
+size_t utf8_fit(const char *input, int columns, int pad, char *output, size_t output_size);
+
+#endif /* UTF8_H */
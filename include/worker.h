@@ -0,0 +1,172 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "imap.h"
+#include "queue.h"
+#include "layout.h"
+#include <pthread.h>
+#include <time.h>
+
+#define WORKER_QUEUE_LEN 64          /* Commands or results in flight */
+#define WORKER_QUERY_LEN 128
+#define WORKER_MESSAGE_LEN 96
+#define WORKER_SNIPPET_BATCH 64      /* Messages per snippet request */
+#define WORKER_STATUS_SECONDS 60     /* How often folder counts are updated */
+
+/* Protocol worker. A thread owns the IMAP session once it is started: it
+ * sends every command, reads every reply, decodes message bodies and keeps
+ * the search index. The UI thread talks to it through two lock-free
+ * queues, commands one way and results the other, and draws from
+ * snapshots of the message index that the worker hands over and never
+ * touches again. A slow server, a large message or a full resync costs
+ * the input loop nothing. SMTP has its own worker in the outbox. */
+
+/* What the folder pane shows of a folder */
+typedef struct {
+    char display_name[MAX_MAILBOX_LEN];
+    int noselect;
+    int unseen;
+} WorkerFolder;
+
+/* Folder counts, replaced whenever a STATUS refresh completes */
+typedef struct {
+    WorkerFolder *folders;
+    int folder_count;
+    int server_messages;            /* Open mailbox per the server, -1 unknown */
+    unsigned int server_max_uid;
+} WorkerCounts;
+
+/* Messages of a snapshot. Nobody writes to them once they are published:
+ * the worker keeps a reference to see what changed since, and the last
+ * holder to let go frees them. */
+typedef struct {
+    int refs;
+    int count;
+    Email emails[];
+} WorkerEmails;
+
+/* Snapshot of the open folder's message index. It belongs to the UI once
+ * received, but its messages are shared and read-only: flags and snippets
+ * that change later come as WORKER_RESULT_FLAGS and
+ * WORKER_RESULT_SNIPPETS, for the UI to keep beside them. */
+typedef struct {
+    WorkerEmails *shared;
+    const Email *emails;            /* shared->emails, in UID order */
+    int email_count;
+    int *thread_order;              /* Conversation order, NULL if none */
+    int *thread_depth;
+    int thread_count;
+    int current_folder;             /* -1 if folders were not listed */
+    char folder_name[MAX_MAILBOX_LEN];
+    WorkerCounts counts;
+} WorkerIndex;
+
+typedef enum {
+    WORKER_OPEN,                    /* Fetch the body of uid, its first range */
+    WORKER_MORE,                    /* Fetch the next range of it, from offset */
+    WORKER_CANCEL,                  /* Drop the body being fetched */
+    WORKER_DELETE,                  /* Delete and expunge uid */
+    WORKER_REFRESH,
+    WORKER_SWITCH_FOLDER,
+    WORKER_MARK_UNSEEN,
+    WORKER_SEARCH,                  /* Full-text search for query */
+    WORKER_SNIPPETS                 /* Fetch snippets for uids */
+} WorkerCommandType;
+
+typedef struct {
+    WorkerCommandType type;
+    int folder;                     /* Folder the UID belongs to, or to open */
+    unsigned int uid;
+    int width;                      /* Columns to wrap an opened body for */
+    size_t offset;
+    char query[WORKER_QUERY_LEN];
+    unsigned int uids[WORKER_SNIPPET_BATCH];
+    int uid_count;
+} WorkerCommand;
+
+typedef enum {
+    WORKER_RESULT_INDEX,            /* A new snapshot in index */
+    WORKER_RESULT_COUNTS,           /* New folder counts in counts */
+    WORKER_RESULT_BODY,             /* A range of uid's body and its layout, or status -1 */
+    WORKER_RESULT_SEARCH,           /* Hits for query, best first */
+    WORKER_RESULT_SNIPPETS,         /* Snippets of messages asked about */
+    WORKER_RESULT_FLAGS,            /* Flags changed since the snapshot, and counts */
+    WORKER_RESULT_DONE              /* A command finished without new data */
+} WorkerResultType;
+
+typedef struct {
+    unsigned int uid;
+    char text[MAX_SNIPPET_LEN];     /* Empty if the message has no text */
+} WorkerSnippet;
+
+typedef struct {
+    unsigned int uid;
+    int seen;
+} WorkerFlags;
+
+/* Pointers in a result belong to whoever receives it; take them (and set
+ * them to NULL) or let worker_result_free release them */
+typedef struct {
+    WorkerResultType type;
+    int status;                     /* 0 done, -1 failed */
+    int folder;                     /* Folder it is about */
+    WorkerIndex *index;
+    WorkerCounts counts;
+    unsigned int uid;
+    char *body;
+    TextLayout layout;              /* Lines of body, empty if not wrapped */
+    size_t offset;                  /* Of the range: 0 for the start of the body */
+    size_t next;                    /* Where the rest starts, 0 if there is none */
+    unsigned int *uids;
+    int uid_count;
+    WorkerSnippet *snippets;
+    int snippet_count;
+    WorkerFlags *flags;
+    int flag_count;
+    char query[WORKER_QUERY_LEN];
+    char message[WORKER_MESSAGE_LEN];   /* For the status bar, may be empty */
+} WorkerResult;
+
+typedef struct {
+    ImapSession *imap;
+    SpscQueue commands;             /* UI -> worker */
+    SpscQueue results;              /* Worker -> UI */
+    int wake[2];                    /* Poked by the UI after a command */
+    int notify[2];                  /* Poked by the worker after a result */
+    pthread_t thread;
+    int started;
+    int stop;
+    unsigned int loading_uid;       /* Body being fetched for the UI, 0 if none */
+    size_t loading_offset;
+    int loading_width;
+    time_t last_status_refresh;     /* Worker only */
+    WorkerEmails *published;        /* Messages of the last snapshot, worker only */
+} ImapWorker;
+
+/* Hand the session over to a new worker thread. The first snapshot is
+ * queued before this returns, so the UI has a list to draw at once. */
+int worker_start(ImapWorker *worker, ImapSession *imap);
+
+/* Stop the thread after the command in progress. Results nobody received
+ * are freed; the session is the caller's again. */
+void worker_stop(ImapWorker *worker);
+
+/* Queue a command (copied). Returns -1 if the queue is full. */
+int worker_send(ImapWorker *worker, const WorkerCommand *command);
+
+/* Next result or NULL; free it with worker_result_free */
+WorkerResult *worker_receive(ImapWorker *worker);
+void worker_result_free(WorkerResult *result);
+
+/* Descriptor that becomes readable when a result is queued; -1 if none */
+int worker_event_fd(const ImapWorker *worker);
+
+/* Snapshot helpers. worker_emails_new returns count zeroed messages,
+ * held once, to fill in before they are published. */
+WorkerEmails *worker_emails_new(int count);
+void worker_emails_release(WorkerEmails *emails);
+int worker_index_find(const WorkerIndex *index, unsigned int uid);
+void worker_index_free(WorkerIndex *index);
+void worker_counts_free(WorkerCounts *counts);
+
+#endif /* WORKER_H */
@@ -1,8 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
 #include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 /* Trim whitespace from both ends of a string */
 static char *trim(char *str) {
@@ -52,6 +55,8 @@ static int parse_line(char *line, Config *config) {
         strncpy(config->imap_username, value, MAX_STRING_LEN - 1);
     } else if (strcmp(key, "imap_password") == 0) {
         strncpy(config->imap_password, value, MAX_STRING_LEN - 1);
+    } else if (strcmp(key, "imap_oauth_token") == 0) {
+        strncpy(config->imap_oauth_token, value, MAX_TOKEN_LEN - 1);
     }
     /* Parse SMTP settings */
     else if (strcmp(key, "smtp_server") == 0) {
@@ -66,6 +71,10 @@ static int parse_line(char *line, Config *config) {
         strncpy(config->smtp_username, value, MAX_STRING_LEN - 1);
     } else if (strcmp(key, "smtp_password") == 0) {
         strncpy(config->smtp_password, value, MAX_STRING_LEN - 1);
+    } else if (strcmp(key, "smtp_oauth_token") == 0) {
+        strncpy(config->smtp_oauth_token, value, MAX_TOKEN_LEN - 1);
+    } else if (strcmp(key, "oauth_token_command") == 0) {
+        strncpy(config->oauth_token_command, value, MAX_STRING_LEN - 1);
     }
     /* Parse user info */
     else if (strcmp(key, "email_address") == 0) {
@@ -73,6 +82,10 @@ static int parse_line(char *line, Config *config) {
     } else if (strcmp(key, "display_name") == 0) {
         strncpy(config->display_name, value, MAX_STRING_LEN - 1);
     }
+    /* Parse local storage */
+    else if (strcmp(key, "cache_dir") == 0) {
+        strncpy(config->cache_dir, value, MAX_STRING_LEN - 1);
+    }
 
     return 0;
 }
@@ -80,7 +93,7 @@ static int parse_line(char *line, Config *config) {
 /* Load configuration from file */
 int config_load(const char *filename, Config *config) {
     FILE *file;
-    char line[512];
+    char line[MAX_TOKEN_LEN + 512];
 
     /* Initialize config with defaults */
     memset(config, 0, sizeof(Config));
@@ -90,6 +103,9 @@ int config_load(const char *filename, Config *config) {
     config->smtp_use_ssl = 0;
     config->smtp_use_starttls = 1;
 
+    const char *home = getenv("HOME");
+    snprintf(config->cache_dir, MAX_STRING_LEN, "%s/.cache/cterm", home ? home : ".");
+
     file = fopen(filename, "r");
     if (!file) {
         fprintf(stderr, "Error: Cannot open config file: %s\n", filename);
@@ -126,6 +142,8 @@ void config_free(Config *config) {
     /* Clear sensitive data */
     memset(config->imap_password, 0, sizeof(config->imap_password));
     memset(config->smtp_password, 0, sizeof(config->smtp_password));
+    memset(config->imap_oauth_token, 0, sizeof(config->imap_oauth_token));
+    memset(config->smtp_oauth_token, 0, sizeof(config->smtp_oauth_token));
 }
 
 /* Print configuration (for debugging) */
@@ -141,4 +159,70 @@ void config_print(const Config *config) {
            config->smtp_use_starttls ? "yes" : "no");
     printf("  SMTP User: %s\n", config->smtp_username);
     printf("  Email: %s (%s)\n", config->email_address, config->display_name);
+    printf("  Cache: %s\n", config->cache_dir);
+}
+
+/* Create a directory and its parents */
+static int make_dirs(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+                *p = '/';
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Build <cache_dir>/<user>@<server>/<name>, creating the account directory.
+ * Characters that cannot appear in a file name are replaced in name. */
+int config_cache_path(const Config *config, const char *name, char *path, size_t path_size) {
+    char dir[768];
+
+    snprintf(dir, sizeof(dir), "%s/%s@%s", config->cache_dir,
+             config->imap_username, config->imap_server);
+    if (make_dirs(dir) < 0) {
+        fprintf(stderr, "Error: Cannot create cache directory %s\n", dir);
+        return -1;
+    }
+
+    int len = snprintf(path, path_size, "%s/", dir);
+    if (len < 0 || (size_t)len >= path_size) return -1;
+
+    for (const char *p = name; *p && (size_t)len < path_size - 1; p++) {
+        path[len++] = (*p == '/' || *p == '\\') ? '_' : *p;
+    }
+    path[len] = '\0';
+    return 0;
+}
+
+/* OAuth access token for IMAP (smtp = 0) or SMTP login. Access tokens
+ * expire within hours, so a configured command is run for every login;
+ * otherwise the token from the config file is used. token is left empty
+ * when OAuth is not configured. */
+int config_oauth_token(const Config *config, int smtp, char *token, size_t size) {
+    token[0] = '\0';
+
+    if (config->oauth_token_command[0]) {
+        FILE *pipe = popen(config->oauth_token_command, "r");
+        if (!pipe) return -1;
+        if (!fgets(token, (int)size, pipe)) token[0] = '\0';
+        int status = pclose(pipe);
+
+        token[strcspn(token, "\r\n")] = '\0';
+        if (status != 0 || !token[0]) {
+            fprintf(stderr, "Error: oauth_token_command did not print a token\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    snprintf(token, size, "%s", smtp ? config->smtp_oauth_token : config->imap_oauth_token);
+    return 0;
 }
@@ -0,0 +1,94 @@
+#include "cterm.h"
+#include <string.h>
+
+int cterm_init(void) {
+    return net_init_ssl();
+}
+
+void cterm_cleanup(void) {
+    net_cleanup_ssl();
+}
+
+int cterm_open(CtermEngine *engine, const char *config_file) {
+    memset(engine, 0, sizeof(*engine));
+    if (config_load(config_file, &engine->config) < 0) {
+        return -1;
+    }
+    engine->config_loaded = 1;
+    return 0;
+}
+
+int cterm_connect(CtermEngine *engine) {
+    const Config *config = &engine->config;
+    char token[MAX_TOKEN_LEN];
+    char cache_dir[1024];
+
+    if (!engine->config_loaded) return -1;
+    if (imap_connect(&engine->imap, config->imap_server, config->imap_port, config->imap_use_ssl) < 0) {
+        return -1;
+    }
+    engine->connected = 1;
+
+    int logged_in = config_oauth_token(config, 0, token, sizeof(token)) == 0 &&
+                    imap_login(&engine->imap, config->imap_username, config->imap_password, token) == 0;
+    memset(token, 0, sizeof(token));
+    if (!logged_in) {
+        imap_disconnect(&engine->imap);
+        engine->connected = 0;
+        return -1;
+    }
+
+    /* Search indices are kept per mailbox in the account's cache */
+    if (config_cache_path(config, "", cache_dir, sizeof(cache_dir)) == 0) {
+        imap_set_cache_dir(&engine->imap, cache_dir);
+    }
+    return 0;
+}
+
+int cterm_select(CtermEngine *engine, const char *mailbox) {
+    if (!engine->connected) return -1;
+    if (imap_select_mailbox(&engine->imap, mailbox) < 0) {
+        return -1;
+    }
+    return imap_fetch_emails(&engine->imap);
+}
+
+int cterm_start_outbox(CtermEngine *engine) {
+    char spool_dir[1024];
+
+    if (!engine->config_loaded || engine->outbox_started) return -1;
+    if (config_cache_path(&engine->config, "outbox", spool_dir, sizeof(spool_dir)) < 0 ||
+        outbox_init(&engine->outbox, &engine->config, spool_dir) < 0) {
+        return -1;
+    }
+    engine->outbox_started = 1;
+    return 0;
+}
+
+int cterm_start_worker(CtermEngine *engine) {
+    if (!engine->connected || engine->worker_started) return -1;
+    if (worker_start(&engine->worker, &engine->imap) < 0) {
+        return -1;
+    }
+    engine->worker_started = 1;
+    return 0;
+}
+
+void cterm_close(CtermEngine *engine) {
+    if (engine->worker_started) {
+        worker_stop(&engine->worker);
+        engine->worker_started = 0;
+    }
+    if (engine->outbox_started) {
+        outbox_shutdown(&engine->outbox);
+        engine->outbox_started = 0;
+    }
+    if (engine->connected) {
+        imap_disconnect(&engine->imap);
+        engine->connected = 0;
+    }
+    if (engine->config_loaded) {
+        config_free(&engine->config);
+        engine->config_loaded = 0;
+    }
+}
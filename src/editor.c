@@ -0,0 +1,332 @@
+#include "editor.h"
+#include "utf8.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define EDITOR_INITIAL_SIZE 4096
+
+int editor_init(Editor *editor) {
+    editor->data = malloc(EDITOR_INITIAL_SIZE);
+    editor->size = editor->data ? EDITOR_INITIAL_SIZE : 0;
+    editor_clear(editor);
+    return editor->data ? 0 : -1;
+}
+
+void editor_free(Editor *editor) {
+    free(editor->data);
+    editor->data = NULL;
+    editor->size = 0;
+    editor_clear(editor);
+}
+
+void editor_clear(Editor *editor) {
+    editor->gap = 0;
+    editor->gap_end = editor->size;
+    editor->top = 0;
+    editor->width = 0;
+    editor->goal = -1;
+}
+
+size_t editor_length(const Editor *editor) {
+    return editor->size - (editor->gap_end - editor->gap);
+}
+
+size_t editor_cursor(const Editor *editor) {
+    return editor->gap;
+}
+
+/* Byte at text offset pos, wherever the gap is */
+static unsigned char editor_byte(const Editor *editor, size_t pos) {
+    return (unsigned char)editor->data[pos < editor->gap ? pos : pos + editor->gap_end - editor->gap];
+}
+
+/* Copy the character at pos into c (5 bytes) for the UTF-8 functions */
+static void editor_peek(const Editor *editor, size_t pos, char *c) {
+    size_t len = editor_length(editor);
+    size_t i;
+
+    for (i = 0; i < 4 && pos + i < len; i++) c[i] = (char)editor_byte(editor, pos + i);
+    c[i] = '\0';
+}
+
+/* Columns of the character at pos when it starts at column, -1 for a
+ * newline. n gets its length in bytes. */
+static int editor_char(const Editor *editor, size_t pos, int column, size_t *n) {
+    unsigned char b = editor_byte(editor, pos);
+    char c[5];
+    int columns;
+
+    *n = 1;
+    if (b >= 0x20 && b < 0x7F) return 1;
+    if (b == '\n') return -1;
+    if (b == '\t') return EDITOR_TAB_WIDTH - column % EDITOR_TAB_WIDTH;
+    if (b < 0x80) return 1;
+
+    editor_peek(editor, pos, c);
+    *n = utf8_next(c, &columns);
+    return columns < 0 ? 1 : columns;
+}
+
+/* Move the gap, and so the cursor, to pos */
+static void editor_goto(Editor *editor, size_t pos) {
+    if (pos < editor->gap) {
+        size_t n = editor->gap - pos;
+        memmove(editor->data + editor->gap_end - n, editor->data + pos, n);
+        editor->gap = pos;
+        editor->gap_end -= n;
+    } else if (pos > editor->gap) {
+        size_t n = pos - editor->gap;
+        memmove(editor->data + editor->gap, editor->data + editor->gap_end, n);
+        editor->gap += n;
+        editor->gap_end += n;
+    }
+}
+
+int editor_insert(Editor *editor, const char *text, size_t len) {
+    /* One byte of gap always stays, for editor_text's terminator */
+    if (editor->gap_end - editor->gap < len + 1) {
+        size_t tail = editor->size - editor->gap_end;
+        size_t size = editor->size ? editor->size : EDITOR_INITIAL_SIZE;
+        while (size - tail - editor->gap < len + 1) size *= 2;
+
+        char *data = realloc(editor->data, size);
+        if (!data) return -1;
+        memmove(data + size - tail, data + editor->gap_end, tail);
+        editor->data = data;
+        editor->gap_end = size - tail;
+        editor->size = size;
+    }
+
+    memcpy(editor->data + editor->gap, text, len);
+    editor->gap += len;
+    editor->goal = -1;
+    return 0;
+}
+
+/* Start of the character before pos. A stray continuation byte counts as
+ * a character of its own. */
+static size_t editor_prev(const Editor *editor, size_t pos) {
+    size_t start = pos, n;
+
+    if (pos == 0) return 0;
+    do {
+        pos--;
+    } while (pos > 0 && start - pos < 4 && (editor_byte(editor, pos) & 0xC0) == 0x80);
+
+    editor_char(editor, pos, 0, &n);
+    return pos + n == start ? pos : start - 1;
+}
+
+void editor_backspace(Editor *editor) {
+    editor->gap = editor_prev(editor, editor->gap);
+    editor->goal = -1;
+}
+
+void editor_delete(Editor *editor) {
+    size_t n;
+
+    if (editor->gap == editor_length(editor)) return;
+    editor_char(editor, editor->gap, 0, &n);
+    editor->gap_end += n;
+    editor->goal = -1;
+}
+
+void editor_left(Editor *editor) {
+    editor_goto(editor, editor_prev(editor, editor->gap));
+    editor->goal = -1;
+}
+
+void editor_right(Editor *editor) {
+    size_t n;
+
+    if (editor->gap == editor_length(editor)) return;
+    editor_char(editor, editor->gap, 0, &n);
+    editor_goto(editor, editor->gap + n);
+    editor->goal = -1;
+}
+
+/* Where the row after the one starting at start begins. end gets 1 if
+ * the row ends at a newline, 0 if it is full, -1 if the text ends. */
+static size_t editor_row_end(const Editor *editor, size_t start, int width, int *end) {
+    size_t len = editor_length(editor), pos = start, n;
+    int column = 0;
+
+    while (pos < len) {
+        int w = editor_char(editor, pos, column, &n);
+        if (w < 0) {
+            *end = 1;
+            return pos + 1;
+        }
+        /* A character wider than the row gets one of its own */
+        if (column + w > width && column > 0) {
+            *end = 0;
+            return pos;
+        }
+        column += w;
+        pos += n;
+    }
+    *end = -1;
+    return len;
+}
+
+/* Start of the row holding pos; rows are found from the start of its
+ * line, which is as far back as it looks */
+static size_t editor_row_start(const Editor *editor, size_t pos, int width) {
+    size_t start = pos;
+    while (start > 0 && editor_byte(editor, start - 1) != '\n') start--;
+
+    for (;;) {
+        int end;
+        size_t next = editor_row_end(editor, start, width, &end);
+        if (end < 0 || pos < next) return start;
+        start = next;
+    }
+}
+
+/* Column of pos in the row starting at start */
+static int editor_column(const Editor *editor, size_t start, size_t pos) {
+    int column = 0;
+    size_t n;
+
+    for (size_t p = start; p < pos; p += n) {
+        column += editor_char(editor, p, column, &n);
+    }
+    return column;
+}
+
+/* Position in the row starting at start closest to goal, not past it */
+static size_t editor_at_column(const Editor *editor, size_t start, int goal, int width) {
+    int end, column = 0;
+    size_t next = editor_row_end(editor, start, width, &end);
+    size_t pos = start, n;
+
+    while (pos < next) {
+        int w = editor_char(editor, pos, column, &n);
+        if (w < 0 || column + w > goal) break;
+        column += w;
+        pos += n;
+    }
+    /* The end of a full row is the start of the next */
+    if (end == 0 && pos == next) pos = editor_prev(editor, next);
+    return pos;
+}
+
+int editor_up(Editor *editor, int width) {
+    size_t start = editor_row_start(editor, editor->gap, width);
+    if (start == 0) return -1;
+
+    int goal = editor->goal >= 0 ? editor->goal : editor_column(editor, start, editor->gap);
+    size_t prev = editor_row_start(editor, start - 1, width);
+    editor_goto(editor, editor_at_column(editor, prev, goal, width));
+    editor->goal = goal;
+    return 0;
+}
+
+int editor_down(Editor *editor, int width) {
+    size_t start = editor_row_start(editor, editor->gap, width);
+    int end;
+    size_t next = editor_row_end(editor, start, width, &end);
+    if (end < 0) return -1;
+
+    int goal = editor->goal >= 0 ? editor->goal : editor_column(editor, start, editor->gap);
+    editor_goto(editor, editor_at_column(editor, next, goal, width));
+    editor->goal = goal;
+    return 0;
+}
+
+void editor_home(Editor *editor, int width) {
+    editor_goto(editor, editor_row_start(editor, editor->gap, width));
+    editor->goal = -1;
+}
+
+void editor_end(Editor *editor, int width) {
+    size_t start = editor_row_start(editor, editor->gap, width);
+    int end;
+    size_t next = editor_row_end(editor, start, width, &end);
+
+    if (end > 0) next--;                        /* On the newline */
+    else if (end == 0) next = editor_prev(editor, next);
+    editor_goto(editor, next);
+    editor->goal = -1;
+}
+
+void editor_view(Editor *editor, int width, int height, int *y, int *x) {
+    size_t cursor = editor->gap;
+    size_t start, next;
+    int row, end;
+
+    if (height < 1) height = 1;
+    if (width != editor->width || editor->top > cursor) {
+        editor->top = editor_row_start(editor, editor->top < cursor ? editor->top : cursor, width);
+        editor->width = width;
+    }
+
+    /* Look up to a screen below the last row, so typing and scrolling
+     * down move the view a row at a time without searching back */
+    start = editor->top;
+    for (row = 0; row < height * 2; row++) {
+        next = editor_row_end(editor, start, width, &end);
+        if (end < 0 || cursor < next) break;
+        start = next;
+    }
+    if (row < height * 2) {
+        for (int i = height - 1; i < row; i++) {
+            editor->top = editor_row_end(editor, editor->top, width, &end);
+        }
+        *y = row < height ? row : height - 1;
+        *x = editor_column(editor, start, cursor);
+        return;
+    }
+
+    /* Far below: the cursor's row goes at the bottom */
+    start = editor_row_start(editor, cursor, width);
+    *x = editor_column(editor, start, cursor);
+    editor->top = start;
+    for (row = 0; row < height - 1 && editor->top > 0; row++) {
+        editor->top = editor_row_start(editor, editor->top - 1, width);
+    }
+    *y = row;
+}
+
+int editor_row(const Editor *editor, size_t start, int width,
+               char *output, size_t output_size, size_t *next) {
+    size_t out = 0, n;
+    int column = 0, end;
+    char c[5];
+
+    *next = editor_row_end(editor, start, width, &end);
+    for (size_t pos = start; pos < *next && out + 5 < output_size; pos += n) {
+        int w = editor_char(editor, pos, column, &n);
+        unsigned char b = editor_byte(editor, pos);
+        if (w < 0) break;
+
+        if (b >= 0x20 && b < 0x7F) {
+            output[out++] = (char)b;
+        } else if (b == '\t') {
+            for (int i = 0; i < w && out + 1 < output_size; i++) output[out++] = ' ';
+        } else {
+            /* Control characters and invalid bytes are never sent as is */
+            int columns = -1;
+            if (b >= 0x80) {
+                editor_peek(editor, pos, c);
+                utf8_next(c, &columns);
+            }
+            if (columns < 0) {
+                output[out++] = ' ';
+            } else {
+                memcpy(output + out, c, n);
+                out += n;
+            }
+        }
+        column += w;
+    }
+    if (output_size > 0) output[out] = '\0';
+    return end >= 0;
+}
+
+const char *editor_text(Editor *editor) {
+    if (!editor->data) return NULL;
+    editor_goto(editor, editor_length(editor));
+    editor->data[editor->gap] = '\0';
+    return editor->data;
+}
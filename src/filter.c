@@ -0,0 +1,224 @@
+#include "filter.h"
+#include "utf8.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* Does hay contain needle? Eight candidate positions are tested at once by
+ * comparing the first and last needle bytes against 64-bit words (SWAR);
+ * only positions where both match are verified with memcmp. */
+static int contains(const char *hay, size_t hay_len, const char *needle, size_t n) {
+    if (n == 0) return 1;
+    if (n > hay_len) return 0;
+    if (n == 1) return memchr(hay, needle[0], hay_len) != NULL;
+
+    const uint64_t first = ONES * (unsigned char)needle[0];
+    const uint64_t last = ONES * (unsigned char)needle[n - 1];
+    const size_t end = hay_len - n + 1; /* Candidate start positions */
+    size_t i = 0;
+
+    for (; i + 8 <= end; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, hay + i, 8);
+        memcpy(&b, hay + i + n - 1, 8);
+
+        uint64_t x = a ^ first;
+        uint64_t y = b ^ last;
+        uint64_t mask = ((x - ONES) & ~x) & ((y - ONES) & ~y) & HIGHS;
+        if (!mask) continue;
+
+        for (size_t k = 0; k < 8; k++) {
+            if (hay[i + k] == needle[0] && hay[i + k + n - 1] == needle[n - 1] &&
+                memcmp(hay + i + k + 1, needle + 1, n - 2) == 0) {
+                return 1;
+            }
+        }
+    }
+
+    for (; i < end; i++) {
+        if (hay[i] == needle[0] && memcmp(hay + i + 1, needle + 1, n - 1) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Length of the pattern prefix made of complete UTF-8 characters */
+static int complete_length(const char *pattern, int len) {
+    int i = len;
+
+    /* Step back over continuation bytes to the last lead byte */
+    while (i > 0 && ((unsigned char)pattern[i - 1] & 0xC0) == 0x80) i--;
+    if (i == 0) return len;
+
+    unsigned char lead = pattern[i - 1];
+    if (lead < 0x80) return len;
+
+    int need = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : 2;
+    return (len - (i - 1) >= need) ? len : i - 1;
+}
+
+static int add_key(ListFilter *filter, const Email *email) {
+    char raw[MAX_FROM_LEN + MAX_SUBJECT_LEN + 2];
+    size_t room = sizeof(raw);
+
+    if (filter->key_count >= filter->key_capacity) {
+        int new_capacity = filter->key_capacity ? filter->key_capacity * 2 : 1024;
+        size_t *offsets = realloc(filter->key_offsets, sizeof(size_t) * new_capacity);
+        if (!offsets) return -1;
+        filter->key_offsets = offsets;
+        unsigned short *lengths = realloc(filter->key_lengths, sizeof(unsigned short) * new_capacity);
+        if (!lengths) return -1;
+        filter->key_lengths = lengths;
+        filter->key_capacity = new_capacity;
+    }
+    if (filter->keys_len + room > filter->keys_capacity) {
+        size_t new_capacity = filter->keys_capacity ? filter->keys_capacity * 2 : 65536;
+        while (filter->keys_len + room > new_capacity) new_capacity *= 2;
+        char *keys = realloc(filter->keys, new_capacity);
+        if (!keys) return -1;
+        filter->keys = keys;
+        filter->keys_capacity = new_capacity;
+    }
+
+    /* A newline between the fields keeps matches from spanning both */
+    snprintf(raw, sizeof(raw), "%s\n%s", email->from, email->subject);
+    size_t len = utf8_fold(raw, filter->keys + filter->keys_len, room);
+
+    filter->key_offsets[filter->key_count] = filter->keys_len;
+    filter->key_lengths[filter->key_count] = (unsigned short)len;
+    filter->keys_len += len + 1;
+    filter->key_count++;
+    return 0;
+}
+
+static void clear_levels(ListFilter *filter) {
+    for (int i = 0; i <= FILTER_MAX_PATTERN; i++) {
+        free(filter->levels[i]);
+        filter->levels[i] = NULL;
+        filter->level_counts[i] = 0;
+    }
+}
+
+/* Initialize an empty filter */
+void filter_init(ListFilter *filter) {
+    memset(filter, 0, sizeof(ListFilter));
+}
+
+/* Free all memory held by the filter */
+void filter_free(ListFilter *filter) {
+    clear_levels(filter);
+    free(filter->keys);
+    free(filter->key_offsets);
+    free(filter->key_lengths);
+    filter_init(filter);
+}
+
+/* Forget precomputed keys after the email array was rebuilt */
+void filter_invalidate(ListFilter *filter) {
+    filter->keys_len = 0;
+    filter->key_count = 0;
+}
+
+/* Set the unfiltered list and reapply the current pattern to it */
+int filter_begin(ListFilter *filter, const Email *emails, int email_count,
+                 const int *rows, int row_count) {
+    char pattern[FILTER_MAX_PATTERN + 1];
+    int pattern_len = filter->pattern_len;
+
+    /* Keys are built once per message; only new arrivals need work */
+    while (filter->key_count < email_count) {
+        if (add_key(filter, &emails[filter->key_count]) < 0) return -1;
+    }
+
+    clear_levels(filter);
+    filter->levels[0] = malloc(sizeof(int) * (row_count + 1));
+    if (!filter->levels[0]) return -1;
+    memcpy(filter->levels[0], rows, sizeof(int) * row_count);
+    filter->level_counts[0] = row_count;
+
+    memcpy(pattern, filter->pattern, pattern_len);
+    filter->pattern_len = 0;
+    for (int i = 0; i < pattern_len; i++) {
+        if (filter_push(filter, pattern[i]) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Narrow the previous result by one more pattern byte */
+int filter_push(ListFilter *filter, char c) {
+    char folded[FILTER_MAX_PATTERN * 2 + 1];
+    int level = filter->pattern_len;
+
+    if (level >= FILTER_MAX_PATTERN || !filter->levels[level]) return -1;
+
+    filter->pattern[level] = c;
+    filter->pattern[level + 1] = '\0';
+    filter->pattern_len = level + 1;
+
+    const int *prev = filter->levels[level];
+    int prev_count = filter->level_counts[level];
+    int *next = malloc(sizeof(int) * (prev_count + 1));
+    if (!next) {
+        filter->pattern_len = level;
+        filter->pattern[level] = '\0';
+        return -1;
+    }
+
+    /* A half-typed multi-byte character does not narrow anything yet */
+    int complete = complete_length(filter->pattern, filter->pattern_len);
+    int count = 0;
+    if (complete < filter->pattern_len) {
+        memcpy(next, prev, sizeof(int) * prev_count);
+        count = prev_count;
+    } else {
+        char raw[FILTER_MAX_PATTERN + 1];
+        memcpy(raw, filter->pattern, complete);
+        raw[complete] = '\0';
+        size_t n = utf8_fold(raw, folded, sizeof(folded));
+
+        for (int i = 0; i < prev_count; i++) {
+            int email = prev[i];
+            if (email < 0 || email >= filter->key_count) continue;
+            if (contains(filter->keys + filter->key_offsets[email],
+                         filter->key_lengths[email], folded, n)) {
+                next[count++] = email;
+            }
+        }
+    }
+
+    filter->levels[level + 1] = next;
+    filter->level_counts[level + 1] = count;
+    return 0;
+}
+
+/* Drop the last character (all of its bytes) from the pattern */
+void filter_pop(ListFilter *filter) {
+    while (filter->pattern_len > 0) {
+        int level = filter->pattern_len;
+        unsigned char c = filter->pattern[level - 1];
+
+        free(filter->levels[level]);
+        filter->levels[level] = NULL;
+        filter->level_counts[level] = 0;
+        filter->pattern_len = level - 1;
+        filter->pattern[level - 1] = '\0';
+
+        /* Stop once a character's lead byte is gone */
+        if ((c & 0xC0) != 0x80) break;
+    }
+}
+
+/* Number of emails passing the filter */
+int filter_count(const ListFilter *filter) {
+    return filter->level_counts[filter->pattern_len];
+}
+
+/* Email indices passing the filter, in base list order */
+const int *filter_rows(const ListFilter *filter) {
+    return filter->levels[filter->pattern_len];
+}
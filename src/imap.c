@@ -1,12 +1,18 @@
 #define _POSIX_C_SOURCE 200809L
 #include "imap.h"
+#include "imap_internal.h"
+#include "sasl.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <strings.h>
 
-#define BUFFER_SIZE 8192
+#define SNIPPET_FETCH_LEN 1024   /* Bytes of a text fetched for its snippet */
+#define SNIPPET_FIELDS "HEADER.FIELDS (CONTENT-TYPE CONTENT-TRANSFER-ENCODING)"
+#define HEADER_FIELDS "HEADER.FIELDS (FROM SUBJECT DATE MESSAGE-ID IN-REPLY-TO REFERENCES)"
+#define SEARCH_SET_LEN 4000      /* UID set per SEARCH, well within 8000-octet lines */
 
 /* Base64 decode table */
 static const unsigned char base64_decode_table[256] = {
@@ -24,7 +30,7 @@ static const unsigned char base64_decode_table[256] = {
 };
 
 /* Decode base64 string */
-static int base64_decode(const char *input, int input_len, char *output, int output_size) {
+IMAP_INTERNAL int base64_decode(const char *input, int input_len, char *output, int output_size) {
     int i = 0, j = 0;
     unsigned char buf[4];
     int buf_pos = 0;
@@ -60,7 +66,7 @@ static int base64_decode(const char *input, int input_len, char *output, int out
 }
 
 /* Sanitize text - remove or replace unprintable control characters */
-static void sanitize_text(char *text) {
+IMAP_INTERNAL void sanitize_text(char *text) {
     if (!text) return;
 
     char *src = text;
@@ -125,7 +131,7 @@ static void sanitize_text(char *text) {
 }
 
 /* Decode MIME encoded-words (RFC 2047) - format: =?charset?encoding?encoded-text?= */
-static void decode_mime_header(const char *input, char *output, int output_size) {
+IMAP_INTERNAL void decode_mime_header(const char *input, char *output, int output_size) {
     const char *p = input;
     char *out = output;
     int out_len = 0;
@@ -268,14 +274,289 @@ static void decode_mime_header(const char *input, char *output, int output_size)
     sanitize_text(output);
 }
 
+/* Check whether line is the tagged completion of command tag.
+ * Returns 1 for OK, 0 for NO/BAD, -1 if the line is not that completion. */
+static int imap_tagged_status(const char *line, const char *tag) {
+    size_t tag_len = strlen(tag);
+
+    if (strncmp(line, tag, tag_len) != 0 || line[tag_len] != ' ') {
+        return -1;
+    }
+    return strncmp(line + tag_len + 1, "OK", 2) == 0 ? 1 : 0;
+}
+
+/* Literal size announced at the end of a response line, or -1 */
+static long literal_size(const char *line) {
+    const char *brace = strrchr(line, '{');
+    if (!brace) return -1;
+
+    char *end;
+    long size = strtol(brace + 1, &end, 10);
+    if (end == brace + 1 || *end != '}') return -1;
+    return size;
+}
+
+/* Read a mailbox name (quoted string or atom). Returns pointer past it. */
+static const char *parse_mailbox_name(const char *p, char *name, size_t size) {
+    size_t len = 0;
+
+    while (*p == ' ') p++;
+    if (*p == '"') {
+        for (p++; *p && *p != '"'; p++) {
+            if (*p == '\\' && p[1]) p++;
+            if (len + 1 < size) name[len++] = *p;
+        }
+        if (*p == '"') p++;
+    } else {
+        for (; *p && *p != ' ' && *p != '(' && *p != '\r' && *p != '\n'; p++) {
+            if (len + 1 < size) name[len++] = *p;
+        }
+    }
+    name[len] = '\0';
+    return p;
+}
+
+/* Write name as a quoted string */
+static void quote_mailbox_name(const char *name, char *out, size_t size) {
+    size_t len = 0;
+
+    out[len++] = '"';
+    for (; *name && len + 3 < size; name++) {
+        if (*name == '"' || *name == '\\') out[len++] = '\\';
+        out[len++] = *name;
+    }
+    out[len++] = '"';
+    out[len] = '\0';
+}
+
+static int find_folder(const ImapFolder *folders, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        /* INBOX is case-insensitive, every other name is not */
+        if (strcmp(folders[i].name, name) == 0 ||
+            (strcasecmp(name, "INBOX") == 0 && strcasecmp(folders[i].name, "INBOX") == 0)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Parse a "* STATUS name (MESSAGES n UNSEEN m)" response. Counts that
+ * are not in it are left untouched. Returns 1 if line was one. */
+static int parse_status(const char *line, char *name, size_t size, int *messages, int *unseen) {
+    if (strncmp(line, "* STATUS ", 9) != 0) return 0;
+
+    const char *p = parse_mailbox_name(line + 9, name, size);
+    const char *items = strchr(p, '(');
+    if (!items) return 0;
+
+    const char *value = strstr(items, "MESSAGES ");
+    if (value) *messages = atoi(value + 9);
+    value = strstr(items, "UNSEEN ");
+    if (value) *unseen = atoi(value + 7);
+    return 1;
+}
+
+/* Apply a STATUS response to a folder list */
+static int apply_status(ImapFolder *folders, int count, const char *line) {
+    char name[MAX_MAILBOX_LEN];
+    int messages = -1, unseen = -1;
+
+    if (!parse_status(line, name, sizeof(name), &messages, &unseen)) return 0;
+
+    int i = find_folder(folders, count, name);
+    if (i < 0) return 0;
+
+    if (messages >= 0) folders[i].messages = messages;
+    if (unseen >= 0) folders[i].unseen = unseen;
+    return 1;
+}
+
+/* Parse "* ESEARCH (TAG "A5") UID COUNT 3 MIN 4 MAX 10 ALL 4:6,10" */
+static void parse_esearch(const char *line, ImapSearchSummary *summary) {
+    const char *p = line + 9;
+
+    while (*p) {
+        while (*p == ' ') p++;
+        if (*p == '(') {
+            /* Search correlator */
+            p = strchr(p, ')');
+            if (!p) return;
+            p++;
+            continue;
+        }
+
+        const char *name = p;
+        while (*p && *p != ' ' && *p != '\r' && *p != '\n') p++;
+        size_t name_len = p - name;
+        if (name_len == 0) return;
+        if (name_len == 3 && strncasecmp(name, "UID", 3) == 0) continue;
+
+        while (*p == ' ') p++;
+        const char *value = p;
+        while (*p && *p != ' ' && *p != '\r' && *p != '\n') p++;
+
+        if (name_len == 5 && strncasecmp(name, "COUNT", 5) == 0) {
+            summary->count = atoi(value);
+        } else if (name_len == 3 && strncasecmp(name, "MIN", 3) == 0) {
+            summary->min = strtoul(value, NULL, 10);
+        } else if (name_len == 3 && strncasecmp(name, "MAX", 3) == 0) {
+            summary->max = strtoul(value, NULL, 10);
+        } else if (name_len == 3 && strncasecmp(name, "ALL", 3) == 0) {
+            free(summary->all);
+            summary->all = malloc(p - value + 1);
+            if (summary->all) {
+                memcpy(summary->all, value, p - value);
+                summary->all[p - value] = '\0';
+            }
+        }
+    }
+}
+
+/* Tag correlator of an ESEARCH response, or 0 */
+static int esearch_tag(const char *line) {
+    const char *tag = strstr(line, "(TAG \"A");
+    return tag ? atoi(tag + 7) : 0;
+}
+
+/* Consume replies to pipelined STATUS commands. Without wait, stops as soon
+ * as nothing more has arrived. Returns the number still outstanding. */
+static int imap_status_drain(ImapSession *session, int wait) {
+    char line[BUFFER_SIZE];
+    int replies = 0;
+
+    TRACE_BEGIN(span);
+    while (session->pending_status > 0) {
+        int n = wait ? net_recv_line(&session->conn, line, sizeof(line))
+                     : net_recv_line_nowait(&session->conn, line, sizeof(line));
+        if (n == 0 && !wait) break;
+
+        if (n <= 0) {
+            session->pending_status = 0;
+            return -1;
+        }
+        if (line[0] == 'A' && isdigit((unsigned char)line[1])) {
+            if (atoi(line + 1) == session->check_tag) session->check_tag = 0;
+            session->pending_status--;
+            replies++;
+        } else if (strncmp(line, "* ESEARCH", 9) == 0) {
+            if (session->check_tag && esearch_tag(line) == session->check_tag) {
+                ImapSearchSummary summary = {0, 0, 0, NULL};
+                parse_esearch(line, &summary);
+                session->server_messages = summary.count;
+                session->server_max_uid = summary.max;
+            }
+        } else {
+            apply_status(session->folders, session->folder_count, line);
+        }
+    }
+    if (replies > 0) {
+        TRACE_END(span, "imap", "command", "STATUS %d replies", replies);
+    }
+    return session->pending_status;
+}
+
+/* Keep what fits of the body fetch reply; the rest of a long body is
+ * read and dropped. The buffer grows as the reply comes in. */
+static void body_fetch_append(ImapBodyFetch *fetch, const char *data, size_t len) {
+    if (fetch->len + len + 1 > fetch->capacity && fetch->capacity < IMAP_BODY_RESPONSE_LEN) {
+        size_t capacity = fetch->capacity;
+        while (capacity < fetch->len + len + 1 && capacity < IMAP_BODY_RESPONSE_LEN) capacity *= 2;
+        if (capacity > IMAP_BODY_RESPONSE_LEN) capacity = IMAP_BODY_RESPONSE_LEN;
+
+        char *response = realloc(fetch->response, capacity);
+        if (response) {
+            fetch->response = response;
+            fetch->capacity = capacity;
+        }
+    }
+
+    size_t room = fetch->capacity - 1 - fetch->len;
+    if (len > room) len = room;
+    memcpy(fetch->response + fetch->len, data, len);
+    fetch->len += len;
+    fetch->response[fetch->len] = '\0';
+}
+
+/* Read what has arrived of the body fetch reply, or with wait all of it.
+ * The literal is read by its size, so body lines that look like a tagged
+ * reply cannot end it early. Returns 1 once the reply is complete, 0 while
+ * more is due, -1 if the connection failed. */
+static int imap_body_fetch_read(ImapSession *session, int wait) {
+    ImapBodyFetch *fetch = &session->body_fetch;
+    char line[BUFFER_SIZE];
+    char tag[16];
+
+    snprintf(tag, sizeof(tag), "A%d", fetch->tag);
+    while (fetch->tag) {
+        int n;
+
+        if (fetch->literal > 0) {
+            if (!wait && net_poll_readable(&session->conn, 0) <= 0) return 0;
+
+            int want = fetch->literal < (long)sizeof(line) - 1 ? (int)fetch->literal : (int)sizeof(line) - 1;
+            n = net_recv(&session->conn, line, want + 1);
+            if (n <= 0) break;
+            body_fetch_append(fetch, line, n);
+            fetch->literal -= n;
+            if (fetch->literal == 0) fetch->literal = -1;
+            continue;
+        }
+
+        n = wait ? net_recv_line(&session->conn, line, sizeof(line))
+                 : net_recv_line_nowait(&session->conn, line, sizeof(line));
+        if (n == 0 && !wait) return 0;
+        if (n <= 0) break;
+
+        /* The tagged reply ends it and is not part of the body */
+        int status = imap_tagged_status(line, tag);
+        if (status >= 0) {
+#ifdef CTERM_TRACE
+            trace_record_command("imap", fetch->sent_at, "UID FETCH");
+#endif
+            fetch->tag = 0;
+            if (!fetch->cancelled) fetch->result = status ? 1 : -1;
+            return 1;
+        }
+
+        /* What follows the literal (")" or more items) is protocol */
+        if (fetch->literal < 0) continue;
+
+        body_fetch_append(fetch, line, n);
+        long size = literal_size(line);
+        if (size >= 0) {
+            fetch->body_start = fetch->len;
+            fetch->body_len = size;
+            fetch->literal = size > 0 ? size : -1;
+        }
+    }
+
+    fetch->tag = 0;
+    if (!fetch->cancelled) fetch->result = -1;
+    return -1;
+}
+
+/* Send command bytes. A body fetch still in flight and outstanding STATUS
+ * replies are read first so they never get mixed into the response of
+ * this command. */
+static int imap_write(ImapSession *session, const char *data, int len) {
+    if (session->body_fetch.tag && imap_body_fetch_read(session, 1) < 0) {
+        return -1;
+    }
+    if (session->pending_status > 0 && imap_status_drain(session, 1) < 0) {
+        return -1;
+    }
+    return net_send(&session->conn, data, len);
+}
+
 /* Send IMAP command and get response */
 static int imap_send_command(ImapSession *session, const char *command, char *response, int response_size) {
     char buffer[BUFFER_SIZE];
     int len;
 
     /* Send command */
+    TRACE_BEGIN(span);
     len = snprintf(buffer, sizeof(buffer), "%s\r\n", command);
-    if (net_send(&session->conn, buffer, len) < 0) {
+    if (imap_write(session, buffer, len) < 0) {
         return -1;
     }
 
@@ -300,9 +581,110 @@ static int imap_send_command(ImapSession *session, const char *command, char *re
         }
     }
 
+    TRACE_END_COMMAND(span, "imap", command);
     return total;
 }
 
+/* Remember the capability list from a CAPABILITY response or response code */
+static void imap_store_capabilities(ImapSession *session, const char *response) {
+    const char *start = strstr(response, "[CAPABILITY ");
+    const char *end;
+
+    if (start) {
+        start += 12;
+        end = strchr(start, ']');
+    } else if ((start = strstr(response, "* CAPABILITY ")) != NULL) {
+        start += 13;
+        end = strpbrk(start, "\r\n");
+    } else {
+        return;
+    }
+
+    size_t len = end ? (size_t)(end - start) : strlen(start);
+    if (len >= sizeof(session->capabilities)) {
+        len = sizeof(session->capabilities) - 1;
+    }
+    memcpy(session->capabilities, start, len);
+    session->capabilities[len] = '\0';
+}
+
+/* Where the search index of mailbox is kept. The name is percent-encoded
+ * except for letters, digits, '-' and '_', so every mailbox gets a file of
+ * its own. Returns -1 without a cache, or if the path does not fit. */
+static int imap_index_path(const ImapSession *session, const char *mailbox,
+                           char *path, size_t size) {
+    if (session->cache_dir[0] == '\0' || mailbox[0] == '\0') return -1;
+
+    int len = snprintf(path, size, "%s/", session->cache_dir);
+    if (len < 0 || (size_t)len >= size) return -1;
+
+    for (const unsigned char *p = (const unsigned char *)mailbox; *p; p++) {
+        if ((size_t)len + 3 + 5 > size) return -1;   /* Room for %XX and ".idx" */
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+            (*p >= '0' && *p <= '9') || *p == '-' || *p == '_') {
+            path[len++] = *p;
+        } else {
+            len += snprintf(path + len, size - len, "%%%02X", *p);
+        }
+    }
+    strcpy(path + len, ".idx");
+    return 0;
+}
+
+static void imap_save_index(const ImapSession *session, const char *mailbox, SearchIndex *index) {
+    char path[1024];
+
+    if (imap_index_path(session, mailbox, path, sizeof(path)) == 0) {
+        search_save(index, path);
+    }
+}
+
+/* Load the open mailbox's index; without a saved one it starts empty */
+static void imap_load_index(ImapSession *session) {
+    char path[1024];
+
+    if (imap_index_path(session, session->mailbox, path, sizeof(path)) == 0) {
+        search_load(&session->search, path, session->uidvalidity);
+    } else {
+        search_free(&session->search);
+        session->search.uidvalidity = session->uidvalidity;
+    }
+}
+
+static void init_folder(ImapFolder *folder, const char *name, int noselect) {
+    memset(folder, 0, sizeof(ImapFolder));
+    snprintf(folder->name, sizeof(folder->name), "%s", name);
+    folder->noselect = noselect;
+    folder->messages = -1;
+    thread_init(&folder->threads);
+    search_init(&folder->search);
+}
+
+/* Save and release a folder's parked message index */
+static void free_folder(const ImapSession *session, ImapFolder *folder) {
+    if (folder->loaded) {
+        imap_save_index(session, folder->name, &folder->search);
+    }
+    free(folder->emails);
+    folder->emails = NULL;
+    folder->email_count = 0;
+    folder->email_capacity = 0;
+    folder->loaded = 0;
+    thread_free(&folder->threads);
+    search_free(&folder->search);
+}
+
+/* Set the directory for per-mailbox search indices */
+void imap_set_cache_dir(ImapSession *session, const char *dir) {
+    strncpy(session->cache_dir, dir, sizeof(session->cache_dir) - 1);
+    session->cache_dir[sizeof(session->cache_dir) - 1] = '\0';
+
+    size_t len = strlen(session->cache_dir);
+    while (len > 1 && session->cache_dir[len - 1] == '/') {
+        session->cache_dir[--len] = '\0';
+    }
+}
+
 /* Connect to IMAP server */
 int imap_connect(ImapSession *session, const char *host, int port, int use_ssl) {
     char response[BUFFER_SIZE];
@@ -312,35 +694,176 @@ int imap_connect(ImapSession *session, const char *host, int port, int use_ssl)
     session->emails = NULL;
     session->email_count = 0;
     session->email_capacity = 0;
+    session->capabilities[0] = '\0';
+    session->cache_dir[0] = '\0';
+    session->folders = NULL;
+    session->folder_count = 0;
+    session->current_folder = -1;
+    session->pending_status = 0;
+    session->check_tag = 0;
+    session->server_messages = -1;
+    session->server_max_uid = 0;
+    session->body_fetch.tag = 0;
+    session->body_fetch.result = 0;
+    session->body_fetch.response = NULL;
+    session->body_fetch.len = 0;
+    session->body_fetch.capacity = 0;
+    session->mailbox[0] = '\0';
+    session->selected[0] = '\0';
+    session->uidvalidity = 0;
+    thread_init(&session->threads);
+    search_init(&session->search);
 
     if (net_connect(host, port, use_ssl, &session->conn) < 0) {
         return -1;
     }
 
-    /* Read greeting */
+    /* Read greeting, which often advertises capabilities already */
     net_recv_line(&session->conn, response, sizeof(response));
+    imap_store_capabilities(session, response);
 
     return 0;
 }
 
-/* Login to IMAP server */
-int imap_login(ImapSession *session, const char *username, const char *password) {
+/* AUTHENTICATE with an initial response. With SASL-IR it goes on the
+ * command line and the exchange takes one round trip; otherwise it is
+ * sent on the server's "+" continuation. A second "+" after the response
+ * carries token error details and is answered with an empty line. */
+static int imap_authenticate(ImapSession *session, SaslMechanism mechanism, const char *initial) {
+    char tag[16];
+    char line[BUFFER_SIZE];
+    int sent = imap_has_capability(session, "SASL-IR");
+
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    int len = sent ? snprintf(line, sizeof(line), "%s AUTHENTICATE %s %s\r\n",
+                              tag, sasl_mechanism_name(mechanism), initial)
+                   : snprintf(line, sizeof(line), "%s AUTHENTICATE %s\r\n",
+                              tag, sasl_mechanism_name(mechanism));
+    if (len < 0 || len >= (int)sizeof(line) || imap_write(session, line, len) < 0) {
+        return -1;
+    }
+
+    /* Capabilities usually change; the reply says whether it has them */
+    session->capabilities[0] = '\0';
+
+    for (;;) {
+        if (net_recv_line(&session->conn, line, sizeof(line)) <= 0) return -1;
+
+        if (line[0] == '+') {
+            const char *reply = sent ? "" : initial;
+            sent = 1;
+            if (net_send(&session->conn, reply, strlen(reply)) < 0 ||
+                net_send(&session->conn, "\r\n", 2) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        int status = imap_tagged_status(line, tag);
+        if (status < 0) {
+            imap_store_capabilities(session, line);
+            continue;
+        }
+        if (status == 0) {
+            fprintf(stderr, "IMAP AUTHENTICATE %s failed: %s", sasl_mechanism_name(mechanism), line);
+            return -1;
+        }
+        imap_store_capabilities(session, line);
+        return 0;
+    }
+}
+
+/* Login to IMAP server. With a token, XOAUTH2 or OAUTHBEARER is used;
+ * otherwise AUTHENTICATE PLAIN if offered, else the LOGIN command. */
+int imap_login(ImapSession *session, const char *username, const char *password,
+               const char *token) {
     char command[512];
     char response[BUFFER_SIZE];
+    char initial[SASL_MAX_RESPONSE];
+    int use_token = token && token[0];
 
-    snprintf(command, sizeof(command), "A%d LOGIN %s %s",
-             session->tag_counter++, username, password);
+    /* The mechanism is chosen from the capabilities; most greetings
+     * carry them, so this rarely costs a round trip */
+    if (!session->capabilities[0]) {
+        imap_fetch_capabilities(session);
+    }
 
-    if (imap_send_command(session, command, response, sizeof(response)) < 0) {
+    SaslMechanism mechanism = sasl_choose(session->capabilities, "AUTH=", use_token);
+    if (mechanism == SASL_NONE && use_token) {
+        fprintf(stderr, "IMAP server offers no OAuth mechanism\n");
         return -1;
     }
 
-    if (strstr(response, "OK") == NULL) {
-        fprintf(stderr, "IMAP login failed\n");
-        return -1;
+    if (mechanism != SASL_NONE) {
+        if (sasl_initial_response(mechanism, username, use_token ? token : password,
+                                  initial, sizeof(initial)) < 0) {
+            return -1;
+        }
+        TRACE_BEGIN(span);
+        int authenticated = imap_authenticate(session, mechanism, initial);
+        TRACE_END(span, "imap", "command", "AUTHENTICATE %s", sasl_mechanism_name(mechanism));
+        if (authenticated < 0) {
+            return -1;
+        }
+    } else {
+        if (imap_has_capability(session, "LOGINDISABLED")) {
+            fprintf(stderr, "IMAP server allows no login on this connection\n");
+            return -1;
+        }
+
+        snprintf(command, sizeof(command), "A%d LOGIN %s %s",
+                 session->tag_counter++, username, password);
+
+        if (imap_send_command(session, command, response, sizeof(response)) < 0) {
+            return -1;
+        }
+
+        if (strstr(response, "OK") == NULL) {
+            fprintf(stderr, "IMAP login failed\n");
+            return -1;
+        }
+
+        session->capabilities[0] = '\0';
+        imap_store_capabilities(session, response);
     }
 
     session->logged_in = 1;
+
+    /* Capabilities may change after login */
+    if (!session->capabilities[0]) {
+        imap_fetch_capabilities(session);
+    }
+
+    return 0;
+}
+
+/* Ask the server for its capability list */
+int imap_fetch_capabilities(ImapSession *session) {
+    char command[128];
+    char response[BUFFER_SIZE];
+
+    snprintf(command, sizeof(command), "A%d CAPABILITY", session->tag_counter++);
+
+    if (imap_send_command(session, command, response, sizeof(response)) < 0) {
+        return -1;
+    }
+
+    imap_store_capabilities(session, response);
+    return 0;
+}
+
+/* Check for a capability token such as "THREAD=REFERENCES" */
+int imap_has_capability(const ImapSession *session, const char *name) {
+    size_t len = strlen(name);
+    const char *p = session->capabilities;
+
+    while (*p) {
+        while (*p == ' ') p++;
+        if (strncasecmp(p, name, len) == 0 && (p[len] == ' ' || p[len] == '\0')) {
+            return 1;
+        }
+        while (*p && *p != ' ') p++;
+    }
     return 0;
 }
 
@@ -355,232 +878,1326 @@ void imap_disconnect(ImapSession *session) {
     }
 
     net_disconnect(&session->conn);
+
+    /* Keep what was indexed in every folder visited this session */
+    imap_save_index(session, session->mailbox, &session->search);
+    for (int i = 0; i < session->folder_count; i++) {
+        free_folder(session, &session->folders[i]);
+    }
+    free(session->folders);
+    session->folders = NULL;
+    session->folder_count = 0;
+
     imap_free_emails(session);
+    thread_free(&session->threads);
+    search_free(&session->search);
+    free(session->body_fetch.response);
+    session->body_fetch.response = NULL;
+    session->body_fetch.capacity = 0;
 }
 
-/* Select mailbox (e.g., INBOX) */
-int imap_select_mailbox(ImapSession *session, const char *mailbox) {
-    char command[256];
+/* Ask the server to select a mailbox */
+static int imap_send_select(ImapSession *session, const char *mailbox) {
+    char quoted[MAX_MAILBOX_LEN * 2 + 3];
+    char command[MAX_MAILBOX_LEN * 2 + 32];
+    char tag[16];
     char response[BUFFER_SIZE];
 
-    snprintf(command, sizeof(command), "A%d SELECT %s", session->tag_counter++, mailbox);
+    quote_mailbox_name(mailbox, quoted, sizeof(quoted));
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    snprintf(command, sizeof(command), "%s SELECT %s", tag, quoted);
+
+    /* A failed SELECT leaves no mailbox selected */
+    session->selected[0] = '\0';
 
     if (imap_send_command(session, command, response, sizeof(response)) < 0) {
         return -1;
     }
 
-    if (strstr(response, "OK") == NULL) {
+    const char *tagged = strstr(response, tag);
+    if (!tagged || imap_tagged_status(tagged, tag) != 1) {
         fprintf(stderr, "IMAP select mailbox failed\n");
         return -1;
     }
 
+    /* UIDs are only meaningful together with UIDVALIDITY */
+    const char *validity = strstr(response, "[UIDVALIDITY ");
+    session->uidvalidity = validity ? strtoul(validity + 13, NULL, 10) : 0;
+
+    strncpy(session->selected, mailbox, sizeof(session->selected) - 1);
+    session->selected[sizeof(session->selected) - 1] = '\0';
+    return 0;
+}
+
+/* Select mailbox (e.g., INBOX) and make it the open one */
+int imap_select_mailbox(ImapSession *session, const char *mailbox) {
+    if (imap_send_select(session, mailbox) < 0) {
+        return -1;
+    }
+
+    if (strcmp(session->mailbox, mailbox) != 0 ||
+        session->search.uidvalidity != session->uidvalidity) {
+        imap_save_index(session, session->mailbox, &session->search);
+        strncpy(session->mailbox, mailbox, sizeof(session->mailbox) - 1);
+        session->mailbox[sizeof(session->mailbox) - 1] = '\0';
+        imap_load_index(session);
+    }
+    session->current_folder = find_folder(session->folders, session->folder_count, mailbox);
+
+    return 0;
+}
+
+/* Re-select the open mailbox if the server has another one selected.
+ * Returns 1 if the mailbox changed UIDVALIDITY meanwhile: the old message
+ * index is dropped then, since its UIDs now mean different messages. */
+static int imap_ensure_selected(ImapSession *session) {
+    unsigned int validity = session->uidvalidity;
+
+    if (session->mailbox[0] == '\0' || strcmp(session->selected, session->mailbox) == 0) {
+        return 0;
+    }
+    if (imap_send_select(session, session->mailbox) < 0) {
+        return -1;
+    }
+    if (session->uidvalidity != validity) {
+        imap_free_emails(session);
+        search_free(&session->search);
+        imap_load_index(session);
+        return 1;
+    }
     return 0;
 }
 
 /* Parse email header from FETCH response */
-static void parse_email_header(const char *data, Email *email) {
+IMAP_INTERNAL void parse_email_header(const char *data, Email *email, ThreadHeaders *refs) {
     char *line, *saveptr;
     char buffer[BUFFER_SIZE];
     char temp_header[BUFFER_SIZE];
 
+    TRACE_BEGIN(span);
     strncpy(buffer, data, sizeof(buffer) - 1);
     buffer[sizeof(buffer) - 1] = '\0';
 
     line = strtok_r(buffer, "\r\n", &saveptr);
     while (line != NULL) {
-        if (strncasecmp(line, "Subject:", 8) == 0) {
-            /* Collect full subject (may span multiple lines) */
-            strncpy(temp_header, line + 9, sizeof(temp_header) - 1);
-            temp_header[sizeof(temp_header) - 1] = '\0';
-
-            /* Check for continuation lines (start with space or tab) */
-            char *next_line = strtok_r(NULL, "\r\n", &saveptr);
-            while (next_line && (next_line[0] == ' ' || next_line[0] == '\t')) {
-                /* Append continuation line, removing leading whitespace */
-                strncat(temp_header, next_line, sizeof(temp_header) - strlen(temp_header) - 1);
-                next_line = strtok_r(NULL, "\r\n", &saveptr);
-            }
-
-            /* Decode MIME header and store */
-            decode_mime_header(temp_header, email->subject, MAX_SUBJECT_LEN);
-            email->subject[MAX_SUBJECT_LEN - 1] = '\0';
+        /* Collect the full header (may span multiple lines) */
+        strncpy(temp_header, line, sizeof(temp_header) - 1);
+        temp_header[sizeof(temp_header) - 1] = '\0';
+
+        /* Check for continuation lines (start with space or tab) */
+        char *next_line = strtok_r(NULL, "\r\n", &saveptr);
+        while (next_line && (next_line[0] == ' ' || next_line[0] == '\t')) {
+            strncat(temp_header, next_line, sizeof(temp_header) - strlen(temp_header) - 1);
+            next_line = strtok_r(NULL, "\r\n", &saveptr);
+        }
 
-            /* Continue from the line we just read */
-            line = next_line;
-            continue;
-        } else if (strncasecmp(line, "From:", 5) == 0) {
-            strncpy(temp_header, line + 6, sizeof(temp_header) - 1);
-            temp_header[sizeof(temp_header) - 1] = '\0';
-            decode_mime_header(temp_header, email->from, MAX_FROM_LEN);
-            email->from[MAX_FROM_LEN - 1] = '\0';
-        } else if (strncasecmp(line, "Date:", 5) == 0) {
-            strncpy(email->date, line + 6, sizeof(email->date) - 1);
-            email->date[sizeof(email->date) - 1] = '\0';
+        /* Value starts after the colon and any whitespace */
+        char *value = strchr(temp_header, ':');
+        if (value) {
+            value++;
+            while (*value == ' ' || *value == '\t') value++;
+
+            if (strncasecmp(temp_header, "Subject:", 8) == 0) {
+                /* Decode MIME header and store */
+                decode_mime_header(value, email->subject, MAX_SUBJECT_LEN);
+                email->subject[MAX_SUBJECT_LEN - 1] = '\0';
+            } else if (strncasecmp(temp_header, "From:", 5) == 0) {
+                decode_mime_header(value, email->from, MAX_FROM_LEN);
+                email->from[MAX_FROM_LEN - 1] = '\0';
+            } else if (strncasecmp(temp_header, "Date:", 5) == 0) {
+                strncpy(email->date, value, sizeof(email->date) - 1);
+                email->date[sizeof(email->date) - 1] = '\0';
+            } else if (strncasecmp(temp_header, "Message-ID:", 11) == 0) {
+                strncpy(email->message_id, value, sizeof(email->message_id) - 1);
+                email->message_id[sizeof(email->message_id) - 1] = '\0';
+            } else if (refs && strncasecmp(temp_header, "In-Reply-To:", 12) == 0) {
+                strncpy(refs->in_reply_to, value, sizeof(refs->in_reply_to) - 1);
+                refs->in_reply_to[sizeof(refs->in_reply_to) - 1] = '\0';
+            } else if (refs && strncasecmp(temp_header, "References:", 11) == 0) {
+                strncpy(refs->references, value, sizeof(refs->references) - 1);
+                refs->references[sizeof(refs->references) - 1] = '\0';
+            }
         }
-        line = strtok_r(NULL, "\r\n", &saveptr);
+
+        /* Continue from the line we just read */
+        line = next_line;
     }
+    TRACE_END(span, "parse", "header", NULL);
 }
 
-/* Fetch list of emails from current mailbox */
-int imap_fetch_emails(ImapSession *session) {
-    char command[256];
-    char response[BUFFER_SIZE * 4];
-    char *line, *saveptr;
+/* Read an IMAP literal of size bytes. Up to buffer_size - 1 bytes are kept,
+ * the rest is read and discarded. Returns bytes kept or -1. */
+static int imap_read_literal(ImapSession *session, long size, char *buffer, int buffer_size) {
+    char discard[BUFFER_SIZE];
+    int kept = 0;
 
-    /* Free previous emails */
-    imap_free_emails(session);
+    while (size > 0) {
+        int room = buffer_size - 1 - kept;
+        char *dst = room > 0 ? buffer + kept : discard;
+        int want = room > 0 ? room : (int)sizeof(discard) - 1;
+        if (want > size) want = (int)size;
 
-    /* Fetch email headers */
-    snprintf(command, sizeof(command),
-             "A%d FETCH 1:* (UID FLAGS BODY.PEEK[HEADER.FIELDS (FROM SUBJECT DATE)])",
-             session->tag_counter++);
+        int n = net_recv(&session->conn, dst, want + 1);
+        if (n <= 0) return -1;
 
-    if (imap_send_command(session, command, response, sizeof(response)) < 0) {
-        return -1;
+        if (room > 0) kept += n;
+        size -= n;
     }
 
-    /* Parse response */
-    session->email_capacity = 10;
-    session->emails = malloc(sizeof(Email) * session->email_capacity);
-    session->email_count = 0;
-
-    line = strtok_r(response, "\n", &saveptr);
-    while (line != NULL) {
-        /* Look for FETCH responses */
-        if (strstr(line, "FETCH")) {
-            if (session->email_count >= session->email_capacity) {
-                session->email_capacity *= 2;
-                session->emails = realloc(session->emails, sizeof(Email) * session->email_capacity);
-            }
-
-            Email *email = &session->emails[session->email_count];
-            memset(email, 0, sizeof(Email));
+    buffer[kept] = '\0';
+    return kept;
+}
 
-            /* Extract UID */
-            char *uid_str = strstr(line, "UID ");
-            if (uid_str) {
-                email->uid = atoi(uid_str + 4);
-            }
+/* Parse UID and FLAGS items from a FETCH response fragment */
+static void parse_fetch_items(const char *text, Email *email) {
+    const char *uid_str = strstr(text, "UID ");
+    if (uid_str) {
+        email->uid = strtoul(uid_str + 4, NULL, 10);
+    }
 
-            /* Check FLAGS for \Seen */
-            if (strstr(line, "\\Seen")) {
-                email->seen = 1;
-            }
+    const char *flags = strstr(text, "FLAGS (");
+    if (flags) {
+        const char *end = strchr(flags, ')');
+        const char *seen = strstr(flags, "\\Seen");
+        const char *deleted = strstr(flags, "\\Deleted");
+        if (seen && (!end || seen < end)) email->seen = 1;
+        if (deleted && (!end || deleted < end)) email->deleted = 1;
+    }
+}
 
-            /* Parse headers */
-            char header_buffer[BUFFER_SIZE] = {0};
-            int header_len = 0;
+/* One line of display text from the start of a message text: quoted
+ * lines dropped, tags skipped in HTML, white space collapsed. A character
+ * cut off at the end is dropped by sanitize_text. */
+static void snippet_clean(const char *text, size_t len, int html, char *snippet, size_t size) {
+    size_t out = 0;
+    int line_start = 1, quoted = 0, in_tag = 0, space = 0;
 
-            /* Collect header lines */
-            line = strtok_r(NULL, "\n", &saveptr);
-            while (line != NULL) {
-                if (strstr(line, ")") && strlen(line) < 5) break; /* End of headers */
+    for (size_t i = 0; i < len && out + 2 < size; i++) {
+        char c = text[i];
 
-                if (header_len + strlen(line) < sizeof(header_buffer) - 2) {
-                    strcat(header_buffer, line);
-                    strcat(header_buffer, "\r\n");
-                    header_len += strlen(line) + 2;
-                }
+        if (c == '\r' || c == '\n') {
+            line_start = 1;
+            quoted = 0;
+            space = out > 0;
+            continue;
+        }
+        if (line_start) {
+            line_start = 0;
+            quoted = c == '>';
+        }
+        if (quoted) continue;
+        if (html && c == '<') in_tag = 1;
+        if (in_tag) {
+            if (c == '>') in_tag = 0;
+            space = out > 0;
+            continue;
+        }
+        if (c == ' ' || c == '\t') {
+            space = out > 0;
+            continue;
+        }
+        if (space) snippet[out++] = ' ';
+        space = 0;
+        snippet[out++] = c;
+    }
+    snippet[out] = '\0';
+    sanitize_text(snippet);
+}
 
-                line = strtok_r(NULL, "\n", &saveptr);
-            }
+/* Decode quoted-printable in place; an escape cut off at the end is
+ * dropped. Returns the new length. */
+static size_t snippet_unquote(char *text, size_t len) {
+    size_t out = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] != '=') {
+            text[out++] = text[i];
+        } else if (i + 2 < len && text[i + 1] == '\r' && text[i + 2] == '\n') {
+            i += 2;             /* Soft line break */
+        } else if (i + 2 < len && isxdigit((unsigned char)text[i + 1]) &&
+                   isxdigit((unsigned char)text[i + 2])) {
+            char hex[3] = { text[i + 1], text[i + 2], '\0' };
+            text[out++] = (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else if (i + 2 >= len) {
+            break;
+        } else {
+            text[out++] = '=';
+        }
+    }
+    return out;
+}
 
-            parse_email_header(header_buffer, email);
+/* Does header field name contain value? Both are compared ignoring case. */
+static int mime_field_has(const char *header, const char *end, const char *name, const char *value) {
+    size_t name_len = strlen(name), value_len = strlen(value);
 
-            /* Default values if parsing failed */
-            if (strlen(email->subject) == 0) {
-                strcpy(email->subject, "(No subject)");
-            }
-            if (strlen(email->from) == 0) {
-                strcpy(email->from, "(Unknown)");
-            }
+    for (const char *p = header; p + name_len <= end; p++) {
+        if ((p != header && p[-1] != '\n') || strncasecmp(p, name, name_len) != 0) continue;
 
-            session->email_count++;
-            continue;
+        /* The field runs on over continuation lines */
+        for (p += name_len; p + value_len <= end; p++) {
+            if (p[0] == '\n' && p + 1 < end && p[1] != ' ' && p[1] != '\t') return 0;
+            if (strncasecmp(p, value, value_len) == 0) return 1;
         }
-
-        line = strtok_r(NULL, "\n", &saveptr);
+        return 0;
     }
-
-    return session->email_count;
+    return 0;
 }
 
-/* Fetch email body */
-int imap_fetch_email_body(ImapSession *session, unsigned int uid, Email *email) {
-    char command[256];
-    char response[BUFFER_SIZE * 2];
-    char *body_start, *body_end;
+/* Next occurrence of text between p and end, or NULL */
+static const char *find_text(const char *p, const char *end, const char *text) {
+    size_t len = strlen(text);
 
-    snprintf(command, sizeof(command),
-             "A%d UID FETCH %u BODY[TEXT]",
-             session->tag_counter++, uid);
+    for (; p + len <= end; p++) {
+        if (memcmp(p, text, len) == 0) return p;
+    }
+    return NULL;
+}
 
-    if (imap_send_command(session, command, response, sizeof(response)) < 0) {
-        return -1;
+/* Snippet from the start of a message text (BODY[TEXT]) and the message's
+ * Content-Type and Content-Transfer-Encoding fields. Multiparts are
+ * entered through their first part until a leaf; a part that is not text
+ * gives an empty snippet. */
+static void make_snippet(const char *header, size_t header_len, const char *text, size_t len,
+                         char *snippet, size_t size) {
+    char decoded[SNIPPET_FETCH_LEN + 1];
+    const char *end = text + len;
+    const char *mime = header, *mime_end = header + header_len;
+
+    snippet[0] = '\0';
+    for (int depth = 0; mime_field_has(mime, mime_end, "Content-Type:", "multipart/"); depth++) {
+        /* The first part's header runs from its boundary line to the empty line */
+        const char *boundary = len >= 2 && text[0] == '-' && text[1] == '-' ? text :
+                               find_text(text, end, "\n--");
+        const char *part = boundary ? find_text(boundary + 1, end, "\n") : NULL;
+        const char *body = part ? find_text(part, end, "\r\n\r\n") : NULL;
+        if (depth == 4 || !body) return;
+
+        mime = part;
+        mime_end = body + 2;
+        text = body + 4;
+        len = end - text;
+    }
+    /* No Content-Type at all is plain text */
+    if (mime_field_has(mime, mime_end, "Content-Type:", "/") &&
+        !mime_field_has(mime, mime_end, "Content-Type:", "text/")) {
+        return;
     }
 
-    /* Find body start - look for the opening brace and skip IMAP protocol data */
-    body_start = strstr(response, "BODY[TEXT] {");
-    if (body_start) {
-        /* Skip to after the {size} and the following \r\n */
-        body_start = strchr(body_start, '\n');
-        if (body_start) {
-            body_start++; /* Skip the \n */
-        }
+    if (len > SNIPPET_FETCH_LEN) len = SNIPPET_FETCH_LEN;
+    if (mime_field_has(mime, mime_end, "Content-Transfer-Encoding:", "base64")) {
+        /* Whole groups only; a line break may fall anywhere */
+        len = (size_t)base64_decode(text, (int)len, decoded, sizeof(decoded));
     } else {
-        /* Try alternative format */
-        body_start = strstr(response, "\r\n\r\n");
-        if (body_start) {
-            body_start += 4;
+        memcpy(decoded, text, len);
+        if (mime_field_has(mime, mime_end, "Content-Transfer-Encoding:", "quoted-printable")) {
+            len = snippet_unquote(decoded, len);
         }
     }
+    snippet_clean(decoded, len, mime_field_has(mime, mime_end, "Content-Type:", "text/html"),
+                  snippet, size);
+}
 
-    if (body_start) {
-        strncpy(email->body, body_start, MAX_BODY_LEN - 1);
-        email->body[MAX_BODY_LEN - 1] = '\0';
+/* Take a quoted PREVIEW item out of a FETCH response fragment, blanking it
+ * so its text is not mistaken for other items. NIL is an empty preview. */
+static void parse_preview(char *text, Email *email) {
+    char *item = strstr(text, "PREVIEW ");
+    char value[MAX_SNIPPET_LEN * 4];
+    size_t len = 0;
+
+    if (!item) return;
+    char *p = item + 8;
+    if (strncmp(p, "NIL", 3) == 0) {
+        email->snippet[0] = '\0';
+        email->previewed = 1;
+        memset(item, ' ', 11);
+        return;
+    }
+    if (*p != '"') return;
 
-        /* Remove trailing IMAP protocol markers */
-        /* Remove trailing )\r\n or ) */
-        body_end = email->body + strlen(email->body) - 1;
-        while (body_end > email->body && (*body_end == ')' || *body_end == '\r' || *body_end == '\n' || *body_end == ' ')) {
-            *body_end = '\0';
-            body_end--;
-        }
+    for (p++; *p && *p != '"'; p++) {
+        if (*p == '\\' && p[1]) p++;
+        if (len < sizeof(value) - 1) value[len++] = *p;
+    }
+    if (*p == '"') p++;
+    memset(item, ' ', p - item);
+    snippet_clean(value, len, 0, email->snippet, sizeof(email->snippet));
+    email->previewed = 1;
+}
 
-        /* Remove any leading whitespace */
-        char *start = email->body;
-        while (*start == ' ' || *start == '\t' || *start == '\r' || *start == '\n') {
-            start++;
-        }
-        if (start != email->body) {
-            memmove(email->body, start, strlen(start) + 1);
-        }
+/* Does the literal at the end of a FETCH response fragment belong to the
+ * item named? */
+static int literal_is(const char *line, const char *item) {
+    const char *brace = strrchr(line, '{');
+    size_t len = strlen(item);
 
-        /* Sanitize the body text */
-        sanitize_text(email->body);
+    while (brace > line && brace[-1] == ' ') brace--;
+    if (brace > line && brace[-1] == '>') {
+        while (brace > line && brace[-1] != '<') brace--;   /* Partial: BODY[TEXT]<0> */
+        if (brace > line) brace--;
+    }
+    return brace - line >= (long)len && strncmp(brace - len, item, len) == 0;
+}
 
-        /* If body is empty after sanitization, mark it */
-        if (strlen(email->body) == 0) {
-            strcpy(email->body, "(Empty message)");
+/* Map a UID to an index in session->emails (emails are kept in UID order) */
+int imap_find_email(const ImapSession *session, unsigned int uid) {
+    int lo = 0, hi = session->email_count - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        unsigned int cur = session->emails[mid].uid;
+        if (cur == uid) return mid;
+        if (cur < uid) lo = mid + 1; else hi = mid - 1;
+    }
+
+    /* Fall back to a scan if the server returned messages out of order */
+    for (int i = 0; i < session->email_count; i++) {
+        if (session->emails[i].uid == uid) return i;
+    }
+    return -1;
+}
+
+/* Replace local threading with the server's THREAD=REFERENCES result.
+ * The response line can be megabytes long, so it is parsed in chunks. */
+static int imap_thread_references(ImapSession *session) {
+    char command[128];
+    char tag[16];
+    char buffer[BUFFER_SIZE];
+    int stack[256];
+    int sp = 0;
+    int last = -1;
+    unsigned int number = 0;
+    int in_number = 0;
+    int in_thread = 0;
+    int at_line_start = 1;
+    int status = -1;
+
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    int len = snprintf(command, sizeof(command), "%s UID THREAD REFERENCES UTF-8 ALL\r\n", tag);
+    if (imap_write(session, command, len) < 0) {
+        return -1;
+    }
+
+    while ((len = net_recv_line(&session->conn, buffer, sizeof(buffer))) > 0) {
+        const char *p = buffer;
+
+        if (at_line_start) {
+            status = imap_tagged_status(buffer, tag);
+            if (status >= 0) break;
+            if (strncmp(buffer, "* THREAD", 8) == 0) {
+                in_thread = 1;
+                p += 8;
+            }
+        }
+
+        for (; in_thread && *p; p++) {
+            if (*p >= '0' && *p <= '9') {
+                number = number * 10 + (*p - '0');
+                in_number = 1;
+                continue;
+            }
+            if (in_number) {
+                int email = imap_find_email(session, number);
+                if (email >= 0) {
+                    thread_link(&session->threads, last, email);
+                    last = email;
+                }
+                number = 0;
+                in_number = 0;
+            }
+            if (*p == '(') {
+                if (sp < (int)(sizeof(stack) / sizeof(stack[0]))) stack[sp] = last;
+                sp++;
+            } else if (*p == ')') {
+                if (sp > 0) sp--;
+                last = sp < (int)(sizeof(stack) / sizeof(stack[0])) ? stack[sp] : -1;
+            }
+        }
+
+        at_line_start = buffer[len - 1] == '\n';
+        if (at_line_start) in_thread = 0;
+    }
+
+    return status == 1 ? 0 : -1;
+}
+
+/* The open folder's counts come from its message index, not from STATUS */
+static void imap_update_folder_counts(ImapSession *session) {
+    if (session->current_folder < 0) return;
+
+    ImapFolder *folder = &session->folders[session->current_folder];
+    folder->messages = session->email_count;
+    folder->unseen = 0;
+    for (int i = 0; i < session->email_count; i++) {
+        if (!session->emails[i].seen) folder->unseen++;
+    }
+}
+
+/* Read the header FETCH responses of command tag, appending each message
+ * to the list and feeding it into the thread index as it arrives.
+ * Messages below min_uid are read and dropped. Returns the tagged status:
+ * 1 for OK, 0 for NO/BAD, -1 if the connection or memory failed. */
+static int imap_read_headers(ImapSession *session, const char *tag, unsigned int min_uid) {
+    char line[BUFFER_SIZE];
+    char header_buffer[BUFFER_SIZE];
+    ThreadHeaders refs;
+    int status = -1;
+
+    while (net_recv_line(&session->conn, line, sizeof(line)) > 0) {
+        status = imap_tagged_status(line, tag);
+        if (status >= 0) break;
+
+        /* Look for FETCH responses */
+        if (line[0] != '*' || !strstr(line, "FETCH")) continue;
+
+        if (session->email_count >= session->email_capacity) {
+            int new_capacity = session->email_capacity ? session->email_capacity * 2 : 10;
+            Email *emails = realloc(session->emails, sizeof(Email) * new_capacity);
+            if (!emails) return -1;
+            session->emails = emails;
+            session->email_capacity = new_capacity;
+        }
+
+        Email *email = &session->emails[session->email_count];
+        memset(email, 0, sizeof(Email));
+        memset(&refs, 0, sizeof(refs));
+        parse_fetch_items(line, email);
+
+        /* Header block arrives as a literal, possibly followed by more items.
+         * Snippets are not asked for here: they cost the server a look into
+         * every body, and only the rows on screen need them. */
+        long size = literal_size(line);
+        if (size >= 0) {
+            if (imap_read_literal(session, size, header_buffer, sizeof(header_buffer)) < 0) {
+                return -1;
+            }
+            if (net_recv_line(&session->conn, line, sizeof(line)) <= 0) {
+                return -1;
+            }
+            parse_fetch_items(line, email);
+            parse_email_header(header_buffer, email, &refs);
+        }
+        if (email->uid < min_uid) continue;
+
+        /* Default values if parsing failed */
+        if (strlen(email->subject) == 0) {
+            strcpy(email->subject, "(No subject)");
+        }
+        if (strlen(email->from) == 0) {
+            strcpy(email->from, "(Unknown)");
+        }
+
+        thread_add(&session->threads, session->email_count,
+                   email->message_id, refs.in_reply_to, refs.references);
+
+        /* Sender and subject go into the local search index */
+        if (!search_has(&session->search, email->uid, SEARCH_DOC_HEADER)) {
+            snprintf(header_buffer, sizeof(header_buffer), "%s %s", email->from, email->subject);
+            search_add(&session->search, email->uid, SEARCH_DOC_HEADER, header_buffer);
+        }
+
+        session->email_count++;
+    }
+
+    return status;
+}
+
+/* Fetch list of emails from current mailbox. FETCH responses are parsed as
+ * they arrive and fed into the thread index one message at a time. */
+int imap_fetch_emails(ImapSession *session) {
+    char command[256];
+    char tag[16];
+    int len;
+
+    if (imap_ensure_selected(session) < 0) {
+        return -1;
+    }
+
+    /* Free previous emails */
+    imap_free_emails(session);
+    session->server_messages = -1;
+
+    /* Fetch email headers */
+    TRACE_BEGIN(span);
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    len = snprintf(command, sizeof(command), "%s FETCH 1:* (UID FLAGS BODY.PEEK[%s])\r\n",
+                   tag, HEADER_FIELDS);
+
+    if (imap_write(session, command, len) < 0) {
+        return -1;
+    }
+
+    int status = imap_read_headers(session, tag, 0);
+    TRACE_END(span, "imap", "command", "FETCH %d headers", session->email_count);
+
+    if (status != 1) {
+        return -1;
+    }
+
+    /* Prefer the server's threading when it can do it for us */
+    if (session->email_count > 0 && imap_has_capability(session, "THREAD=REFERENCES")) {
+        TRACE_BEGIN(thread_span);
+        imap_thread_references(session);
+        TRACE_END(thread_span, "imap", "command", "UID THREAD");
+    }
+
+    imap_update_folder_counts(session);
+    return session->email_count;
+}
+
+/* Fetch the headers of messages that arrived after the last one loaded
+ * and add them to the list and its threads; the rest, snippets included,
+ * is kept. "n:*" takes in the highest UID even if it is below n, so that
+ * one is dropped. Returns the number of messages added. */
+static int imap_fetch_new_emails(ImapSession *session) {
+    char command[256];
+    char tag[16];
+    unsigned int next = session->emails[session->email_count - 1].uid + 1;
+    int before = session->email_count;
+
+    TRACE_BEGIN(span);
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    int len = snprintf(command, sizeof(command), "%s UID FETCH %u:* (UID FLAGS BODY.PEEK[%s])\r\n",
+                       tag, next, HEADER_FIELDS);
+    if (imap_write(session, command, len) < 0) {
+        return -1;
+    }
+
+    int status = imap_read_headers(session, tag, next);
+    TRACE_END(span, "imap", "command", "UID FETCH %d new headers", session->email_count - before);
+
+    session->server_messages = -1;
+    imap_update_folder_counts(session);
+    return status == 1 ? session->email_count - before : -1;
+}
+
+int imap_fetch_snippets(ImapSession *session, const unsigned int *uids, int count) {
+    char command[BUFFER_SIZE];
+    char tag[16];
+    char line[BUFFER_SIZE];
+    char header[BUFFER_SIZE];
+    char text[SNIPPET_FETCH_LEN + 1];
+    int status = -1;
+
+    if (count <= 0) return 0;
+    if (imap_ensure_selected(session) < 0) return -1;
+
+    /* The server's own preview (RFC 8970), or the start of the text and
+     * how it is encoded */
+    int preview = imap_has_capability(session, "PREVIEW");
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    int len = snprintf(command, sizeof(command), "%s UID FETCH ", tag);
+    for (int i = 0; i < count && len < (int)sizeof(command) - 160; i++) {
+        len += snprintf(command + len, sizeof(command) - len, "%s%u", i ? "," : "", uids[i]);
+    }
+    if (preview) {
+        len += snprintf(command + len, sizeof(command) - len, " (UID PREVIEW)\r\n");
+    } else {
+        len += snprintf(command + len, sizeof(command) - len,
+                        " (UID BODY.PEEK[" SNIPPET_FIELDS "] BODY.PEEK[TEXT]<0.%d>)\r\n",
+                        SNIPPET_FETCH_LEN);
+    }
+
+    TRACE_BEGIN(span);
+    if (imap_write(session, command, len) < 0) return -1;
+
+    while (net_recv_line(&session->conn, line, sizeof(line)) > 0) {
+        status = imap_tagged_status(line, tag);
+        if (status >= 0) break;
+        if (line[0] != '*' || !strstr(line, "FETCH")) continue;
+
+        Email email;
+        int header_len = 0, text_len = 0;
+        long size;
+
+        email.uid = 0;
+        email.previewed = 0;
+        for (;;) {
+            parse_preview(line, &email);
+            parse_fetch_items(line, &email);
+            if ((size = literal_size(line)) < 0) break;
+
+            int is_text = literal_is(line, "BODY[TEXT]");
+            int is_preview = literal_is(line, "PREVIEW");
+            int kept = is_text || is_preview ? imap_read_literal(session, size, text, sizeof(text))
+                                             : imap_read_literal(session, size, header, sizeof(header));
+            if (kept < 0 || net_recv_line(&session->conn, line, sizeof(line)) <= 0) return -1;
+            if (is_preview) {
+                snippet_clean(text, kept, 0, email.snippet, sizeof(email.snippet));
+                email.previewed = 1;
+            } else if (is_text) {
+                text_len = kept;
+            } else {
+                header_len = kept;
+            }
+        }
+
+        int index = email.uid ? imap_find_email(session, email.uid) : -1;
+        if (index >= 0) {
+            Email *target = &session->emails[index];
+            if (email.previewed) {
+                memcpy(target->snippet, email.snippet, sizeof(target->snippet));
+            } else {
+                make_snippet(header, header_len, text, text_len, target->snippet, sizeof(target->snippet));
+            }
+            target->previewed = 1;
+        }
+    }
+    TRACE_END(span, "imap", "command", "UID FETCH %d snippets", count);
+
+    /* Messages the server had nothing for are not asked about again */
+    for (int i = 0; i < count; i++) {
+        int index = imap_find_email(session, uids[i]);
+        if (index >= 0) session->emails[index].previewed = 1;
+    }
+    return status == 1 ? 0 : -1;
+}
+
+/* Pull the message text out of a UID FETCH BODY[TEXT] response into body,
+ * sanitized for display. Returns the length kept, 0 if there is none. */
+IMAP_INTERNAL size_t extract_body(const char *response, char *body, size_t size) {
+    const char *body_start;
+    char *body_end;
+
+    TRACE_BEGIN(span);
+    /* Find body start - look for the opening brace and skip IMAP protocol data */
+    body_start = strstr(response, "BODY[TEXT] {");
+    if (body_start) {
+        /* Skip to after the {size} and the following \r\n */
+        body_start = strchr(body_start, '\n');
+        if (body_start) {
+            body_start++; /* Skip the \n */
+        }
+    } else {
+        /* Try alternative format */
+        body_start = strstr(response, "\r\n\r\n");
+        if (body_start) {
+            body_start += 4;
+        }
+    }
+
+    if (!body_start) {
+        body[0] = '\0';
+        return 0;
+    }
+
+    /* Bodies run to megabytes: copy what is there, without padding */
+    size_t copy = strlen(body_start);
+    if (copy > size - 1) copy = size - 1;
+    memcpy(body, body_start, copy);
+    body[copy] = '\0';
+
+    /* Remove trailing IMAP protocol markers */
+    /* Remove trailing )\r\n or ) */
+    body_end = body + copy - 1;
+    while (body_end > body && (*body_end == ')' || *body_end == '\r' || *body_end == '\n' || *body_end == ' ')) {
+        *body_end = '\0';
+        body_end--;
+    }
+
+    /* Remove any leading whitespace */
+    char *start = body;
+    while (*start == ' ' || *start == '\t' || *start == '\r' || *start == '\n') {
+        start++;
+    }
+    if (start != body) {
+        memmove(body, start, strlen(start) + 1);
+    }
+
+    /* Sanitize the body text */
+    sanitize_text(body);
+    size_t len = strlen(body);
+    TRACE_END(span, "parse", "body", "%zu bytes", len);
+    return len;
+}
+
+/* Start fetching a message body; the reply is read by
+ * imap_body_fetch_poll as it arrives. UID FETCH BODY[TEXT] also sets
+ * \Seen on the server, as does its first range. */
+int imap_body_fetch_begin(ImapSession *session, unsigned int uid, size_t offset, size_t length) {
+    ImapBodyFetch *fetch = &session->body_fetch;
+    char command[96];
+    int len;
+
+    if (imap_ensure_selected(session) != 0) {
+        return -1;
+    }
+
+    /* Any fetch still in flight is read to the end by imap_write */
+    if (!fetch->response) {
+        fetch->response = malloc(BUFFER_SIZE);
+        if (!fetch->response) return -1;
+        fetch->capacity = BUFFER_SIZE;
+    }
+
+    int tag = session->tag_counter++;
+    if (length == 0) {
+        len = snprintf(command, sizeof(command), "A%d UID FETCH %u BODY[TEXT]\r\n", tag, uid);
+    } else {
+        len = snprintf(command, sizeof(command), "A%d UID FETCH %u BODY%s[TEXT]<%zu.%zu>\r\n",
+                       tag, uid, offset ? ".PEEK" : "", offset, length);
+    }
+    if (imap_write(session, command, len) < 0) {
+        return -1;
+    }
+
+    fetch->tag = tag;
+    fetch->uid = uid;
+    fetch->offset = offset;
+    fetch->length = length;
+    fetch->cancelled = 0;
+    fetch->result = 0;
+    fetch->literal = 0;
+    fetch->body_len = -1;
+    fetch->len = 0;
+    fetch->response[0] = '\0';
+#ifdef CTERM_TRACE
+    fetch->sent_at = trace_now();
+#endif
+    return 0;
+}
+
+/* Decode a range of a body into body: up to its last line break if more
+ * follows it. Returns the offset of the rest, 0 if there is none. */
+static size_t body_range_collect(ImapBodyFetch *fetch, char *body, size_t size) {
+    const char *data = fetch->response + fetch->body_start;
+    size_t len = fetch->len - fetch->body_start;
+    size_t next = 0;
+
+    if ((long)len > fetch->body_len) len = fetch->body_len;
+    if ((size_t)fetch->body_len >= fetch->length) {
+        /* Full: there may be more. A line longer than the range is cut
+         * at a character boundary instead. */
+        size_t cut = len;
+        while (cut > 0 && data[cut - 1] != '\n') cut--;
+        if (cut == 0) {
+            cut = len;
+            while (cut > 0 && ((unsigned char)data[cut - 1] & 0xC0) == 0x80) cut--;
+            if (cut > 0 && ((unsigned char)data[cut - 1] & 0x80)) cut--;
         }
+        if (cut > 0) {
+            len = cut;
+            next = fetch->offset + cut;
+        }
+    }
+
+    if (len > size - 1) len = size - 1;
+    memcpy(body, data, len);
+    body[len] = '\0';
+    sanitize_text(body);
+    return next;
+}
+
+/* The reply is in: decode the body into body and index it. The first
+ * range set \Seen, so the email is marked seen if it is still listed. */
+static size_t body_fetch_collect(ImapSession *session, char *body, size_t size) {
+    ImapBodyFetch *fetch = &session->body_fetch;
+    size_t next = 0;
+
+    if (fetch->length > 0 && fetch->body_len < 0) {
+        /* A range past the end of the text comes back as NIL or "": the
+         * text is complete, nothing is added to it */
+        body[0] = '\0';
+        if (fetch->offset > 0) return 0;
+    } else if (fetch->length > 0) {
+        next = body_range_collect(fetch, body, size);
+        if (fetch->offset > 0) return next;
+
+        /* Text opens without blank lines, as extract_body leaves it */
+        size_t blank = strspn(body, " \t\r\n");
+        memmove(body, body + blank, strlen(body + blank) + 1);
     } else {
-        /* No body found */
-        strcpy(email->body, "(Empty message)");
+        extract_body(fetch->response, body, size);
+    }
+
+    if (body[0]) {
+        /* A long text is indexed by its first range */
+        search_add(&session->search, fetch->uid, SEARCH_DOC_BODY, body);
+    } else if (!next) {
+        /* No body found, or nothing left after sanitization */
+        snprintf(body, size, "(Empty message)");
+    }
+
+    int index = imap_find_email(session, fetch->uid);
+    if (index >= 0) session->emails[index].seen = 1;
+    return next;
+}
+
+int imap_body_fetch_poll(ImapSession *session, char *body, size_t size, size_t *next) {
+    ImapBodyFetch *fetch = &session->body_fetch;
+
+    if (fetch->tag && imap_body_fetch_read(session, 0) == 0) {
+        return 0;
+    }
+
+    int result = fetch->result;
+    fetch->result = 0;
+    *next = 0;
+    if (result > 0) {
+        *next = body_fetch_collect(session, body, size);
+    }
+    return result ? result : -1;
+}
+
+void imap_body_fetch_cancel(ImapSession *session) {
+    session->body_fetch.cancelled = 1;
+    session->body_fetch.result = 0;
+}
+
+/* Fetch email body */
+int imap_fetch_email_body(ImapSession *session, unsigned int uid, char *body, size_t size) {
+    ImapBodyFetch *fetch = &session->body_fetch;
+
+    if (imap_body_fetch_begin(session, uid, 0, 0) != 0 || imap_body_fetch_read(session, 1) < 0) {
+        fetch->result = 0;
+        return -1;
+    }
+
+    int result = fetch->result;
+    fetch->result = 0;
+    if (result < 0) {
+        return -1;
     }
 
+    body_fetch_collect(session, body, size);
     return 0;
 }
 
+/* Send a command whose last argument is an arbitrary string. ASCII text is
+ * sent quoted; anything else as a literal (non-synchronizing with LITERAL+). */
+static int imap_send_with_string(ImapSession *session, const char *prefix, const char *arg) {
+    char line[BUFFER_SIZE];
+    size_t prefix_len = strlen(prefix), arg_len = strlen(arg);
+    size_t size = prefix_len + 2 * arg_len + 32;    /* Every character escaped, and framing */
+    int plain = 1;
+    int result = -1;
+
+    for (const unsigned char *p = (const unsigned char *)arg; *p; p++) {
+        if (*p >= 0x80 || *p == '\r' || *p == '\n') plain = 0;
+    }
+
+    char *buffer = malloc(size);
+    if (!buffer) return -1;
+    memcpy(buffer, prefix, prefix_len);
+    size_t len = prefix_len;
+
+    if (plain) {
+        buffer[len++] = ' ';
+        buffer[len++] = '"';
+        for (const char *p = arg; *p; p++) {
+            if (*p == '"' || *p == '\\') buffer[len++] = '\\';
+            buffer[len++] = *p;
+        }
+        memcpy(buffer + len, "\"\r\n", 3);
+        result = imap_write(session, buffer, (int)(len + 3)) < 0 ? -1 : 0;
+        free(buffer);
+        return result;
+    }
+
+    int literal_plus = imap_has_capability(session, "LITERAL+");
+    int n = snprintf(buffer + len, size - len, " {%zu%s}\r\n", arg_len, literal_plus ? "+" : "");
+    if (n > 0 && (size_t)n < size - len) {
+        result = imap_write(session, buffer, (int)(len + n));
+    }
+    free(buffer);
+    if (result < 0) {
+        return -1;
+    }
+
+    if (!literal_plus) {
+        /* Wait for the continuation request before sending the literal */
+        if (net_recv_line(&session->conn, line, sizeof(line)) <= 0 || line[0] != '+') {
+            return -1;
+        }
+    }
+
+    if (imap_write(session, arg, (int)arg_len) < 0 || imap_write(session, "\r\n", 2) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Append a UID to a growing array */
+static int push_uid(unsigned int **uids, int *count, int *capacity, unsigned int uid) {
+    if (*count >= *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 64;
+        unsigned int *grown = realloc(*uids, sizeof(unsigned int) * new_capacity);
+        if (!grown) return -1;
+        *uids = grown;
+        *capacity = new_capacity;
+    }
+    (*uids)[(*count)++] = uid;
+    return 0;
+}
+
+/* One UID SEARCH over a sequence set; hits are added to *uids */
+static int imap_search_set(ImapSession *session, const char *set, const char *text,
+                           unsigned int **uids, int *count, int *capacity) {
+    char tag[16];
+    char command[SEARCH_SET_LEN + 64];
+    char buffer[BUFFER_SIZE];
+    int status = -1;
+    int len;
+
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    len = snprintf(command, sizeof(command), "%s UID SEARCH CHARSET UTF-8 UID %s TEXT", tag, set);
+    if (len < 0 || len >= (int)sizeof(command)) {
+        return -1;
+    }
+
+    TRACE_BEGIN(span);
+    if (imap_send_with_string(session, command, text) < 0) {
+        return -1;
+    }
+
+    /* "* SEARCH" can be very long, so numbers are parsed chunk by chunk */
+    int at_line_start = 1;
+    int in_search = 0;
+    unsigned int number = 0;
+    int in_number = 0;
+    while ((len = net_recv_line(&session->conn, buffer, sizeof(buffer))) > 0) {
+        const char *p = buffer;
+
+        if (at_line_start) {
+            status = imap_tagged_status(buffer, tag);
+            if (status >= 0) break;
+            if (strncmp(buffer, "* SEARCH", 8) == 0) {
+                in_search = 1;
+                p += 8;
+            }
+        }
+
+        for (; in_search && *p; p++) {
+            if (*p >= '0' && *p <= '9') {
+                number = number * 10 + (*p - '0');
+                in_number = 1;
+            } else if (in_number) {
+                push_uid(uids, count, capacity, number);
+                number = 0;
+                in_number = 0;
+            }
+        }
+
+        at_line_start = buffer[len - 1] == '\n';
+        if (at_line_start) in_search = 0;
+    }
+    TRACE_END(span, "imap", "command", "UID SEARCH %d hits", *count);
+
+    return status == 1 ? 0 : -1;
+}
+
+/* Server-side text search over messages whose bodies are not in the local
+ * index yet. Returns match count and a malloc'd UID array in *uids. A
+ * sequence set longer than SEARCH_SET_LEN is split over several commands. */
+int imap_search_text(ImapSession *session, const char *text, unsigned int **uids) {
+    char set[SEARCH_SET_LEN + 32];
+    size_t set_len = 0;
+    int count = 0, capacity = 0;
+    int result = 0;
+
+    *uids = NULL;
+
+    if (imap_ensure_selected(session) != 0) {
+        return -1;
+    }
+
+    /* Collapse the not-yet-indexed UIDs into compact sequence sets */
+    for (int i = 0; i < session->email_count; i++) {
+        unsigned int first = session->emails[i].uid;
+        if (search_has(&session->search, first, SEARCH_DOC_BODY)) continue;
+
+        unsigned int last = first;
+        while (i + 1 < session->email_count &&
+               session->emails[i + 1].uid == last + 1 &&
+               !search_has(&session->search, last + 1, SEARCH_DOC_BODY)) {
+            last = session->emails[++i].uid;
+        }
+
+        /* A range takes at most 22 bytes, so the set never overflows */
+        set_len += snprintf(set + set_len, sizeof(set) - set_len,
+                            last == first ? "%s%u" : "%s%u:%u",
+                            set_len ? "," : "", first, last);
+        if (set_len >= SEARCH_SET_LEN) {
+            result = imap_search_set(session, set, text, uids, &count, &capacity);
+            if (result < 0) break;
+            set_len = 0;
+        }
+    }
+
+    /* The rest; there is none if everything is indexed locally */
+    if (result == 0 && set_len > 0) {
+        result = imap_search_set(session, set, text, uids, &count, &capacity);
+    }
+
+    if (result < 0) {
+        free(*uids);
+        *uids = NULL;
+        return -1;
+    }
+    return count;
+}
+
+/* Read one response line of any length. Returns a malloc'd string. */
+static char *imap_recv_long_line(ImapSession *session) {
+    size_t capacity = BUFFER_SIZE;
+    size_t len = 0;
+    char *line = malloc(capacity);
+
+    while (line) {
+        int n = net_recv_line(&session->conn, line + len, (int)(capacity - len));
+        if (n <= 0) break;
+
+        len += n;
+        if (line[len - 1] == '\n') return line;
+
+        if (capacity - len < BUFFER_SIZE) {
+            char *grown = realloc(line, capacity * 2);
+            if (!grown) break;
+            line = grown;
+            capacity *= 2;
+        }
+    }
+
+    free(line);
+    return NULL;
+}
+
+/* Append first:last to a UID set string */
+static int append_uid_run(char **set, size_t *len, size_t *capacity,
+                          unsigned int first, unsigned int last) {
+    if (*len + 32 > *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 256;
+        char *grown = realloc(*set, new_capacity);
+        if (!grown) return -1;
+        *set = grown;
+        *capacity = new_capacity;
+    }
+    *len += snprintf(*set + *len, *capacity - *len, last == first ? "%s%u" : "%s%u:%u",
+                     *len ? "," : "", first, last);
+    return 0;
+}
+
+/* Summarize a plain "* SEARCH 1 2 3" response like ESEARCH would */
+static void summarize_search(const char *line, ImapSearchSummary *summary) {
+    size_t len = 0, capacity = 0;
+    unsigned int first = 0, last = 0;
+    const char *p = line + 8;
+
+    while (*p) {
+        char *end;
+        unsigned long uid = strtoul(p, &end, 10);
+        if (end == p) {
+            p++;
+            continue;
+        }
+        p = end;
+
+        summary->count++;
+        if (summary->min == 0 || uid < summary->min) summary->min = uid;
+        if (uid > summary->max) summary->max = uid;
+
+        /* Consecutive UIDs collapse into one range */
+        if (first && uid == last + 1) {
+            last = uid;
+            continue;
+        }
+        if (first) append_uid_run(&summary->all, &len, &capacity, first, last);
+        first = last = uid;
+    }
+    if (first) append_uid_run(&summary->all, &len, &capacity, first, last);
+}
+
+/* Run search criteria such as "UNSEEN" on the open mailbox and return
+ * only the count, lowest and highest UID and the UID set. With ESEARCH
+ * the server sends this summary instead of one number per message. */
+int imap_esearch(ImapSession *session, const char *criteria, ImapSearchSummary *summary) {
+    char tag[16];
+    char command[BUFFER_SIZE];
+    int esearch = imap_has_capability(session, "ESEARCH");
+    int status = -1;
+
+    memset(summary, 0, sizeof(ImapSearchSummary));
+
+    if (imap_ensure_selected(session) != 0) {
+        return -1;
+    }
+
+    TRACE_BEGIN(span);
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    int len = snprintf(command, sizeof(command), "%s UID SEARCH %s%s\r\n", tag,
+                       esearch ? "RETURN (COUNT MIN MAX ALL) " : "", criteria);
+    if (imap_write(session, command, len) < 0) {
+        return -1;
+    }
+
+    char *line;
+    while ((line = imap_recv_long_line(session)) != NULL) {
+        status = imap_tagged_status(line, tag);
+        if (status < 0) {
+            if (strncmp(line, "* ESEARCH", 9) == 0) {
+                parse_esearch(line, summary);
+            } else if (strncmp(line, "* SEARCH", 8) == 0) {
+                summarize_search(line, summary);
+            }
+        }
+        free(line);
+        if (status >= 0) break;
+    }
+    TRACE_END(span, "imap", "command", esearch ? "UID SEARCH RETURN" : "UID SEARCH");
+
+    if (status != 1) {
+        imap_search_summary_free(summary);
+        return -1;
+    }
+    return 0;
+}
+
+void imap_search_summary_free(ImapSearchSummary *summary) {
+    free(summary->all);
+    memset(summary, 0, sizeof(ImapSearchSummary));
+}
+
+/* Message and unseen counts of any mailbox without selecting it */
+int imap_status(ImapSession *session, const char *mailbox, int *messages, int *unseen) {
+    char quoted[MAX_MAILBOX_LEN * 2 + 3];
+    char command[MAX_MAILBOX_LEN * 2 + 64];
+    char name[MAX_MAILBOX_LEN];
+    char tag[16];
+    char response[BUFFER_SIZE];
+
+    *messages = -1;
+    *unseen = -1;
+
+    quote_mailbox_name(mailbox, quoted, sizeof(quoted));
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    snprintf(command, sizeof(command), "%s STATUS %s (MESSAGES UNSEEN)", tag, quoted);
+
+    if (imap_send_command(session, command, response, sizeof(response)) < 0) {
+        return -1;
+    }
+
+    const char *tagged = strstr(response, tag);
+    if (!tagged || imap_tagged_status(tagged, tag) != 1) {
+        return -1;
+    }
+
+    const char *line = strstr(response, "* STATUS ");
+    if (!line || !parse_status(line, name, sizeof(name), messages, unseen)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Set the \Seen flag of every loaded message from the set of unseen UIDs */
+static void apply_unseen_set(ImapSession *session, const char *set) {
+    for (int i = 0; i < session->email_count; i++) {
+        session->emails[i].seen = 1;
+    }
+
+    const char *p = set;
+    while (p && *p) {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (*end == ':') last = strtoul(end + 1, &end, 10);
+        if (end == p) break;
+
+        if (first > last) {
+            unsigned long swap = first;
+            first = last;
+            last = swap;
+        }
+
+        /* Emails are in UID order: walk the ones in range, however
+         * sparse the range is */
+        int lo = 0, hi = session->email_count;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (session->emails[mid].uid < first) lo = mid + 1; else hi = mid;
+        }
+        for (int i = lo; i < session->email_count && session->emails[i].uid <= last; i++) {
+            session->emails[i].seen = 0;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* Number of UIDs in a set such as "1:5,9" that are at most max */
+static unsigned long count_uids_upto(const char *set, unsigned long max) {
+    unsigned long count = 0;
+    const char *p = set;
+
+    while (p && *p) {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (end == p) break;
+        if (*end == ':') last = strtoul(end + 1, &end, 10);
+
+        if (first > last) {
+            unsigned long swap = first;
+            first = last;
+            last = swap;
+        }
+        if (first <= max) count += (last < max ? last : max) - first + 1;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+/* Bring the open mailbox up to date. When ESEARCH shows that every loaded
+ * message is still there, only the ones that came since are fetched and
+ * the \Seen flags of the rest are refreshed from the UID set of unseen
+ * messages; otherwise all headers are fetched again.
+ * Returns 0 if the message list is unchanged, 1 if it changed. */
+int imap_refresh_emails(ImapSession *session) {
+    ImapSearchSummary all, unseen;
+
+    if (session->email_count > 0 && imap_has_capability(session, "ESEARCH") &&
+        imap_esearch(session, "ALL", &all) == 0) {
+        /* New messages get higher UIDs than any before them, so if as many
+         * UIDs up to the last loaded one remain as are loaded, none of
+         * the loaded messages went away */
+        unsigned int last = session->emails[session->email_count - 1].uid;
+        int kept = count_uids_upto(all.all, last) == (unsigned long)session->email_count;
+        int added = kept && all.max > last;
+        imap_search_summary_free(&all);
+
+        if (added && imap_fetch_new_emails(session) < 0) {
+            return -1;
+        }
+        if (kept && imap_esearch(session, "UNSEEN", &unseen) == 0) {
+            apply_unseen_set(session, unseen.all);
+            imap_search_summary_free(&unseen);
+            session->server_messages = -1;
+            imap_update_folder_counts(session);
+            return added ? 1 : 0;
+        }
+    }
+
+    return imap_fetch_emails(session) < 0 ? -1 : 1;
+}
+
 /* Mark email as seen */
 int imap_mark_seen(ImapSession *session, unsigned int uid) {
     char command[256];
     char response[BUFFER_SIZE];
 
+    if (imap_ensure_selected(session) != 0) {
+        return -1;
+    }
+
     snprintf(command, sizeof(command),
              "A%d UID STORE %u +FLAGS (\\Seen)",
              session->tag_counter++, uid);
 
-    return imap_send_command(session, command, response, sizeof(response));
+    if (imap_send_command(session, command, response, sizeof(response)) <= 0) {
+        return -1;
+    }
+    int index = imap_find_email(session, uid);
+    if (index >= 0) session->emails[index].seen = 1;
+    return 0;
 }
 
 /* Mark email as unseen */
@@ -588,11 +2205,20 @@ int imap_mark_unseen(ImapSession *session, unsigned int uid) {
     char command[256];
     char response[BUFFER_SIZE];
 
+    if (imap_ensure_selected(session) != 0) {
+        return -1;
+    }
+
     snprintf(command, sizeof(command),
              "A%d UID STORE %u -FLAGS (\\Seen)",
              session->tag_counter++, uid);
 
-    return imap_send_command(session, command, response, sizeof(response));
+    if (imap_send_command(session, command, response, sizeof(response)) <= 0) {
+        return -1;
+    }
+    int index = imap_find_email(session, uid);
+    if (index >= 0) session->emails[index].seen = 0;
+    return 0;
 }
 
 /* Delete email (mark as deleted) */
@@ -600,6 +2226,10 @@ int imap_delete_email(ImapSession *session, unsigned int uid) {
     char command[256];
     char response[BUFFER_SIZE];
 
+    if (imap_ensure_selected(session) != 0) {
+        return -1;
+    }
+
     snprintf(command, sizeof(command),
              "A%d UID STORE %u +FLAGS (\\Deleted)",
              session->tag_counter++, uid);
@@ -607,14 +2237,52 @@ int imap_delete_email(ImapSession *session, unsigned int uid) {
     return imap_send_command(session, command, response, sizeof(response));
 }
 
-/* Expunge deleted emails */
+/* Drop one message from the list and from its thread. Its search
+ * entries stay: hits are looked up by UID, and UIDs are not reused. */
+static void imap_remove_email(ImapSession *session, int index) {
+    thread_remove(&session->threads, index);
+    memmove(&session->emails[index], &session->emails[index + 1],
+            sizeof(Email) * (session->email_count - index - 1));
+    session->email_count--;
+}
+
+/* Expunge deleted emails. The server reports each message it removes as
+ * "* n EXPUNGE", numbered as the mailbox is at that moment, and the list
+ * follows along, so nothing has to be fetched again. */
 int imap_expunge(ImapSession *session) {
     char command[128];
-    char response[BUFFER_SIZE];
+    char tag[16];
+    char line[BUFFER_SIZE];
+    int status = -1;
 
-    snprintf(command, sizeof(command), "A%d EXPUNGE", session->tag_counter++);
+    if (imap_ensure_selected(session) != 0) {
+        return -1;
+    }
 
-    return imap_send_command(session, command, response, sizeof(response));
+    TRACE_BEGIN(span);
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    int len = snprintf(command, sizeof(command), "%s EXPUNGE\r\n", tag);
+    if (imap_write(session, command, len) < 0) {
+        return -1;
+    }
+
+    while (net_recv_line(&session->conn, line, sizeof(line)) > 0) {
+        status = imap_tagged_status(line, tag);
+        if (status >= 0) break;
+
+        if (line[0] != '*') continue;
+        char *end;
+        unsigned long number = strtoul(line + 1, &end, 10);
+        if (end != line + 1 && strncmp(end, " EXPUNGE", 8) == 0 &&
+            number >= 1 && number <= (unsigned long)session->email_count) {
+            imap_remove_email(session, (int)number - 1);
+        }
+    }
+    TRACE_END(span, "imap", "command", "EXPUNGE");
+
+    session->server_messages = -1;
+    imap_update_folder_counts(session);
+    return status == 1 ? 0 : -1;
 }
 
 /* Free email list */
@@ -625,4 +2293,382 @@ void imap_free_emails(ImapSession *session) {
     }
     session->email_count = 0;
     session->email_capacity = 0;
+    thread_reset(&session->threads);
+}
+
+/* Append one code point as UTF-8 */
+static size_t put_utf8(char *out, size_t len, size_t size, unsigned int cp) {
+    if (cp < 0x80 && len + 1 < size) {
+        out[len++] = (char)cp;
+    } else if (cp < 0x800 && len + 2 < size) {
+        out[len++] = (char)(0xC0 | (cp >> 6));
+        out[len++] = (char)(0x80 | (cp & 0x3F));
+    } else if (cp >= 0x800 && cp < 0x10000 && len + 3 < size) {
+        out[len++] = (char)(0xE0 | (cp >> 12));
+        out[len++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[len++] = (char)(0x80 | (cp & 0x3F));
+    } else if (cp >= 0x10000 && len + 4 < size) {
+        out[len++] = (char)(0xF0 | (cp >> 18));
+        out[len++] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[len++] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[len++] = (char)(0x80 | (cp & 0x3F));
+    }
+    return len;
+}
+
+/* Decode a modified UTF-7 mailbox name (RFC 3501 5.1.3) into UTF-8 */
+static void decode_mailbox_name(const char *in, char *out, size_t size) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+,";
+    size_t len = 0;
+
+    while (*in && len + 1 < size) {
+        if (*in != '&') {
+            out[len++] = *in++;
+            continue;
+        }
+        if (*++in == '-') {
+            out[len++] = '&';
+            in++;
+            continue;
+        }
+
+        /* Base64 of UTF-16BE, terminated by '-' */
+        unsigned int bits = 0, high = 0;
+        int nbits = 0;
+        for (; *in && *in != '-'; in++) {
+            const char *digit = strchr(alphabet, *in);
+            if (!digit) break;
+
+            bits = (bits << 6) | (unsigned int)(digit - alphabet);
+            nbits += 6;
+            if (nbits < 16) continue;
+
+            nbits -= 16;
+            unsigned int unit = (bits >> nbits) & 0xFFFF;
+            bits &= (1u << nbits) - 1;
+
+            if (unit >= 0xD800 && unit < 0xDC00) {
+                high = unit;
+            } else if (unit >= 0xDC00 && unit < 0xE000 && high) {
+                len = put_utf8(out, len, size, 0x10000 + ((high - 0xD800) << 10) + (unit - 0xDC00));
+                high = 0;
+            } else {
+                len = put_utf8(out, len, size, unit);
+                high = 0;
+            }
+        }
+        if (*in == '-') in++;
+    }
+    out[len] = '\0';
+}
+
+/* Does a LIST flag list such as "(\HasNoChildren \Noselect)" contain flag? */
+static int has_list_flag(const char *flags, const char *end, const char *flag) {
+    size_t len = strlen(flag);
+
+    for (const char *p = flags; p + len <= end; p++) {
+        if (strncasecmp(p, flag, len) == 0 && (p[len] == ' ' || p[len] == ')')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int add_folder(ImapFolder **folders, int *count, int *capacity,
+                      const char *name, int noselect) {
+    if (find_folder(*folders, *count, name) >= 0) return 0;
+
+    if (*count >= *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 16;
+        ImapFolder *grown = realloc(*folders, sizeof(ImapFolder) * new_capacity);
+        if (!grown) return -1;
+        *folders = grown;
+        *capacity = new_capacity;
+    }
+
+    ImapFolder *folder = &(*folders)[*count];
+    init_folder(folder, name, noselect);
+    decode_mailbox_name(name, folder->display_name, sizeof(folder->display_name));
+
+    /* INBOX always comes first */
+    if (strcasecmp(name, "INBOX") == 0 && *count > 0) {
+        ImapFolder inbox = *folder;
+        memmove(*folders + 1, *folders, sizeof(ImapFolder) * *count);
+        (*folders)[0] = inbox;
+    }
+    (*count)++;
+    return 0;
+}
+
+/* Parse one "* LIST (flags) delimiter name" response. A name sent as a
+ * literal is read from the connection. */
+static int parse_list_response(ImapSession *session, char *line, int line_size,
+                               ImapFolder **folders, int *count, int *capacity) {
+    char name[MAX_MAILBOX_LEN];
+
+    const char *flags = strchr(line, '(');
+    const char *flags_end = flags ? strchr(flags, ')') : NULL;
+    if (!flags_end) return 0;
+
+    int noselect = has_list_flag(flags, flags_end, "\\Noselect") ||
+                   has_list_flag(flags, flags_end, "\\NonExistent");
+
+    /* Skip the hierarchy delimiter: a quoted character or NIL */
+    const char *p = flags_end + 1;
+    while (*p == ' ') p++;
+    if (*p == '"') {
+        p++;
+        if (*p == '\\') p++;
+        if (*p) p++;
+        if (*p == '"') p++;
+    } else if (strncasecmp(p, "NIL", 3) == 0) {
+        p += 3;
+    }
+
+    long size = literal_size(p);
+    if (size >= 0) {
+        if (imap_read_literal(session, size, name, sizeof(name)) < 0 ||
+            net_recv_line(&session->conn, line, line_size) <= 0) {
+            return -1;
+        }
+    } else {
+        parse_mailbox_name(p, name, sizeof(name));
+    }
+
+    if (name[0] == '\0') return 0;
+    return add_folder(folders, count, capacity, name, noselect);
+}
+
+/* Replace the folder list, carrying over parked indices and counts of
+ * folders that still exist */
+static void imap_merge_folders(ImapSession *session, ImapFolder *folders, int count) {
+    for (int i = 0; i < session->folder_count; i++) {
+        ImapFolder *old = &session->folders[i];
+        int j = find_folder(folders, count, old->name);
+
+        if (j < 0) {
+            free_folder(session, old);
+            continue;
+        }
+
+        ImapFolder *folder = &folders[j];
+        if (folder->messages < 0) {
+            folder->messages = old->messages;
+            folder->unseen = old->unseen;
+        }
+        folder->loaded = old->loaded;
+        folder->uidvalidity = old->uidvalidity;
+        folder->emails = old->emails;
+        folder->email_count = old->email_count;
+        folder->email_capacity = old->email_capacity;
+        folder->threads = old->threads;
+        folder->search = old->search;
+    }
+
+    free(session->folders);
+    session->folders = folders;
+    session->folder_count = count;
+    session->current_folder = find_folder(folders, count, session->mailbox);
+    imap_update_folder_counts(session);
+}
+
+/* List all folders with their message counts. LIST-STATUS servers return
+ * the counts with the LIST; otherwise STATUS is pipelined for every folder
+ * so the whole refresh costs a single round trip. */
+int imap_list_folders(ImapSession *session) {
+    char command[128];
+    char tag[16];
+    char line[BUFFER_SIZE];
+    ImapFolder *folders = NULL;
+    int count = 0, capacity = 0;
+    int list_status = imap_has_capability(session, "LIST-STATUS");
+    int status = -1;
+    int len;
+
+    TRACE_BEGIN(span);
+    snprintf(tag, sizeof(tag), "A%d", session->tag_counter++);
+    len = snprintf(command, sizeof(command),
+                   list_status ? "%s LIST \"\" \"*\" RETURN (STATUS (MESSAGES UNSEEN))\r\n"
+                               : "%s LIST \"\" \"*\"\r\n",
+                   tag);
+    if (imap_write(session, command, len) < 0) {
+        return -1;
+    }
+
+    while (net_recv_line(&session->conn, line, sizeof(line)) > 0) {
+        status = imap_tagged_status(line, tag);
+        if (status >= 0) break;
+
+        if (strncmp(line, "* LIST ", 7) == 0) {
+            if (parse_list_response(session, line, sizeof(line), &folders, &count, &capacity) < 0) {
+                status = -1;
+                break;
+            }
+        } else {
+            apply_status(folders, count, line);
+        }
+    }
+    TRACE_END(span, "imap", "command", "LIST %d folders", count);
+
+    if (status != 1) {
+        for (int i = 0; i < count; i++) free_folder(session, &folders[i]);
+        free(folders);
+        fprintf(stderr, "IMAP LIST failed\n");
+        return -1;
+    }
+
+    imap_merge_folders(session, folders, count);
+
+    if (!list_status && imap_status_refresh_begin(session) > 0) {
+        imap_status_drain(session, 1);
+    }
+    return session->folder_count;
+}
+
+/* Take a parked folder's index back into the session */
+static void imap_unpark_folder(ImapSession *session, int folder) {
+    ImapFolder *parked = &session->folders[folder];
+
+    session->uidvalidity = parked->uidvalidity;
+    session->emails = parked->emails;
+    session->email_count = parked->email_count;
+    session->email_capacity = parked->email_capacity;
+    session->threads = parked->threads;
+    session->search = parked->search;
+
+    parked->loaded = 0;
+    parked->emails = NULL;
+    parked->email_count = 0;
+    parked->email_capacity = 0;
+    thread_init(&parked->threads);
+    search_init(&parked->search);
+}
+
+static void imap_set_mailbox(ImapSession *session, int folder, const char *name) {
+    session->current_folder = folder;
+    session->server_messages = -1;
+    snprintf(session->mailbox, sizeof(session->mailbox), "%s", name);
+}
+
+/* Make folder the open one. A folder visited before is restored from
+ * memory without any network traffic; it is re-selected on the server
+ * only when a command needs it. If the folder cannot be opened, the one
+ * open before stays open. */
+int imap_switch_folder(ImapSession *session, int folder) {
+    char previous_mailbox[MAX_MAILBOX_LEN];
+    int previous = session->current_folder;
+
+    if (folder < 0 || folder >= session->folder_count) return -1;
+    if (folder == previous) return 0;
+
+    ImapFolder *target = &session->folders[folder];
+    if (target->noselect) return -1;
+
+    /* Park the open folder's index */
+    if (previous >= 0) {
+        ImapFolder *current = &session->folders[previous];
+        current->loaded = 1;
+        current->uidvalidity = session->uidvalidity;
+        current->emails = session->emails;
+        current->email_count = session->email_count;
+        current->email_capacity = session->email_capacity;
+        current->threads = session->threads;
+        current->search = session->search;
+    } else {
+        imap_save_index(session, session->mailbox, &session->search);
+        free(session->emails);
+        thread_free(&session->threads);
+        search_free(&session->search);
+    }
+    session->emails = NULL;
+    session->email_count = 0;
+    session->email_capacity = 0;
+    thread_init(&session->threads);
+    search_init(&session->search);
+
+    snprintf(previous_mailbox, sizeof(previous_mailbox), "%s", session->mailbox);
+    imap_set_mailbox(session, folder, target->name);
+
+    if (target->loaded) {
+        imap_unpark_folder(session, folder);
+        return 0;
+    }
+
+    if (imap_send_select(session, target->name) == 0) {
+        imap_load_index(session);
+        if (imap_fetch_emails(session) >= 0) return 0;
+    }
+
+    /* Back to the folder that was open; the server has none selected
+     * now, so it is re-selected when a command needs it */
+    imap_free_emails(session);
+    thread_free(&session->threads);
+    search_free(&session->search);
+    imap_set_mailbox(session, previous, previous_mailbox);
+    if (previous >= 0) imap_unpark_folder(session, previous);
+    return -1;
+}
+
+/* Pipeline STATUS for every folder but the open one without waiting for
+ * the answers. Returns the number of replies due. */
+int imap_status_refresh_begin(ImapSession *session) {
+    char quoted[MAX_MAILBOX_LEN * 2 + 3];
+    size_t entry_size = sizeof(quoted) + 48;
+    size_t len = 0;
+    int sent = 0;
+
+    if (session->pending_status > 0) {
+        return session->pending_status;
+    }
+    if (session->body_fetch.tag) {
+        /* Sending now would wait for the whole body; try again later */
+        return 0;
+    }
+    imap_update_folder_counts(session);
+
+    char *commands = malloc(entry_size * (session->folder_count + 2));
+    if (!commands) return -1;
+
+    for (int i = 0; i < session->folder_count; i++) {
+        if (i == session->current_folder || session->folders[i].noselect) continue;
+
+        quote_mailbox_name(session->folders[i].name, quoted, sizeof(quoted));
+        len += snprintf(commands + len, entry_size, "A%d STATUS %s (MESSAGES UNSEEN)\r\n",
+                        session->tag_counter++, quoted);
+        sent++;
+    }
+
+    /* STATUS is not meant for the selected mailbox; a search tells whether
+     * messages came or went there */
+    if (session->current_folder >= 0 && imap_has_capability(session, "ESEARCH") &&
+        strcmp(session->selected, session->mailbox) == 0) {
+        session->check_tag = session->tag_counter++;
+        len += snprintf(commands + len, entry_size, "A%d UID SEARCH RETURN (COUNT MAX) ALL\r\n",
+                        session->check_tag);
+        sent++;
+    }
+
+    if (sent > 0 && imap_write(session, commands, (int)len) < 0) {
+        free(commands);
+        return -1;
+    }
+    free(commands);
+
+    session->pending_status = sent;
+    return sent;
+}
+
+/* Apply whatever STATUS replies have arrived. Never blocks waiting for the
+ * server. Returns the number of replies still due. */
+int imap_status_refresh_poll(ImapSession *session) {
+    return imap_status_drain(session, 0);
+}
+
+/* Display name of the open mailbox */
+const char *imap_current_folder_name(const ImapSession *session) {
+    if (session->current_folder >= 0) {
+        return session->folders[session->current_folder].display_name;
+    }
+    return session->mailbox[0] ? session->mailbox : "INBOX";
 }
@@ -0,0 +1,32 @@
+#ifndef IMAP_INTERNAL_H
+#define IMAP_INTERNAL_H
+
+/* Parsers private to imap.c. A library built with CTERM_BENCH_INTERNALS
+ * exports them so the microbenchmarks can call them; otherwise they stay
+ * static. */
+#include "imap.h"
+#include <stddef.h>
+
+#define BUFFER_SIZE 8192
+
+#ifdef CTERM_BENCH_INTERNALS
+#define IMAP_INTERNAL
+#else
+#define IMAP_INTERNAL static
+#endif
+
+/* Threading headers that are only needed while a message is being added */
+typedef struct {
+    char in_reply_to[MAX_MSGID_LEN];
+    char references[BUFFER_SIZE];
+} ThreadHeaders;
+
+#ifdef CTERM_BENCH_INTERNALS
+int base64_decode(const char *input, int input_len, char *output, int output_size);
+void sanitize_text(char *text);
+void decode_mime_header(const char *input, char *output, int output_size);
+void parse_email_header(const char *data, Email *email, ThreadHeaders *refs);
+size_t extract_body(const char *response, char *body, size_t size);
+#endif
+
+#endif /* IMAP_INTERNAL_H */
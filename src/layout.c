@@ -0,0 +1,184 @@
+#include "layout.h"
+#include "utf8.h"
+#include <stdlib.h>
+#include <string.h>
+
+void layout_init(TextLayout *layout) {
+    layout->text = NULL;
+    layout->len = 0;
+    layout->width = 0;
+    layout->lines = NULL;
+    layout->count = 0;
+    layout->capacity = 0;
+}
+
+void layout_free(TextLayout *layout) {
+    free(layout->lines);
+    layout_init(layout);
+}
+
+static int layout_push(TextLayout *layout, size_t offset) {
+    if (layout->count == layout->capacity) {
+        int capacity = layout->capacity ? layout->capacity * 2 : 256;
+        size_t *lines = realloc(layout->lines, sizeof(size_t) * capacity);
+        if (!lines) return -1;
+        layout->lines = lines;
+        layout->capacity = capacity;
+    }
+    layout->lines[layout->count++] = offset;
+    return 0;
+}
+
+/* Columns of one character at column, -1 for a line break. n gets its
+ * length in bytes. */
+static int layout_char(const char *p, int column, size_t *n) {
+    int columns;
+
+    *n = 1;
+    if ((unsigned char)*p >= 0x20 && (unsigned char)*p < 0x7F) return 1;
+    if (*p == '\n') return -1;
+    if (*p == '\r') return 0;
+    if (*p == '\t') return LAYOUT_TAB_WIDTH - column % LAYOUT_TAB_WIDTH;
+
+    *n = utf8_next(p, &columns);
+    return columns < 0 ? 1 : columns;
+}
+
+/* Column reached at end when a line starts at start */
+static int layout_column(const char *text, size_t start, size_t end) {
+    int column = 0;
+    size_t n;
+
+    for (size_t pos = start; pos < end; pos += n) {
+        column += layout_char(text + pos, column, &n);
+    }
+    return column;
+}
+
+int layout_wrap(TextLayout *layout, const char *text, size_t len, int width) {
+    size_t line_start = 0, pos = 0, space = 0;
+    int column = 0;
+
+    if (width < 1) width = 1;
+    layout->text = text;
+    layout->len = len;
+    layout->width = width;
+    layout->count = 0;
+    if (layout_push(layout, 0) < 0) return -1;
+
+    while (pos < len) {
+        size_t n;
+        int w = layout_char(text + pos, column, &n);
+
+        if (w < 0) {
+            pos++;
+            if (pos < len && layout_push(layout, pos) < 0) return -1;
+            line_start = pos;
+            space = 0;
+            column = 0;
+            continue;
+        }
+
+        if (column + w > width && column > 0) {
+            /* Break after the last space, or inside a word longer than
+             * the line; a space at the break is dropped */
+            if (text[pos] == ' ') {
+                line_start = pos + 1;
+            } else if (space > line_start) {
+                line_start = space;
+            } else {
+                line_start = pos;
+            }
+            if (layout_push(layout, line_start) < 0) return -1;
+            space = 0;
+            if (line_start > pos) {
+                pos = line_start;
+                column = 0;
+                continue;
+            }
+            column = layout_column(text, line_start, pos);
+            continue;
+        }
+
+        if (text[pos] == ' ' || text[pos] == '\t') space = pos + n;
+        column += w;
+        pos += n;
+    }
+    return layout->count;
+}
+
+int layout_append(TextLayout *layout, const char *text, size_t len, const TextLayout *tail) {
+    size_t base = layout->len;
+    int first = 0;
+
+    /* An empty layout already has the line its tail starts with */
+    if (layout->count > 0 && layout->lines[layout->count - 1] == base) first = 1;
+    for (int i = first; i < tail->count; i++) {
+        if (layout_push(layout, base + tail->lines[i]) < 0) return -1;
+    }
+    layout->text = text;
+    layout->len = len;
+    return layout->count;
+}
+
+int layout_valid(const TextLayout *layout, const char *text, int width) {
+    return layout->text == text && layout->width == (width < 1 ? 1 : width);
+}
+
+int layout_find(const TextLayout *layout, size_t offset) {
+    int lo = 0, hi = layout->count - 1;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (layout->lines[mid] <= offset) lo = mid; else hi = mid - 1;
+    }
+    return lo;
+}
+
+size_t layout_line(const TextLayout *layout, int line, char *output, size_t output_size) {
+    size_t out = 0;
+    int column = 0;
+
+    if (output_size == 0) return 0;
+    if (line < 0 || line >= layout->count) {
+        output[0] = '\0';
+        return 0;
+    }
+
+    size_t pos = layout->lines[line];
+    size_t end = line + 1 < layout->count ? layout->lines[line + 1] : layout->len;
+
+    while (pos < end && layout->text[pos] != '\n') {
+        const char *p = layout->text + pos;
+        size_t n = 1;
+        int w;
+
+        if (*p == '\r') {
+            w = 0;
+        } else if (*p == '\t') {
+            w = LAYOUT_TAB_WIDTH - column % LAYOUT_TAB_WIDTH;
+            if (column + w > layout->width || out + w >= output_size) break;
+            memset(output + out, ' ', w);
+            out += w;
+        } else {
+            n = utf8_next(p, &w);
+
+            /* Past the width there is only the space the line broke at */
+            if (column + (w < 0 ? 1 : w) > layout->width) break;
+            if (w < 0) {
+                /* Controls and stray bytes take their one column as a space */
+                if (out + 1 >= output_size) break;
+                output[out++] = ' ';
+                w = 1;
+            } else {
+                if (out + n >= output_size) break;
+                memcpy(output + out, p, n);
+                out += n;
+            }
+        }
+        column += w;
+        pos += n;
+    }
+    output[out] = '\0';
+    return out;
+}
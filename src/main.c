@@ -3,11 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include "config.h"
-#include "network.h"
-#include "imap.h"
-#include "smtp.h"
+#include <getopt.h>
+#include "cterm.h"
 #include "ui.h"
+#include "trace.h"
 
 #define DEFAULT_CONFIG_FILE ".cterm.conf"
 
@@ -15,16 +14,57 @@ static void print_usage(const char *prog_name) {
     printf("Usage: %s [options]\n", prog_name);
     printf("Options:\n");
     printf("  -c <config>  Configuration file (default: ~/%s)\n", DEFAULT_CONFIG_FILE);
+    printf("  -n           Print unread counts and exit\n");
+    printf("  --trace=<file>  Write a Chrome trace of this run (builds with CTERM_TRACE)\n");
+    printf("  --stats=<file>  Write key-to-paint and draw time percentiles on exit\n");
     printf("  -h           Show this help message\n");
 }
 
+/* Print unread counts of every folder. Only STATUS is used, so no
+ * message is downloaded. Returns the total or -1. */
+static int check_mail(ImapSession *session) {
+    int total = 0;
+
+    if (imap_list_folders(session) < 0) {
+        int messages, unseen;
+        if (imap_status(session, "INBOX", &messages, &unseen) < 0) {
+            return -1;
+        }
+        printf("INBOX: %d unread, %d messages\n", unseen, messages);
+        return unseen;
+    }
+
+    for (int i = 0; i < session->folder_count; i++) {
+        const ImapFolder *folder = &session->folders[i];
+        if (folder->noselect || folder->messages < 0) continue;
+        printf("%s: %d unread, %d messages\n", folder->display_name, folder->unseen, folder->messages);
+        total += folder->unseen;
+    }
+    printf("Total: %d unread\n", total);
+    return total;
+}
+
+/* Shut the engine down after a startup error */
+static int fail(CtermEngine *engine) {
+    cterm_close(engine);
+    cterm_cleanup();
+    trace_stop();
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
-    Config config;
-    ImapSession imap_session;
-    SmtpSession smtp_session;
+    CtermEngine engine;
     UIContext ui_ctx;
     char config_file[512];
+    const char *stats_path = NULL;
+    int check_only = 0;
     int opt;
+    static const struct option long_options[] = {
+        { "trace", required_argument, NULL, 't' },
+        { "stats", required_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
 
     /* Default config file path */
     const char *home = getenv("HOME");
@@ -35,11 +75,20 @@ int main(int argc, char *argv[]) {
     }
 
     /* Parse command line arguments */
-    while ((opt = getopt(argc, argv, "c:h")) != -1) {
+    while ((opt = getopt_long(argc, argv, "c:hn", long_options, NULL)) != -1) {
         switch (opt) {
+            case 't':
+                trace_start(optarg);
+                break;
+            case 's':
+                stats_path = optarg;
+                break;
             case 'c':
                 strncpy(config_file, optarg, sizeof(config_file) - 1);
                 break;
+            case 'n':
+                check_only = 1;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return 0;
@@ -50,111 +99,86 @@ int main(int argc, char *argv[]) {
     }
 
     /* Load configuration */
-    printf("Loading configuration from: %s\n", config_file);
-    if (config_load(config_file, &config) < 0) {
+    if (!check_only) printf("Loading configuration from: %s\n", config_file);
+    if (cterm_open(&engine, config_file) < 0) {
         fprintf(stderr, "Error: Failed to load configuration\n");
+        trace_stop();
         return 1;
     }
 
     /* Initialize SSL */
-    net_init_ssl();
+    cterm_init();
 
-    /* Connect to IMAP server */
-    printf("Connecting to IMAP server: %s:%d\n", config.imap_server, config.imap_port);
-    if (imap_connect(&imap_session, config.imap_server, config.imap_port, config.imap_use_ssl) < 0) {
-        fprintf(stderr, "Error: Failed to connect to IMAP server\n");
-        config_free(&config);
-        net_cleanup_ssl();
-        return 1;
+    /* Connect and log in to the IMAP server */
+    if (!check_only) {
+        printf("Connecting to IMAP server: %s:%d\n", engine.config.imap_server, engine.config.imap_port);
+        printf("Logging in as: %s\n", engine.config.imap_username);
     }
-
-    /* Login to IMAP */
-    printf("Logging in as: %s\n", config.imap_username);
-    if (imap_login(&imap_session, config.imap_username, config.imap_password) < 0) {
-        fprintf(stderr, "Error: Failed to login to IMAP server\n");
-        imap_disconnect(&imap_session);
-        config_free(&config);
-        net_cleanup_ssl();
-        return 1;
+    if (cterm_connect(&engine) < 0) {
+        fprintf(stderr, "Error: Failed to connect to IMAP server\n");
+        return fail(&engine);
     }
 
-    /* Select INBOX */
-    printf("Selecting INBOX...\n");
-    if (imap_select_mailbox(&imap_session, "INBOX") < 0) {
-        fprintf(stderr, "Error: Failed to select INBOX\n");
-        imap_disconnect(&imap_session);
-        config_free(&config);
-        net_cleanup_ssl();
-        return 1;
+    /* Check mode: counts only, no mailbox is opened */
+    if (check_only) {
+        int unread = check_mail(&engine.imap);
+        if (unread < 0) {
+            fprintf(stderr, "Error: Failed to get folder status\n");
+        }
+        cterm_close(&engine);
+        cterm_cleanup();
+        trace_stop();
+        return unread < 0 ? 1 : 0;
     }
 
-    /* Fetch emails */
-    printf("Fetching emails...\n");
-    int email_count = imap_fetch_emails(&imap_session);
+    /* Select INBOX and fetch its index */
+    printf("Fetching INBOX...\n");
+    int email_count = cterm_select(&engine, "INBOX");
     if (email_count < 0) {
-        fprintf(stderr, "Error: Failed to fetch emails\n");
-        imap_disconnect(&imap_session);
-        config_free(&config);
-        net_cleanup_ssl();
-        return 1;
+        fprintf(stderr, "Error: Failed to open INBOX\n");
+        return fail(&engine);
     }
     printf("Found %d emails\n", email_count);
 
-    /* Connect to SMTP server */
-    printf("Connecting to SMTP server: %s:%d\n", config.smtp_server, config.smtp_port);
-    if (smtp_connect(&smtp_session, config.smtp_server, config.smtp_port, config.smtp_use_ssl) < 0) {
-        fprintf(stderr, "Error: Failed to connect to SMTP server\n");
-        imap_disconnect(&imap_session);
-        config_free(&config);
-        net_cleanup_ssl();
-        return 1;
+    /* Folder list for the folder pane; INBOX alone still works without it */
+    printf("Listing folders...\n");
+    if (imap_list_folders(&engine.imap) < 0) {
+        fprintf(stderr, "Warning: Failed to list folders\n");
     }
 
-    /* Use STARTTLS if configured */
-    if (config.smtp_use_starttls) {
-        printf("Starting TLS...\n");
-        if (smtp_starttls(&smtp_session) < 0) {
-            fprintf(stderr, "Error: Failed to start TLS\n");
-            smtp_disconnect(&smtp_session);
-            imap_disconnect(&imap_session);
-            config_free(&config);
-            net_cleanup_ssl();
-            return 1;
-        }
+    /* Messages are sent from a spool by a background worker, which also
+     * connects to the SMTP server when needed; anything left from an
+     * earlier run goes out now */
+    if (cterm_start_outbox(&engine) < 0) {
+        fprintf(stderr, "Error: Failed to open outbox\n");
+        return fail(&engine);
     }
 
-    /* Authenticate with SMTP */
-    printf("Authenticating with SMTP...\n");
-    if (smtp_auth_login(&smtp_session, config.smtp_username, config.smtp_password) < 0) {
-        fprintf(stderr, "Error: Failed to authenticate with SMTP server\n");
-        smtp_disconnect(&smtp_session);
-        imap_disconnect(&imap_session);
-        config_free(&config);
-        net_cleanup_ssl();
-        return 1;
+    /* From here on the IMAP session is driven by its own thread */
+    if (cterm_start_worker(&engine) < 0) {
+        fprintf(stderr, "Error: Failed to start IMAP worker\n");
+        return fail(&engine);
     }
 
     printf("Starting TUI...\n");
     sleep(1); /* Give user time to read messages */
 
     /* Initialize and run UI */
-    if (ui_init(&ui_ctx, &imap_session, &smtp_session, &config) < 0) {
+    if (ui_init(&ui_ctx, &engine.worker, &engine.outbox, &engine.config) < 0) {
         fprintf(stderr, "Error: Failed to initialize UI\n");
-        smtp_disconnect(&smtp_session);
-        imap_disconnect(&imap_session);
-        config_free(&config);
-        net_cleanup_ssl();
-        return 1;
+        return fail(&engine);
     }
 
     ui_run(&ui_ctx);
 
     /* Cleanup */
     ui_cleanup(&ui_ctx);
-    smtp_disconnect(&smtp_session);
-    imap_disconnect(&imap_session);
-    config_free(&config);
-    net_cleanup_ssl();
+    if (stats_path) {
+        ui_write_stats(&ui_ctx, stats_path);
+    }
+    cterm_close(&engine);
+    cterm_cleanup();
+    trace_stop();
 
     printf("Goodbye!\n");
     return 0;
@@ -0,0 +1,270 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mime.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ENCODE_LINES 512                /* Lines encoded per write to the stream */
+#define MAP_WINDOW_PAGES 16             /* Window is this many pages of lines */
+
+static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Both output characters for every 12-bit input value, so three input
+ * bytes take two lookups and two 16-bit stores instead of four of each */
+static char pair_table[4096][2];
+static pthread_once_t pair_table_once = PTHREAD_ONCE_INIT;
+
+static void build_pair_table(void) {
+    for (int i = 0; i < 4096; i++) {
+        pair_table[i][0] = alphabet[i >> 6];
+        pair_table[i][1] = alphabet[i & 63];
+    }
+}
+
+/* Encode whole groups of three bytes, two groups (one 48-bit word) per step */
+static char *encode_groups(const unsigned char *in, size_t groups, char *out) {
+    for (; groups >= 2; groups -= 2, in += 6, out += 8) {
+        uint64_t v = (uint64_t)in[0] << 40 | (uint64_t)in[1] << 32 | (uint64_t)in[2] << 24 |
+                     (uint64_t)in[3] << 16 | (uint64_t)in[4] << 8 | in[5];
+        memcpy(out, pair_table[(v >> 36) & 0xFFF], 2);
+        memcpy(out + 2, pair_table[(v >> 24) & 0xFFF], 2);
+        memcpy(out + 4, pair_table[(v >> 12) & 0xFFF], 2);
+        memcpy(out + 6, pair_table[v & 0xFFF], 2);
+    }
+    if (groups) {
+        uint32_t v = (uint32_t)in[0] << 16 | (uint32_t)in[1] << 8 | in[2];
+        memcpy(out, pair_table[v >> 12], 2);
+        memcpy(out + 2, pair_table[v & 0xFFF], 2);
+        out += 4;
+    }
+    return out;
+}
+
+/* The last one or two bytes, padded with '=' */
+static char *encode_tail(const unsigned char *in, size_t n, char *out) {
+    if (n == 0) return out;
+
+    uint32_t v = (uint32_t)in[0] << 16 | (n > 1 ? (uint32_t)in[1] << 8 : 0);
+    out[0] = alphabet[v >> 18];
+    out[1] = alphabet[(v >> 12) & 63];
+    out[2] = n > 1 ? alphabet[(v >> 6) & 63] : '=';
+    out[3] = '=';
+    return out + 4;
+}
+
+/* Base64 without line breaks */
+size_t mime_base64_encode(const unsigned char *in, size_t len, char *out) {
+    pthread_once(&pair_table_once, build_pair_table);
+
+    char *end = encode_groups(in, len / 3, out);
+    end = encode_tail(in + len / 3 * 3, len % 3, end);
+    *end = '\0';
+    return end - out;
+}
+
+/* Base64 in 76-character CRLF-terminated lines */
+size_t mime_base64_encode_lines(const unsigned char *in, size_t len, char *out) {
+    char *p = out;
+
+    pthread_once(&pair_table_once, build_pair_table);
+
+    while (len > 0) {
+        size_t n = len < MIME_LINE_BYTES ? len : MIME_LINE_BYTES;
+        p = encode_groups(in, n / 3, p);
+        p = encode_tail(in + n / 3 * 3, n % 3, p);
+        *p++ = '\r';
+        *p++ = '\n';
+        in += n;
+        len -= n;
+    }
+    return p - out;
+}
+
+/* Check that a file can be attached */
+int mime_attachment_ok(const char *path) {
+    struct stat st;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || access(path, R_OK) < 0) {
+        return 0;
+    }
+    return 1;
+}
+
+static const struct {
+    const char *extension;
+    const char *type;
+} content_types[] = {
+    { "txt", "text/plain" },          { "csv", "text/csv" },
+    { "html", "text/html" },          { "htm", "text/html" },
+    { "pdf", "application/pdf" },     { "json", "application/json" },
+    { "xml", "application/xml" },     { "zip", "application/zip" },
+    { "gz", "application/gzip" },     { "tar", "application/x-tar" },
+    { "png", "image/png" },           { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },         { "gif", "image/gif" },
+    { "webp", "image/webp" },         { "svg", "image/svg+xml" },
+    { "mp3", "audio/mpeg" },          { "mp4", "video/mp4" },
+    { "doc", "application/msword" },
+    { "odt", "application/vnd.oasis.opendocument.text" },
+    { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+    { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+};
+
+static const char *content_type(const char *name) {
+    const char *dot = strrchr(name, '.');
+
+    if (dot) {
+        for (size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+            if (strcasecmp(dot + 1, content_types[i].extension) == 0) {
+                return content_types[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+/* key="name" for plain ASCII names, otherwise the RFC 2231 form
+ * key*=utf-8''percent-encoded */
+static void format_name_param(const char *key, const char *name, char *out, size_t size) {
+    int plain = 1;
+
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        if (*p < 0x20 || *p >= 0x7F || *p == '"' || *p == '\\') plain = 0;
+    }
+    if (plain) {
+        snprintf(out, size, "%s=\"%s\"", key, name);
+        return;
+    }
+
+    size_t len = snprintf(out, size, "%s*=utf-8''", key);
+    for (const unsigned char *p = (const unsigned char *)name; *p && len + 4 < size; p++) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+            strchr("-._~", *p)) {
+            out[len++] = *p;
+        } else {
+            len += snprintf(out + len, size - len, "%%%02X", *p);
+        }
+    }
+    out[len] = '\0';
+}
+
+/* Headers that turn a message into multipart/mixed, and the opening of
+ * the text part that follows them */
+int mime_write_multipart_headers(FILE *file, const char *boundary) {
+    fprintf(file, "MIME-Version: 1.0\n"
+                  "Content-Type: multipart/mixed; boundary=\"%s\"\n"
+                  "\n"
+                  "This is a multi-part message in MIME format.\n"
+                  "\n"
+                  "--%s\n"
+                  "Content-Type: text/plain; charset=utf-8\n"
+                  "Content-Transfer-Encoding: 8bit\n"
+                  "\n", boundary, boundary);
+    return ferror(file) ? -1 : 0;
+}
+
+/* Encode a file through a sliding mapping. Each window is a whole number
+ * of base64 lines and of pages, and is unmapped once sent, so even a huge
+ * file keeps a small resident footprint. A window that cannot be mapped
+ * is left to read(): returns 1 with the file offset at its start. The size
+ * is checked again before each window, as touching a mapping past the end
+ * of a file that shrank raises SIGBUS. */
+static int encode_mapped(SmtpData *data, int fd, size_t size) {
+    char out[ENCODE_LINES * 78];
+    const size_t block = ENCODE_LINES * MIME_LINE_BYTES;
+    const size_t window = MIME_LINE_BYTES * (size_t)sysconf(_SC_PAGESIZE) * MAP_WINDOW_PAGES;
+    struct stat st;
+
+    for (size_t offset = 0; offset < size; offset += window) {
+        size_t n = size - offset < window ? size - offset : window;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < offset + n) {
+            fprintf(stderr, "MIME: file changed while being sent\n");
+            return -1;
+        }
+        unsigned char *map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, (off_t)offset);
+        if (map == MAP_FAILED) {
+            return lseek(fd, (off_t)offset, SEEK_SET) < 0 ? -1 : 1;
+        }
+        posix_madvise(map, n, POSIX_MADV_SEQUENTIAL);
+
+        for (size_t pos = 0; pos < n; pos += block) {
+            size_t len = n - pos < block ? n - pos : block;
+            len = mime_base64_encode_lines(map + pos, len, out);
+            if (smtp_data_write(data, out, len) < 0) {
+                munmap(map, n);
+                return -1;
+            }
+        }
+        munmap(map, n);
+    }
+    return 0;
+}
+
+/* Encode with read() from the file offset on, where the file cannot be
+ * mapped. The offset is a multiple of MIME_LINE_BYTES, so lines stay whole. */
+static int encode_read(SmtpData *data, int fd) {
+    unsigned char in[ENCODE_LINES * MIME_LINE_BYTES];
+    char out[ENCODE_LINES * 78];
+    size_t have = 0;
+    ssize_t n;
+
+    /* Only full blocks are encoded before the end, so lines stay whole */
+    while ((n = read(fd, in + have, sizeof(in) - have)) > 0) {
+        have += n;
+        if (have < sizeof(in)) continue;
+        if (smtp_data_write(data, out, mime_base64_encode_lines(in, have, out)) < 0) return -1;
+        have = 0;
+    }
+    if (n < 0) return -1;
+    if (have > 0 && smtp_data_write(data, out, mime_base64_encode_lines(in, have, out)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Stream a file as a base64 part */
+int mime_write_attachment(SmtpData *data, const char *boundary, const char *path) {
+    char header[2048];
+    char name_param[800], filename_param[800];
+    struct stat st;
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "MIME: cannot open %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    format_name_param("name", name, name_param, sizeof(name_param));
+    format_name_param("filename", name, filename_param, sizeof(filename_param));
+    int len = snprintf(header, sizeof(header),
+                       "\r\n--%s\r\n"
+                       "Content-Type: %s; %s\r\n"
+                       "Content-Disposition: attachment; %s\r\n"
+                       "Content-Transfer-Encoding: base64\r\n"
+                       "\r\n", boundary, content_type(name), name_param, filename_param);
+
+    int result = smtp_data_write(data, header, len);
+    if (result == 0 && st.st_size > 0) {
+        result = encode_mapped(data, fd, (size_t)st.st_size);
+        if (result == 1) result = encode_read(data, fd);
+    }
+    close(fd);
+    return result;
+}
+
+/* Close the multipart body */
+int mime_write_end(SmtpData *data, const char *boundary) {
+    char line[MIME_BOUNDARY_LEN + 16];
+    int len = snprintf(line, sizeof(line), "\r\n--%s--\r\n", boundary);
+    return smtp_data_write(data, line, len);
+}
@@ -1,4 +1,6 @@
+#define _POSIX_C_SOURCE 200809L
 #include "network.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,9 +10,16 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
 
 /* Initialize SSL library */
 int net_init_ssl(void) {
+    /* A write to a connection the server has dropped must fail with
+     * EPIPE instead of killing the process */
+    signal(SIGPIPE, SIG_IGN);
+
     SSL_library_init();
     SSL_load_error_strings();
     OpenSSL_add_all_algorithms();
@@ -37,7 +46,9 @@ static int create_socket(const char *host, int port) {
     }
 
     /* Resolve hostname */
+    TRACE_BEGIN(dns_span);
     server = gethostbyname(host);
+    TRACE_END(dns_span, "net", "dns", "%s", host);
     if (server == NULL) {
         fprintf(stderr, "Error: Cannot resolve host %s\n", host);
         close(sockfd);
@@ -51,7 +62,10 @@ static int create_socket(const char *host, int port) {
     server_addr.sin_port = htons(port);
 
     /* Connect */
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    TRACE_BEGIN(connect_span);
+    int connected = connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    TRACE_END(connect_span, "net", "tcp connect", "%s:%d", host, port);
+    if (connected < 0) {
         perror("connect");
         close(sockfd);
         return -1;
@@ -66,6 +80,8 @@ int net_connect(const char *host, int port, int use_ssl, Connection *conn) {
     conn->ssl = NULL;
     conn->ssl_ctx = NULL;
     conn->use_ssl = use_ssl;
+    conn->in_start = 0;
+    conn->in_end = 0;
 
     /* Create TCP socket */
     conn->sockfd = create_socket(host, port);
@@ -96,7 +112,10 @@ int net_connect(const char *host, int port, int use_ssl, Connection *conn) {
         SSL_set_fd(conn->ssl, conn->sockfd);
 
         /* Perform SSL handshake */
-        if (SSL_connect(conn->ssl) <= 0) {
+        TRACE_BEGIN(handshake_span);
+        int handshake = SSL_connect(conn->ssl);
+        TRACE_END(handshake_span, "net", "tls handshake", "%s", host);
+        if (handshake <= 0) {
             fprintf(stderr, "Error: SSL handshake failed\n");
             ERR_print_errors_fp(stderr);
             SSL_free(conn->ssl);
@@ -124,29 +143,79 @@ void net_disconnect(Connection *conn) {
         close(conn->sockfd);
         conn->sockfd = -1;
     }
+    conn->in_start = 0;
+    conn->in_end = 0;
 }
 
-/* Send data over connection */
+/* Send data over connection. A write can take only part of the data
+ * (a send timeout is set on the socket), so this goes on until all of it
+ * is sent. Returns len, or -1 if the rest could not be sent: a message cut
+ * short must not pass for a sent one. */
 int net_send(Connection *conn, const char *data, int len) {
-    int bytes_sent;
+    int sent = 0;
+
+    TRACE_BEGIN(span);
+    while (sent < len) {
+        int n;
+        if (conn->use_ssl && conn->ssl) {
+            n = SSL_write(conn->ssl, data + sent, len - sent);
+        } else {
+            n = write(conn->sockfd, data + sent, len - sent);
+            if (n < 0 && errno == EINTR) continue;
+        }
+        if (n <= 0) {
+            sent = -1;
+            break;
+        }
+        sent += n;
+    }
+    TRACE_END(span, "net", "send", "%d bytes", sent);
+
+    return sent;
+}
 
+/* One read from the socket or TLS into buffer */
+static int net_read(Connection *conn, char *buffer, int len) {
+    int bytes_received;
+
+    TRACE_BEGIN(span);
     if (conn->use_ssl && conn->ssl) {
-        bytes_sent = SSL_write(conn->ssl, data, len);
+        bytes_received = SSL_read(conn->ssl, buffer, len);
     } else {
-        bytes_sent = write(conn->sockfd, data, len);
+        bytes_received = read(conn->sockfd, buffer, len);
     }
+    TRACE_END(span, "net", "recv", "%d bytes", bytes_received);
 
-    return bytes_sent;
+    return bytes_received;
+}
+
+/* Read more into the input buffer. Returns bytes added, <= 0 at end of
+ * stream or on error. */
+static int net_fill(Connection *conn) {
+    if (conn->in_start > 0) {
+        memmove(conn->in, conn->in + conn->in_start, conn->in_end - conn->in_start);
+        conn->in_end -= conn->in_start;
+        conn->in_start = 0;
+    }
+
+    int n = net_read(conn, conn->in + conn->in_end, NET_BUFFER_SIZE - conn->in_end);
+    if (n > 0) conn->in_end += n;
+    return n;
 }
 
 /* Receive data from connection */
 int net_recv(Connection *conn, char *buffer, int buffer_size) {
     int bytes_received;
 
-    if (conn->use_ssl && conn->ssl) {
-        bytes_received = SSL_read(conn->ssl, buffer, buffer_size - 1);
+    if (conn->in_end > conn->in_start) {
+        /* Buffered data first */
+        bytes_received = conn->in_end - conn->in_start;
+        if (bytes_received > buffer_size - 1) bytes_received = buffer_size - 1;
+        memcpy(buffer, conn->in + conn->in_start, bytes_received);
+        conn->in_start += bytes_received;
     } else {
-        bytes_received = read(conn->sockfd, buffer, buffer_size - 1);
+        /* Large reads such as literals go straight to the caller */
+        bytes_received = net_read(conn, buffer, buffer_size - 1);
     }
 
     if (bytes_received > 0) {
@@ -156,30 +225,99 @@ int net_recv(Connection *conn, char *buffer, int buffer_size) {
     return bytes_received;
 }
 
-/* Receive a line of data (until \n) */
-int net_recv_line(Connection *conn, char *buffer, int buffer_size) {
-    int total = 0;
-    char c;
-    int n;
+/* Cut a line (through \n) out of the input buffer, or as much as fits in
+ * buffer. With partial, what is buffered is taken even without \n.
+ * Returns its length, 0 if there is no line yet. */
+static int net_take_line(Connection *conn, char *buffer, int buffer_size, int partial) {
+    int available = conn->in_end - conn->in_start;
+    int room = buffer_size - 1;
+    int len = available < room ? available : room;
+    const char *start = conn->in + conn->in_start;
+    const char *newline = memchr(start, '\n', len);
 
-    while (total < buffer_size - 1) {
-        if (conn->use_ssl && conn->ssl) {
-            n = SSL_read(conn->ssl, &c, 1);
-        } else {
-            n = read(conn->sockfd, &c, 1);
-        }
+    if (newline) {
+        len = (int)(newline - start) + 1;
+    } else if (len < room && !partial && conn->in_end - conn->in_start < NET_BUFFER_SIZE) {
+        /* Incomplete, and both buffers have room for more */
+        return 0;
+    }
 
-        if (n <= 0) {
-            break;
-        }
+    memcpy(buffer, start, len);
+    buffer[len] = '\0';
+    conn->in_start += len;
+    if (conn->in_start == conn->in_end) {
+        conn->in_start = 0;
+        conn->in_end = 0;
+    }
+    return len;
+}
 
-        buffer[total++] = c;
+/* Receive a line of data (until \n) */
+int net_recv_line(Connection *conn, char *buffer, int buffer_size) {
+    int total;
 
-        if (c == '\n') {
+    TRACE_BEGIN(span);
+    while ((total = net_take_line(conn, buffer, buffer_size, 0)) == 0) {
+        if (net_fill(conn) <= 0) {
+            /* What arrived before the end of the stream is still a line */
+            total = net_take_line(conn, buffer, buffer_size, 1);
             break;
         }
     }
 
     buffer[total] = '\0';
+    TRACE_END(span, "net", "recv line", "%d bytes", total);
     return total;
 }
+
+int net_recv_line_nowait(Connection *conn, char *buffer, int buffer_size) {
+    int total;
+
+    while ((total = net_take_line(conn, buffer, buffer_size, 0)) == 0) {
+        /* Check the socket itself: the buffered partial line does not count */
+        int ready = conn->use_ssl && conn->ssl && SSL_pending(conn->ssl) > 0;
+        if (!ready) {
+            struct pollfd pfd = { conn->sockfd, POLLIN, 0 };
+            ready = poll(&pfd, 1, 0) > 0;
+        }
+        if (!ready) return 0;
+
+        if (net_fill(conn) <= 0) return -1;
+    }
+    return total;
+}
+
+/* Wait up to timeout_ms for data to read. Returns 1 if readable, 0 on
+ * timeout, -1 on error. Data already buffered or decrypted by OpenSSL
+ * counts. */
+int net_poll_readable(Connection *conn, int timeout_ms) {
+    struct pollfd pfd;
+
+    if (conn->in_end > conn->in_start) {
+        return 1;
+    }
+    if (conn->use_ssl && conn->ssl && SSL_pending(conn->ssl) > 0) {
+        return 1;
+    }
+
+    pfd.fd = conn->sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int n = poll(&pfd, 1, timeout_ms);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    return n > 0 ? 1 : 0;
+}
+
+/* Make reads and writes give up after the given number of seconds */
+int net_set_timeout(Connection *conn, int seconds) {
+    struct timeval tv = { seconds, 0 };
+
+    if (setsockopt(conn->sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(conn->sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,522 @@
+#define _XOPEN_SOURCE 700
+#include "outbox.h"
+#include "mime.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SPOOL_NAME_LEN 64
+#define ENVELOPE_LINE_LEN 4096
+
+/* Spool files are named <time>-<pid>-<seq>.msg, so name order is queue
+ * order. Each holds the envelope, a blank line and the message:
+ *
+ *   envelope-from: me@example.com
+ *   envelope-to: a@example.com, "Doe, J" <j@example.com>
+ *   boundary: =_cterm_...              (only with attachments)
+ *   attachment: /home/me/report.pdf    (one line per file)
+ *
+ *   From: me@example.com
+ *   ...
+ *
+ * Attached files are not copied: the spooled message ends with the text
+ * part, and the files are encoded straight into the SMTP stream when the
+ * message is sent.
+ *
+ * A message is written to a .tmp file first and renamed when complete;
+ * one that was set aside gets the .failed suffix. */
+
+static int has_suffix(const char *name, const char *suffix) {
+    size_t len = strlen(name), n = strlen(suffix);
+    return len > n && strcmp(name + len - n, suffix) == 0;
+}
+
+/* Count spooled and set-aside messages and find the oldest spooled one.
+ * Leftover .tmp files come from an interrupted write and are removed. */
+static int outbox_scan(Outbox *outbox, char *oldest, size_t size) {
+    char path[800];
+    DIR *dir = opendir(outbox->spool_dir);
+    struct dirent *entry;
+
+    if (!dir) return -1;
+
+    oldest[0] = '\0';
+    outbox->queued = 0;
+    outbox->failed = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+
+        if (has_suffix(name, ".msg")) {
+            outbox->queued++;
+            if ((!oldest[0] || strcmp(name, oldest) < 0) && strlen(name) < size) {
+                strcpy(oldest, name);
+            }
+        } else if (has_suffix(name, ".failed")) {
+            outbox->failed++;
+        } else if (has_suffix(name, ".tmp") && outbox->seq == 0) {
+            snprintf(path, sizeof(path), "%s/%s", outbox->spool_dir, name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+/* Send one spool file: the envelope is parsed, the message itself is
+ * streamed from the file descriptor */
+static int outbox_send_file(SmtpSession *smtp, const char *path) {
+    char line[ENVELOPE_LINE_LEN];
+    char from[MAX_ADDRESS_LEN] = "";
+    char to[ENVELOPE_LINE_LEN] = "";
+    char boundary[MIME_BOUNDARY_LEN] = "";
+    char attachments[MIME_MAX_ATTACHMENTS][PATH_MAX];
+    int attachment_count = 0;
+    int malformed = 0;
+    SmtpData data;
+
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') break;
+
+        if (strncmp(line, "envelope-from: ", 15) == 0) {
+            /* An address that does not fit would go out cut short */
+            if (snprintf(from, sizeof(from), "%s", line + 15) >= (int)sizeof(from)) malformed = 1;
+        } else if (strncmp(line, "envelope-to: ", 13) == 0) {
+            snprintf(to, sizeof(to), "%s", line + 13);
+        } else if (strncmp(line, "boundary: ", 10) == 0) {
+            if (snprintf(boundary, sizeof(boundary), "%s", line + 10) >= (int)sizeof(boundary)) {
+                malformed = 1;
+            }
+        } else if (strncmp(line, "attachment: ", 12) == 0 &&
+                   attachment_count < MIME_MAX_ATTACHMENTS) {
+            snprintf(attachments[attachment_count++], PATH_MAX, "%s", line + 12);
+        }
+    }
+
+    /* stdio has read ahead; continue from the end of the envelope */
+    off_t offset = ftello(file);
+    int fd = fileno(file);
+    if (malformed || !from[0] || !to[0] || offset < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+        fprintf(stderr, "Outbox: malformed spool file %s\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    /* A file that went away cannot be noticed once DATA has started */
+    for (int i = 0; i < attachment_count; i++) {
+        if (!mime_attachment_ok(attachments[i])) {
+            fprintf(stderr, "Outbox: cannot read attachment %s\n", attachments[i]);
+            fclose(file);
+            return -1;
+        }
+    }
+
+    int result = smtp_data_begin(smtp, from, to, &data);
+    if (result == 0) {
+        result = smtp_data_write_fd(&data, fd);
+        for (int i = 0; result == 0 && i < attachment_count; i++) {
+            result = mime_write_attachment(&data, boundary, attachments[i]);
+        }
+        if (result == 0 && attachment_count > 0) {
+            result = mime_write_end(&data, boundary);
+        }
+
+        /* Ending a message that lost a part on the way would send it */
+        if (result == 0) {
+            result = smtp_data_end(&data);
+        } else {
+            smtp_data_abort(&data);
+            if (data.rejected) result = SMTP_REJECTED;
+        }
+    }
+    fclose(file);
+    return result;
+}
+
+/* Delay before the next attempt after the given number of failures */
+static int outbox_backoff(int attempts) {
+    int delay = OUTBOX_RETRY_MIN;
+    while (--attempts > 0 && delay < OUTBOX_RETRY_MAX) delay *= 2;
+    return delay < OUTBOX_RETRY_MAX ? delay : OUTBOX_RETRY_MAX;
+}
+
+/* Drop a session without QUIT, for when the server is gone */
+static void outbox_drop(Outbox *outbox) {
+    outbox->smtp.connected = 0;
+    smtp_disconnect(&outbox->smtp);
+}
+
+/* Open and authenticate the SMTP session */
+static int outbox_connect(Outbox *outbox) {
+    const Config *config = outbox->config;
+    SmtpSession *smtp = &outbox->smtp;
+    char token[MAX_TOKEN_LEN];
+
+    /* The token command is run on every connect, so a refreshed token
+     * is picked up without a restart */
+    if (config_oauth_token(config, 1, token, sizeof(token)) < 0) {
+        return -1;
+    }
+    if (smtp_connect(smtp, config->smtp_server, config->smtp_port, config->smtp_use_ssl) < 0) {
+        return -1;
+    }
+    if ((config->smtp_use_starttls && smtp_starttls(smtp) < 0) ||
+        smtp_authenticate(smtp, config->smtp_username, config->smtp_password, token) < 0) {
+        memset(token, 0, sizeof(token));
+        outbox_drop(outbox);
+        return -1;
+    }
+    memset(token, 0, sizeof(token));
+    outbox->last_used = time(NULL);
+    return 0;
+}
+
+/* Get a working session: one the server closed, or one that does not
+ * answer a NOOP after a long idle time, is replaced by a new one */
+static int outbox_ensure_connected(Outbox *outbox) {
+    SmtpSession *smtp = &outbox->smtp;
+
+    if (smtp->connected && !smtp_idle_ok(smtp)) {
+        outbox_drop(outbox);
+    }
+    if (smtp->connected && time(NULL) - outbox->last_used >= OUTBOX_KEEPALIVE) {
+        if (smtp_noop(smtp) < 0) {
+            outbox_drop(outbox);
+        } else {
+            outbox->last_used = time(NULL);
+        }
+    }
+    if (!smtp->connected) {
+        return outbox_connect(outbox);
+    }
+    return 0;
+}
+
+/* Tell the UI the status changed */
+static void outbox_notify(Outbox *outbox) {
+    if (outbox->notify[1] >= 0 && write(outbox->notify[1], "", 1) < 0) {
+        /* The pipe is full: a notification is pending already */
+    }
+}
+
+/* Record the outcome of a connection attempt. Called with the lock held. */
+static void outbox_connected(Outbox *outbox, int ok) {
+    if (ok) {
+        outbox->offline = 0;
+        outbox->connect_failures = 0;
+    } else {
+        outbox->offline = 1;
+        outbox->connect_failures++;
+        outbox->next_attempt = time(NULL) + outbox_backoff(outbox->connect_failures);
+    }
+}
+
+/* Send the oldest spooled message. Called with the lock held; the lock is
+ * released while talking to the server. */
+static void outbox_send_next(Outbox *outbox) {
+    char name[SPOOL_NAME_LEN + 16];
+    char path[800];
+
+    if (outbox_scan(outbox, name, sizeof(name)) < 0 || !name[0]) {
+        outbox->queued = 0;
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/%s", outbox->spool_dir, name);
+
+    outbox->sending = 1;
+    outbox_notify(outbox);
+    pthread_mutex_unlock(&outbox->lock);
+
+    int connected = outbox_ensure_connected(outbox) == 0;
+    int result = -1;
+    if (connected) {
+        result = outbox_send_file(&outbox->smtp, path);
+        if (result == 0) {
+            unlink(path);
+        } else if (outbox->smtp.connected && smtp_noop(&outbox->smtp) < 0) {
+            /* The connection broke, not the message: try again later. One
+             * closed on purpose to abort a message is reopened next time. */
+            outbox_drop(outbox);
+            connected = 0;
+        }
+        outbox->last_used = time(NULL);
+    }
+
+    pthread_mutex_lock(&outbox->lock);
+    outbox->sending = 0;
+    outbox_connected(outbox, connected);
+    outbox_notify(outbox);
+
+    if (result == 0) {
+        outbox->sent++;
+        outbox->last_sent = time(NULL);
+        outbox->attempts = 0;
+        outbox->next_attempt = 0;
+    } else if (connected && (result == SMTP_REJECTED || ++outbox->attempts >= OUTBOX_MAX_ATTEMPTS)) {
+        /* Keep it out of the way of the messages behind it. A message the
+         * server refused for good is not tried again. */
+        char failed[820];
+        snprintf(failed, sizeof(failed), "%.*s.failed", (int)(strlen(path) - 4), path);
+        rename(path, failed);
+        outbox->attempts = 0;
+        outbox->next_attempt = 0;
+    } else if (connected) {
+        outbox->next_attempt = time(NULL) + outbox_backoff(outbox->attempts);
+    }
+    outbox_scan(outbox, name, sizeof(name));
+}
+
+/* Worker thread: send due messages and look after the session */
+static void *outbox_worker(void *arg) {
+    Outbox *outbox = arg;
+    SmtpSession *smtp = &outbox->smtp;
+
+    TRACE_THREAD("outbox");
+    pthread_mutex_lock(&outbox->lock);
+    while (!outbox->stop) {
+        time_t now = time(NULL);
+        int retry_due = outbox->next_attempt <= now;
+        int warm = outbox->warm_until > now;
+
+        if (outbox->queued > 0 && retry_due) {
+            outbox_send_next(outbox);
+            continue;
+        }
+
+        if (warm && (smtp->connected ? now - outbox->last_used >= OUTBOX_KEEPALIVE : retry_due)) {
+            /* Connect in advance, or keep the idle session from timing out */
+            pthread_mutex_unlock(&outbox->lock);
+            int ok = outbox_ensure_connected(outbox) == 0;
+            pthread_mutex_lock(&outbox->lock);
+            outbox_connected(outbox, ok);
+            outbox_notify(outbox);
+            continue;
+        }
+
+        if (!warm && smtp->connected) {
+            /* Nobody is about to send: do not hold the server's resources */
+            pthread_mutex_unlock(&outbox->lock);
+            smtp_disconnect(smtp);
+            pthread_mutex_lock(&outbox->lock);
+            continue;
+        }
+
+        /* Sleep until a retry is due, the session needs a NOOP or the
+         * warm-up ends, or until woken by a new message */
+        time_t until = 0;
+        if (outbox->next_attempt > now && (outbox->queued > 0 || warm)) {
+            until = outbox->next_attempt;
+        }
+        if (warm && smtp->connected) {
+            time_t keepalive = outbox->last_used + OUTBOX_KEEPALIVE;
+            if (!until || keepalive < until) until = keepalive;
+            if (outbox->warm_until < until) until = outbox->warm_until;
+        } else if (warm && !until) {
+            until = outbox->warm_until;
+        }
+
+        if (until) {
+            struct timespec deadline = { until, 0 };
+            pthread_cond_timedwait(&outbox->wake, &outbox->lock, &deadline);
+        } else {
+            pthread_cond_wait(&outbox->wake, &outbox->lock);
+        }
+    }
+    pthread_mutex_unlock(&outbox->lock);
+
+    smtp_disconnect(smtp);
+    return NULL;
+}
+
+static void outbox_close_notify(Outbox *outbox) {
+    for (int i = 0; i < 2; i++) {
+        if (outbox->notify[i] >= 0) close(outbox->notify[i]);
+        outbox->notify[i] = -1;
+    }
+}
+
+/* Scan the spool and start the worker */
+int outbox_init(Outbox *outbox, const Config *config, const char *spool_dir) {
+    char oldest[SPOOL_NAME_LEN + 16];
+
+    memset(outbox, 0, sizeof(Outbox));
+    outbox->config = config;
+    outbox->smtp.conn.sockfd = -1;
+    snprintf(outbox->spool_dir, sizeof(outbox->spool_dir), "%s", spool_dir);
+
+    if (mkdir(spool_dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create outbox %s\n", spool_dir);
+        return -1;
+    }
+    if (outbox_scan(outbox, oldest, sizeof(oldest)) < 0) {
+        fprintf(stderr, "Error: Cannot read outbox %s\n", spool_dir);
+        return -1;
+    }
+
+    /* Without the pipe the UI still sees changes on its next redraw */
+    if (pipe(outbox->notify) < 0) {
+        outbox->notify[0] = outbox->notify[1] = -1;
+    } else {
+        fcntl(outbox->notify[0], F_SETFL, O_NONBLOCK);
+        fcntl(outbox->notify[1], F_SETFL, O_NONBLOCK);
+    }
+
+    pthread_mutex_init(&outbox->lock, NULL);
+    pthread_cond_init(&outbox->wake, NULL);
+    if (pthread_create(&outbox->thread, NULL, outbox_worker, outbox) != 0) {
+        fprintf(stderr, "Error: Cannot start outbox worker\n");
+        pthread_cond_destroy(&outbox->wake);
+        pthread_mutex_destroy(&outbox->lock);
+        outbox_close_notify(outbox);
+        return -1;
+    }
+    outbox->started = 1;
+    return 0;
+}
+
+/* Stop the worker after the message in progress; the spool is kept */
+void outbox_shutdown(Outbox *outbox) {
+    if (!outbox->started) return;
+
+    pthread_mutex_lock(&outbox->lock);
+    outbox->stop = 1;
+    pthread_cond_signal(&outbox->wake);
+    pthread_mutex_unlock(&outbox->lock);
+
+    pthread_join(outbox->thread, NULL);
+    pthread_cond_destroy(&outbox->wake);
+    pthread_mutex_destroy(&outbox->lock);
+    outbox_close_notify(outbox);
+    outbox->started = 0;
+}
+
+/* Spool a message for sending. Returns once it is safely on disk. */
+int outbox_enqueue(Outbox *outbox, const char *from, const char *to,
+                   const char *subject, const char *body,
+                   const char *const *attachments, int attachment_count) {
+    char name[SPOOL_NAME_LEN];
+    char boundary[MIME_BOUNDARY_LEN];
+    char resolved[PATH_MAX];
+    char tmp_path[800], path[800];
+    char date_str[64];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&outbox->lock);
+    unsigned int seq = ++outbox->seq;
+    pthread_mutex_unlock(&outbox->lock);
+
+    snprintf(name, sizeof(name), "%010lld-%05d-%04u", (long long)now, (int)getpid(), seq % 10000);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", outbox->spool_dir, name);
+    snprintf(path, sizeof(path), "%s/%s.msg", outbox->spool_dir, name);
+
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        fprintf(stderr, "Outbox: cannot create %s\n", tmp_path);
+        return -1;
+    }
+
+    if (attachment_count > MIME_MAX_ATTACHMENTS) attachment_count = MIME_MAX_ATTACHMENTS;
+    snprintf(boundary, sizeof(boundary), "=_cterm_%.48s", name);
+
+    strftime(date_str, sizeof(date_str), "%a, %d %b %Y %H:%M:%S +0000", gmtime(&now));
+    fprintf(file, "envelope-from: %s\nenvelope-to: %s\n", from, to);
+    if (attachment_count > 0) fprintf(file, "boundary: %s\n", boundary);
+    for (int i = 0; i < attachment_count; i++) {
+        /* Sending may happen after a restart from another directory */
+        if (!realpath(attachments[i], resolved)) {
+            fprintf(stderr, "Outbox: cannot attach %s\n", attachments[i]);
+            fclose(file);
+            unlink(tmp_path);
+            return -1;
+        }
+        fprintf(file, "attachment: %s\n", resolved);
+    }
+
+    fprintf(file, "\nFrom: %s\nTo: %s\nSubject: %s\nDate: %s\n", from, to, subject, date_str);
+    if (attachment_count > 0) {
+        mime_write_multipart_headers(file, boundary);
+    } else {
+        fputc('\n', file);
+    }
+    fputs(body, file);
+
+    /* The message must be on disk before it counts as queued */
+    int failed = ferror(file) || fflush(file) != 0 || fsync(fileno(file)) < 0;
+    if (fclose(file) != 0 || failed) {
+        fprintf(stderr, "Outbox: cannot write %s\n", tmp_path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&outbox->lock);
+    int result = rename(tmp_path, path);
+    if (result == 0) {
+        outbox->queued++;
+        outbox->next_attempt = 0;
+        pthread_cond_signal(&outbox->wake);
+    }
+    pthread_mutex_unlock(&outbox->lock);
+
+    if (result < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* A message is about to be written: connect now so sending does not wait
+ * for TCP, TLS and authentication */
+void outbox_warm_up(Outbox *outbox) {
+    if (!outbox->started) return;
+
+    pthread_mutex_lock(&outbox->lock);
+    outbox->warm_until = time(NULL) + OUTBOX_WARM_SECONDS;
+    if (outbox->offline) outbox->next_attempt = 0;
+    pthread_cond_signal(&outbox->wake);
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+/* One-line state for the status bar, empty when there is nothing to say */
+void outbox_status(Outbox *outbox, char *buffer, size_t size) {
+    time_t now = time(NULL);
+    int len = 0;
+
+    buffer[0] = '\0';
+    if (!outbox->started) return;
+
+    /* Whatever was notified is about to be shown */
+    char drain[64];
+    while (outbox->notify[0] >= 0 && read(outbox->notify[0], drain, sizeof(drain)) > 0) {
+    }
+
+    pthread_mutex_lock(&outbox->lock);
+    if (outbox->sending) {
+        len = snprintf(buffer, size, "Sending (%d queued)", outbox->queued);
+    } else if (outbox->queued > 0 && outbox->next_attempt > now) {
+        len = snprintf(buffer, size, "%d queued, %sretry in %llds", outbox->queued,
+                       outbox->offline ? "SMTP unreachable, " : "",
+                       (long long)(outbox->next_attempt - now));
+    } else if (outbox->queued > 0) {
+        len = snprintf(buffer, size, "%d queued", outbox->queued);
+    } else if (outbox->last_sent && now - outbox->last_sent < 5) {
+        len = snprintf(buffer, size, "✓ Sent");
+    }
+    if (outbox->failed > 0 && len >= 0 && (size_t)len < size) {
+        snprintf(buffer + len, size - len, "%s%d not sent", len ? ", " : "", outbox->failed);
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+int outbox_event_fd(const Outbox *outbox) {
+    return outbox->started ? outbox->notify[0] : -1;
+}
@@ -0,0 +1,43 @@
+#include "queue.h"
+#include <stdlib.h>
+
+int queue_init(SpscQueue *queue, unsigned int capacity) {
+    unsigned int size = 2;
+
+    while (size < capacity) size *= 2;
+
+    queue->slots = calloc(size, sizeof(void *));
+    if (!queue->slots) return -1;
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    return 0;
+}
+
+void queue_free(SpscQueue *queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+int queue_push(SpscQueue *queue, void *item) {
+    unsigned int tail = queue->tail;
+    unsigned int head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+    /* Indices run freely; their difference is the number queued */
+    if (tail - head > queue->mask) return -1;
+
+    queue->slots[tail & queue->mask] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void *queue_pop(SpscQueue *queue) {
+    unsigned int head = queue->head;
+    unsigned int tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) return NULL;
+
+    void *item = queue->slots[head & queue->mask];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
@@ -0,0 +1,155 @@
+#include "render.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV_PRIME 1099511628211ULL
+
+void render_init(RenderRegion *region) {
+    region->rows = NULL;
+    region->height = 0;
+    region->width = 0;
+    region->owner = -1;
+    region->valid = 0;
+    region->top = 0;
+}
+
+void render_free(RenderRegion *region) {
+    free(region->rows);
+    render_init(region);
+}
+
+void render_invalidate(RenderRegion *region) {
+    region->valid = 0;
+}
+
+int render_begin(RenderRegion *region, WINDOW *win, int owner) {
+    int height, width;
+    getmaxyx(win, height, width);
+
+    if (height != region->height || width != region->width) {
+        uint64_t *rows = realloc(region->rows, sizeof(uint64_t) * (height > 0 ? height : 1));
+        if (!rows) {
+            /* Without a row cache every paint is a full one */
+            region->valid = 0;
+            return 1;
+        }
+        region->rows = rows;
+        region->height = height;
+        region->width = width;
+        region->valid = 0;
+    }
+    if (owner != region->owner) {
+        region->owner = owner;
+        region->valid = 0;
+    }
+    if (region->valid) return 0;
+
+    memset(region->rows, 0, sizeof(uint64_t) * region->height);
+    region->valid = 1;
+    return 1;
+}
+
+uint64_t render_hash(uint64_t hash, const char *text) {
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        hash = (hash ^ *p) * FNV_PRIME;
+    }
+    /* Separator, so "ab"+"c" and "a"+"bc" differ */
+    return (hash ^ 0xFF) * FNV_PRIME;
+}
+
+uint64_t render_hash_int(uint64_t hash, long value) {
+    unsigned long bits = (unsigned long)value;
+    for (size_t i = 0; i < sizeof(bits); i++) {
+        hash = (hash ^ (bits & 0xFF)) * FNV_PRIME;
+        bits >>= 8;
+    }
+    return hash;
+}
+
+int render_row_changed(RenderRegion *region, int y, uint64_t hash) {
+    if (!region->rows || !region->valid || y < 0 || y >= region->height) return 1;
+    if (hash == RENDER_UNKNOWN) hash = 1;
+
+    if (region->rows[y] == hash) return 0;
+    region->rows[y] = hash;
+    return 1;
+}
+
+void render_scroll(RenderRegion *region, WINDOW *win, int top, int bottom, int delta) {
+    int lines = bottom - top + 1;
+    if (delta == 0 || lines <= 0) return;
+
+    /* With idlok the terminal moves the rows itself (csr plus index or
+     * reverse index), so only the exposed rows are sent */
+    wsetscrreg(win, top, bottom);
+    wscrl(win, delta);
+    wsetscrreg(win, 0, region->height - 1);
+
+    if (!region->rows || !region->valid) return;
+    if (delta >= lines || -delta >= lines) {
+        memset(region->rows + top, 0, sizeof(uint64_t) * lines);
+    } else if (delta > 0) {
+        memmove(region->rows + top, region->rows + top + delta, sizeof(uint64_t) * (lines - delta));
+        memset(region->rows + bottom + 1 - delta, 0, sizeof(uint64_t) * delta);
+    } else {
+        memmove(region->rows + top - delta, region->rows + top, sizeof(uint64_t) * (lines + delta));
+        memset(region->rows + top, 0, sizeof(uint64_t) * -delta);
+    }
+}
+
+void render_cache_init(RenderRowCache *cache) {
+    cache->text = NULL;
+    cache->keys = NULL;
+    cache->capacity = 0;
+}
+
+void render_cache_free(RenderRowCache *cache) {
+    render_cache_clear(cache);
+    free(cache->text);
+    free(cache->keys);
+    render_cache_init(cache);
+}
+
+void render_cache_clear(RenderRowCache *cache) {
+    for (int i = 0; i < cache->capacity; i++) {
+        free(cache->text[i]);
+        cache->text[i] = NULL;
+        cache->keys[i] = 0;
+    }
+}
+
+const char *render_cache_get(RenderRowCache *cache, int index, uint64_t key) {
+    if (index < 0 || index >= cache->capacity || cache->keys[index] != key) return NULL;
+    return cache->text[index];
+}
+
+const char *render_cache_put(RenderRowCache *cache, int index, uint64_t key, const char *text) {
+    if (index < 0) return NULL;
+
+    if (index >= cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity : 256;
+        while (capacity <= index) capacity *= 2;
+
+        char **rows = realloc(cache->text, sizeof(char *) * capacity);
+        if (!rows) return NULL;
+        cache->text = rows;
+        uint64_t *keys = realloc(cache->keys, sizeof(uint64_t) * capacity);
+        if (!keys) return NULL;
+        cache->keys = keys;
+
+        for (int i = cache->capacity; i < capacity; i++) {
+            cache->text[i] = NULL;
+            cache->keys[i] = 0;
+        }
+        cache->capacity = capacity;
+    }
+
+    size_t len = strlen(text);
+    char *copy = realloc(cache->text[index], len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, len + 1);
+
+    cache->text[index] = copy;
+    cache->keys[index] = key;
+    return copy;
+}
@@ -0,0 +1,74 @@
+#include "sasl.h"
+#include "mime.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+static const char *mechanism_names[] = {
+    [SASL_NONE] = "",
+    [SASL_PLAIN] = "PLAIN",
+    [SASL_LOGIN] = "LOGIN",
+    [SASL_XOAUTH2] = "XOAUTH2",
+    [SASL_OAUTHBEARER] = "OAUTHBEARER",
+};
+
+const char *sasl_mechanism_name(SaslMechanism mechanism) {
+    return mechanism_names[mechanism];
+}
+
+/* Is name one of the space-separated tokens in list (after prefix)? */
+static int offers(const char *list, const char *prefix, const char *name) {
+    size_t prefix_len = strlen(prefix), name_len = strlen(name);
+    const char *p = list;
+
+    while (*p) {
+        while (*p == ' ') p++;
+        size_t len = strcspn(p, " \r\n");
+        if (len == prefix_len + name_len && strncasecmp(p, prefix, prefix_len) == 0 &&
+            strncasecmp(p + prefix_len, name, name_len) == 0) {
+            return 1;
+        }
+        p += len;
+        if (*p == '\r' || *p == '\n') break;
+    }
+    return 0;
+}
+
+/* Pick a mechanism from the server's list */
+SaslMechanism sasl_choose(const char *offered, const char *prefix, int use_token) {
+    static const SaslMechanism token_order[] = { SASL_OAUTHBEARER, SASL_XOAUTH2 };
+    static const SaslMechanism password_order[] = { SASL_PLAIN, SASL_LOGIN };
+    const SaslMechanism *order = use_token ? token_order : password_order;
+
+    for (int i = 0; i < 2; i++) {
+        if (offers(offered, prefix, mechanism_names[order[i]])) return order[i];
+    }
+    return SASL_NONE;
+}
+
+/* Base64 initial client response carrying the password or token */
+int sasl_initial_response(SaslMechanism mechanism, const char *username,
+                          const char *secret, char *out, size_t size) {
+    char raw[SASL_MAX_RESPONSE * 3 / 4];
+    int len;
+
+    switch (mechanism) {
+        case SASL_PLAIN:
+            /* authzid NUL authcid NUL password */
+            len = snprintf(raw, sizeof(raw), "%c%s%c%s", 0, username, 0, secret);
+            break;
+        case SASL_XOAUTH2:
+            len = snprintf(raw, sizeof(raw), "user=%s\001auth=Bearer %s\001\001", username, secret);
+            break;
+        case SASL_OAUTHBEARER:
+            len = snprintf(raw, sizeof(raw), "n,a=%s,\001auth=Bearer %s\001\001", username, secret);
+            break;
+        default:
+            return -1;
+    }
+
+    if (len < 0 || (size_t)len >= sizeof(raw) || ((size_t)len + 2) / 3 * 4 + 1 > size) {
+        return -1;
+    }
+    return (int)mime_base64_encode((const unsigned char *)raw, len, out);
+}
@@ -0,0 +1,572 @@
+#include "search.h"
+#include "utf8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SEARCH_MAGIC "CTIX"
+#define SEARCH_VERSION 1
+#define MIN_TERM_LEN 2
+#define MAX_TERM_LEN 32
+#define MAX_QUERY_TERMS 16
+#define MAX_TF 127
+
+static unsigned int hash_term(const char *term, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)term[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static unsigned int hash_uid(unsigned int uid) {
+    uid ^= uid >> 16;
+    uid *= 0x45d9f3bu;
+    uid ^= uid >> 16;
+    return uid;
+}
+
+/* Find the next word in folded text. Words are runs of ASCII letters and
+ * digits or non-ASCII bytes. Returns pointer past the word or NULL. */
+static const char *next_term(const char *p, const char **term, size_t *len) {
+    const unsigned char *s = (const unsigned char *)p;
+
+    for (;;) {
+        while (*s && !(*s >= 0x80 || (*s >= 'a' && *s <= 'z') || (*s >= '0' && *s <= '9'))) {
+            s++;
+        }
+        if (!*s) return NULL;
+
+        const unsigned char *start = s;
+        while (*s >= 0x80 || (*s >= 'a' && *s <= 'z') || (*s >= '0' && *s <= '9')) {
+            s++;
+        }
+
+        size_t n = s - start;
+        if (n >= MIN_TERM_LEN && n <= MAX_TERM_LEN) {
+            *term = (const char *)start;
+            *len = n;
+            return (const char *)s;
+        }
+    }
+}
+
+static int find_term(const SearchIndex *index, const char *term, size_t len, unsigned int hash) {
+    if (index->term_bucket_count == 0) return -1;
+
+    unsigned int mask = index->term_bucket_count - 1;
+    unsigned int slot = hash & mask;
+    while (index->term_buckets[slot] != -1) {
+        const SearchTerm *t = &index->terms[index->term_buckets[slot]];
+        if (t->hash == hash) {
+            const char *stored = index->pool + t->text_offset;
+            if (strncmp(stored, term, len) == 0 && stored[len] == '\0') {
+                return index->term_buckets[slot];
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+static int grow_term_buckets(SearchIndex *index) {
+    int new_count = index->term_bucket_count ? index->term_bucket_count * 2 : 4096;
+    int *buckets = malloc(sizeof(int) * new_count);
+    if (!buckets) return -1;
+
+    for (int i = 0; i < new_count; i++) buckets[i] = -1;
+    for (int i = 0; i < index->term_count; i++) {
+        unsigned int slot = index->terms[i].hash & (new_count - 1);
+        while (buckets[slot] != -1) slot = (slot + 1) & (new_count - 1);
+        buckets[slot] = i;
+    }
+
+    free(index->term_buckets);
+    index->term_buckets = buckets;
+    index->term_bucket_count = new_count;
+    return 0;
+}
+
+static int add_term(SearchIndex *index, const char *term, size_t len, unsigned int hash) {
+    if ((index->term_count + 1) * 2 > index->term_bucket_count) {
+        if (grow_term_buckets(index) < 0) return -1;
+    }
+    if (index->term_count >= index->term_capacity) {
+        int new_capacity = index->term_capacity ? index->term_capacity * 2 : 1024;
+        SearchTerm *terms = realloc(index->terms, sizeof(SearchTerm) * new_capacity);
+        if (!terms) return -1;
+        index->terms = terms;
+        index->term_capacity = new_capacity;
+    }
+    if (index->pool_len + len + 1 > index->pool_capacity) {
+        size_t new_capacity = index->pool_capacity ? index->pool_capacity * 2 : 65536;
+        while (index->pool_len + len + 1 > new_capacity) new_capacity *= 2;
+        char *pool = realloc(index->pool, new_capacity);
+        if (!pool) return -1;
+        index->pool = pool;
+        index->pool_capacity = new_capacity;
+    }
+
+    SearchTerm *t = &index->terms[index->term_count];
+    memset(t, 0, sizeof(SearchTerm));
+    t->text_offset = index->pool_len;
+    t->hash = hash;
+    t->last_doc = -1;
+    memcpy(index->pool + index->pool_len, term, len);
+    index->pool[index->pool_len + len] = '\0';
+    index->pool_len += len + 1;
+
+    unsigned int slot = hash & (index->term_bucket_count - 1);
+    while (index->term_buckets[slot] != -1) {
+        slot = (slot + 1) & (index->term_bucket_count - 1);
+    }
+    index->term_buckets[slot] = index->term_count;
+    return index->term_count++;
+}
+
+static int append_bytes(SearchTerm *t, const unsigned char *bytes, size_t len) {
+    if (t->postings_len + len > t->postings_capacity) {
+        size_t new_capacity = t->postings_capacity ? t->postings_capacity * 2 : 16;
+        while (t->postings_len + len > new_capacity) new_capacity *= 2;
+        unsigned char *p = realloc(t->postings, new_capacity);
+        if (!p) return -1;
+        t->postings = p;
+        t->postings_capacity = new_capacity;
+    }
+    memcpy(t->postings + t->postings_len, bytes, len);
+    t->postings_len += len;
+    return 0;
+}
+
+/* Record one occurrence of a term in doc */
+static int add_posting(SearchTerm *t, int doc) {
+    if (t->last_doc == doc) {
+        /* Same document again: bump the trailing tf byte */
+        if (t->postings[t->postings_len - 1] < MAX_TF) {
+            t->postings[t->postings_len - 1]++;
+        }
+        return 0;
+    }
+
+    unsigned char bytes[6];
+    unsigned int delta = doc - (t->last_doc < 0 ? 0 : t->last_doc + 1);
+    size_t n = 0;
+    do {
+        unsigned char b = delta & 0x7F;
+        delta >>= 7;
+        bytes[n++] = delta ? (b | 0x80) : b;
+    } while (delta);
+    bytes[n++] = 1;
+
+    if (append_bytes(t, bytes, n) < 0) return -1;
+    t->last_doc = doc;
+    t->df++;
+    return 0;
+}
+
+static int find_uid_slot(const SearchIndex *index, unsigned int uid) {
+    unsigned int mask = index->uid_bucket_count - 1;
+    unsigned int slot = hash_uid(uid) & mask;
+    while (index->uid_keys[slot] != 0 && index->uid_keys[slot] != uid) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int set_uid_flag(SearchIndex *index, unsigned int uid, int kind) {
+    if ((index->uid_count + 1) * 2 > index->uid_bucket_count) {
+        int old_count = index->uid_bucket_count;
+        unsigned int *old_keys = index->uid_keys;
+        unsigned char *old_flags = index->uid_flags;
+        int new_count = old_count ? old_count * 2 : 4096;
+
+        index->uid_keys = calloc(new_count, sizeof(unsigned int));
+        index->uid_flags = calloc(new_count, 1);
+        if (!index->uid_keys || !index->uid_flags) {
+            free(index->uid_keys);
+            free(index->uid_flags);
+            index->uid_keys = old_keys;
+            index->uid_flags = old_flags;
+            return -1;
+        }
+        index->uid_bucket_count = new_count;
+        for (int i = 0; i < old_count; i++) {
+            if (old_keys[i] == 0) continue;
+            int slot = find_uid_slot(index, old_keys[i]);
+            index->uid_keys[slot] = old_keys[i];
+            index->uid_flags[slot] = old_flags[i];
+        }
+        free(old_keys);
+        free(old_flags);
+    }
+
+    int slot = find_uid_slot(index, uid);
+    if (index->uid_keys[slot] == 0) {
+        index->uid_keys[slot] = uid;
+        index->uid_count++;
+    }
+    index->uid_flags[slot] |= kind;
+    return 0;
+}
+
+static int add_doc(SearchIndex *index, unsigned int uid, int kind) {
+    if (index->doc_count >= index->doc_capacity) {
+        int new_capacity = index->doc_capacity ? index->doc_capacity * 2 : 1024;
+        unsigned int *uids = realloc(index->doc_uids, sizeof(unsigned int) * new_capacity);
+        if (!uids) return -1;
+        index->doc_uids = uids;
+        unsigned char *kinds = realloc(index->doc_kinds, new_capacity);
+        if (!kinds) return -1;
+        index->doc_kinds = kinds;
+        index->doc_capacity = new_capacity;
+    }
+
+    index->doc_uids[index->doc_count] = uid;
+    index->doc_kinds[index->doc_count] = kind;
+    if (set_uid_flag(index, uid, kind) < 0) return -1;
+    return index->doc_count++;
+}
+
+/* Initialize an empty index */
+void search_init(SearchIndex *index) {
+    memset(index, 0, sizeof(SearchIndex));
+}
+
+/* Free all memory held by the index */
+void search_free(SearchIndex *index) {
+    for (int i = 0; i < index->term_count; i++) {
+        free(index->terms[i].postings);
+    }
+    free(index->terms);
+    free(index->term_buckets);
+    free(index->pool);
+    free(index->doc_uids);
+    free(index->doc_kinds);
+    free(index->uid_keys);
+    free(index->uid_flags);
+    search_init(index);
+}
+
+/* Check whether a part of a message is already indexed */
+int search_has(const SearchIndex *index, unsigned int uid, int kind) {
+    if (index->uid_bucket_count == 0 || uid == 0) return 0;
+
+    int slot = find_uid_slot(index, uid);
+    return index->uid_keys[slot] == uid && (index->uid_flags[slot] & kind);
+}
+
+/* Index the words of text as one document */
+int search_add(SearchIndex *index, unsigned int uid, int kind, const char *text) {
+    if (uid == 0 || !text || search_has(index, uid, kind)) return 0;
+
+    size_t size = strlen(text) + 1;
+    char *folded = malloc(size);
+    if (!folded) return -1;
+    utf8_fold(text, folded, size);
+
+    int doc = add_doc(index, uid, kind);
+    if (doc < 0) {
+        free(folded);
+        return -1;
+    }
+
+    const char *term;
+    size_t len;
+    const char *p = folded;
+    while ((p = next_term(p, &term, &len)) != NULL) {
+        unsigned int hash = hash_term(term, len);
+        int t = find_term(index, term, len, hash);
+        if (t < 0) t = add_term(index, term, len, hash);
+        if (t < 0 || add_posting(&index->terms[t], doc) < 0) {
+            free(folded);
+            return -1;
+        }
+    }
+
+    free(folded);
+    index->dirty = 1;
+    return 0;
+}
+
+static int compare_results(const void *a, const void *b) {
+    const SearchResult *ra = a, *rb = b;
+    if (ra->score != rb->score) return ra->score < rb->score ? 1 : -1;
+    return ra->uid < rb->uid ? 1 : (ra->uid > rb->uid ? -1 : 0);
+}
+
+/* Rank messages matching every query word by summed tf-idf */
+int search_query(const SearchIndex *index, const char *query, SearchResult **results) {
+    char folded[512];
+    int terms[MAX_QUERY_TERMS];
+    int term_count = 0;
+    const char *term;
+    size_t len;
+
+    *results = NULL;
+    utf8_fold(query, folded, sizeof(folded));
+
+    const char *p = folded;
+    while ((p = next_term(p, &term, &len)) != NULL && term_count < MAX_QUERY_TERMS) {
+        int t = find_term(index, term, len, hash_term(term, len));
+        if (t < 0) return 0; /* A word nobody uses: nothing can match */
+        terms[term_count++] = t;
+    }
+    if (term_count == 0) return 0;
+
+    /* Accumulate scores per UID in a temporary open-addressing table */
+    int bucket_count = 1024;
+    for (int i = 0; i < term_count; i++) {
+        while (bucket_count < index->terms[terms[i]].df * 4) bucket_count *= 2;
+    }
+    unsigned int *keys = calloc(bucket_count, sizeof(unsigned int));
+    double *scores = calloc(bucket_count, sizeof(double));
+    unsigned int *matched = calloc(bucket_count, sizeof(unsigned int));
+    if (!keys || !scores || !matched) {
+        free(keys);
+        free(scores);
+        free(matched);
+        return -1;
+    }
+
+    for (int i = 0; i < term_count; i++) {
+        const SearchTerm *t = &index->terms[terms[i]];
+        double idf = log(1.0 + (double)index->doc_count / t->df);
+        size_t pos = 0;
+        int doc = -1;
+
+        while (pos < t->postings_len) {
+            unsigned int delta = 0;
+            int shift = 0;
+            unsigned char b;
+            do {
+                b = t->postings[pos++];
+                delta |= (unsigned int)(b & 0x7F) << shift;
+                shift += 7;
+            } while ((b & 0x80) && pos < t->postings_len);
+            int tf = pos < t->postings_len ? t->postings[pos++] : 1;
+            doc += delta + 1;
+
+            unsigned int uid = index->doc_uids[doc];
+            unsigned int slot = hash_uid(uid) & (bucket_count - 1);
+            while (keys[slot] != 0 && keys[slot] != uid) {
+                slot = (slot + 1) & (bucket_count - 1);
+            }
+            keys[slot] = uid;
+
+            /* Header words (From, Subject) count double */
+            double weight = index->doc_kinds[doc] == SEARCH_DOC_HEADER ? 2.0 : 1.0;
+            scores[slot] += weight * (1.0 + log((double)tf)) * idf;
+            matched[slot] |= 1u << i;
+        }
+    }
+
+    unsigned int all = (1u << term_count) - 1;
+    int count = 0;
+    for (int i = 0; i < bucket_count; i++) {
+        if (keys[i] && matched[i] == all) count++;
+    }
+
+    SearchResult *out = count ? malloc(sizeof(SearchResult) * count) : NULL;
+    if (count && !out) count = -1;
+    int n = 0;
+    for (int i = 0; out && i < bucket_count; i++) {
+        if (keys[i] && matched[i] == all) {
+            out[n].uid = keys[i];
+            out[n].score = scores[i];
+            n++;
+        }
+    }
+    if (out) qsort(out, count, sizeof(SearchResult), compare_results);
+
+    free(keys);
+    free(scores);
+    free(matched);
+    *results = out;
+    return count;
+}
+
+/* Save the index. Written to a temporary file first so a crash never
+ * leaves a truncated index behind. */
+int search_save(SearchIndex *index, const char *path) {
+    char tmp_path[1024];
+    unsigned int header[4];
+    FILE *file;
+
+    if (!index->dirty) return 0;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    file = fopen(tmp_path, "wb");
+    if (!file) {
+        return -1;
+    }
+
+    memcpy(&header[0], SEARCH_MAGIC, 4);
+    header[1] = SEARCH_VERSION;
+    header[2] = index->uidvalidity;
+    header[3] = index->doc_count;
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(index->doc_uids, sizeof(unsigned int), index->doc_count, file);
+    fwrite(index->doc_kinds, 1, index->doc_count, file);
+
+    unsigned int term_count = index->term_count;
+    fwrite(&term_count, sizeof(term_count), 1, file);
+    for (int i = 0; i < index->term_count; i++) {
+        const SearchTerm *t = &index->terms[i];
+        const char *text = index->pool + t->text_offset;
+        unsigned int fields[4];
+        fields[0] = strlen(text);
+        fields[1] = t->df;
+        fields[2] = t->last_doc;
+        fields[3] = t->postings_len;
+        fwrite(fields, sizeof(fields), 1, file);
+        fwrite(text, 1, fields[0], file);
+        fwrite(t->postings, 1, t->postings_len, file);
+    }
+
+    if (ferror(file) || fclose(file) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+
+    index->dirty = 0;
+    return 0;
+}
+
+/* A loaded posting list must decode to df documents that exist, the last
+ * one being last_doc: search_query indexes doc_uids with them unchecked */
+static int postings_valid(const SearchTerm *t, int doc_count) {
+    size_t pos = 0;
+    int doc = -1;
+    int df = 0;
+
+    while (pos < t->postings_len) {
+        unsigned int delta = 0;
+        int shift = 0;
+        unsigned char b;
+        do {
+            if (pos == t->postings_len || shift > 28) return 0;
+            b = t->postings[pos++];
+            delta |= (unsigned int)(b & 0x7F) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        if (pos++ == t->postings_len) return 0;   /* No tf byte */
+
+        if (delta >= (unsigned int)doc_count) return 0;
+        doc += delta + 1;
+        if (doc >= doc_count) return 0;
+        df++;
+    }
+    return df == t->df && doc == t->last_doc;
+}
+
+/* Load a saved index, replacing the current contents */
+int search_load(SearchIndex *index, const char *path, unsigned int uidvalidity) {
+    unsigned int header[4];
+    FILE *file;
+    long left;
+
+    search_free(index);
+    index->uidvalidity = uidvalidity;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        return 0; /* No index yet */
+    }
+
+    /* Every count read below is checked against the bytes left in the
+     * file before anything is allocated for it */
+    if (fseek(file, 0, SEEK_END) != 0 || (left = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return 0;
+    }
+    left -= (long)sizeof(header);
+
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+        memcmp(&header[0], SEARCH_MAGIC, 4) != 0 ||
+        header[1] != SEARCH_VERSION || header[2] != uidvalidity) {
+        /* Stale or foreign index: start over */
+        fclose(file);
+        return 0;
+    }
+
+    /* A UID and a kind byte per document */
+    unsigned int doc_count = header[3];
+    if (doc_count > (unsigned long)left / (sizeof(unsigned int) + 1)) {
+        goto fail;
+    }
+    left -= (long)doc_count * (sizeof(unsigned int) + 1);
+    for (unsigned int i = 0; i < doc_count; i++) {
+        unsigned int uid;
+        /* UID 0 marks a free slot in the UID table */
+        if (fread(&uid, sizeof(uid), 1, file) != 1 || uid == 0 || add_doc(index, uid, 0) < 0) {
+            goto fail;
+        }
+    }
+    if (fread(index->doc_kinds, 1, doc_count, file) != doc_count) {
+        goto fail;
+    }
+    for (unsigned int i = 0; i < doc_count; i++) {
+        int kind = index->doc_kinds[i];
+        if (kind != SEARCH_DOC_HEADER && kind != SEARCH_DOC_BODY) goto fail;
+        set_uid_flag(index, index->doc_uids[i], kind);
+    }
+
+    /* A term takes at least its four fields */
+    unsigned int term_count;
+    if (fread(&term_count, sizeof(term_count), 1, file) != 1) {
+        goto fail;
+    }
+    left -= (long)sizeof(term_count);
+    if (left < 0 || term_count > (unsigned long)left / (4 * sizeof(unsigned int))) {
+        goto fail;
+    }
+    for (unsigned int i = 0; i < term_count; i++) {
+        unsigned int fields[4];
+        char text[MAX_TERM_LEN + 1];
+
+        if (fread(fields, sizeof(fields), 1, file) != 1 || fields[0] > MAX_TERM_LEN ||
+            fread(text, 1, fields[0], file) != fields[0]) {
+            goto fail;
+        }
+        left -= (long)(sizeof(fields) + fields[0]);
+        if (left < 0 || fields[3] > (unsigned long)left) {
+            goto fail;
+        }
+        left -= (long)fields[3];
+
+        unsigned int hash = hash_term(text, fields[0]);
+        if (find_term(index, text, fields[0], hash) >= 0) goto fail;
+        int t = add_term(index, text, fields[0], hash);
+        if (t < 0) goto fail;
+
+        SearchTerm *term = &index->terms[t];
+        term->df = fields[1];
+        term->last_doc = (int)fields[2];
+        term->postings = malloc(fields[3] ? fields[3] : 1);
+        if (!term->postings) goto fail;
+        term->postings_capacity = fields[3];
+        term->postings_len = fields[3];
+        if (fread(term->postings, 1, fields[3], file) != fields[3] ||
+            !postings_valid(term, index->doc_count)) {
+            goto fail;
+        }
+    }
+
+    fclose(file);
+    index->dirty = 0;
+    return 0;
+
+fail:
+    fprintf(stderr, "Warning: search index %s is corrupt, rebuilding\n", path);
+    fclose(file);
+    remove(path);
+    search_free(index);
+    index->uidvalidity = uidvalidity;
+    return -1;
+}
@@ -1,66 +1,104 @@
 #include "smtp.h"
+#include "mime.h"
+#include "sasl.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <unistd.h>
 
 #define BUFFER_SIZE 1024
 
-/* Base64 encoding for authentication */
-static void base64_encode(const char *input, char *output, int output_size) {
-    static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    int i = 0, j = 0;
-    unsigned char char_array_3[3];
-    unsigned char char_array_4[4];
-    int len = strlen(input);
-    int out_idx = 0;
-
-    while (len--) {
-        char_array_3[i++] = *(input++);
-        if (i == 3) {
-            char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-            char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-            char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-            char_array_4[3] = char_array_3[2] & 0x3f;
-
-            for(i = 0; i < 4 && out_idx < output_size - 1; i++) {
-                output[out_idx++] = base64_chars[char_array_4[i]];
-            }
-            i = 0;
+/* Read a reply, which may span several "250-..." lines. The lines are
+ * kept in buffer as far as they fit. Returns the reply code or -1. */
+static int smtp_read_response(Connection *conn, char *buffer, int buffer_size) {
+    char line[BUFFER_SIZE];
+    int used = 0;
+    int code;
+
+    TRACE_BEGIN(span);
+    buffer[0] = '\0';
+    for (;;) {
+        int len = net_recv_line(conn, line, sizeof(line));
+        if (len < 4) {
+            code = -1;
+            break;
         }
-    }
 
-    if (i) {
-        for(j = i; j < 3; j++) {
-            char_array_3[j] = '\0';
+        if (used + len < buffer_size) {
+            memcpy(buffer + used, line, len + 1);
+            used += len;
         }
+        if (line[3] != '-') {
+            code = atoi(line);
+            break;
+        }
+    }
+    TRACE_END(span, "smtp", "reply", "%.*s", (int)strcspn(buffer, "\r\n"), buffer);
+    return code;
+}
 
-        char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-        char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-        char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
+/* Check if SMTP response is positive */
+static int smtp_check_response(const char *response, int expected_code) {
+    int code = atoi(response);
+    return (code == expected_code || code / 100 == expected_code / 100);
+}
 
-        for (j = 0; j < i + 1 && out_idx < output_size - 1; j++) {
-            output[out_idx++] = base64_chars[char_array_4[j]];
-        }
+/* Send EHLO and remember the extensions the server announces */
+static int smtp_ehlo(SmtpSession *session) {
+    char line[BUFFER_SIZE];
+    size_t used = 0;
+    int first = 1;
 
-        while(i++ < 3 && out_idx < output_size - 1) {
-            output[out_idx++] = '=';
+    TRACE_BEGIN(span);
+    session->extensions[0] = '\0';
+    if (net_send(&session->conn, "EHLO localhost\r\n", 16) < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        int len = net_recv_line(&session->conn, line, sizeof(line));
+        if (len < 4) return -1;
+
+        /* The first line is the greeting, every further one an extension */
+        if (!first) {
+            size_t n = strcspn(line + 4, "\r\n");
+            if (used + n + 2 <= sizeof(session->extensions)) {
+                memcpy(session->extensions + used, line + 4, n);
+                used += n;
+                session->extensions[used++] = '\n';
+                session->extensions[used] = '\0';
+            }
         }
+        first = 0;
+
+        if (line[3] != '-') break;
     }
+    TRACE_END(span, "smtp", "command", "EHLO");
 
-    output[out_idx] = '\0';
+    if (!smtp_check_response(line, 250)) {
+        fprintf(stderr, "SMTP EHLO failed: %s\n", line);
+        return -1;
+    }
+    return 0;
 }
 
-/* Read SMTP server response */
-static int smtp_read_response(Connection *conn, char *buffer, int buffer_size) {
-    int len = net_recv_line(conn, buffer, buffer_size);
-    return len;
-}
+/* Check for an EHLO extension keyword such as "PIPELINING" */
+int smtp_has_extension(const SmtpSession *session, const char *name) {
+    size_t len = strlen(name);
+    const char *p = session->extensions;
 
-/* Check if SMTP response is positive */
-static int smtp_check_response(const char *response, int expected_code) {
-    int code = atoi(response);
-    return (code == expected_code || code / 100 == expected_code / 100);
+    while (*p) {
+        if (strncasecmp(p, name, len) == 0 && (p[len] == ' ' || p[len] == '\n' || p[len] == '\0')) {
+            return 1;
+        }
+        p = strchr(p, '\n');
+        if (!p) break;
+        p++;
+    }
+    return 0;
 }
 
 /* Connect to SMTP server */
@@ -68,11 +106,16 @@ int smtp_connect(SmtpSession *session, const char *host, int port, int use_ssl)
     char response[BUFFER_SIZE];
 
     session->connected = 0;
+    session->extensions[0] = '\0';
 
+    TRACE_BEGIN(span);
     if (net_connect(host, port, use_ssl, &session->conn) < 0) {
         return -1;
     }
 
+    /* A server that stops answering must not hang the caller forever */
+    net_set_timeout(&session->conn, SMTP_TIMEOUT);
+
     /* Read greeting */
     smtp_read_response(&session->conn, response, sizeof(response));
     if (!smtp_check_response(response, 220)) {
@@ -82,22 +125,13 @@ int smtp_connect(SmtpSession *session, const char *host, int port, int use_ssl)
     }
 
     /* Send EHLO */
-    char command[256];
-    snprintf(command, sizeof(command), "EHLO localhost\r\n");
-    net_send(&session->conn, command, strlen(command));
-
-    /* Read EHLO response (may be multiline) */
-    do {
-        smtp_read_response(&session->conn, response, sizeof(response));
-    } while (response[3] == '-'); /* Continue if response has continuation */
-
-    if (!smtp_check_response(response, 250)) {
-        fprintf(stderr, "SMTP EHLO failed: %s\n", response);
+    if (smtp_ehlo(session) < 0) {
         net_disconnect(&session->conn);
         return -1;
     }
 
     session->connected = 1;
+    TRACE_END(span, "smtp", "connect", "%s:%d", host, port);
     return 0;
 }
 
@@ -139,15 +173,8 @@ int smtp_starttls(SmtpSession *session) {
         return -1;
     }
 
-    /* Send EHLO again after STARTTLS */
-    snprintf(command, sizeof(command), "EHLO localhost\r\n");
-    net_send(&session->conn, command, strlen(command));
-
-    do {
-        smtp_read_response(&session->conn, response, sizeof(response));
-    } while (response[3] == '-');
-
-    return 0;
+    /* Send EHLO again after STARTTLS; extensions may differ now */
+    return smtp_ehlo(session);
 }
 
 /* Authenticate using AUTH LOGIN */
@@ -167,7 +194,7 @@ int smtp_auth_login(SmtpSession *session, const char *username, const char *pass
     }
 
     /* Send username (base64 encoded) */
-    base64_encode(username, encoded, sizeof(encoded));
+    mime_base64_encode((const unsigned char *)username, strlen(username), encoded);
     snprintf(command, sizeof(command), "%s\r\n", encoded);
     net_send(&session->conn, command, strlen(command));
 
@@ -178,7 +205,7 @@ int smtp_auth_login(SmtpSession *session, const char *username, const char *pass
     }
 
     /* Send password (base64 encoded) */
-    base64_encode(password, encoded, sizeof(encoded));
+    mime_base64_encode((const unsigned char *)password, strlen(password), encoded);
     snprintf(command, sizeof(command), "%s\r\n", encoded);
     net_send(&session->conn, command, strlen(command));
 
@@ -191,6 +218,71 @@ int smtp_auth_login(SmtpSession *session, const char *username, const char *pass
     return 0;
 }
 
+/* Mechanisms from the EHLO "AUTH" line; some servers still send the
+ * pre-standard "AUTH=" form */
+static const char *smtp_auth_mechanisms(const SmtpSession *session) {
+    const char *p = session->extensions;
+
+    while (*p) {
+        if (strncasecmp(p, "AUTH", 4) == 0 && (p[4] == ' ' || p[4] == '=')) {
+            return p + 5;
+        }
+        p = strchr(p, '\n');
+        if (!p) break;
+        p++;
+    }
+    return "";
+}
+
+/* Authenticate in one round trip with an initial response: AUTH PLAIN
+ * with the password, or XOAUTH2/OAUTHBEARER with a token. Falls back to
+ * AUTH LOGIN when PLAIN is not offered. */
+int smtp_authenticate(SmtpSession *session, const char *username, const char *password,
+                      const char *token) {
+    char command[SASL_MAX_RESPONSE + 32];
+    char response[BUFFER_SIZE];
+    char initial[SASL_MAX_RESPONSE];
+    int use_token = token && token[0];
+
+    SaslMechanism mechanism = sasl_choose(smtp_auth_mechanisms(session), "", use_token);
+    if (use_token && mechanism == SASL_NONE) {
+        fprintf(stderr, "SMTP server offers no OAuth mechanism\n");
+        return -1;
+    }
+    if (mechanism == SASL_NONE || mechanism == SASL_LOGIN) {
+        return smtp_auth_login(session, username, password);
+    }
+
+    if (sasl_initial_response(mechanism, username, use_token ? token : password,
+                              initial, sizeof(initial)) < 0) {
+        return -1;
+    }
+    TRACE_BEGIN(span);
+    int len = snprintf(command, sizeof(command), "AUTH %s %s\r\n",
+                       sasl_mechanism_name(mechanism), initial);
+    if (net_send(&session->conn, command, len) < 0) {
+        return -1;
+    }
+
+    int code = smtp_read_response(&session->conn, response, sizeof(response));
+
+    /* A 334 after the initial response carries token error details; the
+     * empty reply lets the server finish with its final code */
+    if (code == 334) {
+        if (net_send(&session->conn, "\r\n", 2) < 0) {
+            return -1;
+        }
+        code = smtp_read_response(&session->conn, response, sizeof(response));
+    }
+    TRACE_END(span, "smtp", "command", "AUTH %s", sasl_mechanism_name(mechanism));
+
+    if (code != 235) {
+        fprintf(stderr, "SMTP AUTH %s failed: %s\n", sasl_mechanism_name(mechanism), response);
+        return -1;
+    }
+    return 0;
+}
+
 /* Disconnect from SMTP server */
 void smtp_disconnect(SmtpSession *session) {
     char command[128];
@@ -206,42 +298,378 @@ void smtp_disconnect(SmtpSession *session) {
     session->connected = 0;
 }
 
+/* Send NOOP: keeps an idle session open and tells whether it still works */
+int smtp_noop(SmtpSession *session) {
+    char response[BUFFER_SIZE];
+
+    if (!session->connected || net_send(&session->conn, "NOOP\r\n", 6) < 0) {
+        return -1;
+    }
+    return smtp_read_response(&session->conn, response, sizeof(response)) == 250 ? 0 : -1;
+}
+
+/* Quick check of an idle session without a round trip. A server that
+ * dropped the connection has either closed it or sent a 421, and both
+ * show up as something to read. */
+int smtp_idle_ok(SmtpSession *session) {
+    return session->connected && net_poll_readable(&session->conn, 0) == 0;
+}
+
+/* Split a To: field such as "a@x, Bob <b@y>" into bare addresses.
+ * Returns the number of addresses found. */
+static int smtp_parse_recipients(const char *to, char recipients[][MAX_ADDRESS_LEN], int max) {
+    int count = 0;
+    const char *p = to;
+
+    while (*p && count < max) {
+        /* One entry runs up to a comma or semicolon outside quotes */
+        const char *start = p;
+        int quoted = 0;
+        while (*p && (quoted || (*p != ',' && *p != ';'))) {
+            if (*p == '"') quoted = !quoted;
+            p++;
+        }
+        const char *end = p;
+        if (*p) p++;
+
+        /* Prefer the part in angle brackets */
+        const char *open = memchr(start, '<', end - start);
+        const char *close = open ? memchr(open, '>', end - open) : NULL;
+        if (open && close) {
+            start = open + 1;
+            end = close;
+        }
+
+        while (start < end && (*start == ' ' || *start == '\t')) start++;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+
+        size_t len = end - start;
+        if (len == 0 || len >= MAX_ADDRESS_LEN) continue;
+        memcpy(recipients[count], start, len);
+        recipients[count][len] = '\0';
+        count++;
+    }
+    return count;
+}
+
+/* Command i of the envelope: MAIL FROM, one RCPT TO per recipient and,
+ * unless the content goes out with BDAT, DATA */
+static int smtp_envelope_command(char *buffer, size_t size, int i, const char *from,
+                                 char recipients[][MAX_ADDRESS_LEN], int count) {
+    if (i == 0) return snprintf(buffer, size, "MAIL FROM:<%s>\r\n", from);
+    if (i <= count) return snprintf(buffer, size, "RCPT TO:<%s>\r\n", recipients[i - 1]);
+    return snprintf(buffer, size, "DATA\r\n");
+}
+
+/* Abandon the current mail transaction */
+static void smtp_reset(SmtpSession *session) {
+    char response[BUFFER_SIZE];
+
+    if (net_send(&session->conn, "RSET\r\n", 6) >= 0) {
+        smtp_read_response(&session->conn, response, sizeof(response));
+    }
+}
+
+/* Start a mail transaction and prepare data for the message content.
+ * With PIPELINING (RFC 2920) the whole envelope goes out in one write and
+ * the replies are matched to the commands in order, so the transaction
+ * costs one round trip before the content. */
+int smtp_data_begin(SmtpSession *session, const char *from, const char *to, SmtpData *data) {
+    char command[1024];
+    char response[BUFFER_SIZE];
+    char recipients[MAX_RECIPIENTS][MAX_ADDRESS_LEN];
+
+    memset(data, 0, sizeof(SmtpData));
+
+    int count = smtp_parse_recipients(to, recipients, MAX_RECIPIENTS);
+    if (count == 0) {
+        fprintf(stderr, "SMTP: no valid recipient in \"%s\"\n", to);
+        return SMTP_REJECTED;
+    }
+
+    int pipelining = smtp_has_extension(session, "PIPELINING");
+    int bdat = smtp_has_extension(session, "CHUNKING");
+    int commands = count + (bdat ? 1 : 2);
+    TRACE_BEGIN(span);
+
+    if (pipelining) {
+        size_t size = (size_t)commands * (MAX_ADDRESS_LEN + 16);
+        char *envelope = malloc(size);
+        if (!envelope) return -1;
+
+        size_t len = 0;
+        for (int i = 0; i < commands; i++) {
+            len += smtp_envelope_command(envelope + len, size - len, i, from, recipients, count);
+        }
+        int sent = net_send(&session->conn, envelope, (int)len);
+        free(envelope);
+        if (sent < 0) return -1;
+    }
+
+    /* Every command sent gets exactly one reply, in order. Only 5xx
+     * replies make the failure permanent. */
+    int mail_ok = 0, accepted = 0, data_ok = bdat;
+    int permanent = 0, recipients_temporary = 0;
+    for (int i = 0; i < commands; i++) {
+        if (!pipelining) {
+            /* Without pipelining, stop as soon as the transaction is lost */
+            if ((i > 0 && !mail_ok) || (i > count && accepted == 0)) break;
+            int len = smtp_envelope_command(command, sizeof(command), i, from, recipients, count);
+            if (net_send(&session->conn, command, len) < 0) return -1;
+        }
+
+        int code = smtp_read_response(&session->conn, response, sizeof(response));
+        if (code < 0) return -1;
+
+        if (i == 0) {
+            mail_ok = code / 100 == 2;
+            if (!mail_ok) {
+                fprintf(stderr, "SMTP MAIL FROM failed: %s\n", response);
+                permanent = code / 100 == 5;
+            }
+        } else if (i <= count) {
+            if (code / 100 == 2) {
+                accepted++;
+            } else {
+                fprintf(stderr, "SMTP RCPT TO <%s> failed: %s\n", recipients[i - 1], response);
+                if (code / 100 != 5) recipients_temporary++;
+            }
+        } else {
+            data_ok = code == 354;
+            if (!data_ok && mail_ok && accepted > 0) {
+                fprintf(stderr, "SMTP DATA failed: %s\n", response);
+                permanent = code / 100 == 5;
+            }
+        }
+    }
+
+    TRACE_END(span, "smtp", "envelope", "%d of %d recipients", accepted, count);
+
+    if (!mail_ok || accepted == 0 || !data_ok) {
+        if (data_ok && !bdat) {
+            /* Server waits for data nobody can receive: send an empty message */
+            net_send(&session->conn, ".\r\n", 3);
+            smtp_read_response(&session->conn, response, sizeof(response));
+        }
+        smtp_reset(session);
+        /* Every recipient refused for good is as final as a refused sender */
+        if (mail_ok && accepted == 0 && recipients_temporary == 0) permanent = 1;
+        return permanent ? SMTP_REJECTED : -1;
+    }
+
+    data->buffer = malloc(SMTP_CHUNK_HEADROOM + SMTP_CHUNK_SIZE);
+    if (!data->buffer) {
+        smtp_reset(session);
+        return -1;
+    }
+    data->session = session;
+    data->bdat = bdat;
+    data->pipelining = pipelining;
+    data->at_line_start = 1;
+    return 0;
+}
+
+/* Send the buffered content. DATA content goes out as is; with BDAT the
+ * chunk command is put in the headroom right before the chunk, so both
+ * leave in a single write. */
+static int smtp_data_flush(SmtpData *data, int last) {
+    char *out = data->buffer + SMTP_CHUNK_HEADROOM;
+    size_t len = data->len;
+
+    if (data->bdat) {
+        char command[SMTP_CHUNK_HEADROOM];
+        int n = snprintf(command, sizeof(command), "BDAT %zu%s\r\n", len, last ? " LAST" : "");
+        out -= n;
+        memcpy(out, command, n);
+        len += n;
+    }
+
+    data->len = 0;
+    if (len > 0 && net_send(&data->session->conn, out, (int)len) < 0) {
+        data->failed = 1;
+        return -1;
+    }
+    if (!data->bdat) return 0;
+
+    /* Each chunk is answered. Without pipelining the answer is awaited;
+     * with it, answers are read as they turn up and no more than
+     * SMTP_BDAT_WINDOW are left unread, as a server whose replies pile up
+     * stops reading what comes next. */
+    int window = data->pipelining ? SMTP_BDAT_WINDOW : 0;
+    data->pending++;
+    while (data->pending > 0 &&
+           (data->pending > window || net_poll_readable(&data->session->conn, 0) > 0)) {
+        char response[BUFFER_SIZE];
+        int code = smtp_read_response(&data->session->conn, response, sizeof(response));
+        data->pending--;
+        if (code != 250) {
+            fprintf(stderr, "SMTP BDAT failed: %s\n", response);
+            data->rejected = code / 100 == 5;
+            data->failed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Append message content. Line endings become CRLF and, for DATA, lines
+ * starting with "." get another one so the message cannot end early. */
+int smtp_data_write(SmtpData *data, const char *text, size_t len) {
+    char *out = data->buffer + SMTP_CHUNK_HEADROOM;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+
+        /* A byte adds at most four: CRLF for a pending CR, a dot, itself */
+        if (data->len + 4 > SMTP_CHUNK_SIZE && smtp_data_flush(data, 0) < 0) {
+            return -1;
+        }
+
+        /* Bytes inside a line need no translation: copy up to the next
+         * line break in one go */
+        if (!data->last_cr && c != '\r' && c != '\n' && !(c == '.' && data->at_line_start)) {
+            size_t n = 1, room = SMTP_CHUNK_SIZE - 4 - data->len;
+            while (n < room && i + n < len && text[i + n] != '\r' && text[i + n] != '\n') n++;
+            memcpy(out + data->len, text + i, n);
+            data->len += n;
+            data->at_line_start = 0;
+            i += n - 1;
+            continue;
+        }
+
+        if (data->last_cr) {
+            out[data->len++] = '\r';
+            out[data->len++] = '\n';
+            data->last_cr = 0;
+            data->at_line_start = 1;
+            if (c == '\n') continue;
+        }
+
+        if (c == '\r') {
+            data->last_cr = 1;
+        } else if (c == '\n') {
+            out[data->len++] = '\r';
+            out[data->len++] = '\n';
+            data->at_line_start = 1;
+        } else {
+            if (c == '.' && data->at_line_start && !data->bdat) {
+                out[data->len++] = '.';
+            }
+            out[data->len++] = c;
+            data->at_line_start = 0;
+        }
+    }
+    return data->failed ? -1 : 0;
+}
+
+/* Append everything readable from a file descriptor */
+int smtp_data_write_fd(SmtpData *data, int fd) {
+    char chunk[16384];
+    ssize_t n;
+
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        if (smtp_data_write(data, chunk, (size_t)n) < 0) return -1;
+    }
+    return n < 0 ? -1 : 0;
+}
+
+/* Finish the message and wait for the server to accept it */
+int smtp_data_end(SmtpData *data) {
+    char response[BUFFER_SIZE];
+    int result = -1;
+
+    if (!data->buffer) return -1;
+    TRACE_BEGIN(span);
+
+    if (!data->failed) {
+        /* Room for a final CRLF and the terminating ".\r\n" */
+        if (data->len + 7 > SMTP_CHUNK_SIZE) smtp_data_flush(data, 0);
+    }
+
+    if (!data->failed) {
+        char *out = data->buffer + SMTP_CHUNK_HEADROOM;
+
+        if (data->last_cr || !data->at_line_start) {
+            out[data->len++] = '\r';
+            out[data->len++] = '\n';
+        }
+        if (!data->bdat) {
+            memcpy(out + data->len, ".\r\n", 3);
+            data->len += 3;
+        }
+
+        if (smtp_data_flush(data, 1) == 0) {
+            /* Collect what is still due: the reply to DATA, or one per
+             * pipelined BDAT chunk */
+            int due = data->bdat ? data->pending : 1;
+            result = 0;
+            for (; due > 0; due--) {
+                int code = smtp_read_response(&data->session->conn, response, sizeof(response));
+                if (code < 0) {
+                    result = -1;
+                    break;
+                }
+                if (code != 250) {
+                    fprintf(stderr, "SMTP message send failed: %s\n", response);
+                    if (code / 100 == 5) data->rejected = 1;
+                    result = -1;
+                }
+            }
+            if (result < 0) smtp_reset(data->session);
+        }
+    }
+    if (result < 0 && data->rejected) result = SMTP_REJECTED;
+
+    TRACE_END(span, "smtp", "end of data", data->bdat ? "BDAT LAST" : ".");
+    free(data->buffer);
+    data->buffer = NULL;
+    return result;
+}
+
+/* Give up on a message part way through */
+void smtp_data_abort(SmtpData *data) {
+    char response[BUFFER_SIZE];
+
+    if (!data->buffer) return;
+
+    if (data->bdat) {
+        /* Chunks never ending in LAST are dropped by RSET */
+        for (; data->pending > 0; data->pending--) {
+            if (smtp_read_response(&data->session->conn, response, sizeof(response)) < 0) break;
+        }
+        smtp_reset(data->session);
+    } else if (!data->failed) {
+        /* Anything that ends DATA delivers the message */
+        net_disconnect(&data->session->conn);
+        data->session->connected = 0;
+    }
+
+    free(data->buffer);
+    data->buffer = NULL;
+}
+
+/* Write one header line */
+static int smtp_data_header(SmtpData *data, const char *name, const char *value) {
+    if (smtp_data_write(data, name, strlen(name)) < 0 ||
+        smtp_data_write(data, ": ", 2) < 0 ||
+        smtp_data_write(data, value, strlen(value)) < 0) {
+        return -1;
+    }
+    return smtp_data_write(data, "\r\n", 2);
+}
+
 /* Send an email */
 int smtp_send_email(SmtpSession *session,
                    const char *from,
                    const char *to,
                    const char *subject,
                    const char *body) {
-    char command[1024];
-    char response[BUFFER_SIZE];
+    SmtpData data;
     time_t now;
     struct tm *tm_info;
     char date_str[64];
 
-    /* MAIL FROM */
-    snprintf(command, sizeof(command), "MAIL FROM:<%s>\r\n", from);
-    net_send(&session->conn, command, strlen(command));
-    smtp_read_response(&session->conn, response, sizeof(response));
-    if (!smtp_check_response(response, 250)) {
-        fprintf(stderr, "SMTP MAIL FROM failed: %s\n", response);
-        return -1;
-    }
-
-    /* RCPT TO */
-    snprintf(command, sizeof(command), "RCPT TO:<%s>\r\n", to);
-    net_send(&session->conn, command, strlen(command));
-    smtp_read_response(&session->conn, response, sizeof(response));
-    if (!smtp_check_response(response, 250)) {
-        fprintf(stderr, "SMTP RCPT TO failed: %s\n", response);
-        return -1;
-    }
-
-    /* DATA */
-    snprintf(command, sizeof(command), "DATA\r\n");
-    net_send(&session->conn, command, strlen(command));
-    smtp_read_response(&session->conn, response, sizeof(response));
-    if (!smtp_check_response(response, 354)) {
-        fprintf(stderr, "SMTP DATA failed: %s\n", response);
+    if (smtp_data_begin(session, from, to, &data) < 0) {
         return -1;
     }
 
@@ -251,22 +679,12 @@ int smtp_send_email(SmtpSession *session,
     strftime(date_str, sizeof(date_str), "%a, %d %b %Y %H:%M:%S +0000", tm_info);
 
     /* Send message headers and body */
-    snprintf(command, sizeof(command),
-             "From: %s\r\n"
-             "To: %s\r\n"
-             "Subject: %s\r\n"
-             "Date: %s\r\n"
-             "\r\n"
-             "%s\r\n"
-             ".\r\n",
-             from, to, subject, date_str, body);
-
-    net_send(&session->conn, command, strlen(command));
-    smtp_read_response(&session->conn, response, sizeof(response));
-    if (!smtp_check_response(response, 250)) {
-        fprintf(stderr, "SMTP message send failed: %s\n", response);
-        return -1;
-    }
-
-    return 0;
+    smtp_data_header(&data, "From", from);
+    smtp_data_header(&data, "To", to);
+    smtp_data_header(&data, "Subject", subject);
+    smtp_data_header(&data, "Date", date_str);
+    smtp_data_write(&data, "\r\n", 2);
+    smtp_data_write(&data, body, strlen(body));
+
+    return smtp_data_end(&data);
 }
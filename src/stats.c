@@ -0,0 +1,90 @@
+#define _POSIX_C_SOURCE 200809L
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+void stats_init(StatsHistogram *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+/* Values below STATS_SUB_BUCKETS get a bucket each; above, a power of
+ * two is split in STATS_SUB_BUCKETS by the bits after the leading one */
+static int stats_bucket(unsigned long long us) {
+    int exponent = 0;
+
+    if (us < STATS_SUB_BUCKETS) return (int)us;
+    while ((us >> exponent) >= 2 * STATS_SUB_BUCKETS) exponent++;
+
+    int bucket = (exponent + 1) * STATS_SUB_BUCKETS + (int)((us >> exponent) - STATS_SUB_BUCKETS);
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/* Largest value that falls in bucket */
+static unsigned long long stats_bucket_top(int bucket) {
+    if (bucket < STATS_SUB_BUCKETS) return (unsigned long long)bucket;
+
+    int exponent = bucket / STATS_SUB_BUCKETS - 1;
+    unsigned long long low = (unsigned long long)(STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << exponent;
+    return low + (1ULL << exponent) - 1;
+}
+
+void stats_add(StatsHistogram *histogram, unsigned long long us) {
+    histogram->counts[stats_bucket(us)]++;
+    histogram->count++;
+    histogram->total += us;
+    if (us > histogram->max) histogram->max = us;
+}
+
+unsigned long long stats_percentile(const StatsHistogram *histogram, double p) {
+    unsigned long target = (unsigned long)(histogram->count * p / 100.0 + 0.999999);
+    unsigned long seen = 0;
+
+    if (histogram->count == 0) return 0;
+    if (target == 0) target = 1;
+
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= target) {
+            unsigned long long top = stats_bucket_top(i);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+unsigned long long stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void stats_format(unsigned long long us, char *buffer, size_t size) {
+    if (us < 1000) {
+        snprintf(buffer, size, "%lluus", us);
+    } else if (us < 100000) {
+        snprintf(buffer, size, "%.2fms", us / 1000.0);
+    } else {
+        snprintf(buffer, size, "%llums", us / 1000);
+    }
+}
+
+void stats_write(FILE *file, const char *name, const StatsHistogram *histogram) {
+    static const double points[] = { 50, 90, 99 };
+    char value[32];
+
+    if (!histogram) {
+        fprintf(file, "%-16s %8s %10s %10s %10s %10s %10s\n",
+                "", "count", "p50", "p90", "p99", "max", "mean");
+        return;
+    }
+
+    fprintf(file, "%-16s %8lu", name, histogram->count);
+    for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); i++) {
+        stats_format(stats_percentile(histogram, points[i]), value, sizeof(value));
+        fprintf(file, " %10s", value);
+    }
+    stats_format(histogram->max, value, sizeof(value));
+    fprintf(file, " %10s", value);
+    stats_format(histogram->count ? histogram->total / histogram->count : 0, value, sizeof(value));
+    fprintf(file, " %10s\n", value);
+}
@@ -0,0 +1,387 @@
+#include "thread.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_ID ((size_t)-1)
+
+/* FNV-1a hash of a Message-ID */
+static unsigned int hash_id(const char *id, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Find the next <id> token in a header value. Returns pointer past it. */
+static const char *next_id(const char *p, const char **id, size_t *len) {
+    if (!p) return NULL;
+
+    while (*p && *p != '<') p++;
+    if (!*p) return NULL;
+
+    const char *end = strchr(p, '>');
+    if (!end) return NULL;
+
+    *id = p;
+    *len = end - p + 1;
+    return end + 1;
+}
+
+static int grow_buckets(ThreadIndex *index) {
+    int new_count = index->bucket_count ? index->bucket_count * 2 : 1024;
+    int *buckets = malloc(sizeof(int) * new_count);
+    if (!buckets) return -1;
+
+    for (int i = 0; i < new_count; i++) buckets[i] = -1;
+
+    /* Rehash every named container */
+    for (int i = 0; i < index->count; i++) {
+        if (index->containers[i].id_offset == NO_ID) continue;
+        unsigned int slot = index->containers[i].hash & (new_count - 1);
+        while (buckets[slot] != -1) {
+            slot = (slot + 1) & (new_count - 1);
+        }
+        buckets[slot] = i;
+    }
+
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = new_count;
+    return 0;
+}
+
+static int lookup(const ThreadIndex *index, const char *id, size_t len, unsigned int hash) {
+    if (index->bucket_count == 0) return -1;
+
+    unsigned int slot = hash & (index->bucket_count - 1);
+    while (index->buckets[slot] != -1) {
+        const ThreadContainer *c = &index->containers[index->buckets[slot]];
+        if (c->hash == hash) {
+            const char *stored = index->pool + c->id_offset;
+            if (strncmp(stored, id, len) == 0 && stored[len] == '\0') {
+                return index->buckets[slot];
+            }
+        }
+        slot = (slot + 1) & (index->bucket_count - 1);
+    }
+    return -1;
+}
+
+/* Append a new container; id may be NULL for an anonymous one */
+static int create(ThreadIndex *index, const char *id, size_t len, unsigned int hash) {
+    if (index->count >= index->capacity) {
+        int new_capacity = index->capacity ? index->capacity * 2 : 256;
+        ThreadContainer *c = realloc(index->containers, sizeof(ThreadContainer) * new_capacity);
+        if (!c) return -1;
+        index->containers = c;
+        index->capacity = new_capacity;
+    }
+
+    ThreadContainer *c = &index->containers[index->count];
+    c->id_offset = NO_ID;
+    c->hash = hash;
+    c->email = -1;
+    c->parent = -1;
+    c->first_child = -1;
+    c->last_child = -1;
+    c->next = -1;
+
+    if (id) {
+        if (index->pool_len + len + 1 > index->pool_capacity) {
+            size_t new_capacity = index->pool_capacity ? index->pool_capacity * 2 : 16384;
+            while (index->pool_len + len + 1 > new_capacity) new_capacity *= 2;
+            char *pool = realloc(index->pool, new_capacity);
+            if (!pool) return -1;
+            index->pool = pool;
+            index->pool_capacity = new_capacity;
+        }
+        memcpy(index->pool + index->pool_len, id, len);
+        index->pool[index->pool_len + len] = '\0';
+        c->id_offset = index->pool_len;
+        index->pool_len += len + 1;
+
+        if ((index->used_buckets + 1) * 2 > index->bucket_count) {
+            if (grow_buckets(index) < 0) return -1;
+        }
+        unsigned int slot = hash & (index->bucket_count - 1);
+        while (index->buckets[slot] != -1) {
+            slot = (slot + 1) & (index->bucket_count - 1);
+        }
+        index->buckets[slot] = index->count;
+        index->used_buckets++;
+    }
+
+    return index->count++;
+}
+
+static int lookup_or_create(ThreadIndex *index, const char *id, size_t len) {
+    unsigned int hash = hash_id(id, len);
+    int c = lookup(index, id, len, hash);
+    return c >= 0 ? c : create(index, id, len, hash);
+}
+
+/* Is a equal to b or one of b's ancestors? */
+static int is_ancestor(const ThreadIndex *index, int a, int b) {
+    while (b != -1) {
+        if (a == b) return 1;
+        b = index->containers[b].parent;
+    }
+    return 0;
+}
+
+static void link_child(ThreadIndex *index, int parent, int child) {
+    ThreadContainer *p = &index->containers[parent];
+    ThreadContainer *c = &index->containers[child];
+
+    c->parent = parent;
+    c->next = -1;
+    if (p->last_child != -1) {
+        index->containers[p->last_child].next = child;
+    } else {
+        p->first_child = child;
+    }
+    p->last_child = child;
+}
+
+static void unlink_child(ThreadIndex *index, int child) {
+    ThreadContainer *c = &index->containers[child];
+    ThreadContainer *p = &index->containers[c->parent];
+    int prev = -1;
+
+    for (int i = p->first_child; i != -1 && i != child; i = index->containers[i].next) {
+        prev = i;
+    }
+
+    if (prev == -1) {
+        p->first_child = c->next;
+    } else {
+        index->containers[prev].next = c->next;
+    }
+    if (p->last_child == child) {
+        p->last_child = prev;
+    }
+
+    c->parent = -1;
+    c->next = -1;
+}
+
+static int set_email_container(ThreadIndex *index, int email, int container) {
+    if (email >= index->by_email_capacity) {
+        int new_capacity = index->by_email_capacity ? index->by_email_capacity : 256;
+        while (email >= new_capacity) new_capacity *= 2;
+        int *map = realloc(index->by_email, sizeof(int) * new_capacity);
+        if (!map) return -1;
+        for (int i = index->by_email_capacity; i < new_capacity; i++) map[i] = -1;
+        index->by_email = map;
+        index->by_email_capacity = new_capacity;
+    }
+    index->by_email[email] = container;
+    return 0;
+}
+
+/* Initialize an empty index */
+void thread_init(ThreadIndex *index) {
+    memset(index, 0, sizeof(ThreadIndex));
+}
+
+/* Free all memory held by the index */
+void thread_free(ThreadIndex *index) {
+    free(index->containers);
+    free(index->buckets);
+    free(index->by_email);
+    free(index->pool);
+    free(index->order);
+    free(index->depth);
+    thread_init(index);
+}
+
+/* Drop all threads but keep allocations for reuse */
+void thread_reset(ThreadIndex *index) {
+    index->count = 0;
+    index->used_buckets = 0;
+    index->pool_len = 0;
+    index->order_count = 0;
+    index->dirty = 1;
+    for (int i = 0; i < index->bucket_count; i++) index->buckets[i] = -1;
+    for (int i = 0; i < index->by_email_capacity; i++) index->by_email[i] = -1;
+}
+
+/* Add a message to the index (JWZ steps 1A-1C, done incrementally) */
+int thread_add(ThreadIndex *index, int email,
+               const char *message_id, const char *in_reply_to,
+               const char *references) {
+    const char *id;
+    size_t len;
+    int c = -1;
+
+    if (next_id(message_id, &id, &len)) {
+        c = lookup_or_create(index, id, len);
+        /* Duplicate Message-ID: keep the second copy in its own container */
+        if (c >= 0 && index->containers[c].email != -1) {
+            c = create(index, NULL, 0, 0);
+        }
+    } else {
+        c = create(index, NULL, 0, 0);
+    }
+    if (c < 0) return -1;
+
+    index->containers[c].email = email;
+    if (set_email_container(index, email, c) < 0) return -1;
+
+    /* Chain the References together, oldest first */
+    int prev = -1;
+    const char *last_ref = NULL;
+    size_t last_len = 0;
+    const char *p = references;
+    while ((p = next_id(p, &id, &len)) != NULL) {
+        int r = lookup_or_create(index, id, len);
+        if (r < 0) return -1;
+        if (r == c) continue;
+        if (prev != -1 && index->containers[r].parent == -1 &&
+            !is_ancestor(index, r, prev)) {
+            link_child(index, prev, r);
+        }
+        prev = r;
+        last_ref = id;
+        last_len = len;
+    }
+
+    /* In-Reply-To counts when References is missing or does not end with it */
+    if (next_id(in_reply_to, &id, &len) &&
+        !(last_ref && last_len == len && strncmp(last_ref, id, len) == 0)) {
+        int r = lookup_or_create(index, id, len);
+        if (r < 0) return -1;
+        if (r != c) {
+            if (prev != -1 && index->containers[r].parent == -1 &&
+                !is_ancestor(index, r, prev)) {
+                link_child(index, prev, r);
+            }
+            prev = r;
+        }
+    }
+
+    /* The message's own references win over what others presumed; a message
+     * with no references at all keeps any parent it already has. */
+    if (prev != -1 && !is_ancestor(index, c, prev) &&
+        index->containers[c].parent != prev) {
+        if (index->containers[c].parent != -1) {
+            unlink_child(index, c);
+        }
+        link_child(index, prev, c);
+    }
+
+    index->dirty = 1;
+    return 0;
+}
+
+/* Apply one parent/child pair from a server-side THREAD response */
+int thread_link(ThreadIndex *index, int parent_email, int child_email) {
+    if (child_email < 0 || child_email >= index->by_email_capacity) return -1;
+
+    int child = index->by_email[child_email];
+    if (child < 0) return -1;
+
+    int parent = -1;
+    if (parent_email >= 0) {
+        if (parent_email >= index->by_email_capacity) return -1;
+        parent = index->by_email[parent_email];
+        if (parent < 0 || is_ancestor(index, child, parent)) return -1;
+    }
+
+    if (index->containers[child].parent == parent) return 0;
+
+    if (index->containers[child].parent != -1) {
+        unlink_child(index, child);
+    }
+    if (parent != -1) {
+        link_child(index, parent, child);
+    }
+
+    index->dirty = 1;
+    return 0;
+}
+
+/* Remove a deleted message, keeping its replies where they were */
+int thread_remove(ThreadIndex *index, int email) {
+    if (email < 0 || email >= index->by_email_capacity) return -1;
+
+    int c = index->by_email[email];
+    if (c < 0) return -1;
+
+    /* A named container may still be referred to; an anonymous leaf is
+     * dropped from its parent */
+    ThreadContainer *container = &index->containers[c];
+    container->email = -1;
+    if (container->id_offset == NO_ID && container->first_child == -1 &&
+        container->parent != -1) {
+        unlink_child(index, c);
+    }
+
+    memmove(&index->by_email[email], &index->by_email[email + 1],
+            sizeof(int) * (index->by_email_capacity - email - 1));
+    index->by_email[index->by_email_capacity - 1] = -1;
+    for (int i = 0; i < index->count; i++) {
+        if (index->containers[i].email > email) index->containers[i].email--;
+    }
+
+    index->dirty = 1;
+    return 0;
+}
+
+/* Walk every tree depth-first. Empty containers are not shown; their
+ * children are promoted to the empty container's level. */
+int thread_flatten(ThreadIndex *index) {
+    if (!index->dirty && index->order) {
+        return index->order_count;
+    }
+
+    int n = index->by_email_capacity;
+    int *order = realloc(index->order, sizeof(int) * (n + 1));
+    int *depth = realloc(index->depth, sizeof(int) * (n + 1));
+    if (order) index->order = order;
+    if (depth) index->depth = depth;
+    if (!order || !depth) return -1;
+
+    int *stack = malloc(sizeof(int) * 2 * (index->count + 1));
+    if (!stack) return -1;
+
+    int count = 0;
+    for (int root = 0; root < index->count; root++) {
+        if (index->containers[root].parent != -1) continue;
+
+        int sp = 0;
+        stack[sp++] = root;
+        stack[sp++] = 0;
+
+        while (sp > 0) {
+            int d = stack[--sp];
+            int node = stack[--sp];
+            const ThreadContainer *c = &index->containers[node];
+
+            if (node != root && c->next != -1) {
+                stack[sp++] = c->next;
+                stack[sp++] = d;
+            }
+
+            int child_depth = d;
+            if (c->email != -1 && count < n) {
+                order[count] = c->email;
+                depth[count] = d;
+                count++;
+                child_depth = d + 1;
+            }
+
+            if (c->first_child != -1) {
+                stack[sp++] = c->first_child;
+                stack[sp++] = child_depth;
+            }
+        }
+    }
+
+    free(stack);
+    index->order_count = count;
+    index->dirty = 0;
+    return count;
+}
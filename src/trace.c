@@ -0,0 +1,244 @@
+#define _POSIX_C_SOURCE 200809L
+#include "trace.h"
+#include <stdio.h>
+
+#ifdef CTERM_TRACE
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct {
+    const char *category;
+    const char *name;
+    unsigned long long start;
+    unsigned long long duration;
+    char detail[TRACE_DETAIL_LEN];
+} TraceEvent;
+
+/* Written only by its own thread. The head is published with a release
+ * store, so recording takes no lock; rings are kept after their thread
+ * exits until the trace is written. */
+typedef struct TraceRing {
+    TraceEvent *events;
+    unsigned long head;     /* Events recorded so far */
+    int tid;
+    char thread_name[32];
+    struct TraceRing *next;
+} TraceRing;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing *rings;
+static int ring_count;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int recording;
+static int started;
+static unsigned long long epoch;
+static char trace_path[512];
+
+static unsigned long long clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, NULL);
+}
+
+/* The calling thread's ring, created on its first event */
+static TraceRing *thread_ring(void) {
+    pthread_once(&ring_key_once, create_ring_key);
+
+    TraceRing *ring = pthread_getspecific(ring_key);
+    if (ring) return ring;
+
+    ring = calloc(1, sizeof(TraceRing));
+    if (!ring) return NULL;
+    ring->events = malloc(TRACE_RING_EVENTS * sizeof(TraceEvent));
+    if (!ring->events) {
+        free(ring);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    ring->tid = ++ring_count;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+/* Claim the next slot; publish_event makes it visible */
+static TraceEvent *next_event(TraceRing **ring_out) {
+    TraceRing *ring = thread_ring();
+    if (!ring) return NULL;
+    *ring_out = ring;
+    return &ring->events[ring->head % TRACE_RING_EVENTS];
+}
+
+static void publish_event(TraceRing *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long long trace_now(void) {
+    if (!__atomic_load_n(&recording, __ATOMIC_RELAXED)) return 0;
+    return clock_us();
+}
+
+void trace_record(const char *category, const char *name, unsigned long long start,
+                  const char *format, ...) {
+    TraceRing *ring;
+    TraceEvent *event;
+
+    /* Spans begun before recording started are dropped */
+    if (start == 0 || !__atomic_load_n(&recording, __ATOMIC_RELAXED)) return;
+    if (!(event = next_event(&ring))) return;
+
+    event->category = category;
+    event->name = name;
+    event->start = start;
+    event->duration = clock_us() - start;
+    event->detail[0] = '\0';
+    if (format) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(event->detail, sizeof(event->detail), format, args);
+        va_end(args);
+    }
+    publish_event(ring);
+}
+
+void trace_record_command(const char *category, unsigned long long start, const char *command) {
+    const char *p = command;
+    size_t len;
+
+    /* Skip the tag, keep one word, two for UID commands */
+    if (p[0] == 'A' && p[1] >= '0' && p[1] <= '9') {
+        p += strcspn(p, " ");
+        p += strspn(p, " ");
+    }
+    len = strcspn(p, " \r\n");
+    if (len == 3 && strncmp(p, "UID", 3) == 0 && p[3] == ' ') {
+        len = 4 + strcspn(p + 4, " \r\n");
+    }
+    trace_record(category, "command", start, "%.*s", (int)len, p);
+}
+
+void trace_thread_name(const char *name) {
+    if (!__atomic_load_n(&recording, __ATOMIC_RELAXED)) return;
+
+    TraceRing *ring = thread_ring();
+    if (ring) snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", name);
+}
+
+int trace_start(const char *path) {
+    /* Threads keep pointers to their rings, so there is one trace per run */
+    if (started) return -1;
+    started = 1;
+
+    snprintf(trace_path, sizeof(trace_path), "%s", path);
+    epoch = clock_us();
+    __atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+    trace_thread_name("main");
+    return 0;
+}
+
+static void write_string(FILE *file, const char *text) {
+    fputc('"', file);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(file, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(file, "\\u%04x", *p);
+        } else {
+            fputc(*p, file);
+        }
+    }
+    fputc('"', file);
+}
+
+int trace_stop(void) {
+    if (!__atomic_load_n(&recording, __ATOMIC_ACQUIRE)) return 0;
+    __atomic_store_n(&recording, 0, __ATOMIC_RELEASE);
+
+    FILE *file = fopen(trace_path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot write trace %s\n", trace_path);
+    }
+
+    int pid = (int)getpid();
+    int first = 1;
+    unsigned long events = 0, lost = 0;
+
+    if (file) fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&rings_lock);
+    while (rings) {
+        TraceRing *ring = rings;
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long begin = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+        if (file && ring->thread_name[0]) {
+            fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                    first ? "" : ",\n", pid, ring->tid);
+            write_string(file, ring->thread_name);
+            fprintf(file, "}}");
+            first = 0;
+        }
+        for (unsigned long i = begin; file && i < head; i++) {
+            const TraceEvent *event = &ring->events[i % TRACE_RING_EVENTS];
+            fprintf(file, "%s{\"ph\":\"X\",\"cat\":", first ? "" : ",\n");
+            write_string(file, event->category);
+            fprintf(file, ",\"name\":");
+            write_string(file, event->name);
+            fprintf(file, ",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d",
+                    event->start - epoch, event->duration, pid, ring->tid);
+            if (event->detail[0]) {
+                fprintf(file, ",\"args\":{\"detail\":");
+                write_string(file, event->detail);
+                fputc('}', file);
+            }
+            fputc('}', file);
+            first = 0;
+        }
+        events += head - begin;
+        lost += begin;
+
+        rings = ring->next;
+        free(ring->events);
+        free(ring);
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (!file) return -1;
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: Cannot write trace %s\n", trace_path);
+        return -1;
+    }
+    fprintf(stderr, "Trace: %lu events written to %s", events, trace_path);
+    if (lost > 0) fprintf(stderr, " (%lu older events overwritten)", lost);
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+#else
+
+int trace_start(const char *path) {
+    fprintf(stderr, "Warning: Not writing %s, cterm was built without tracing (CTERM_TRACE)\n", path);
+    return -1;
+}
+
+int trace_stop(void) {
+    return 0;
+}
+
+#endif /* CTERM_TRACE */
@@ -1,22 +1,834 @@
 #include "ui.h"
+#include "trace.h"
+#include "mime.h"
+#include "utf8.h"
+#include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
 
 #define STATUS_HEIGHT 2
 #define INPUT_SIZE 256
+#define MAX_THREAD_INDENT 6
+#define FOLDER_PANE_WIDTH 26
+#define LIST_ROW_LEN 1024
+#define PREVIEW_HEIGHT 9             /* Preview pane: headers and four snippet rows */
+#define PREVIEW_MIN_LIST 10          /* Rows the list keeps beside the pane */
+#define PREVIEW_AHEAD 2              /* Pages of snippets fetched from the top row */
+#define BODY_AHEAD 2                 /* Pages of a body kept loaded below the view */
+#define UI_TICK_MS 1000              /* Status bar tick while the outbox counts down */
+#define UI_ESC_DELAY_MS 100          /* Wait for the rest of an escape sequence */
+#define UI_KEY_PASTE_BEGIN (KEY_MAX + 1)    /* Bracketed paste markers */
+#define UI_KEY_PASTE_END (KEY_MAX + 2)
+#define UI_PASTE_CHUNK 65536         /* Bytes of a paste read at once */
+#define UI_PASTE_WAIT_MS 500         /* Wait for the rest of a paste */
+#define UI_KEY_STATS KEY_F(12)       /* Latency overlay on/off */
+
+/* Names of the views in the latency stats, as in the trace */
+static const char *const ui_view_names[] = { "draw list", "draw message", "draw compose" };
+
+/* Number of rows before the filter is applied */
+static int ui_base_count(UIContext *ctx) {
+    if (ctx->search_query[0]) {
+        return ctx->search_row_count;
+    }
+    if (ctx->threaded && ctx->index->thread_count >= 0) {
+        return ctx->index->thread_count;
+    }
+    return ctx->index->email_count;
+}
+
+/* Email index at a row before the filter is applied, or -1 */
+static int ui_base_index(UIContext *ctx, int row, int *depth) {
+    const WorkerIndex *index = ctx->index;
+
+    if (depth) *depth = 0;
+    if (row < 0 || row >= ui_base_count(ctx)) return -1;
+
+    if (ctx->search_query[0]) {
+        return ctx->search_rows[row];
+    }
+    if (ctx->threaded && index->thread_order) {
+        if (depth) *depth = index->thread_depth[row];
+        return index->thread_order[row];
+    }
+    return row;
+}
+
+/* Is the list narrowed by the filter (or is the user typing one)? */
+static int ui_filter_active(UIContext *ctx) {
+    return ctx->filtering || ctx->filter.pattern_len > 0;
+}
+
+/* Number of rows in the current list view */
+static int ui_view_count(UIContext *ctx) {
+    if (ui_filter_active(ctx)) {
+        return filter_count(&ctx->filter);
+    }
+    return ui_base_count(ctx);
+}
+
+/* Email index shown at a list row, or -1. depth may be NULL. */
+static int ui_view_index(UIContext *ctx, int row, int *depth) {
+    if (ui_filter_active(ctx)) {
+        if (depth) *depth = 0;
+        if (row < 0 || row >= filter_count(&ctx->filter)) return -1;
+        return filter_rows(&ctx->filter)[row];
+    }
+    return ui_base_index(ctx, row, depth);
+}
+
+/* Re-run the filter on top of a changed base list */
+static void ui_filter_rebase(UIContext *ctx) {
+    if (!ui_filter_active(ctx)) return;
+
+    int count = ui_base_count(ctx);
+    int *rows = malloc(sizeof(int) * (count + 1));
+    if (!rows) return;
+    for (int row = 0; row < count; row++) {
+        rows[row] = ui_base_index(ctx, row, NULL);
+    }
+
+    filter_begin(&ctx->filter, ctx->index->emails, ctx->index->email_count, rows, count);
+    free(rows);
+}
+
+/* Email under the cursor, or NULL */
+static const Email *ui_selected_email(UIContext *ctx) {
+    int index = ui_view_index(ctx, ctx->selected_index, NULL);
+    return index >= 0 ? &ctx->index->emails[index] : NULL;
+}
+
+/* Snippet of a message, the snapshot's unless one came since */
+static const char *ui_snippet(const UIContext *ctx, int index) {
+    const UIEmailState *state = &ctx->email_state[index];
+    return state->snippet ? state->snippet : ctx->index->emails[index].snippet;
+}
+
+static void ui_email_state_free(UIEmailState *state, int count) {
+    if (!state) return;
+    for (int i = 0; i < count; i++) free(state[i].snippet);
+    free(state);
+}
+
+/* Map search hits to current email indices, dropping vanished messages */
+static void ui_search_remap(UIContext *ctx) {
+    ctx->search_row_count = 0;
+    for (int i = 0; i < ctx->search_count; i++) {
+        int index = worker_index_find(ctx->index, ctx->search_uids[i]);
+        if (index >= 0) {
+            ctx->search_rows[ctx->search_row_count++] = index;
+        }
+    }
+}
+
+/* A new snapshot came in: indices in every derived view are stale */
+static void ui_list_changed(UIContext *ctx) {
+    render_cache_clear(&ctx->list_rows);
+    ui_search_remap(ctx);
+    filter_invalidate(&ctx->filter);
+    ui_filter_rebase(ctx);
+}
+
+/* Leave search results and go back to the full list */
+static void ui_search_clear(UIContext *ctx) {
+    free(ctx->search_uids);
+    free(ctx->search_rows);
+    ctx->search_uids = NULL;
+    ctx->search_rows = NULL;
+    ctx->search_count = 0;
+    ctx->search_row_count = 0;
+    ctx->search_query[0] = '\0';
+}
+
+/* Status bar text until the next key, e.g. what the worker reported */
+static void ui_set_notice(UIContext *ctx, const char *notice) {
+    snprintf(ctx->notice, sizeof(ctx->notice), "%s", notice);
+}
+
+/* Queue a command for the IMAP worker; notice says what is going on */
+static int ui_send(UIContext *ctx, const WorkerCommand *command, const char *notice) {
+    if (worker_send(ctx->worker, command) < 0) {
+        ui_set_notice(ctx, "Busy, try again");
+        return -1;
+    }
+    if (notice) ui_set_notice(ctx, notice);
+    return 0;
+}
+
+/* Queue a command about a message of the open folder */
+static int ui_command(UIContext *ctx, WorkerCommandType type, unsigned int uid, const char *notice) {
+    WorkerCommand command;
+
+    memset(&command, 0, sizeof(command));
+    command.type = type;
+    command.folder = ctx->index->current_folder;
+    command.uid = uid;
+    return ui_send(ctx, &command, notice);
+}
+
+/* Show the hits of a search the worker ran */
+static void ui_search_apply(UIContext *ctx, WorkerResult *result) {
+    ui_search_clear(ctx);
+
+    ctx->search_rows = malloc(sizeof(int) * (result->uid_count + 1));
+    if (!ctx->search_rows) {
+        ui_set_notice(ctx, "Error: out of memory");
+        return;
+    }
+    ctx->search_uids = result->uids;
+    ctx->search_count = result->uid_count;
+    result->uids = NULL;
+
+    snprintf(ctx->search_query, sizeof(ctx->search_query), "%s", result->query);
+    ui_search_remap(ctx);
+    ui_filter_rebase(ctx);
+    ctx->selected_index = 0;
+    ctx->scroll_offset = 0;
+}
+
+/* Read a line of input on the status bar. Returns its length. */
+static int ui_prompt(UIContext *ctx, const char *label, char *buffer, int size) {
+    render_invalidate(&ctx->status_region);
+    werase(ctx->status_win);
+    wattron(ctx->status_win, COLOR_PAIR(5));
+    box(ctx->status_win, 0, 0);
+    wattroff(ctx->status_win, COLOR_PAIR(5));
+
+    wattron(ctx->status_win, COLOR_PAIR(1) | A_BOLD);
+    mvwprintw(ctx->status_win, 0, 2, "%s", label);
+    wattroff(ctx->status_win, COLOR_PAIR(1) | A_BOLD);
+    wrefresh(ctx->status_win);
+
+    echo();
+    curs_set(1);
+    buffer[0] = '\0';
+    mvwgetnstr(ctx->status_win, 0, 3 + strlen(label), buffer, size - 1);
+    noecho();
+    curs_set(0);
+
+    /* Latency counts from Enter, not from the key that opened the prompt */
+    ctx->key_time = stats_now();
+
+    return strlen(buffer);
+}
+
+/* Row showing a given email in the current view, or 0 */
+static int ui_find_row(UIContext *ctx, int email_index) {
+    int count = ui_view_count(ctx);
+    for (int row = 0; row < count; row++) {
+        if (ui_view_index(ctx, row, NULL) == email_index) return row;
+    }
+    return 0;
+}
+
+/* Rows of the preview pane in the current view, 0 if it is not shown */
+static int ui_preview_rows(UIContext *ctx) {
+    if (!ctx->show_preview || ctx->current_view != VIEW_EMAIL_LIST) return 0;
+    return getmaxy(stdscr) - STATUS_HEIGHT >= PREVIEW_HEIGHT + PREVIEW_MIN_LIST ? PREVIEW_HEIGHT : 0;
+}
+
+/* Put the list next to the folder pane when the pane is shown, and above
+ * the preview pane */
+static void ui_layout(UIContext *ctx) {
+    int max_y, max_x;
+    getmaxyx(stdscr, max_y, max_x);
+
+    if (max_x < FOLDER_PANE_WIDTH + 40) {
+        ctx->show_folders = 0;
+        ctx->folder_focus = 0;
+    }
+    int pane = ctx->show_folders ? FOLDER_PANE_WIDTH : 0;
+    int preview = ui_preview_rows(ctx);
+    int list = max_y - STATUS_HEIGHT - preview;
+
+    /* Move first so the resized window always fits on screen */
+    mvwin(ctx->main_win, 0, 0);
+    wresize(ctx->main_win, list, max_x - pane);
+    mvwin(ctx->main_win, 0, pane);
+    if (preview > 0) {
+        mvwin(ctx->preview_win, 0, 0);
+        wresize(ctx->preview_win, preview, max_x - pane);
+        mvwin(ctx->preview_win, list, pane);
+    }
+    ctx->preview_height = preview;
+
+    /* The panes were covered by the list while they were hidden */
+    render_invalidate(&ctx->folder_region);
+    render_invalidate(&ctx->preview_region);
+}
+
+/* Clear the inside of row y of a boxed window and restore its side
+ * borders, which a scroll may have taken away */
+static void ui_clear_row(WINDOW *win, int y) {
+    int max_x = getmaxx(win);
+
+    wattron(win, COLOR_PAIR(5));
+    mvwaddch(win, y, 0, ACS_VLINE);
+    mvwaddch(win, y, max_x - 1, ACS_VLINE);
+    wattroff(win, COLOR_PAIR(5));
+    mvwhline(win, y, 1, ' ', max_x - 2);
+}
+
+/* Cut text in place to at most columns terminal columns */
+static void ui_fit(char *text, int columns) {
+    char fitted[1024];
+
+    /* Fitting never makes text longer */
+    utf8_fit(text, columns > 0 ? columns : 0, 0, fitted, sizeof(fitted));
+    strcpy(text, fitted);
+}
+
+/* Bottom border of a boxed window, with a label such as the scroll
+ * position on it */
+static void ui_draw_bottom(RenderRegion *region, WINDOW *win, const char *label, attr_t attr) {
+    int max_y = getmaxy(win);
+    int max_x = getmaxx(win);
+
+    uint64_t hash = render_hash_int(render_hash(RENDER_HASH_SEED, label), (long)attr);
+    if (!render_row_changed(region, max_y - 1, hash)) return;
+
+    wattron(win, COLOR_PAIR(5));
+    mvwhline(win, max_y - 1, 1, ACS_HLINE, max_x - 2);
+    wattroff(win, COLOR_PAIR(5));
+    if (label[0]) {
+        wattron(win, attr);
+        mvwprintw(win, max_y - 1, max_x - 20, "%s", label);
+        wattroff(win, attr);
+    }
+}
+
+/* Draw the folder pane with unread counts */
+static void ui_draw_folders(UIContext *ctx) {
+    const WorkerCounts *folders = &ctx->index->counts;
+    WINDOW *win = ctx->folder_win;
+    RenderRegion *region = &ctx->folder_region;
+    int painted = 0;
+
+    TRACE_BEGIN(span);
+    if (render_begin(region, win, 0)) {
+        werase(win);
+        wattron(win, COLOR_PAIR(5));
+        box(win, 0, 0);
+        wattroff(win, COLOR_PAIR(5));
+
+        wattron(win, COLOR_PAIR(1) | A_BOLD);
+        mvwprintw(win, 1, 2, "📁 Folders");
+        wattroff(win, COLOR_PAIR(1) | A_BOLD);
+
+        wattron(win, COLOR_PAIR(5));
+        mvwhline(win, 2, 1, ACS_HLINE, getmaxx(win) - 2);
+        wattroff(win, COLOR_PAIR(5));
+    }
+
+    int max_y = getmaxy(win);
+    int max_x = getmaxx(win);
+    int visible = max_y - 4;
+    int top = ctx->folder_selected >= visible ? ctx->folder_selected - visible + 1 : 0;
+
+    for (int y = 3; y < max_y - 1; y++) {
+        int i = top + y - 3;
+        char counts[16] = "";
+        char name[MAX_MAILBOX_LEN] = "";
+        int selected = 0;
+        attr_t attr = 0;
+
+        if (i < folders->folder_count) {
+            const WorkerFolder *folder = &folders->folders[i];
+
+            if (folder->unseen > 0) {
+                snprintf(counts, sizeof(counts), "%d", folder->unseen);
+            }
+
+            /* Cut the name to leave room for the count */
+            strncpy(name, folder->display_name, sizeof(name) - 1);
+            name[sizeof(name) - 1] = '\0';
+            ui_fit(name, max_x - 5 - (int)strlen(counts));
+
+            selected = ctx->folder_focus && i == ctx->folder_selected;
+            if (selected) {
+                attr = COLOR_PAIR(7) | A_BOLD;
+            } else if (i == ctx->index->current_folder) {
+                attr = COLOR_PAIR(1) | A_BOLD;
+            } else if (folder->noselect) {
+                attr = A_DIM;
+            }
+        }
+
+        uint64_t hash = render_hash(render_hash(RENDER_HASH_SEED, name), counts);
+        if (!render_row_changed(region, y, render_hash_int(hash, (long)attr))) continue;
+
+        ui_clear_row(win, y);
+        wattron(win, attr);
+        if (selected) mvwhline(win, y, 1, ' ', max_x - 2);
+        mvwprintw(win, y, 2, "%s", name);
+        wattroff(win, attr);
+
+        if (counts[0]) {
+            attr_t count_attr = selected ? attr : (attr_t)(COLOR_PAIR(3) | A_BOLD);
+            wattron(win, count_attr);
+            mvwprintw(win, y, max_x - 2 - (int)strlen(counts), "%s", counts);
+            wattroff(win, count_attr);
+        }
+        painted++;
+    }
+
+    wnoutrefresh(win);
+    TRACE_END(span, "ui", "draw folders", "%d rows painted", painted);
+}
+
+/* Open a folder from the pane; the list changes when the worker sends
+ * the folder's snapshot */
+static void ui_open_folder(UIContext *ctx, int folder) {
+    WorkerCommand command;
+
+    if (folder == ctx->index->current_folder) {
+        ctx->folder_focus = 0;
+        return;
+    }
+    if (ctx->index->counts.folders[folder].noselect) {
+        ui_set_notice(ctx, "Folder cannot be opened");
+        return;
+    }
+
+    /* UIDs are per folder: a body still coming belongs to this one, and
+     * the worker drops it */
+    ctx->loading_uid = 0;
+
+    memset(&command, 0, sizeof(command));
+    command.type = WORKER_SWITCH_FOLDER;
+    command.folder = folder;
+    if (ui_send(ctx, &command, "Opening folder...") == 0) {
+        ctx->folder_focus = 0;
+    }
+}
+
+/* Keys typed while the folder pane has focus */
+static void ui_folder_input(UIContext *ctx, int ch) {
+    switch (ch) {
+        case KEY_UP:
+        case 'k':
+            if (ctx->folder_selected > 0) ctx->folder_selected--;
+            break;
+
+        case KEY_DOWN:
+        case 'j':
+            if (ctx->folder_selected < ctx->index->counts.folder_count - 1) ctx->folder_selected++;
+            break;
+
+        case '\n':
+        case KEY_ENTER:
+            if (ctx->folder_selected < ctx->index->counts.folder_count) {
+                ui_open_folder(ctx, ctx->folder_selected);
+            }
+            break;
+
+        case '\t':
+            ctx->folder_focus = 0;
+            break;
+
+        case 27: /* ESC */
+            ctx->show_folders = 0;
+            ctx->folder_focus = 0;
+            ui_layout(ctx);
+            break;
+
+        case 'q':
+        case 'Q':
+            ctx->running = 0;
+            break;
+    }
+}
+
+/* Ask for the next range of the open body when the view gets within
+ * BODY_AHEAD pages of where it ends, so scrolling rarely has to wait */
+static void ui_want_body(UIContext *ctx) {
+    WorkerCommand command;
+    const Email *email = ui_selected_email(ctx);
+    int page = getmaxy(ctx->main_win) - 6;
+
+    if (!ctx->body_next || ctx->body_more || !email || email->uid != ctx->body_uid) return;
+    if (ctx->body_top + (BODY_AHEAD + 1) * page < ctx->body_layout.count) return;
+
+    memset(&command, 0, sizeof(command));
+    command.type = WORKER_MORE;
+    command.folder = ctx->index->current_folder;
+    command.uid = ctx->body_uid;
+    command.offset = ctx->body_next;
+    command.width = getmaxx(ctx->main_win) - 4;
+    if (worker_send(ctx->worker, &command) == 0) ctx->body_more = 1;
+}
+
+/* Start opening a message; ui_idle shows it once the body is in */
+static void ui_open_email(UIContext *ctx, const Email *email) {
+    WorkerCommand command;
+
+    /* The worker wraps the body for the content view as it arrives */
+    memset(&command, 0, sizeof(command));
+    command.type = WORKER_OPEN;
+    command.folder = ctx->index->current_folder;
+    command.uid = email->uid;
+    command.width = getmaxx(ctx->main_win) - 4;
+    if (ui_send(ctx, &command, NULL) == 0) {
+        ctx->loading_uid = email->uid;
+    }
+}
+
+/* Take a new snapshot of the open folder, keeping the same message
+ * selected; if it is gone, the cursor stays on its row */
+static void ui_take_index(UIContext *ctx, WorkerResult *result) {
+    WorkerIndex *old = ctx->index;
+    int switched = old && result->index->current_folder != old->current_folder;
+    const Email *email = old ? ui_selected_email(ctx) : NULL;
+    unsigned int uid = email ? email->uid : 0;
+    int row = ctx->selected_index;
+
+    /* The snapshot's messages are shared with the worker; what changes
+     * of them from now on is kept here */
+    int count = result->index->email_count;
+    UIEmailState *state = calloc(count + 1, sizeof(UIEmailState));
+    if (!state) {
+        ui_set_notice(ctx, "Error: out of memory");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        state[i].seen = result->index->emails[i].seen;
+        state[i].previewed = result->index->emails[i].previewed;
+    }
+
+    if (old) ui_email_state_free(ctx->email_state, old->email_count);
+    ctx->email_state = state;
+    ctx->index = result->index;
+    result->index = NULL;
+    worker_index_free(old);
+
+    /* Counted once per snapshot, not on every frame */
+    ctx->unseen = 0;
+    for (int i = 0; i < count; i++) {
+        if (!state[i].seen) ctx->unseen++;
+    }
+
+    if (switched) {
+        /* Search results belong to the old folder; the filter carries over */
+        ui_search_clear(ctx);
+        uid = 0;
+        row = 0;
+        ctx->scroll_offset = 0;
+    }
+    ui_list_changed(ctx);
+
+    int index = uid ? worker_index_find(ctx->index, uid) : -1;
+    if (index >= 0) row = ui_find_row(ctx, index);
+    if (row >= ui_view_count(ctx)) row = ui_view_count(ctx) - 1;
+    ctx->selected_index = row > 0 ? row : 0;
+}
+
+/* The next range of the open body arrived: its text goes at the end, and
+ * so do its lines, which the worker wrapped */
+static void ui_append_body(UIContext *ctx, WorkerResult *result) {
+    TextLayout *layout = &ctx->body_layout;
+
+    ctx->body_more = 0;
+    if (result->uid != ctx->body_uid || result->offset != ctx->body_next) return;
+    if (result->status < 0) {
+        /* Not asked for again: the text ends where it got to */
+        ctx->body_next = 0;
+        ui_set_notice(ctx, "Failed to load the rest of the email");
+        return;
+    }
+
+    size_t len = strlen(result->body);
+    int extend = layout_valid(layout, ctx->body, result->layout.width);
+    char *body = realloc(ctx->body, ctx->body_len + len + 1);
+    if (!body) {
+        ctx->body_next = 0;
+        ui_set_notice(ctx, "Error: out of memory");
+        return;
+    }
+    memcpy(body + ctx->body_len, result->body, len + 1);
+
+    if (!extend || layout_append(layout, body, ctx->body_len + len, &result->layout) < 0) {
+        /* Wrapped for another width: made again when drawn, from the
+         * line at the top */
+        layout->text = body;
+        layout->width = 0;
+    }
+    ctx->body = body;
+    ctx->body_len += len;
+    ctx->body_next = result->next;
+}
+
+/* A body arrived; it is shown unless the user moved on meanwhile */
+static void ui_take_body(UIContext *ctx, WorkerResult *result) {
+    if (result->offset > 0) {
+        ui_append_body(ctx, result);
+        return;
+    }
+    if (result->uid != ctx->loading_uid) return;   /* Cancelled */
+    ctx->loading_uid = 0;
+
+    if (result->status < 0) {
+        ui_set_notice(ctx, "Failed to load email");
+        return;
+    }
+    free(ctx->body);
+    ctx->body = result->body;
+    ctx->body_len = strlen(ctx->body);
+    ctx->body_next = result->next;
+    ctx->body_more = 0;
+    ctx->body_uid = result->uid;
+    result->body = NULL;
+
+    /* The layout points into the body, which moved along with it */
+    layout_free(&ctx->body_layout);
+    ctx->body_layout = result->layout;
+    layout_init(&result->layout);
+    ctx->body_top = 0;
+
+    /* Fetching the body set \Seen on the server */
+    int index = worker_index_find(ctx->index, result->uid);
+    if (index >= 0 && !ctx->email_state[index].seen) {
+        ctx->email_state[index].seen = 1;
+        ctx->unseen--;
+    }
+
+    const Email *email = ui_selected_email(ctx);
+    if (email && email->uid == result->uid && ctx->current_view == VIEW_EMAIL_LIST) {
+        ctx->current_view = VIEW_EMAIL_CONTENT;
+    }
+}
+
+/* Snippets arrived; the rows showing them are formatted again */
+static void ui_take_snippets(UIContext *ctx, WorkerResult *result) {
+    for (int i = 0; i < result->snippet_count; i++) {
+        int index = worker_index_find(ctx->index, result->snippets[i].uid);
+        if (index < 0) continue;
+
+        UIEmailState *state = &ctx->email_state[index];
+        size_t len = strlen(result->snippets[i].text);
+        char *snippet = realloc(state->snippet, len + 1);
+        if (!snippet) continue;
+        memcpy(snippet, result->snippets[i].text, len + 1);
+        state->snippet = snippet;
+        state->previewed = 1;
+    }
+}
+
+/* Flags that changed on the server while the list stayed the same */
+static void ui_take_flags(UIContext *ctx, WorkerResult *result) {
+    for (int i = 0; i < result->flag_count; i++) {
+        int index = worker_index_find(ctx->index, result->flags[i].uid);
+        if (index < 0) continue;
+
+        UIEmailState *state = &ctx->email_state[index];
+        if (state->seen != result->flags[i].seen) {
+            state->seen = result->flags[i].seen;
+            ctx->unseen += state->seen ? -1 : 1;
+        }
+    }
+
+    worker_counts_free(&ctx->index->counts);
+    ctx->index->counts = result->counts;
+    result->counts.folders = NULL;
+}
+
+/* Ask for the snippets of the rows on screen and the next page, so the
+ * preview follows j/k without waiting for the server. With PREVIEW they
+ * came with the headers and nothing is asked. */
+static void ui_want_snippets(UIContext *ctx) {
+    WorkerCommand command;
+    int count = ui_view_count(ctx);
+    int rows = getmaxy(ctx->main_win) - 4;
+    int last = ctx->scroll_offset + PREVIEW_AHEAD * (rows > 0 ? rows : 1);
+    int asked[WORKER_SNIPPET_BATCH];
+
+    memset(&command, 0, sizeof(command));
+    command.type = WORKER_SNIPPETS;
+    command.folder = ctx->index->current_folder;
+
+    for (int row = ctx->scroll_offset; row < count && row < last; row++) {
+        int index = ui_view_index(ctx, row, NULL);
+        if (ctx->email_state[index].previewed != 0) continue;
+
+        asked[command.uid_count] = index;
+        command.uids[command.uid_count++] = ctx->index->emails[index].uid;
+        if (command.uid_count < WORKER_SNIPPET_BATCH && row + 1 < count && row + 1 < last) continue;
+
+        /* A full queue is no error: the rows are asked about next frame */
+        if (worker_send(ctx->worker, &command) < 0) break;
+        for (int i = 0; i < command.uid_count; i++) ctx->email_state[asked[i]].previewed = -1;
+        command.uid_count = 0;
+    }
+}
+
+/* Apply what the IMAP worker has sent since the last call */
+static void ui_idle(UIContext *ctx) {
+    WorkerResult *result;
+
+    while ((result = worker_receive(ctx->worker)) != NULL) {
+        switch (result->type) {
+            case WORKER_RESULT_INDEX:
+                ui_take_index(ctx, result);
+                break;
+
+            case WORKER_RESULT_COUNTS:
+                worker_counts_free(&ctx->index->counts);
+                ctx->index->counts = result->counts;
+                result->counts.folders = NULL;
+                break;
+
+            case WORKER_RESULT_BODY:
+                ui_take_body(ctx, result);
+                break;
+
+            case WORKER_RESULT_SEARCH:
+                /* Unless the folder was switched meanwhile */
+                if (result->folder == ctx->index->current_folder) {
+                    ui_search_apply(ctx, result);
+                }
+                break;
+
+            case WORKER_RESULT_SNIPPETS:
+                if (result->folder == ctx->index->current_folder) {
+                    ui_take_snippets(ctx, result);
+                }
+                break;
+
+            case WORKER_RESULT_FLAGS:
+                if (result->folder == ctx->index->current_folder) {
+                    ui_take_flags(ctx, result);
+                }
+                break;
+
+            case WORKER_RESULT_DONE:
+                break;
+        }
+        if (result->message[0]) ui_set_notice(ctx, result->message);
+        worker_result_free(result);
+    }
+}
+
+/* Sleep until a key is pressed, the worker has a result, the outbox
+ * changes or the status bar countdown ticks */
+static void ui_wait(UIContext *ctx) {
+    struct pollfd fds[3];
+    int count = 0;
+
+    fds[count].fd = STDIN_FILENO;
+    fds[count++].events = POLLIN;
+
+    int worker_fd = worker_event_fd(ctx->worker);
+    if (worker_fd >= 0) {
+        fds[count].fd = worker_fd;
+        fds[count++].events = POLLIN;
+    }
+
+    int outbox_fd = outbox_event_fd(ctx->outbox);
+    if (outbox_fd >= 0) {
+        fds[count].fd = outbox_fd;
+        fds[count++].events = POLLIN;
+    }
+
+    for (int i = 0; i < count; i++) fds[i].revents = 0;
+    poll(fds, count, ctx->status_ticking ? UI_TICK_MS : -1);
+}
+
+/* Status bar text when there is no message: unread mail everywhere and
+ * whether the server reported changes in the open folder */
+static void ui_mail_notice(UIContext *ctx, char *notice, size_t size) {
+    const WorkerIndex *index = ctx->index;
+    int unseen = ctx->unseen;
+
+    for (int i = 0; i < index->counts.folder_count; i++) {
+        if (i != index->current_folder && index->counts.folders[i].unseen > 0) {
+            unseen += index->counts.folders[i].unseen;
+        }
+    }
+
+    unsigned int last_uid = index->email_count > 0 ? index->emails[index->email_count - 1].uid : 0;
+    int changed = index->counts.server_messages >= 0 &&
+                  (index->counts.server_messages != index->email_count ||
+                   index->counts.server_max_uid > last_uid);
+
+    char outbox[96];
+    outbox_status(ctx->outbox, outbox, sizeof(outbox));
+    ctx->status_ticking = outbox[0] != '\0';
+
+    snprintf(notice, size, "%s%s%s%d unread", outbox, outbox[0] ? " | " : "",
+             changed ? "New mail, [R]efresh | " : "", unseen);
+}
 
 /* Initialize UI */
-int ui_init(UIContext *ctx, ImapSession *imap, SmtpSession *smtp, Config *cfg) {
-    ctx->imap_session = imap;
-    ctx->smtp_session = smtp;
+int ui_init(UIContext *ctx, ImapWorker *worker, Outbox *outbox, Config *cfg) {
+    ctx->worker = worker;
+    ctx->index = NULL;
+    ctx->unseen = 0;
+    ctx->body = NULL;
+    ctx->body_len = 0;
+    ctx->body_next = 0;
+    ctx->body_more = 0;
+    ctx->body_uid = 0;
+    layout_init(&ctx->body_layout);
+    ctx->body_top = 0;
+    for (int i = 0; i < COMPOSE_FIELDS; i++) {
+        if (editor_init(&ctx->compose[i]) < 0) {
+            fprintf(stderr, "Error: Out of memory for the compose form\n");
+            return -1;
+        }
+    }
+    ctx->compose_field = COMPOSE_TO;
+    ctx->pasting = 0;
+    stats_init(&ctx->key_latency);
+    for (int i = 0; i <= VIEW_COMPOSE; i++) {
+        stats_init(&ctx->draw_time[i]);
+    }
+    ctx->key_time = 0;
+    ctx->show_stats = 0;
+    ctx->notice[0] = '\0';
+    ctx->outbox = outbox;
     ctx->config = cfg;
     ctx->current_view = VIEW_EMAIL_LIST;
     ctx->selected_index = 0;
     ctx->scroll_offset = 0;
+    ctx->threaded = 0;
+    ctx->search_query[0] = '\0';
+    ctx->search_uids = NULL;
+    ctx->search_count = 0;
+    ctx->search_rows = NULL;
+    ctx->search_row_count = 0;
+    filter_init(&ctx->filter);
+    ctx->filtering = 0;
+    ctx->show_folders = 0;
+    ctx->folder_focus = 0;
+    ctx->folder_selected = 0;
+    ctx->show_preview = 0;
+    ctx->preview_height = 0;
+    layout_init(&ctx->preview_layout);
+    ctx->loading_uid = 0;
+    ctx->status_ticking = 0;
     ctx->running = 1;
+    render_init(&ctx->main_region);
+    render_init(&ctx->status_region);
+    render_init(&ctx->folder_region);
+    render_init(&ctx->preview_region);
+    render_cache_init(&ctx->list_rows);
+
+    /* The worker queued the first snapshot when it started */
+    ui_idle(ctx);
+    if (!ctx->index) {
+        fprintf(stderr, "Error: No message index from the IMAP worker\n");
+        return -1;
+    }
 
-    /* Initialize ncurses */
-    initscr();
+    /* Initialize ncurses; the locale lets it draw UTF-8 */
+    setlocale(LC_ALL, "");
+    if (!stdscr) {
+        /* Unless the caller set up a terminal of its own with newterm,
+         * as the render benchmark does */
+        initscr();
+    }
     cbreak();
     noecho();
     keypad(stdscr, TRUE);
@@ -41,8 +853,10 @@ int ui_init(UIContext *ctx, ImapSession *imap, SmtpSession *smtp, Config *cfg) {
 
     ctx->main_win = newwin(max_y - STATUS_HEIGHT, max_x, 0, 0);
     ctx->status_win = newwin(STATUS_HEIGHT, max_x, max_y - STATUS_HEIGHT, 0);
+    ctx->folder_win = newwin(max_y - STATUS_HEIGHT, FOLDER_PANE_WIDTH, 0, 0);
+    ctx->preview_win = newwin(PREVIEW_HEIGHT, max_x, 0, 0);
 
-    if (!ctx->main_win || !ctx->status_win) {
+    if (!ctx->main_win || !ctx->status_win || !ctx->folder_win || !ctx->preview_win) {
         endwin();
         fprintf(stderr, "Error: Failed to create windows\n");
         return -1;
@@ -52,96 +866,259 @@ int ui_init(UIContext *ctx, ImapSession *imap, SmtpSession *smtp, Config *cfg) {
     scrollok(ctx->main_win, TRUE);
     keypad(ctx->main_win, TRUE);
 
+    /* Let the list scroll with the terminal's insert/delete line */
+    idlok(ctx->main_win, TRUE);
+
+    /* ui_run polls for keys together with the server; reading them must
+     * not block, and a lone Esc should not take a second */
+    wtimeout(ctx->main_win, 0);
+    set_escdelay(UI_ESC_DELAY_MS);
+    define_key("\033[200~", UI_KEY_PASTE_BEGIN);
+    define_key("\033[201~", UI_KEY_PASTE_END);
+
     return 0;
 }
 
 /* Cleanup UI */
 void ui_cleanup(UIContext *ctx) {
+    ui_search_clear(ctx);
+    filter_free(&ctx->filter);
     if (ctx->main_win) {
         delwin(ctx->main_win);
     }
     if (ctx->status_win) {
         delwin(ctx->status_win);
     }
+    if (ctx->folder_win) {
+        delwin(ctx->folder_win);
+    }
+    if (ctx->preview_win) {
+        delwin(ctx->preview_win);
+    }
+    render_free(&ctx->main_region);
+    render_free(&ctx->status_region);
+    render_free(&ctx->folder_region);
+    render_free(&ctx->preview_region);
+    layout_free(&ctx->preview_layout);
+    render_cache_free(&ctx->list_rows);
+    if (ctx->index) ui_email_state_free(ctx->email_state, ctx->index->email_count);
+    ctx->email_state = NULL;
+    worker_index_free(ctx->index);
+    ctx->index = NULL;
+    free(ctx->body);
+    ctx->body = NULL;
+    layout_free(&ctx->body_layout);
+    for (int i = 0; i < COMPOSE_FIELDS; i++) {
+        editor_free(&ctx->compose[i]);
+    }
     endwin();
 }
 
-/* Draw status bar */
-void ui_draw_status(UIContext *ctx, const char *message) {
-    werase(ctx->status_win);
+/* Latency overlay: key to paint and the current view's draw time */
+static void ui_stats_line(UIContext *ctx, char *line, size_t size) {
+    const StatsHistogram *draw = &ctx->draw_time[ctx->current_view];
+    char key50[16], key99[16], draw50[16], draw99[16];
+
+    stats_format(stats_percentile(&ctx->key_latency, 50), key50, sizeof(key50));
+    stats_format(stats_percentile(&ctx->key_latency, 99), key99, sizeof(key99));
+    stats_format(stats_percentile(draw, 50), draw50, sizeof(draw50));
+    stats_format(stats_percentile(draw, 99), draw99, sizeof(draw99));
+    snprintf(line, size, "Key to paint p50 %s p99 %s (%lu) | %s p50 %s p99 %s [F12]Hide",
+             key50, key99, ctx->key_latency.count, ui_view_names[ctx->current_view], draw50, draw99);
+}
 
-    /* Color border */
-    wattron(ctx->status_win, COLOR_PAIR(5));
-    box(ctx->status_win, 0, 0);
-    wattroff(ctx->status_win, COLOR_PAIR(5));
+/* Stage the status bar; it is only redrawn when its text changed */
+static void ui_stage_status(UIContext *ctx, const char *message) {
+    WINDOW *win = ctx->status_win;
+    RenderRegion *region = &ctx->status_region;
+
+    TRACE_BEGIN(span);
 
     /* Show current view and controls */
     const char *view_name = "";
     const char *controls = "";
+    char filter_line[FILTER_MAX_PATTERN + 64];
+    char notice[160];
+    char stats_line[160];
+
+    ctx->status_ticking = 0;
+    if ((!message || !message[0]) && ctx->loading_uid) {
+        message = "Loading email... [Esc] Cancel";
+    } else if ((!message || !message[0]) && ctx->notice[0]) {
+        message = ctx->notice;
+    } else if (!message || !message[0]) {
+        /* Every view shows it: reading the outbox status is also what
+         * clears its wake-up for ui_wait */
+        ui_mail_notice(ctx, notice, sizeof(notice));
+        message = notice;
+    }
+    if (!message) message = "";
 
     switch (ctx->current_view) {
         case VIEW_EMAIL_LIST:
             view_name = "📧 Email List";
-            controls = "[Enter]Open [C]Compose [D]Delete [R]Refresh [Q]Quit";
+            controls = "[Enter]Open [/]Search [F]Filter [Tab]Folders [P]Preview [C]Compose [D]Delete [R]Refresh [T]Threads [Q]Quit";
+            if (ctx->folder_focus) {
+                controls = "[Enter]Open folder [J/K]Move [Tab]Messages [Esc]Hide folders";
+            } else if (ctx->filtering) {
+                snprintf(filter_line, sizeof(filter_line), "Filter: %s_   [Enter]Keep [Esc]Clear",
+                         ctx->filter.pattern);
+                controls = filter_line;
+            }
             break;
         case VIEW_EMAIL_CONTENT:
             view_name = "📖 Email Content";
-            controls = "[Esc]Back [D]Delete [M]Mark Unseen";
+            controls = "[J/K]Scroll [Space/B]Page [G]End [Esc]Back [D]Delete [M]Mark Unseen";
             break;
         case VIEW_COMPOSE:
             view_name = "✉️  Compose Email";
-            controls = "[F2]Send [Esc]Cancel";
+            controls = "[Tab]Next field [F2]Send [Esc]Cancel";
             break;
     }
 
-    wattron(ctx->status_win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(ctx->status_win, 0, 2, "[ %s ]", view_name);
-    wattroff(ctx->status_win, COLOR_PAIR(1) | A_BOLD);
+    if (ctx->show_stats) {
+        ui_stats_line(ctx, stats_line, sizeof(stats_line));
+        controls = stats_line;
+    }
 
-    wattron(ctx->status_win, COLOR_PAIR(6));
-    mvwprintw(ctx->status_win, 1, 2, "%s", controls);
-    wattroff(ctx->status_win, COLOR_PAIR(6));
+    int msg_color = (strstr(message, "Failed") || strstr(message, "Error")) ? 4 : 2;
 
-    if (message && strlen(message) > 0) {
-        int max_x = getmaxx(ctx->status_win);
-        int msg_color = (strstr(message, "Failed") || strstr(message, "Error")) ? 4 : 2;
-        wattron(ctx->status_win, COLOR_PAIR(msg_color) | A_BOLD);
-        mvwprintw(ctx->status_win, 0, max_x - strlen(message) - 3, " %s ", message);
-        wattroff(ctx->status_win, COLOR_PAIR(msg_color) | A_BOLD);
+    /* Both rows are checked so both hashes stay current */
+    int full = render_begin(region, win, 0);
+    int changed = render_row_changed(region, 0,
+        render_hash_int(render_hash(render_hash(RENDER_HASH_SEED, view_name), message), msg_color));
+    changed |= render_row_changed(region, 1, render_hash(RENDER_HASH_SEED, controls));
+    if (!full && !changed) {
+        TRACE_END(span, "ui", "draw status", "unchanged");
+        return;
     }
 
-    wrefresh(ctx->status_win);
+    werase(win);
+
+    /* Color border */
+    wattron(win, COLOR_PAIR(5));
+    box(win, 0, 0);
+    wattroff(win, COLOR_PAIR(5));
+
+    wattron(win, COLOR_PAIR(1) | A_BOLD);
+    mvwprintw(win, 0, 2, "[ %s ]", view_name);
+    wattroff(win, COLOR_PAIR(1) | A_BOLD);
+
+    wattron(win, COLOR_PAIR(6));
+    mvwprintw(win, 1, 2, "%s", controls);
+    wattroff(win, COLOR_PAIR(6));
+
+    if (message[0]) {
+        int max_x = getmaxx(win);
+        wattron(win, COLOR_PAIR(msg_color) | A_BOLD);
+        mvwprintw(win, 0, max_x - strlen(message) - 3, " %s ", message);
+        wattroff(win, COLOR_PAIR(msg_color) | A_BOLD);
+    }
+
+    wnoutrefresh(win);
+    TRACE_END(span, "ui", "draw status", NULL);
 }
 
-/* Draw email list view */
-void ui_draw_email_list(UIContext *ctx) {
-    werase(ctx->main_win);
+/* Draw status bar and show it at once: messages are put up right before
+ * blocking work */
+void ui_draw_status(UIContext *ctx, const char *message) {
+    ui_stage_status(ctx, message);
+    doupdate();
+}
 
-    /* Color border */
-    wattron(ctx->main_win, COLOR_PAIR(5));
-    box(ctx->main_win, 0, 0);
-    wattroff(ctx->main_win, COLOR_PAIR(5));
+/* The list line of an email: formatted for the window width once and
+ * taken from the row cache until its flags, thread depth, snippet or the
+ * width change. line is used when the cache is out of memory. */
+static const char *ui_list_row(UIContext *ctx, int index, int depth, int max_x,
+                               char *line, size_t size) {
+    const Email *email = &ctx->index->emails[index];
+    const UIEmailState *state = &ctx->email_state[index];
+    int levels = depth < MAX_THREAD_INDENT ? depth : MAX_THREAD_INDENT;
+    int snippet = ctx->show_preview && state->previewed > 0 && ui_snippet(ctx, index)[0];
+    uint64_t key = ((uint64_t)email->uid << 32) | ((uint64_t)(max_x & 0x7FFFFF) << 9) |
+                   ((uint64_t)snippet << 4) | ((uint64_t)levels << 1) | (state->seen ? 1 : 0);
+
+    const char *row = render_cache_get(&ctx->list_rows, index, key);
+    if (row) return row;
+
+    /* Format: [*] From: Subject */
+    const char *status_icon = state->seen ? " " : "●";
+
+    /* Replies are indented under their parent in conversation view */
+    char indent[2 * MAX_THREAD_INDENT + 8] = "";
+    if (levels > 0) {
+        memset(indent, ' ', 2 * (levels - 1));
+        strcpy(indent + 2 * (levels - 1), "↳ ");
+    }
 
-    int max_y = getmaxy(ctx->main_win);
-    int max_x = getmaxx(ctx->main_win);
-    int email_count = ctx->imap_session->email_count;
+    /* Widths are in terminal columns, so names line up whatever the script */
+    int from_len = max_x > 100 ? 30 : 20;
+    char from[MAX_FROM_LEN + 32];
+    utf8_fit(email->from, from_len, 1, from, sizeof(from));
+
+    char text[LIST_ROW_LEN];
+    int len = snprintf(text, sizeof(text), " %s %s │ %s", status_icon, from, indent);
+    if (len > 0 && len < (int)sizeof(text)) {
+        int subject_len = max_x - 3 - (from_len + 6) - 2 * levels;
+        char subject[MAX_SUBJECT_LEN + MAX_SNIPPET_LEN + 8];
+        snprintf(subject, sizeof(subject), "%s%s%s", email->subject,
+                 snippet ? " — " : "", snippet ? ui_snippet(ctx, index) : "");
+        utf8_fit(subject, subject_len > 0 ? subject_len : 0, 0, text + len, sizeof(text) - len);
+    }
+
+    /* Never wider than the space between the borders */
+    utf8_fit(text, max_x - 3, 0, line, size);
+
+    row = render_cache_put(&ctx->list_rows, index, key, line);
+    return row ? row : line;
+}
+
+/* Draw email list view. Rows that show the same as before are skipped;
+ * scrolling moves the rows on the terminal and draws only the new ones. */
+void ui_draw_email_list(UIContext *ctx) {
+    WINDOW *win = ctx->main_win;
+    RenderRegion *region = &ctx->main_region;
+    int painted = 0;
+
+    TRACE_BEGIN(span);
+    int full = render_begin(region, win, VIEW_EMAIL_LIST);
+    if (full) {
+        werase(win);
+
+        /* Color border */
+        wattron(win, COLOR_PAIR(5));
+        box(win, 0, 0);
+        wattroff(win, COLOR_PAIR(5));
+
+        /* Draw separator line */
+        wattron(win, COLOR_PAIR(5));
+        mvwhline(win, 2, 1, ACS_HLINE, getmaxx(win) - 2);
+        wattroff(win, COLOR_PAIR(5));
+    }
+
+    int max_y = getmaxy(win);
+    int max_x = getmaxx(win);
+    int email_count = ui_view_count(ctx);
 
     /* Header */
-    wattron(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(ctx->main_win, 1, 2, "📬 INBOX - %d messages", email_count);
-    wattroff(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-
-    /* Draw separator line */
-    wattron(ctx->main_win, COLOR_PAIR(5));
-    mvwhline(ctx->main_win, 2, 1, ACS_HLINE, max_x - 2);
-    wattroff(ctx->main_win, COLOR_PAIR(5));
-
-    if (email_count == 0) {
-        wattron(ctx->main_win, COLOR_PAIR(3));
-        mvwprintw(ctx->main_win, 4, 2, "No emails in inbox");
-        wattroff(ctx->main_win, COLOR_PAIR(3));
-        wrefresh(ctx->main_win);
-        return;
+    char header[512];
+    int len;
+    if (ctx->search_query[0]) {
+        len = snprintf(header, sizeof(header), "🔍 \"%s\" - %d results", ctx->search_query, email_count);
+    } else {
+        len = snprintf(header, sizeof(header), "📬 %s - %d messages, %d unread%s",
+                       ctx->index->folder_name, email_count, ctx->unseen,
+                       ctx->threaded && !ui_filter_active(ctx) ? " (conversations)" : "");
+    }
+    if (ctx->filter.pattern_len > 0 && len >= 0 && len < (int)sizeof(header)) {
+        snprintf(header + len, sizeof(header) - len, " [filter: %s]", ctx->filter.pattern);
+    }
+    ui_fit(header, max_x - 3);
+    if (render_row_changed(region, 1, render_hash(RENDER_HASH_SEED, header))) {
+        ui_clear_row(win, 1);
+        wattron(win, COLOR_PAIR(1) | A_BOLD);
+        mvwprintw(win, 1, 2, "%s", header);
+        wattroff(win, COLOR_PAIR(1) | A_BOLD);
     }
 
     /* Adjust scroll offset if needed */
@@ -152,248 +1129,662 @@ void ui_draw_email_list(UIContext *ctx) {
     if (ctx->selected_index >= ctx->scroll_offset + visible_lines) {
         ctx->scroll_offset = ctx->selected_index - visible_lines + 1;
     }
+    if (ctx->scroll_offset < 0) ctx->scroll_offset = 0;
 
-    /* Draw emails */
-    int y = 3;
-    for (int i = ctx->scroll_offset; i < email_count && y < max_y - 1; i++) {
-        Email *email = &ctx->imap_session->emails[i];
+    /* Rows still on screen are moved rather than redrawn */
+    int top = 3, bottom = max_y - 2;
+    if (!full && region->top != ctx->scroll_offset) {
+        render_scroll(region, win, top, bottom, ctx->scroll_offset - region->top);
+    }
+    region->top = ctx->scroll_offset;
 
-        /* Highlight selected */
-        if (i == ctx->selected_index) {
-            wattron(ctx->main_win, COLOR_PAIR(7) | A_BOLD);
+    /* Draw emails */
+    for (int y = top; y <= bottom; y++) {
+        int i = ctx->scroll_offset + y - top;
+        char line[LIST_ROW_LEN];
+        const char *row = "";
+        attr_t attr = 0;
+
+        if (email_count == 0) {
+            if (y == 4) {
+                row = ctx->search_query[0] || ui_filter_active(ctx) ?
+                      "No matches" : "No emails in this folder";
+                attr = COLOR_PAIR(3);
+            }
+        } else if (i < email_count) {
+            int depth;
+            int index = ui_view_index(ctx, i, &depth);
+            row = ui_list_row(ctx, index, depth, max_x, line, sizeof(line));
+
+            /* Highlight selected, color unread emails differently */
+            if (i == ctx->selected_index) {
+                attr = COLOR_PAIR(7) | A_BOLD;
+            } else if (!ctx->email_state[index].seen) {
+                attr = COLOR_PAIR(3) | A_BOLD;
+            }
         }
 
-        /* Format: [*] From: Subject */
-        char status_icon[8];
-        if (email->seen) {
-            strcpy(status_icon, " ");
-        } else {
-            strcpy(status_icon, "●");
+        if (!render_row_changed(region, y, render_hash_int(render_hash(RENDER_HASH_SEED, row), (long)attr))) {
+            continue;
         }
+        ui_clear_row(win, y);
+        if (row[0]) {
+            wattron(win, attr);
+            mvwprintw(win, y, 2, "%s", row);
+            wattroff(win, attr);
+        }
+        painted++;
+    }
 
-        char line[512];
-        int from_len = max_x > 100 ? 30 : 20;
-        int subject_len = max_x - from_len - 15;
-        snprintf(line, sizeof(line), " %s %-*.*s │ %.*s",
-                status_icon, from_len, from_len, email->from, subject_len, email->subject);
+    /* Show scroll indicator */
+    char position[32] = "";
+    if (email_count > visible_lines) {
+        snprintf(position, sizeof(position), "[%d/%d]", ctx->selected_index + 1, email_count);
+    }
+    ui_draw_bottom(region, win, position, COLOR_PAIR(5));
 
-        /* Truncate if too long */
-        if ((int)strlen(line) > max_x - 4) {
-            line[max_x - 4] = '\0';
-        }
+    wnoutrefresh(win);
+    TRACE_END(span, "ui", "draw list", "%d rows painted", painted);
+}
 
-        /* Color unread emails differently */
-        if (!email->seen && i != ctx->selected_index) {
-            wattron(ctx->main_win, COLOR_PAIR(3) | A_BOLD);
-        }
+/* One "Label: value" header row of the message view */
+static void ui_draw_field(RenderRegion *region, WINDOW *win, int y, const char *label, const char *value) {
+    char text[MAX_SUBJECT_LEN];
+
+    strncpy(text, value, sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+    ui_fit(text, getmaxx(win) - 3 - utf8_width(label));
+
+    if (!render_row_changed(region, y, render_hash(render_hash(RENDER_HASH_SEED, label), text))) return;
+
+    ui_clear_row(win, y);
+    wattron(win, COLOR_PAIR(1) | A_BOLD);
+    mvwprintw(win, y, 2, "%s", label);
+    wattroff(win, COLOR_PAIR(1) | A_BOLD);
+    wprintw(win, "%s", text);
+}
 
-        mvwprintw(ctx->main_win, y, 2, "%s", line);
+/* Draw the preview pane: the selected message's headers and snippet */
+void ui_draw_preview(UIContext *ctx) {
+    WINDOW *win = ctx->preview_win;
+    RenderRegion *region = &ctx->preview_region;
+    const Email *email = ui_selected_email(ctx);
+
+    TRACE_BEGIN(span);
+    if (render_begin(region, win, 0)) {
+        werase(win);
+        wattron(win, COLOR_PAIR(5));
+        box(win, 0, 0);
+        mvwhline(win, 4, 1, ACS_HLINE, getmaxx(win) - 2);
+        wattroff(win, COLOR_PAIR(5));
+    }
 
-        if (!email->seen && i != ctx->selected_index) {
-            wattroff(ctx->main_win, COLOR_PAIR(3) | A_BOLD);
+    ui_draw_field(region, win, 1, "From: ", email ? email->from : "");
+    ui_draw_field(region, win, 2, "Subject: ", email ? email->subject : "");
+    ui_draw_field(region, win, 3, "Date: ", email ? email->date : "");
+
+    const char *snippet = "";
+    attr_t attr = 0;
+    if (email) {
+        int index = ui_view_index(ctx, ctx->selected_index, NULL);
+        int previewed = ctx->email_state[index].previewed > 0;
+        snippet = previewed ? ui_snippet(ctx, index) : "";
+        if (!snippet[0]) {
+            snippet = previewed ? "(no text)" : "Loading preview...";
+            attr = COLOR_PAIR(3);
         }
+    }
+
+    /* A snippet is one short line, wrapped afresh on every frame */
+    TextLayout *layout = &ctx->preview_layout;
+    if (layout_wrap(layout, snippet, strlen(snippet), getmaxx(win) - 4) < 0) layout_free(layout);
+
+    int bottom = getmaxy(win) - 2;
+    for (int y = 5; y <= bottom; y++) {
+        char text[MAX_SNIPPET_LEN * 2] = "";
+        int line = y - 5;
 
-        if (i == ctx->selected_index) {
-            wattroff(ctx->main_win, COLOR_PAIR(7) | A_BOLD);
+        /* The last row ends with an ellipsis if there is more */
+        if (line < layout->count) layout_line(layout, line, text, sizeof(text));
+        if (y == bottom && layout->count > line + 1) {
+            ui_fit(text, getmaxx(win) - 6);
+            strcat(text, " …");
         }
 
-        y++;
+        if (!render_row_changed(region, y, render_hash_int(render_hash(RENDER_HASH_SEED, text), (long)attr))) {
+            continue;
+        }
+        ui_clear_row(win, y);
+        wattron(win, attr);
+        mvwprintw(win, y, 2, "%s", text);
+        wattroff(win, attr);
     }
 
-    /* Show scroll indicator */
-    if (email_count > visible_lines) {
-        wattron(ctx->main_win, COLOR_PAIR(5));
-        mvwprintw(ctx->main_win, max_y - 1, max_x - 20, "[%d/%d]", ctx->selected_index + 1, email_count);
-        wattroff(ctx->main_win, COLOR_PAIR(5));
-    }
+    wnoutrefresh(win);
+    TRACE_END(span, "ui", "draw preview", "uid %u", email ? email->uid : 0);
+}
 
-    wrefresh(ctx->main_win);
+/* First body line to show so that the last page is full */
+static int ui_body_top(int top, int count, int visible) {
+    if (top > count - visible) top = count - visible;
+    return top > 0 ? top : 0;
 }
 
 /* Draw email content view */
 void ui_draw_email_content(UIContext *ctx) {
-    werase(ctx->main_win);
-
-    /* Color border */
-    wattron(ctx->main_win, COLOR_PAIR(5));
-    box(ctx->main_win, 0, 0);
-    wattroff(ctx->main_win, COLOR_PAIR(5));
+    WINDOW *win = ctx->main_win;
+    RenderRegion *region = &ctx->main_region;
+    int painted = 0;
+
+    TRACE_BEGIN(span);
+    int full = render_begin(region, win, VIEW_EMAIL_CONTENT);
+    if (full) {
+        werase(win);
+
+        /* Color border */
+        wattron(win, COLOR_PAIR(5));
+        box(win, 0, 0);
+        wattroff(win, COLOR_PAIR(5));
+
+        /* Separator */
+        wattron(win, COLOR_PAIR(5));
+        mvwhline(win, 4, 1, ACS_HLINE, getmaxx(win) - 2);
+        wattroff(win, COLOR_PAIR(5));
+    }
 
-    int max_y = getmaxy(ctx->main_win);
-    int max_x = getmaxx(ctx->main_win);
+    int max_y = getmaxy(win);
+    int max_x = getmaxx(win);
 
-    if (ctx->selected_index < 0 || ctx->selected_index >= ctx->imap_session->email_count) {
-        wrefresh(ctx->main_win);
+    const Email *email = ui_selected_email(ctx);
+    if (!email) {
+        wnoutrefresh(win);
+        TRACE_END(span, "ui", "draw message", NULL);
         return;
     }
 
-    Email *email = &ctx->imap_session->emails[ctx->selected_index];
-
     /* Headers */
-    wattron(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(ctx->main_win, 1, 2, "From: ");
-    wattroff(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    wprintw(ctx->main_win, "%s", email->from);
-
-    wattron(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(ctx->main_win, 2, 2, "Subject: ");
-    wattroff(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    wprintw(ctx->main_win, "%s", email->subject);
-
-    wattron(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(ctx->main_win, 3, 2, "Date: ");
-    wattroff(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    wprintw(ctx->main_win, "%s", email->date);
-
-    /* Separator */
-    wattron(ctx->main_win, COLOR_PAIR(5));
-    mvwhline(ctx->main_win, 4, 1, ACS_HLINE, max_x - 2);
-    wattroff(ctx->main_win, COLOR_PAIR(5));
-
-    /* Body - CRITICAL FIX: Use a copy of the body to avoid corrupting original with strtok */
-    int y = 5;
-    char body_copy[MAX_BODY_LEN];
-    strncpy(body_copy, email->body, MAX_BODY_LEN - 1);
-    body_copy[MAX_BODY_LEN - 1] = '\0';
-
-    char *line = strtok(body_copy, "\n");
-    while (line && y < max_y - 1) {
-        /* Word wrap simple implementation */
-        int len = strlen(line);
-        if (len > max_x - 4) {
-            char temp[2048];
-            strncpy(temp, line, max_x - 7);
-            temp[max_x - 7] = '\0';
-            mvwprintw(ctx->main_win, y, 2, "%s...", temp);
-        } else {
-            mvwprintw(ctx->main_win, y, 2, "%s", line);
+    ui_draw_field(region, win, 1, "From: ", email->from);
+    ui_draw_field(region, win, 2, "Subject: ", email->subject);
+    ui_draw_field(region, win, 3, "Date: ", email->date);
+
+    /* Body, if it is this message's. It was wrapped when it arrived; after
+     * a resize it is wrapped again, keeping the same text at the top. */
+    TextLayout *layout = &ctx->body_layout;
+    const char *body = ctx->body && ctx->body_uid == email->uid ? ctx->body : NULL;
+    int width = max_x - 4;
+    int top = 5, bottom = max_y - 2;
+    int visible = bottom - top + 1;
+
+    if (body && !layout_valid(layout, body, width)) {
+        size_t offset = layout->count > 0 && layout->text == body ?
+                        layout->lines[ui_body_top(ctx->body_top, layout->count, visible)] : 0;
+        if (layout_wrap(layout, body, ctx->body_len, width) < 0) {
+            layout_free(layout);
+            ui_set_notice(ctx, "Error: out of memory");
         }
-        y++;
-        line = strtok(NULL, "\n");
+        ctx->body_top = layout->count > 0 ? layout_find(layout, offset) : 0;
     }
+    int count = body ? layout->count : 0;
+    ctx->body_top = ui_body_top(ctx->body_top, count, visible);
 
-    /* Show if there's more content */
-    if (line != NULL || y >= max_y - 1) {
-        wattron(ctx->main_win, COLOR_PAIR(3));
-        mvwprintw(ctx->main_win, max_y - 1, max_x - 20, "[More content...]");
-        wattroff(ctx->main_win, COLOR_PAIR(3));
+    /* Scrolled: let the terminal move the rows, only new ones are drawn */
+    if (!full && region->top != ctx->body_top) {
+        render_scroll(region, win, top, bottom, ctx->body_top - region->top);
     }
+    region->top = ctx->body_top;
 
-    wrefresh(ctx->main_win);
+    for (int y = top; y <= bottom; y++) {
+        char text[2048] = "";
+        int line = ctx->body_top + y - top;
+
+        if (line < count) layout_line(layout, line, text, sizeof(text));
+
+        if (!render_row_changed(region, y, render_hash(RENDER_HASH_SEED, text))) continue;
+        ui_clear_row(win, y);
+        mvwprintw(win, y, 2, "%s", text);
+        painted++;
+    }
+
+    /* Position, when the body does not fit */
+    char position[32] = "";
+    if (count > visible) {
+        int last = ctx->body_top + visible < count ? ctx->body_top + visible : count;
+        snprintf(position, sizeof(position), "[%d-%d/%d%s]", ctx->body_top + 1, last, count,
+                 ctx->body_next ? "+" : "");
+    }
+    ui_draw_bottom(region, win, position, COLOR_PAIR(3));
+
+    wnoutrefresh(win);
+    TRACE_END(span, "ui", "draw message", "uid %u, %d rows painted", email->uid, painted);
 }
 
-/* Draw compose email view */
-void ui_draw_compose(UIContext *ctx) {
-    werase(ctx->main_win);
+/* Split the Attach field ("report.pdf, ~/photo.jpg") into file paths.
+ * Returns the number of files, or -1 with a message in error. */
+static int ui_parse_attachments(const char *field, char paths[][INPUT_SIZE],
+                                const char **attachments, char *error, size_t error_size) {
+    const char *home = getenv("HOME");
+    const char *p = field;
+    int count = 0;
+
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (!*p) break;
+
+        const char *end = strchr(p, ',');
+        if (!end) end = p + strlen(p);
+        int len = (int)(end - p);
+        while (len > 0 && p[len - 1] == ' ') len--;
+
+        if (count >= MIME_MAX_ATTACHMENTS) {
+            snprintf(error, error_size, "✗ At most %d attachments", MIME_MAX_ATTACHMENTS);
+            return -1;
+        }
+        if (p[0] == '~' && p[1] == '/' && home) {
+            snprintf(paths[count], INPUT_SIZE, "%s%.*s", home, len - 1, p + 1);
+        } else {
+            snprintf(paths[count], INPUT_SIZE, "%.*s", len, p);
+        }
+        if (!mime_attachment_ok(paths[count])) {
+            snprintf(error, error_size, "✗ Cannot attach %.*s", len, p);
+            return -1;
+        }
+        attachments[count] = paths[count];
+        count++;
+        p = end;
+    }
+    return count;
+}
 
-    /* Color border */
-    wattron(ctx->main_win, COLOR_PAIR(5));
-    box(ctx->main_win, 0, 0);
-    wattroff(ctx->main_win, COLOR_PAIR(5));
+/* Header fields of the compose form: label, row */
+static const struct {
+    const char *label;
+    int row;
+} compose_fields[COMPOSE_BODY] = {
+    { "To: ", 3 },
+    { "Subject: ", 4 },
+    { "Attach: ", 5 }
+};
 
-    int max_y = getmaxy(ctx->main_win);
+#define COMPOSE_BODY_ROW 8
+
+/* Columns a compose field wraps at; one more is kept for the cursor */
+static int ui_compose_width(UIContext *ctx, int field) {
     int max_x = getmaxx(ctx->main_win);
+    int width = field == COMPOSE_BODY ? max_x - 6 : max_x - 4 - (int)strlen(compose_fields[field].label);
+    return width > 1 ? width : 1;
+}
 
-    /* Header */
-    wattron(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(ctx->main_win, 1, 2, "✉️  Compose New Email");
-    wattroff(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-
-    /* Separator */
-    wattron(ctx->main_win, COLOR_PAIR(5));
-    mvwhline(ctx->main_win, 2, 1, ACS_HLINE, max_x - 2);
-    wattroff(ctx->main_win, COLOR_PAIR(5));
-
-    /* Labels */
-    wattron(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-    mvwprintw(ctx->main_win, 3, 2, "To: ");
-    mvwprintw(ctx->main_win, 4, 2, "Subject: ");
-    mvwprintw(ctx->main_win, 6, 2, "Body:");
-    wattroff(ctx->main_win, COLOR_PAIR(1) | A_BOLD);
-
-    wattron(ctx->main_win, COLOR_PAIR(6));
-    mvwprintw(ctx->main_win, 5, 2, "(Press F2 to send, Esc to cancel)");
-    wattroff(ctx->main_win, COLOR_PAIR(6));
-
-    /* Input fields */
-    char to[INPUT_SIZE] = "";
-    char subject[INPUT_SIZE] = "";
-    char body[1024] = "";
+static int ui_compose_height(UIContext *ctx) {
+    int height = getmaxy(ctx->main_win) - 1 - COMPOSE_BODY_ROW;
+    return height > 1 ? height : 1;
+}
 
-    echo();
-    curs_set(1);
+/* Start a new message. Bracketed paste is on while composing, so pasted
+ * text arrives marked and goes in as it is. */
+static void ui_compose_open(UIContext *ctx) {
+    for (int i = 0; i < COMPOSE_FIELDS; i++) {
+        editor_clear(&ctx->compose[i]);
+    }
+    ctx->compose_field = COMPOSE_TO;
+    ctx->pasting = 0;
+    ctx->current_view = VIEW_COMPOSE;
+    putp("\033[?2004h");
+}
 
-    /* Get To */
-    wattron(ctx->main_win, COLOR_PAIR(2));
-    mvwgetnstr(ctx->main_win, 3, 6, to, INPUT_SIZE - 1);
-    wattroff(ctx->main_win, COLOR_PAIR(2));
+static void ui_compose_close(UIContext *ctx) {
+    putp("\033[?2004l");
+    curs_set(0);
+    ctx->pasting = 0;
+    ctx->current_view = VIEW_EMAIL_LIST;
+}
 
-    /* Get Subject */
-    wattron(ctx->main_win, COLOR_PAIR(2));
-    mvwgetnstr(ctx->main_win, 4, 11, subject, INPUT_SIZE - 1);
-    wattroff(ctx->main_win, COLOR_PAIR(2));
+/* Queue the message; the outbox worker sends it in the background. On a
+ * mistake the form stays open with everything typed. */
+static void ui_compose_send(UIContext *ctx) {
+    const char *to = editor_text(&ctx->compose[COMPOSE_TO]);
+    const char *subject = editor_text(&ctx->compose[COMPOSE_SUBJECT]);
+    const char *attach = editor_text(&ctx->compose[COMPOSE_ATTACH]);
+    const char *body = editor_text(&ctx->compose[COMPOSE_BODY]);
+    char paths[MIME_MAX_ATTACHMENTS][INPUT_SIZE];
+    const char *attachments[MIME_MAX_ATTACHMENTS];
+    char error[sizeof(ctx->notice)];
+
+    if (!to || !subject || !attach || !body) {
+        ui_set_notice(ctx, "Error: out of memory");
+        return;
+    }
+    int attachment_count = ui_parse_attachments(attach, paths, attachments, error, sizeof(error));
+
+    if (attachment_count < 0) {
+        ui_set_notice(ctx, error);
+        ctx->compose_field = COMPOSE_ATTACH;
+    } else if (!to[0] || !subject[0]) {
+        ui_set_notice(ctx, "✗ Invalid email (missing To or Subject)");
+        ctx->compose_field = to[0] ? COMPOSE_SUBJECT : COMPOSE_TO;
+    } else if (outbox_enqueue(ctx->outbox, ctx->config->email_address,
+                              to, subject, body, attachments, attachment_count) == 0) {
+        ui_compose_close(ctx);
+    } else {
+        ui_set_notice(ctx, "✗ Failed to queue email");
+    }
+}
 
-    /* Get Body (simple multiline) */
-    int body_y = 7;
-    int body_len = 0;
-    wattron(ctx->main_win, COLOR_PAIR(6));
-    mvwprintw(ctx->main_win, body_y, 2, "│ ");
-    wattroff(ctx->main_win, COLOR_PAIR(6));
-    wrefresh(ctx->main_win);
+/* Add a pasted byte to text: line breaks as newlines (spaces in a header
+ * field), other control characters dropped. Returns the new length. */
+static size_t ui_paste_byte(char *text, size_t len, char c, int one_line, int *last_cr) {
+    int cr = c == '\r';
 
-    int ch;
-    while (body_len < (int)sizeof(body) - 2 && body_y < max_y - 2) {
-        ch = wgetch(ctx->main_win);
-
-        if (ch == KEY_F(2)) {
-            break; /* Send */
-        } else if (ch == 27) { /* ESC */
-            noecho();
-            curs_set(0);
-            ctx->current_view = VIEW_EMAIL_LIST;
-            return;
-        } else if (ch == '\n') {
-            body[body_len++] = '\n';
-            body_y++;
-            if (body_y < max_y - 2) {
-                wattron(ctx->main_win, COLOR_PAIR(6));
-                mvwprintw(ctx->main_win, body_y, 2, "│ ");
-                wattroff(ctx->main_win, COLOR_PAIR(6));
-                wrefresh(ctx->main_win);
+    if (c == '\n' && *last_cr) c = 0;      /* Second half of CR LF */
+    *last_cr = cr;
+    if (cr) c = '\n';
+    if (one_line && (c == '\n' || c == '\t')) c = ' ';
+    if (((unsigned char)c < 0x20 && c != '\n' && c != '\t') || c == 0x7F) return len;
+
+    text[len++] = c;
+    return len;
+}
+
+/* Read a bracketed paste straight from the terminal up to its end marker:
+ * a megabyte goes in with a few reads instead of a curses call per byte.
+ * Keys typed after it go back to curses. If the marker does not come, the
+ * rest of the paste is taken a key at a time. */
+static void ui_compose_paste(UIContext *ctx) {
+    static const char marker[] = "\033[201~";
+    Editor *editor = &ctx->compose[ctx->compose_field];
+    int one_line = ctx->compose_field != COMPOSE_BODY;
+    char *input = malloc(UI_PASTE_CHUNK);
+    char *text = malloc(UI_PASTE_CHUNK + sizeof(marker));
+    struct pollfd fd;
+    size_t matched = 0;
+    int last_cr = 0;
+
+    ctx->pasting = 1;
+    fd.fd = STDIN_FILENO;
+    fd.events = POLLIN;
+
+    while (input && text && ctx->pasting && poll(&fd, 1, UI_PASTE_WAIT_MS) > 0) {
+        ssize_t n = read(STDIN_FILENO, input, UI_PASTE_CHUNK);
+        size_t len = 0;
+        if (n <= 0) break;
+
+        for (ssize_t i = 0; i < n; i++) {
+            if (input[i] == marker[matched]) {
+                if (++matched < sizeof(marker) - 1) continue;
+                ctx->pasting = 0;
+                for (ssize_t j = n - 1; j > i; j--) ungetch((unsigned char)input[j]);
+                break;
             }
-        } else if (ch >= 32 && ch < 127) {
-            body[body_len++] = ch;
-            waddch(ctx->main_win, ch);
+            /* What looked like the marker was text */
+            for (size_t j = 0; j < matched; j++) {
+                len = ui_paste_byte(text, len, marker[j], one_line, &last_cr);
+            }
+            matched = input[i] == marker[0];
+            if (!matched) len = ui_paste_byte(text, len, input[i], one_line, &last_cr);
+        }
+        if (editor_insert(editor, text, len) < 0) {
+            ui_set_notice(ctx, "Error: out of memory");
+            break;
         }
     }
+    free(input);
+    free(text);
+}
 
-    body[body_len] = '\0';
+void ui_compose_input(UIContext *ctx, wint_t ch, int key) {
+    int field = ctx->compose_field;
+    Editor *editor = &ctx->compose[field];
+    int width = ui_compose_width(ctx, field);
+    char text[8];
+    size_t len = 0;
+
+    if (key) {
+        switch (ch) {
+            case UI_KEY_PASTE_BEGIN:
+                ui_compose_paste(ctx);
+                break;
+            case UI_KEY_PASTE_END:
+                ctx->pasting = 0;
+                break;
+            case KEY_F(2):
+                ui_compose_send(ctx);
+                break;
+            case UI_KEY_STATS:
+                ctx->show_stats = !ctx->show_stats;
+                break;
+            case KEY_BTAB:
+                ctx->compose_field = (field + COMPOSE_FIELDS - 1) % COMPOSE_FIELDS;
+                break;
+            case KEY_ENTER:
+                if (field == COMPOSE_BODY) {
+                    len = 1;
+                    text[0] = '\n';
+                } else {
+                    ctx->compose_field = field + 1;
+                }
+                break;
+            case KEY_BACKSPACE:
+                editor_backspace(editor);
+                break;
+            case KEY_DC:
+                editor_delete(editor);
+                break;
+            case KEY_LEFT:
+                editor_left(editor);
+                break;
+            case KEY_RIGHT:
+                editor_right(editor);
+                break;
+            case KEY_HOME:
+                editor_home(editor, width);
+                break;
+            case KEY_END:
+                editor_end(editor, width);
+                break;
+            case KEY_UP:
+                if (field != COMPOSE_BODY || editor_up(editor, width) < 0) {
+                    if (field > 0) ctx->compose_field = field - 1;
+                }
+                break;
+            case KEY_DOWN:
+                if (field != COMPOSE_BODY) ctx->compose_field = field + 1;
+                else editor_down(editor, width);
+                break;
+            case KEY_PPAGE:
+                for (int i = 0; field == COMPOSE_BODY && i < ui_compose_height(ctx); i++) {
+                    if (editor_up(editor, width) < 0) break;
+                }
+                break;
+            case KEY_NPAGE:
+                for (int i = 0; field == COMPOSE_BODY && i < ui_compose_height(ctx); i++) {
+                    if (editor_down(editor, width) < 0) break;
+                }
+                break;
+        }
+    } else if (ctx->pasting) {
+        /* The rest of a paste that stalled: taken as it is, except that
+         * the header fields stay on one line */
+        if (ch == '\r') ch = '\n';
+        if (field != COMPOSE_BODY && (ch == '\n' || ch == '\t')) ch = ' ';
+        if (ch == '\n' || ch == '\t' || ch >= 0x20) len = utf8_encode((unsigned int)ch, text);
+    } else if (ch == 27) { /* ESC */
+        ui_compose_close(ctx);
+    } else if (ch == '\t') {
+        ctx->compose_field = (field + 1) % COMPOSE_FIELDS;
+    } else if (ch == '\n' || ch == '\r') {
+        if (field == COMPOSE_BODY) {
+            len = 1;
+            text[0] = '\n';
+        } else {
+            ctx->compose_field = field + 1;
+        }
+    } else if (ch == 127 || ch == 8) {
+        editor_backspace(editor);
+    } else if (ch >= 0x20) {
+        len = utf8_encode((unsigned int)ch, text);
+    }
 
-    noecho();
-    curs_set(0);
+    if (len > 0 && editor_insert(editor, text, len) < 0) {
+        ui_set_notice(ctx, "Error: out of memory");
+    }
+}
 
-    /* Send email */
-    ui_draw_status(ctx, "Sending email...");
+/* Compose form. Only the rows around the cursor are formatted, and only
+ * those that changed are drawn, so a keystroke costs the same in a
+ * megabyte reply as in an empty one. */
+void ui_draw_compose(UIContext *ctx) {
+    WINDOW *win = ctx->main_win;
+    RenderRegion *region = &ctx->main_region;
+    int max_y = getmaxy(win);
+    int cursor_y = 0, cursor_x = 0, painted = 0;
+    char text[1024];
+    size_t next;
+
+    TRACE_BEGIN(span);
+    if (render_begin(region, win, VIEW_COMPOSE)) {
+        int max_x = getmaxx(win);
+        werase(win);
+
+        /* Color border */
+        wattron(win, COLOR_PAIR(5));
+        box(win, 0, 0);
+        wattroff(win, COLOR_PAIR(5));
+
+        /* Header */
+        wattron(win, COLOR_PAIR(1) | A_BOLD);
+        mvwprintw(win, 1, 2, "✉️  Compose New Email");
+        wattroff(win, COLOR_PAIR(1) | A_BOLD);
+
+        /* Separator */
+        wattron(win, COLOR_PAIR(5));
+        mvwhline(win, 2, 1, ACS_HLINE, max_x - 2);
+        wattroff(win, COLOR_PAIR(5));
+
+        /* Labels */
+        wattron(win, COLOR_PAIR(1) | A_BOLD);
+        for (int i = 0; i < COMPOSE_BODY; i++) {
+            mvwprintw(win, compose_fields[i].row, 2, "%s", compose_fields[i].label);
+        }
+        mvwprintw(win, COMPOSE_BODY_ROW - 1, 2, "Body:");
+        wattroff(win, COLOR_PAIR(1) | A_BOLD);
 
-    if (strlen(to) > 0 && strlen(subject) > 0) {
-        if (smtp_send_email(ctx->smtp_session, ctx->config->email_address,
-                           to, subject, body) == 0) {
-            ui_draw_status(ctx, "✓ Email sent successfully!");
-        } else {
-            ui_draw_status(ctx, "✗ Failed to send email");
+        wattron(win, COLOR_PAIR(6));
+        mvwprintw(win, 6, 2, "(Files separated by commas; F2 to send, Esc to cancel)");
+        for (int y = COMPOSE_BODY_ROW; y < max_y - 1; y++) {
+            mvwprintw(win, y, 2, "│ ");
         }
-    } else {
-        ui_draw_status(ctx, "✗ Invalid email (missing To or Subject)");
+        wattroff(win, COLOR_PAIR(6));
     }
 
-    /* Wait for key press */
-    wgetch(ctx->main_win);
+    /* Header fields: the part of the line the cursor is on */
+    for (int i = 0; i < COMPOSE_BODY; i++) {
+        Editor *editor = &ctx->compose[i];
+        int column = 2 + (int)strlen(compose_fields[i].label);
+        int width = ui_compose_width(ctx, i);
+        int y, x;
+
+        editor_view(editor, width, 1, &y, &x);
+        editor_row(editor, editor->top, width, text, sizeof(text), &next);
+        if (i == ctx->compose_field) {
+            cursor_y = compose_fields[i].row;
+            cursor_x = column + x;
+        }
 
-    ctx->current_view = VIEW_EMAIL_LIST;
+        if (!render_row_changed(region, compose_fields[i].row, render_hash(RENDER_HASH_SEED, text))) continue;
+        mvwhline(win, compose_fields[i].row, column, ' ', width + 1);
+        wattron(win, COLOR_PAIR(2));
+        mvwprintw(win, compose_fields[i].row, column, "%s", text);
+        wattroff(win, COLOR_PAIR(2));
+        painted++;
+    }
+
+    /* Body: the screen of rows that holds the cursor */
+    Editor *body = &ctx->compose[COMPOSE_BODY];
+    int width = ui_compose_width(ctx, COMPOSE_BODY);
+    int height = ui_compose_height(ctx);
+    int y, x, more = 1;
+
+    editor_view(body, width, height, &y, &x);
+    if (ctx->compose_field == COMPOSE_BODY) {
+        cursor_y = COMPOSE_BODY_ROW + y;
+        cursor_x = 4 + x;
+    }
+    next = body->top;
+    for (int row = 0; row < height; row++) {
+        size_t start = next;
+        text[0] = '\0';
+        if (more) more = editor_row(body, start, width, text, sizeof(text), &next);
+
+        if (!render_row_changed(region, COMPOSE_BODY_ROW + row, render_hash(RENDER_HASH_SEED, text))) continue;
+        mvwhline(win, COMPOSE_BODY_ROW + row, 4, ' ', width + 1);
+        mvwprintw(win, COMPOSE_BODY_ROW + row, 4, "%s", text);
+        painted++;
+    }
+
+    wmove(win, cursor_y, cursor_x);
+    curs_set(1);
+    wnoutrefresh(win);
+    TRACE_END(span, "ui", "draw compose", "%d rows painted", painted);
+}
+
+/* Keys typed while the filter prompt is open */
+static void ui_filter_input(UIContext *ctx, int ch) {
+    switch (ch) {
+        case 27: /* ESC */
+            while (ctx->filter.pattern_len > 0) filter_pop(&ctx->filter);
+            ctx->filtering = 0;
+            break;
+
+        case '\n':
+        case KEY_ENTER:
+            ctx->filtering = 0;
+            return;
+
+        case KEY_UP:
+            if (ctx->selected_index > 0) ctx->selected_index--;
+            return;
+
+        case KEY_DOWN:
+            if (ctx->selected_index < ui_view_count(ctx) - 1) ctx->selected_index++;
+            return;
+
+        case KEY_BACKSPACE:
+        case 127:
+        case 8:
+            filter_pop(&ctx->filter);
+            break;
+
+        default:
+            if (ch < 32 || ch > 255) return;
+            filter_push(&ctx->filter, (char)ch);
+            break;
+    }
+
+    ctx->selected_index = 0;
+    ctx->scroll_offset = 0;
 }
 
 /* Handle keyboard input */
 void ui_handle_input(UIContext *ctx, int ch) {
+    if (ch == UI_KEY_STATS) {
+        ctx->show_stats = !ctx->show_stats;
+        return;
+    }
+    if (ctx->loading_uid && ch == 27) {
+        /* Stop waiting for a slow message; its reply is dropped */
+        ui_command(ctx, WORKER_CANCEL, 0, NULL);
+        ctx->loading_uid = 0;
+        ui_set_notice(ctx, "Cancelled");
+        return;
+    }
+    if (ctx->current_view == VIEW_EMAIL_LIST && ctx->folder_focus) {
+        ui_folder_input(ctx, ch);
+        return;
+    }
+    if (ctx->current_view == VIEW_EMAIL_LIST && ctx->filtering) {
+        ui_filter_input(ctx, ch);
+        return;
+    }
+
     switch (ctx->current_view) {
         case VIEW_EMAIL_LIST:
             switch (ch) {
@@ -406,56 +1797,116 @@ void ui_handle_input(UIContext *ctx, int ch) {
 
                 case KEY_DOWN:
                 case 'j':
-                    if (ctx->selected_index < ctx->imap_session->email_count - 1) {
+                    if (ctx->selected_index < ui_view_count(ctx) - 1) {
                         ctx->selected_index++;
                     }
                     break;
 
                 case '\n':
-                case KEY_ENTER:
+                case KEY_ENTER: {
                     /* Open email */
-                    if (ctx->selected_index >= 0 && ctx->selected_index < ctx->imap_session->email_count) {
-                        Email *email = &ctx->imap_session->emails[ctx->selected_index];
-                        ui_draw_status(ctx, "Loading email...");
-                        if (imap_fetch_email_body(ctx->imap_session, email->uid, email) == 0) {
-                            imap_mark_seen(ctx->imap_session, email->uid);
-                            email->seen = 1;
-                            ctx->current_view = VIEW_EMAIL_CONTENT;
-                        } else {
-                            ui_draw_status(ctx, "Failed to load email");
-                        }
+                    const Email *email = ui_selected_email(ctx);
+                    if (email) {
+                        ui_open_email(ctx, email);
                     }
                     break;
+                }
 
                 case 'c':
                 case 'C':
-                    /* Compose new email */
-                    ctx->current_view = VIEW_COMPOSE;
+                    /* Compose new email; the SMTP session is opened
+                     * while it is being written */
+                    outbox_warm_up(ctx->outbox);
+                    ui_compose_open(ctx);
                     break;
 
                 case 'd':
-                case 'D':
+                case 'D': {
                     /* Delete email */
-                    if (ctx->selected_index >= 0 && ctx->selected_index < ctx->imap_session->email_count) {
-                        Email *email = &ctx->imap_session->emails[ctx->selected_index];
-                        imap_delete_email(ctx->imap_session, email->uid);
-                        imap_expunge(ctx->imap_session);
-                        ui_draw_status(ctx, "Email deleted");
-                        /* Refresh list */
-                        imap_fetch_emails(ctx->imap_session);
-                        if (ctx->selected_index >= ctx->imap_session->email_count) {
-                            ctx->selected_index = ctx->imap_session->email_count - 1;
-                        }
-                        if (ctx->selected_index < 0) ctx->selected_index = 0;
+                    const Email *email = ui_selected_email(ctx);
+                    if (email) {
+                        /* The list follows with the worker's next snapshot */
+                        ui_command(ctx, WORKER_DELETE, email->uid, "Deleting...");
                     }
                     break;
+                }
 
                 case 'r':
                 case 'R':
                     /* Refresh */
-                    ui_draw_status(ctx, "Refreshing...");
-                    imap_fetch_emails(ctx->imap_session);
-                    ui_draw_status(ctx, "Refreshed");
+                    ui_command(ctx, WORKER_REFRESH, 0, "Refreshing...");
+                    break;
+
+                case '/': {
+                    /* Full-text search */
+                    WorkerCommand command;
+                    memset(&command, 0, sizeof(command));
+                    command.type = WORKER_SEARCH;
+                    command.folder = ctx->index->current_folder;
+                    if (ui_prompt(ctx, "Search:", command.query, sizeof(command.query)) > 0) {
+                        ui_send(ctx, &command, "Searching...");
+                    }
+                    break;
+                }
+
+                case 'f':
+                case 'F':
+                    /* Search-as-you-type filter on sender and subject */
+                    ctx->filtering = 1;
+                    ui_filter_rebase(ctx);
+                    ctx->selected_index = 0;
+                    ctx->scroll_offset = 0;
+                    break;
+
+                case 27: { /* ESC */
+                    /* Drop the filter first, then search results */
+                    int current = ui_view_index(ctx, ctx->selected_index, NULL);
+                    if (ctx->filter.pattern_len > 0) {
+                        while (ctx->filter.pattern_len > 0) filter_pop(&ctx->filter);
+                    } else if (ctx->search_query[0]) {
+                        ui_search_clear(ctx);
+                    } else {
+                        break;
+                    }
+                    ctx->selected_index = current >= 0 ? ui_find_row(ctx, current) : 0;
+                    ctx->scroll_offset = 0;
+                    break;
+                }
+
+                case 'p':
+                case 'P':
+                    /* Preview pane and snippets in the list */
+                    ctx->show_preview = !ctx->show_preview;
+                    ui_layout(ctx);
+                    if (ctx->show_preview && !ctx->preview_height) {
+                        ui_set_notice(ctx, "Window too short for the preview pane");
+                    }
+                    break;
+
+                case 't':
+                case 'T': {
+                    /* Toggle conversation view, keeping the same email selected */
+                    int current = ui_view_index(ctx, ctx->selected_index, NULL);
+                    ctx->threaded = !ctx->threaded;
+                    ui_filter_rebase(ctx);
+                    ctx->selected_index = current >= 0 ? ui_find_row(ctx, current) : 0;
+                    ctx->scroll_offset = 0;
+                    break;
+                }
+
+                case '\t':
+                    /* Show the folder pane and move into it */
+                    if (ctx->index->counts.folder_count == 0) break;
+                    ctx->show_folders = 1;
+                    ui_layout(ctx);
+                    if (!ctx->show_folders) {
+                        ui_set_notice(ctx, "Window too narrow for folders");
+                        break;
+                    }
+                    ctx->folder_focus = 1;
+                    if (ctx->index->current_folder >= 0) {
+                        ctx->folder_selected = ctx->index->current_folder;
+                    }
                     break;
 
                 case 'q':
@@ -465,46 +1916,126 @@ void ui_handle_input(UIContext *ctx, int ch) {
             }
             break;
 
-        case VIEW_EMAIL_CONTENT:
+        case VIEW_EMAIL_CONTENT: {
+            /* Scrolling is clamped to the body when it is drawn */
+            int page = getmaxy(ctx->main_win) - 6;
+            if (page < 1) page = 1;
+
             switch (ch) {
                 case 27: /* ESC */
                 case 'q':
                     ctx->current_view = VIEW_EMAIL_LIST;
                     break;
 
+                case KEY_DOWN:
+                case 'j':
+                    ctx->body_top++;
+                    break;
+
+                case KEY_UP:
+                case 'k':
+                    if (ctx->body_top > 0) ctx->body_top--;
+                    break;
+
+                case KEY_NPAGE:
+                case ' ':
+                    ctx->body_top = ui_body_top(ctx->body_top, ctx->body_layout.count, page) + page;
+                    break;
+
+                case KEY_PPAGE:
+                case 'b':
+                    ctx->body_top = ui_body_top(ctx->body_top, ctx->body_layout.count, page) - page;
+                    if (ctx->body_top < 0) ctx->body_top = 0;
+                    break;
+
+                case KEY_HOME:
+                case 'g':
+                    ctx->body_top = 0;
+                    break;
+
+                case KEY_END:
+                case 'G':
+                    ctx->body_top = ctx->body_layout.count;
+                    break;
+
                 case 'd':
-                case 'D':
+                case 'D': {
                     /* Delete current email */
-                    if (ctx->selected_index >= 0 && ctx->selected_index < ctx->imap_session->email_count) {
-                        Email *email = &ctx->imap_session->emails[ctx->selected_index];
-                        imap_delete_email(ctx->imap_session, email->uid);
-                        imap_expunge(ctx->imap_session);
+                    const Email *email = ui_selected_email(ctx);
+                    if (email && ui_command(ctx, WORKER_DELETE, email->uid, "Deleting...") == 0) {
                         ctx->current_view = VIEW_EMAIL_LIST;
-                        imap_fetch_emails(ctx->imap_session);
-                        ui_draw_status(ctx, "Email deleted");
                     }
                     break;
+                }
 
                 case 'm':
-                case 'M':
+                case 'M': {
                     /* Mark as unseen */
-                    if (ctx->selected_index >= 0 && ctx->selected_index < ctx->imap_session->email_count) {
-                        Email *email = &ctx->imap_session->emails[ctx->selected_index];
-                        imap_mark_unseen(ctx->imap_session, email->uid);
-                        email->seen = 0;
-                        ui_draw_status(ctx, "Marked as unseen");
+                    int index = ui_view_index(ctx, ctx->selected_index, NULL);
+                    if (index >= 0 && ctx->email_state[index].seen &&
+                        ui_command(ctx, WORKER_MARK_UNSEEN, ctx->index->emails[index].uid, NULL) == 0) {
+                        ctx->email_state[index].seen = 0;
+                        ctx->unseen++;
                     }
                     break;
+                }
             }
             break;
+        }
 
         case VIEW_COMPOSE:
-            /* Handled in ui_draw_compose */
+            /* Keys go to ui_compose_input */
             break;
     }
 }
 
 /* Main UI loop */
+void ui_frame(UIContext *ctx) {
+    ui_idle(ctx);
+
+    /* The preview pane only goes with the list */
+    if (ui_preview_rows(ctx) != ctx->preview_height) {
+        ui_layout(ctx);
+    }
+
+    if (ctx->show_folders) {
+        ui_draw_folders(ctx);
+    }
+
+    /* Draw current view */
+    ViewMode view = ctx->current_view;
+    unsigned long long start = stats_now();
+    switch (view) {
+        case VIEW_EMAIL_LIST:
+            ui_draw_email_list(ctx);
+            if (ctx->show_preview) ui_want_snippets(ctx);
+            if (ctx->preview_height) ui_draw_preview(ctx);
+            break;
+        case VIEW_EMAIL_CONTENT:
+            ui_draw_email_content(ctx);
+            ui_want_body(ctx);
+            break;
+        case VIEW_COMPOSE:
+            ui_draw_compose(ctx);
+            break;
+    }
+    stats_add(&ctx->draw_time[view], stats_now() - start);
+
+    /* Everything drawn above goes out in one update */
+    ui_stage_status(ctx, "");
+    if (ctx->current_view == VIEW_COMPOSE) {
+        /* The cursor stays where the form put it */
+        wnoutrefresh(ctx->main_win);
+    }
+    doupdate();
+
+    /* The keys handled since the last frame are on screen now */
+    if (ctx->key_time) {
+        stats_add(&ctx->key_latency, stats_now() - ctx->key_time);
+        ctx->key_time = 0;
+    }
+}
+
 void ui_run(UIContext *ctx) {
     int ch;
 
@@ -513,23 +2044,47 @@ void ui_run(UIContext *ctx) {
     ui_draw_status(ctx, "Ready");
 
     while (ctx->running) {
-        /* Draw current view */
-        switch (ctx->current_view) {
-            case VIEW_EMAIL_LIST:
-                ui_draw_email_list(ctx);
-                break;
-            case VIEW_EMAIL_CONTENT:
-                ui_draw_email_content(ctx);
-                break;
-            case VIEW_COMPOSE:
-                ui_draw_compose(ctx);
-                continue; /* Compose handles its own input */
+        ui_frame(ctx);
+
+        ui_wait(ctx);
+        unsigned long long woke = stats_now();
+
+        /* Handle every key typed meanwhile before drawing again; a paste
+         * is taken in whole before the form is drawn */
+        while (ctx->running) {
+            if (ctx->current_view == VIEW_COMPOSE) {
+                wint_t wch;
+                int type = wget_wch(ctx->main_win, &wch);
+                if (type == ERR) break;
+                if (!ctx->key_time) ctx->key_time = woke;
+                ctx->notice[0] = '\0';
+                ui_compose_input(ctx, wch, type == KEY_CODE_YES);
+                continue;
+            }
+            if ((ch = wgetch(ctx->main_win)) == ERR) break;
+            if (!ctx->key_time) ctx->key_time = woke;
+            ctx->notice[0] = '\0';
+            ui_handle_input(ctx, ch);
         }
+    }
+}
 
-        ui_draw_status(ctx, "");
+int ui_write_stats(UIContext *ctx, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot write stats to %s\n", path);
+        return -1;
+    }
 
-        /* Get input */
-        ch = wgetch(ctx->main_win);
-        ui_handle_input(ctx, ch);
+    stats_write(file, NULL, NULL);
+    stats_write(file, "key to paint", &ctx->key_latency);
+    for (int i = 0; i <= VIEW_COMPOSE; i++) {
+        stats_write(file, ui_view_names[i], &ctx->draw_time[i]);
     }
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: Cannot write stats to %s\n", path);
+        return -1;
+    }
+    return 0;
 }
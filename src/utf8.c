@@ -0,0 +1,208 @@
+#include "utf8.h"
+#include <string.h>
+
+/* Case-fold UTF-8 text (output is never longer than input) */
+size_t utf8_fold(const char *input, char *output, size_t output_size) {
+    const unsigned char *p = (const unsigned char *)input;
+    unsigned char *dst = (unsigned char *)output;
+    size_t out = 0;
+
+    if (output_size == 0) return 0;
+
+    while (*p && out < output_size - 1) {
+        unsigned char c = p[0];
+
+        if (c >= 'A' && c <= 'Z') {
+            dst[out++] = c + ('a' - 'A');
+            p++;
+        } else if (c == 0xD0 && p[1] && out + 2 < output_size) {
+            /* U+0400..U+043F: Ѐ-Я become ѐ-я, а-п stay */
+            unsigned char n = p[1];
+            if (n >= 0x90 && n <= 0x9F) {
+                dst[out++] = 0xD0;
+                dst[out++] = n + 0x20;
+            } else if (n >= 0xA0 && n <= 0xAF) {
+                dst[out++] = 0xD1;
+                dst[out++] = n - 0x20;
+            } else if (n >= 0x80 && n <= 0x8F) {
+                dst[out++] = 0xD1;
+                dst[out++] = n + 0x10;
+            } else {
+                dst[out++] = c;
+                dst[out++] = n;
+            }
+            p += 2;
+        } else if (c >= 0x80 && !(c & 0x40)) {
+            /* Stray continuation byte */
+            dst[out++] = c;
+            p++;
+        } else if (c >= 0x80) {
+            /* Copy the whole multi-byte sequence so it is never split */
+            size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+            size_t i;
+            if (out + len >= output_size) break;
+            for (i = 0; i < len && p[i]; i++) {
+                dst[out++] = p[i];
+            }
+            p += i;
+        } else {
+            dst[out++] = c;
+            p++;
+        }
+    }
+
+    dst[out] = '\0';
+    return out;
+}
+
+/* Decode one character. Invalid bytes decode as U+FFFD, one at a time. */
+static size_t utf8_decode(const unsigned char *p, unsigned int *code) {
+    size_t len;
+    unsigned int c = p[0];
+
+    if (c < 0x80) {
+        *code = c;
+        return 1;
+    }
+    if (c >= 0xF8) {
+        *code = 0xFFFD;
+        return 1;
+    }
+    if (c >= 0xF0) {
+        len = 4;
+        c &= 0x07;
+    } else if (c >= 0xE0) {
+        len = 3;
+        c &= 0x0F;
+    } else if (c >= 0xC0) {
+        len = 2;
+        c &= 0x1F;
+    } else {
+        *code = 0xFFFD;
+        return 1;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *code = 0xFFFD;
+            return 1;
+        }
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+    *code = c;
+    return len;
+}
+
+/* Columns of one character, -1 for control characters. The ranges follow
+ * what terminals do for the common scripts (as wcwidth does) without
+ * depending on the locale. */
+static int utf8_code_width(unsigned int c) {
+    if (c < 0x20 || (c >= 0x7F && c < 0xA0)) return -1;
+
+    /* Combining marks, zero-width spaces and joiners, variation selectors */
+    if ((c >= 0x0300 && c <= 0x036F) || (c >= 0x0483 && c <= 0x0489) ||
+        (c >= 0x1AB0 && c <= 0x1AFF) || (c >= 0x1DC0 && c <= 0x1DFF) ||
+        (c >= 0x200B && c <= 0x200F) || (c >= 0x20D0 && c <= 0x20FF) ||
+        (c >= 0xFE00 && c <= 0xFE0F) || (c >= 0xFE20 && c <= 0xFE2F) ||
+        (c >= 0xE0100 && c <= 0xE01EF)) {
+        return 0;
+    }
+
+    /* East Asian wide and fullwidth, emoji */
+    if ((c >= 0x1100 && c <= 0x115F) || (c >= 0x2E80 && c <= 0x303E) ||
+        (c >= 0x3041 && c <= 0x33FF) || (c >= 0x3400 && c <= 0x4DBF) ||
+        (c >= 0x4E00 && c <= 0x9FFF) || (c >= 0xA000 && c <= 0xA4CF) ||
+        (c >= 0xAC00 && c <= 0xD7A3) || (c >= 0xF900 && c <= 0xFAFF) ||
+        (c >= 0xFE30 && c <= 0xFE4F) || (c >= 0xFF00 && c <= 0xFF60) ||
+        (c >= 0xFFE0 && c <= 0xFFE6) || (c >= 0x1F300 && c <= 0x1F64F) ||
+        (c >= 0x1F900 && c <= 0x1F9FF) || (c >= 0x20000 && c <= 0x3FFFD)) {
+        return 2;
+    }
+    return 1;
+}
+
+size_t utf8_next(const char *text, int *columns) {
+    unsigned int code;
+    size_t len = utf8_decode((const unsigned char *)text, &code);
+
+    *columns = code == 0xFFFD && len == 1 ? -1 : utf8_code_width(code);
+    return len;
+}
+
+size_t utf8_encode(unsigned int code, char *output) {
+    if (code > 0x10FFFF || (code >= 0xD800 && code < 0xE000)) code = 0xFFFD;
+
+    if (code < 0x80) {
+        output[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        output[0] = (char)(0xC0 | (code >> 6));
+        output[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000) {
+        output[0] = (char)(0xE0 | (code >> 12));
+        output[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        output[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    output[0] = (char)(0xF0 | (code >> 18));
+    output[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    output[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    output[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+int utf8_width(const char *text) {
+    const unsigned char *p = (const unsigned char *)text;
+    int width = 0;
+
+    while (*p) {
+        unsigned int code;
+        p += utf8_decode(p, &code);
+
+        int w = utf8_code_width(code);
+        width += w < 0 ? 1 : w;
+    }
+    return width;
+}
+
+size_t utf8_fit(const char *input, int columns, int pad, char *output, size_t output_size) {
+    const unsigned char *p = (const unsigned char *)input;
+    size_t out = 0;
+    int width = 0;
+
+    if (output_size == 0) return 0;
+
+    while (*p) {
+        unsigned int code;
+        size_t len = utf8_decode(p, &code);
+        int w = utf8_code_width(code);
+
+        if (w < 0) {
+            /* Terminals would show ^X; keep the column count right */
+            if (width + 1 > columns || out + 1 >= output_size) break;
+            output[out++] = ' ';
+            width++;
+        } else if (code == 0xFFFD && len == 1) {
+            /* Invalid byte: never copy it, it could start a sequence */
+            if (width + 1 > columns || out + 1 >= output_size) break;
+            output[out++] = '?';
+            width++;
+        } else {
+            if (width + w > columns || out + len >= output_size) break;
+            memcpy(output + out, p, len);
+            out += len;
+            width += w;
+        }
+        p += len;
+    }
+
+    while (pad && width < columns && out + 1 < output_size) {
+        output[out++] = ' ';
+        width++;
+    }
+
+    output[out] = '\0';
+    return out;
+}
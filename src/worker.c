@@ -0,0 +1,589 @@
+#define _POSIX_C_SOURCE 200809L
+#include "worker.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define WORKER_RETRY_MS 10   /* Wait for the UI to make room for a result */
+
+/* Wake the other side; a full pipe means a wake-up is pending already */
+static void worker_poke(int fd) {
+    if (fd >= 0 && write(fd, "", 1) < 0) {
+        /* Nothing to do */
+    }
+}
+
+static void worker_drain(int fd) {
+    char drain[64];
+    while (fd >= 0 && read(fd, drain, sizeof(drain)) > 0) {
+    }
+}
+
+int worker_index_find(const WorkerIndex *index, unsigned int uid) {
+    int lo = 0, hi = index->email_count - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        unsigned int cur = index->emails[mid].uid;
+        if (cur == uid) return mid;
+        if (cur < uid) lo = mid + 1; else hi = mid - 1;
+    }
+
+    /* Same fallback as imap_find_email for servers that break UID order */
+    for (int i = 0; i < index->email_count; i++) {
+        if (index->emails[i].uid == uid) return i;
+    }
+    return -1;
+}
+
+WorkerEmails *worker_emails_new(int count) {
+    WorkerEmails *emails = calloc(1, sizeof(WorkerEmails) + sizeof(Email) * count);
+    if (emails) {
+        emails->refs = 1;
+        emails->count = count;
+    }
+    return emails;
+}
+
+/* Drop one reference; the UI and the worker let go from their own threads */
+void worker_emails_release(WorkerEmails *emails) {
+    if (emails && __atomic_sub_fetch(&emails->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(emails);
+    }
+}
+
+void worker_counts_free(WorkerCounts *counts) {
+    free(counts->folders);
+    counts->folders = NULL;
+    counts->folder_count = 0;
+}
+
+void worker_index_free(WorkerIndex *index) {
+    if (!index) return;
+    worker_emails_release(index->shared);
+    free(index->thread_order);
+    free(index->thread_depth);
+    worker_counts_free(&index->counts);
+    free(index);
+}
+
+void worker_result_free(WorkerResult *result) {
+    if (!result) return;
+    worker_index_free(result->index);
+    worker_counts_free(&result->counts);
+    free(result->body);
+    layout_free(&result->layout);
+    free(result->uids);
+    free(result->snippets);
+    free(result->flags);
+    free(result);
+}
+
+static int worker_copy_counts(const ImapSession *imap, WorkerCounts *counts) {
+    counts->folders = NULL;
+    counts->folder_count = 0;
+    counts->server_messages = imap->server_messages;
+    counts->server_max_uid = imap->server_max_uid;
+    if (imap->folder_count == 0) return 0;
+
+    counts->folders = malloc(sizeof(WorkerFolder) * imap->folder_count);
+    if (!counts->folders) return -1;
+    for (int i = 0; i < imap->folder_count; i++) {
+        WorkerFolder *folder = &counts->folders[i];
+        memcpy(folder->display_name, imap->folders[i].display_name, sizeof(folder->display_name));
+        folder->noselect = imap->folders[i].noselect;
+        folder->unseen = imap->folders[i].unseen;
+    }
+    counts->folder_count = imap->folder_count;
+    return 0;
+}
+
+/* Copy the open folder's index for the UI, with the conversation order
+ * already worked out. Its messages stay shared with the worker, which
+ * compares against them when only flags change. */
+static WorkerIndex *worker_snapshot(ImapWorker *worker) {
+    ImapSession *imap = worker->imap;
+
+    TRACE_BEGIN(span);
+    WorkerIndex *index = calloc(1, sizeof(WorkerIndex));
+    if (!index) return NULL;
+
+    index->shared = worker_emails_new(imap->email_count);
+    if (!index->shared) {
+        worker_index_free(index);
+        return NULL;
+    }
+    memcpy(index->shared->emails, imap->emails, sizeof(Email) * imap->email_count);
+    index->emails = index->shared->emails;
+    index->email_count = imap->email_count;
+
+    index->thread_count = thread_flatten(&imap->threads);
+    if (index->thread_count > 0 && imap->threads.order) {
+        size_t size = sizeof(int) * index->thread_count;
+        index->thread_order = malloc(size);
+        index->thread_depth = malloc(size);
+        if (!index->thread_order || !index->thread_depth) {
+            worker_index_free(index);
+            return NULL;
+        }
+        memcpy(index->thread_order, imap->threads.order, size);
+        memcpy(index->thread_depth, imap->threads.depth, size);
+    }
+
+    index->current_folder = imap->current_folder;
+    snprintf(index->folder_name, sizeof(index->folder_name), "%s", imap_current_folder_name(imap));
+    if (worker_copy_counts(imap, &index->counts) < 0) {
+        worker_index_free(index);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&index->shared->refs, 1, __ATOMIC_RELAXED);
+    worker_emails_release(worker->published);
+    worker->published = index->shared;
+    TRACE_END(span, "worker", "snapshot", "%d messages", index->email_count);
+    return index;
+}
+
+static WorkerResult *worker_result_new(ImapWorker *worker, WorkerResultType type) {
+    WorkerResult *result = calloc(1, sizeof(WorkerResult));
+    if (result) {
+        result->type = type;
+        result->folder = worker->imap->current_folder;
+        layout_init(&result->layout);
+    }
+    return result;
+}
+
+/* Queue a result for the UI. Results are never dropped: when the UI is
+ * behind, the worker waits for room. */
+static void worker_push(ImapWorker *worker, WorkerResult *result) {
+    if (!result) return;
+
+    while (queue_push(&worker->results, result) < 0) {
+        if (__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+            worker_result_free(result);
+            return;
+        }
+        poll(NULL, 0, WORKER_RETRY_MS);
+    }
+    worker_poke(worker->notify[1]);
+}
+
+static void worker_done(ImapWorker *worker, int status, const char *message) {
+    WorkerResult *result = worker_result_new(worker, WORKER_RESULT_DONE);
+    if (!result) return;
+
+    result->status = status;
+    snprintf(result->message, sizeof(result->message), "%s", message);
+    worker_push(worker, result);
+}
+
+/* The message list changed: hand the UI a new snapshot */
+static void worker_publish_index(ImapWorker *worker, int status, const char *message) {
+    WorkerResult *result = worker_result_new(worker, WORKER_RESULT_INDEX);
+    if (!result) return;
+
+    result->index = worker_snapshot(worker);
+    if (!result->index) {
+        worker_result_free(result);
+        worker_done(worker, -1, "Error: out of memory");
+        return;
+    }
+    result->status = status;
+    snprintf(result->message, sizeof(result->message), "%s", message);
+    worker_push(worker, result);
+}
+
+/* The message list is as last published, but flags may have changed:
+ * send only those that differ from the snapshot, and fresh counts */
+static void worker_publish_flags(ImapWorker *worker, const char *message) {
+    ImapSession *imap = worker->imap;
+    const WorkerEmails *published = worker->published;
+
+    if (!published || published->count != imap->email_count) {
+        worker_publish_index(worker, 0, message);
+        return;
+    }
+
+    WorkerResult *result = worker_result_new(worker, WORKER_RESULT_FLAGS);
+    if (!result) return;
+
+    int changed = 0;
+    for (int i = 0; i < imap->email_count; i++) {
+        if (imap->emails[i].seen != published->emails[i].seen) changed++;
+    }
+    result->flags = malloc(sizeof(WorkerFlags) * (changed + 1));
+    if (!result->flags || worker_copy_counts(imap, &result->counts) < 0) {
+        worker_result_free(result);
+        worker_done(worker, -1, "Error: out of memory");
+        return;
+    }
+    for (int i = 0; i < imap->email_count; i++) {
+        if (imap->emails[i].seen == published->emails[i].seen) continue;
+        WorkerFlags *flags = &result->flags[result->flag_count++];
+        flags->uid = imap->emails[i].uid;
+        flags->seen = imap->emails[i].seen;
+    }
+    snprintf(result->message, sizeof(result->message), "%s", message);
+    worker_push(worker, result);
+}
+
+/* Ranked local hits first, then server matches among messages whose
+ * bodies have not been downloaded yet */
+static void worker_search(ImapWorker *worker, const char *query) {
+    ImapSession *imap = worker->imap;
+    SearchResult *local = NULL;
+    unsigned int *remote = NULL;
+
+    TRACE_BEGIN(span);
+    int local_count = search_query(&imap->search, query, &local);
+    if (local_count < 0) local_count = 0;
+
+    int remote_count = imap_search_text(imap, query, &remote);
+    if (remote_count < 0) remote_count = 0;
+
+    WorkerResult *result = worker_result_new(worker, WORKER_RESULT_SEARCH);
+    char *listed = calloc(imap->email_count + 1, 1);
+    if (result) result->uids = malloc(sizeof(unsigned int) * (local_count + remote_count + 1));
+    if (!result || !result->uids || !listed) {
+        free(local);
+        free(remote);
+        free(listed);
+        worker_result_free(result);
+        worker_done(worker, -1, "Error: out of memory");
+        return;
+    }
+
+    for (int i = 0; i < local_count + remote_count; i++) {
+        unsigned int uid = i < local_count ? local[i].uid : remote[i - local_count];
+        int index = imap_find_email(imap, uid);
+        if (index < 0 || listed[index]) continue;
+        listed[index] = 1;
+        result->uids[result->uid_count++] = uid;
+    }
+
+    free(local);
+    free(remote);
+    free(listed);
+
+    snprintf(result->query, sizeof(result->query), "%s", query);
+    snprintf(result->message, sizeof(result->message), "%d results", result->uid_count);
+    TRACE_END(span, "worker", "search", "%d results", result->uid_count);
+    worker_push(worker, result);
+}
+
+/* Snippets for the rows the UI is showing. Failures come back as empty
+ * snippets, so the UI never asks about the same messages twice. */
+static void worker_snippets(ImapWorker *worker, const WorkerCommand *command) {
+    ImapSession *imap = worker->imap;
+    WorkerResult *result = worker_result_new(worker, WORKER_RESULT_SNIPPETS);
+    if (!result) return;
+
+    result->snippets = calloc(command->uid_count, sizeof(WorkerSnippet));
+    if (!result->snippets) {
+        worker_result_free(result);
+        return;
+    }
+    result->status = imap_fetch_snippets(imap, command->uids, command->uid_count);
+
+    for (int i = 0; i < command->uid_count; i++) {
+        WorkerSnippet *snippet = &result->snippets[result->snippet_count++];
+        int index = imap_find_email(imap, command->uids[i]);
+        snippet->uid = command->uids[i];
+        if (index >= 0) {
+            snprintf(snippet->text, sizeof(snippet->text), "%s", imap->emails[index].snippet);
+        }
+    }
+    worker_push(worker, result);
+}
+
+static void worker_run(ImapWorker *worker, const WorkerCommand *command) {
+    ImapSession *imap = worker->imap;
+
+    /* UIDs are per folder: a command about a folder left since is stale */
+    if ((command->type == WORKER_OPEN || command->type == WORKER_MORE ||
+         command->type == WORKER_DELETE || command->type == WORKER_MARK_UNSEEN ||
+         command->type == WORKER_SNIPPETS) &&
+        command->folder != imap->current_folder) {
+        return;
+    }
+
+    switch (command->type) {
+        case WORKER_OPEN:
+        case WORKER_MORE: {
+            /* A body opens with a short range, so its first screen shows
+             * after one round trip whatever its size */
+            size_t offset = command->type == WORKER_MORE ? command->offset : 0;
+            size_t length = offset ? IMAP_BODY_CHUNK : IMAP_BODY_FIRST_CHUNK;
+            if (imap_body_fetch_begin(imap, command->uid, offset, length) == 0) {
+                worker->loading_uid = command->uid;
+                worker->loading_offset = offset;
+                worker->loading_width = command->width;
+            } else {
+                WorkerResult *result = worker_result_new(worker, WORKER_RESULT_BODY);
+                if (!result) break;
+                result->uid = command->uid;
+                result->offset = offset;
+                result->status = -1;
+                worker_push(worker, result);
+            }
+            break;
+        }
+
+        case WORKER_CANCEL:
+            if (worker->loading_uid) {
+                imap_body_fetch_cancel(imap);
+                worker->loading_uid = 0;
+            }
+            break;
+
+        case WORKER_DELETE:
+            /* The expunge takes the message out of the list; only when the
+             * server did not say so is the list fetched again */
+            if (imap_delete_email(imap, command->uid) > 0 && imap_expunge(imap) == 0) {
+                if (imap_find_email(imap, command->uid) >= 0) imap_fetch_emails(imap);
+                worker_publish_index(worker, 0, "Email deleted");
+            } else {
+                worker_done(worker, -1, "Failed to delete email");
+            }
+            break;
+
+        case WORKER_REFRESH: {
+            /* Flags may have changed even when the list did not */
+            int changed = imap_refresh_emails(imap);
+            if (changed < 0) {
+                worker_done(worker, -1, "Failed to refresh");
+            } else if (changed) {
+                worker_publish_index(worker, 0, "Refreshed");
+            } else {
+                worker_publish_flags(worker, "Refreshed");
+            }
+            break;
+        }
+
+        case WORKER_SWITCH_FOLDER:
+            if (worker->loading_uid) {
+                imap_body_fetch_cancel(imap);
+                worker->loading_uid = 0;
+            }
+            if (imap_switch_folder(imap, command->folder) < 0) {
+                worker_publish_index(worker, -1, "Failed to open folder");
+            } else {
+                worker_publish_index(worker, 0, "");
+            }
+            break;
+
+        case WORKER_MARK_UNSEEN:
+            if (imap_mark_unseen(imap, command->uid) < 0) {
+                worker_done(worker, -1, "Failed to mark as unseen");
+            } else {
+                worker_done(worker, 0, "Marked as unseen");
+            }
+            break;
+
+        case WORKER_SEARCH:
+            worker_search(worker, command->query);
+            break;
+
+        case WORKER_SNIPPETS:
+            worker_snippets(worker, command);
+            break;
+    }
+}
+
+/* Read what has arrived of a body being fetched. A cancelled fetch is
+ * read to the end as well, so the next command need not wait for it.
+ * The body is wrapped here, so even a long one costs the UI nothing. */
+static void worker_poll_body(ImapWorker *worker, char *body, size_t size) {
+    ImapSession *imap = worker->imap;
+
+    if (!worker->loading_uid && !imap->body_fetch.tag) return;
+
+    size_t next;
+    int status = imap_body_fetch_poll(imap, body, size, &next);
+    if (status == 0 || !worker->loading_uid) return;
+
+    WorkerResult *result = worker_result_new(worker, WORKER_RESULT_BODY);
+    if (result) {
+        result->uid = worker->loading_uid;
+        result->offset = worker->loading_offset;
+        result->next = status > 0 ? next : 0;
+        result->status = -1;
+        if (status > 0 && (result->body = strdup(body)) != NULL) {
+            result->status = 0;
+            if (worker->loading_width > 0) {
+                layout_wrap(&result->layout, result->body, strlen(result->body), worker->loading_width);
+            }
+        }
+    }
+    worker->loading_uid = 0;
+    worker_push(worker, result);
+}
+
+/* Folder counts: requested now and then, applied as the replies trickle
+ * in and handed to the UI once all are in */
+static void worker_poll_status(ImapWorker *worker) {
+    ImapSession *imap = worker->imap;
+
+    if (imap->pending_status > 0) {
+        if (imap_status_refresh_poll(imap) > 0) return;
+
+        WorkerResult *result = worker_result_new(worker, WORKER_RESULT_COUNTS);
+        if (result && worker_copy_counts(imap, &result->counts) < 0) {
+            worker_result_free(result);
+            return;
+        }
+        worker_push(worker, result);
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (now - worker->last_status_refresh >= WORKER_STATUS_SECONDS) {
+        worker->last_status_refresh = now;
+        imap_status_refresh_begin(imap);
+    }
+}
+
+/* Sleep until a command comes, the server replies to something in flight
+ * or the next folder count refresh is due */
+static void worker_wait(ImapWorker *worker) {
+    ImapSession *imap = worker->imap;
+    struct pollfd fds[2];
+    int count = 0;
+
+    fds[count].fd = worker->wake[0];
+    fds[count++].events = POLLIN;
+
+    if (worker->loading_uid || imap->body_fetch.tag || imap->pending_status > 0) {
+        /* A reply may be buffered already, with nothing left on the socket */
+        if (net_poll_readable(&imap->conn, 0) != 0) return;
+        fds[count].fd = imap->conn.sockfd;
+        fds[count++].events = POLLIN;
+    }
+
+    long timeout = (long)(worker->last_status_refresh + WORKER_STATUS_SECONDS - time(NULL)) * 1000;
+    if (timeout < 0) timeout = 0;
+
+    for (int i = 0; i < count; i++) fds[i].revents = 0;
+    poll(fds, count, (int)timeout);
+}
+
+static void *worker_main(void *arg) {
+    ImapWorker *worker = arg;
+
+    /* Too big for the stack; pages are only touched by long bodies */
+    char *body = malloc(MAX_BODY_LEN);
+    if (!body) {
+        fprintf(stderr, "Error: Out of memory in IMAP worker\n");
+        return NULL;
+    }
+
+    TRACE_THREAD("imap");
+    while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+        WorkerCommand *command;
+
+        /* Drained first, so a command queued after the last pop still
+         * leaves its wake-up in the pipe */
+        worker_drain(worker->wake[0]);
+        while ((command = queue_pop(&worker->commands)) != NULL) {
+            worker_run(worker, command);
+            free(command);
+        }
+
+        worker_poll_body(worker, body, MAX_BODY_LEN);
+        worker_poll_status(worker);
+        worker_wait(worker);
+    }
+    free(body);
+    return NULL;
+}
+
+/* Free everything still queued and close the pipes */
+static void worker_release(ImapWorker *worker) {
+    void *item;
+
+    while ((item = queue_pop(&worker->commands)) != NULL) free(item);
+    while ((item = queue_pop(&worker->results)) != NULL) worker_result_free(item);
+    queue_free(&worker->commands);
+    queue_free(&worker->results);
+    worker_emails_release(worker->published);
+    worker->published = NULL;
+
+    for (int i = 0; i < 2; i++) {
+        if (worker->wake[i] >= 0) close(worker->wake[i]);
+        if (worker->notify[i] >= 0) close(worker->notify[i]);
+        worker->wake[i] = worker->notify[i] = -1;
+    }
+}
+
+int worker_start(ImapWorker *worker, ImapSession *imap) {
+    memset(worker, 0, sizeof(ImapWorker));
+    worker->imap = imap;
+    worker->wake[0] = worker->wake[1] = -1;
+    worker->notify[0] = worker->notify[1] = -1;
+
+    if (queue_init(&worker->commands, WORKER_QUEUE_LEN) < 0 ||
+        queue_init(&worker->results, WORKER_QUEUE_LEN) < 0 ||
+        pipe(worker->wake) < 0 || pipe(worker->notify) < 0) {
+        fprintf(stderr, "Error: Cannot set up IMAP worker\n");
+        worker_release(worker);
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(worker->wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(worker->notify[i], F_SETFL, O_NONBLOCK);
+    }
+
+    /* Queued from this thread while the worker does not exist yet */
+    worker->last_status_refresh = time(NULL);
+    worker_publish_index(worker, 0, "");
+
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+        fprintf(stderr, "Error: Cannot start IMAP worker\n");
+        worker_release(worker);
+        return -1;
+    }
+    worker->started = 1;
+    return 0;
+}
+
+void worker_stop(ImapWorker *worker) {
+    if (!worker->started) return;
+
+    __atomic_store_n(&worker->stop, 1, __ATOMIC_RELEASE);
+    worker_poke(worker->wake[1]);
+    pthread_join(worker->thread, NULL);
+
+    worker_release(worker);
+    worker->started = 0;
+}
+
+int worker_send(ImapWorker *worker, const WorkerCommand *command) {
+    WorkerCommand *copy = malloc(sizeof(WorkerCommand));
+    if (!copy) return -1;
+
+    *copy = *command;
+    if (queue_push(&worker->commands, copy) < 0) {
+        free(copy);
+        return -1;
+    }
+    worker_poke(worker->wake[1]);
+    return 0;
+}
+
+WorkerResult *worker_receive(ImapWorker *worker) {
+    WorkerResult *result = queue_pop(&worker->results);
+    if (result) return result;
+
+    /* Clear the wake-up, then look again for what came in meanwhile */
+    worker_drain(worker->notify[0]);
+    return queue_pop(&worker->results);
+}
+
+int worker_event_fd(const ImapWorker *worker) {
+    return worker->notify[0];
+}